@@ -39,7 +39,9 @@ extern FOO Signer[];
 #define CBOR_CONTEXT_PARAM
 #endif
 
-FOO AlgorithmMap[37] = {
+FOO AlgorithmMap[38] = {
+	{ "ECDSA 512", CN_CBOR_INT, -36, NULL, 0, 0 },
+	{ "ECDSA 384", CN_CBOR_INT, -35, NULL, 0, 0 },
 	{ "ECHD-SS+A256KW", CN_CBOR_INT, -34, NULL, 0, 0 },
 	{ "ECHD-SS+A192KW", CN_CBOR_INT, -33, NULL, 0, 0 },
 	{ "ECHD-SS+A128KW", CN_CBOR_INT, -32, NULL, 0, 0 },
@@ -51,8 +53,7 @@ FOO AlgorithmMap[37] = {
 	{ "ECDH-ES + HKDF-512", CN_CBOR_INT, -26, NULL, 0, 0 },
 	{ "ECDH-ES + HKDF-256", CN_CBOR_INT, -25, NULL, 0, 0 },
 
-	{ "ECDSA 512", CN_CBOR_INT, -9, NULL, 0, 0 },
-	{ "ECDSA 384", CN_CBOR_INT, -8, NULL, 0, 0 },
+	{ "EdDSA", CN_CBOR_INT, -8, NULL, 0, 0 },
 	{"ECDSA 256", CN_CBOR_INT, -7, NULL, 0, 0 },
 
 	{"direct", CN_CBOR_INT, -6, NULL, 0, 0 },
@@ -87,16 +88,35 @@ FOO AlgorithmMap[37] = {
 	{"AES-CCM-64-128-256", CN_CBOR_UINT, 33, NULL, 0, 0 },
 };
 
-FOO KeyMap[9] = {
-	{"kty", CN_CBOR_UINT, 1, NULL, 0, 0 },
+FOO KeyTypeMap[3] = {
+	{"OKP", CN_CBOR_UINT, 1, NULL, 0, 0 },
+	{"EC2", CN_CBOR_UINT, 2, NULL, 0, 0 },
+	{"Symmetric", CN_CBOR_UINT, 4, NULL, 0, 0 }
+};
+
+FOO CurveMap[7] = {
+	{"P-256", CN_CBOR_UINT, 1, NULL, 0, 0 },
+	{"P-384", CN_CBOR_UINT, 2, NULL, 0, 0 },
+	{"P-521", CN_CBOR_UINT, 3, NULL, 0, 0 },
+	{"X25519", CN_CBOR_UINT, 4, NULL, 0, 0 },
+	{"X448", CN_CBOR_UINT, 5, NULL, 0, 0 },
+	{"Ed25519", CN_CBOR_UINT, 6, NULL, 0, 0 },
+	{"Ed448", CN_CBOR_UINT, 7, NULL, 0, 0 }
+};
+
+FOO KeyMap[12] = {
+	{"kty", CN_CBOR_UINT, 1, KeyTypeMap, _countof(KeyTypeMap), 0 },
 	{"kid", CN_CBOR_UINT, 2, NULL, 0, 0 },
 	{"alg", CN_CBOR_UINT, 3, AlgorithmMap, _countof(AlgorithmMap), 0 },
 	{"key_ops", CN_CBOR_UINT, 4, NULL, 0, 0 },
-	{"crv", CN_CBOR_INT, -1, NULL, 0, 2},
+	{"crv", CN_CBOR_INT, -1, CurveMap, _countof(CurveMap), 2},
 	{"x", CN_CBOR_INT, -2, NULL, 0, 2},
 	{"y", CN_CBOR_INT, -3, NULL, 0, 2},
 	{"d", CN_CBOR_INT, -4, NULL, 0, 2},
-	{"k", CN_CBOR_INT, -1, NULL, 0, 4}
+	{"k", CN_CBOR_INT, -1, NULL, 0, 4},
+	{"crv", CN_CBOR_INT, -1, CurveMap, _countof(CurveMap), 1},
+	{"x", CN_CBOR_INT, -2, NULL, 0, 1},
+	{"d", CN_CBOR_INT, -4, NULL, 0, 1}
 };
 
 FOO Key = {
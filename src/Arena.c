@@ -0,0 +1,261 @@
+/** \file Arena.c
+* Contains the implementation of a block (arena) allocator which plugs into
+* the cn_cbor_context allocation hooks.
+*
+* All memory for a message is sub-allocated from a small number of large blocks.
+* Individual frees are ignored (except for the most recent allocation) and the
+* memory is given back in a single operation by resetting or destroying the arena.
+* The handles of the objects built on the arena are dropped by the same
+* operation, so the objects do not need to be freed one by one.  Key objects
+* and prepared keys are the exception: they hold objects of the crypto
+* library, and the arena refuses to be reset until they have been freed.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#ifdef USE_CBOR_CONTEXT
+
+#define ARENA_ALIGN (2 * sizeof(void *))
+#define ARENA_ROUND(cb) (((cb) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_DEFAULT_BLOCK (4 * 1024)
+
+typedef struct _ArenaBlock {
+	struct _ArenaBlock * m_next;
+	size_t m_cbSize;		//  Usable bytes in the block
+	size_t m_cbUsed;		//  Bytes handed out so far
+} ArenaBlock;
+
+#define ARENA_BLOCK_HEADER ARENA_ROUND(sizeof(ArenaBlock))
+#define ARENA_BLOCK_DATA(p) (((byte *) (p)) + ARENA_BLOCK_HEADER)
+
+typedef struct _cose_arena {
+	cn_cbor_context m_context;		//  Context handed to the library
+	ArenaBlock * m_blockFirst;		//  Allocated together with the arena
+	ArenaBlock * m_blockCurrent;	//  Block currently being carved up
+	size_t m_cbBlock;				//  Size of new blocks
+	byte * m_pbLast;				//  Most recent allocation
+	COSE_HandleEpoch * m_pEpoch;	//  Handles of objects on the arena, NULL if none
+} COSE_Arena;
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(COSE_Arena))
+
+/*! \private
+* @brief Sub-allocate zeroed memory from the arena
+*
+* Matches the cn_calloc_func signature.  Requests which do not fit into the
+* current block move on to the next retained block, or a new block is
+* allocated when none of the retained blocks are big enough.
+*
+* @param count number of items
+* @param size size of each item
+* @param context the arena
+* @returns zero filled memory or NULL on failure
+*/
+
+static void * _COSE_Arena_Calloc(size_t count, size_t size, void * context)
+{
+	COSE_Arena * pArena = (COSE_Arena *)context;
+	ArenaBlock * pBlock = pArena->m_blockCurrent;
+	ArenaBlock * pNew;
+	size_t cb;
+	byte * pb;
+
+	if ((size != 0) && (count > ((size_t)-1 - ARENA_ALIGN) / size)) return NULL;
+	cb = ARENA_ROUND(count * size);
+	if (cb == 0) cb = ARENA_ALIGN;
+
+	if (pBlock->m_cbSize - pBlock->m_cbUsed < cb) {
+		if ((pBlock->m_next != NULL) && (pBlock->m_next->m_cbSize >= cb)) {
+			pBlock = pBlock->m_next;
+		}
+		else {
+			size_t cbNew = (cb > pArena->m_cbBlock) ? cb : pArena->m_cbBlock;
+
+			pNew = (ArenaBlock *)malloc(ARENA_BLOCK_HEADER + cbNew);
+			if (pNew == NULL) return NULL;
+
+			pNew->m_cbSize = cbNew;
+			pNew->m_cbUsed = 0;
+			pNew->m_next = pBlock->m_next;
+			pBlock->m_next = pNew;
+			pBlock = pNew;
+		}
+		pArena->m_blockCurrent = pBlock;
+	}
+
+	pb = ARENA_BLOCK_DATA(pBlock) + pBlock->m_cbUsed;
+	pBlock->m_cbUsed += cb;
+	memset(pb, 0, cb);
+
+	pArena->m_pbLast = pb;
+	return pb;
+}
+
+/*! \private
+* @brief Release memory back to the arena
+*
+* Matches the cn_free_func signature.  Memory is normally only returned when
+* the arena is reset or destroyed.  The most recent allocation is given back
+* right away so that short lived temporaries do not grow the arena.
+*
+* @param ptr memory to be released
+* @param context the arena
+*/
+
+static void _COSE_Arena_Free(void * ptr, void * context)
+{
+	COSE_Arena * pArena = (COSE_Arena *)context;
+
+	if ((ptr != NULL) && (ptr == pArena->m_pbLast)) {
+		pArena->m_blockCurrent->m_cbUsed = (byte *)ptr - ARENA_BLOCK_DATA(pArena->m_blockCurrent);
+		pArena->m_pbLast = NULL;
+	}
+}
+
+/*!
+* @brief Create a new arena allocator
+*
+* The arena and its first block are obtained with a single heap allocation.
+* Additional blocks are only allocated if a message does not fit and are
+* kept for reuse across COSE_Arena_Reset calls.
+*
+* @param cbBlock size of each block, 0 selects the default size
+* @param perr location to return errors
+* @return handle for the arena or NULL on failure
+*/
+
+HCOSE_ARENA COSE_Arena_Create(size_t cbBlock, cose_errback * perr)
+{
+	COSE_Arena * pArena;
+
+	if (cbBlock == 0) cbBlock = ARENA_DEFAULT_BLOCK;
+	CHECK_CONDITION(cbBlock < (size_t)-1 - ARENA_HEADER - ARENA_BLOCK_HEADER - ARENA_ALIGN, COSE_ERR_INVALID_PARAMETER);
+	cbBlock = ARENA_ROUND(cbBlock);
+
+	pArena = (COSE_Arena *)malloc(ARENA_HEADER + ARENA_BLOCK_HEADER + cbBlock);
+	CHECK_CONDITION(pArena != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	pArena->m_context.calloc_func = _COSE_Arena_Calloc;
+	pArena->m_context.free_func = _COSE_Arena_Free;
+	pArena->m_context.context = pArena;
+
+	pArena->m_blockFirst = (ArenaBlock *)(((byte *)pArena) + ARENA_HEADER);
+	pArena->m_blockFirst->m_next = NULL;
+	pArena->m_blockFirst->m_cbSize = cbBlock;
+	pArena->m_blockFirst->m_cbUsed = 0;
+	pArena->m_blockCurrent = pArena->m_blockFirst;
+	pArena->m_cbBlock = cbBlock;
+	pArena->m_pbLast = NULL;
+	pArena->m_pEpoch = NULL;
+
+	return (HCOSE_ARENA)pArena;
+
+errorReturn:
+	return NULL;
+}
+
+/*!
+* @brief Get the allocation context for an arena
+*
+* The returned context is passed to the COSE_*_Init and COSE_Decode functions
+* in place of a user supplied allocator.
+*
+* @param h handle for the arena
+* @return the context or NULL if the handle is invalid
+*/
+
+cn_cbor_context * COSE_Arena_GetContext(HCOSE_ARENA h)
+{
+	if (h == NULL) return NULL;
+	return &((COSE_Arena *)h)->m_context;
+}
+
+/*! \private
+* @brief Get the handle generation of the arena behind a context
+*
+* @param context allocation context of an object, may be NULL
+* @return location of the generation or NULL if the context is not an arena
+*/
+
+COSE_HandleEpoch ** _COSE_Arena_HandleEpoch(const cn_cbor_context * context)
+{
+	if ((context == NULL) || (context->calloc_func != _COSE_Arena_Calloc)) return NULL;
+	return &((COSE_Arena *)context->context)->m_pEpoch;
+}
+
+/*!
+* @brief Release all memory allocated from an arena
+*
+* All of the blocks are kept for reuse, so a steady state workload does
+* not need to go back to the heap.  Messages, recipients, signers and key
+* sets created using the arena are discarded along with their handles and
+* need not be freed first, the reset does not depend on how many there are.
+* Objects from other allocators must not refer to them any longer.  Any of
+* them may still be freed before the reset if the application prefers.
+*
+* Key objects (COSE_KEY_FromCbor) and prepared keys (COSE_PreparedKey_Create)
+* hold keys and contexts of the crypto library which live outside of the
+* arena.  They must be freed before the reset, which fails and leaves the
+* arena untouched while any of them is live.
+*
+* @param h handle for the arena
+* @return result of the operation
+*/
+
+bool COSE_Arena_Reset(HCOSE_ARENA h)
+{
+	COSE_Arena * pArena = (COSE_Arena *)h;
+	ArenaBlock * pBlock;
+
+	if (pArena == NULL) return false;
+	if (_COSE_Handle_EpochPinned(pArena->m_pEpoch)) return false;
+
+	for (pBlock = pArena->m_blockFirst; pBlock != NULL; pBlock = pBlock->m_next) {
+		pBlock->m_cbUsed = 0;
+	}
+	pArena->m_blockCurrent = pArena->m_blockFirst;
+	pArena->m_pbLast = NULL;
+
+	_COSE_Handle_EndEpoch(pArena->m_pEpoch);
+	pArena->m_pEpoch = NULL;
+
+	return true;
+}
+
+/*!
+* @brief Destroy an arena and all of the memory allocated from it
+*
+* Objects created using the arena are discarded as they are by
+* COSE_Arena_Reset.  The arena is not destroyed while key objects or
+* prepared keys created using it are live.
+*
+* @param h handle for the arena
+* @return result of the operation
+*/
+
+bool COSE_Arena_Destroy(HCOSE_ARENA h)
+{
+	COSE_Arena * pArena = (COSE_Arena *)h;
+	ArenaBlock * pBlock;
+	ArenaBlock * pBlock2;
+
+	if (pArena == NULL) return false;
+	if (_COSE_Handle_EpochPinned(pArena->m_pEpoch)) return false;
+
+	_COSE_Handle_EndEpoch(pArena->m_pEpoch);
+
+	for (pBlock = pArena->m_blockFirst->m_next; pBlock != NULL; pBlock = pBlock2) {
+		pBlock2 = pBlock->m_next;
+		free(pBlock);
+	}
+
+	free(pArena);
+
+	return true;
+}
+
+#endif // USE_CBOR_CONTEXT
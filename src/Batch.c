@@ -0,0 +1,232 @@
+/** \file Batch.c
+* Contains the implementation of batch signature verification.
+*
+* The messages of a batch are handed out one at a time from a shared index,
+* so a worker which draws cheap messages keeps taking more and no thread
+* sits idle while others still have work queued.  The calling thread works
+* on the batch as well.
+*
+* When no allocation context is supplied each worker decodes into its own
+* arena, which is reset after every message.  The decoded message, the
+* Sig_structure and the signature temporaries therefore reuse the same few
+* blocks for the whole batch instead of going to the heap per message.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE BATCH_THREAD;
+#define BATCH_NEXT(p) ((size_t) InterlockedIncrement(p) - 1)
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t BATCH_THREAD;
+#define BATCH_NEXT(p) __sync_fetch_and_add(p, 1)
+#endif
+
+#define BATCH_MAX_THREADS 256
+
+typedef struct {
+	COSE_VERIFY_ITEM * m_rgItems;
+	size_t m_cItems;
+#ifdef _WIN32
+	volatile LONG m_iNext;
+#else
+	volatile size_t m_iNext;
+#endif
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * m_context;
+#endif
+} BatchState;
+
+/*! \private
+* @brief Decode and verify a single message of a batch
+*
+* @param pItem  Message to verify, the result is written back into it
+* @param context  Allocation context for the message
+*/
+
+static void VerifyOne(COSE_VERIFY_ITEM * pItem CBOR_CONTEXT)
+{
+	HCOSE h = NULL;
+	HCOSE_SIGNER hSigner = NULL;
+	cose_errback error = { COSE_ERR_NONE };
+	cose_errback * perr = &error;
+	int type = COSE_unknown_object;
+
+	pItem->fValid = false;
+
+	CHECK_CONDITION(IsValidKeyHandle(pItem->hKey), COSE_ERR_INVALID_HANDLE);
+
+	h = COSE_Decode(pItem->pbMessage, pItem->cbMessage, &type, pItem->type, CBOR_CONTEXT_PARAM_COMMA perr);
+	if (h == NULL) goto errorReturn;
+
+	switch (type) {
+	case COSE_sign0_object:
+		pItem->fValid = COSE_Sign0_validate2((HCOSE_SIGN0)h, pItem->hKey, perr);
+		break;
+
+	case COSE_sign_object:
+		hSigner = COSE_Sign_GetSigner((HCOSE_SIGN)h, pItem->iSigner, perr);
+		if (hSigner == NULL) goto errorReturn;
+		if (!COSE_Signer_SetKey2(hSigner, pItem->hKey, perr)) goto errorReturn;
+		pItem->fValid = COSE_Sign_validate((HCOSE_SIGN)h, hSigner, perr);
+		break;
+
+	default:
+		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+	}
+
+errorReturn:
+	if (hSigner != NULL) COSE_Signer_Free(hSigner);
+	if (h != NULL) {
+		if (type == COSE_sign0_object) COSE_Sign0_Free((HCOSE_SIGN0)h);
+		else if (type == COSE_sign_object) COSE_Sign_Free((HCOSE_SIGN)h);
+	}
+	pItem->err = pItem->fValid ? COSE_ERR_NONE : error.err;
+}
+
+/*! \private
+* @brief Verify messages of the batch until none are left
+*
+* @param pState  The shared batch state
+*/
+
+static void BatchWork(BatchState * pState)
+{
+	size_t i;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = pState->m_context;
+	HCOSE_ARENA hArena = NULL;
+
+	if (context == NULL) {
+		hArena = COSE_Arena_Create(0, NULL);
+		context = COSE_Arena_GetContext(hArena);
+	}
+#endif
+
+	while ((i = BATCH_NEXT(&pState->m_iNext)) < pState->m_cItems) {
+		VerifyOne(&pState->m_rgItems[i] CBOR_CONTEXT_PARAM);
+#ifdef USE_CBOR_CONTEXT
+		if (hArena != NULL) COSE_Arena_Reset(hArena);
+#endif
+	}
+
+#ifdef USE_CBOR_CONTEXT
+	if (hArena != NULL) COSE_Arena_Destroy(hArena);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI BatchThread(LPVOID pv)
+{
+	BatchWork((BatchState *)pv);
+	COSE_Pool_Trim();
+	COSE_Random_Clear();
+	return 0;
+}
+#else
+static void * BatchThread(void * pv)
+{
+	BatchWork((BatchState *)pv);
+	COSE_Pool_Trim();
+	COSE_Random_Clear();
+	return NULL;
+}
+#endif
+
+/*! \private
+* @brief Number of processors available to the process
+*/
+
+static int ProcessorCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long c = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (c < 1) ? 1 : (int)c;
+#endif
+}
+
+/*!
+* @brief Verify the signatures on a set of encoded messages
+*
+* Each item names an encoded COSE_Sign or COSE_Sign1 message and the key to
+* verify it with; COSE_Sign messages are verified for the signer given by
+* iSigner.  The result of each message is returned in its fValid and err
+* fields, a failed message does not stop the rest of the batch.
+*
+* The key objects are only read and the same key may appear in any number
+* of items.  An allocation context, if one is given, is called from all of
+* the worker threads and must be thread safe.
+*
+* @param rgItems  Messages to verify
+* @param cItems  Number of messages
+* @param cThreads  Number of threads to verify on, including the caller, 0 for one per processor
+* @param context  Allocation context, may be NULL
+* @param perr  Location to return errors
+* @return true if the batch was processed, the individual results are in the items
+*/
+
+bool COSE_Verify_Batch(COSE_VERIFY_ITEM * rgItems, size_t cItems, int cThreads, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	BatchState state;
+	BATCH_THREAD rgThreads[BATCH_MAX_THREADS];
+	int cStarted = 0;
+	int i;
+
+	CHECK_CONDITION((rgItems != NULL) || (cItems == 0), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(cThreads >= 0, COSE_ERR_INVALID_PARAMETER);
+
+	if (cThreads == 0) cThreads = ProcessorCount();
+	if (cThreads > BATCH_MAX_THREADS) cThreads = BATCH_MAX_THREADS;
+	if ((size_t)cThreads > cItems) cThreads = (int)cItems;
+
+	state.m_rgItems = rgItems;
+	state.m_cItems = cItems;
+	state.m_iNext = 0;
+#ifdef USE_CBOR_CONTEXT
+	state.m_context = context;
+#endif
+
+	//  If a thread cannot be started the remaining threads, and the caller,
+	//  take its share of the batch.
+
+	for (i = 1; i < cThreads; i++) {
+#ifdef _WIN32
+		rgThreads[cStarted] = CreateThread(NULL, 0, BatchThread, &state, 0, NULL);
+		if (rgThreads[cStarted] == NULL) break;
+#else
+		if (pthread_create(&rgThreads[cStarted], NULL, BatchThread, &state) != 0) break;
+#endif
+		cStarted += 1;
+	}
+
+	BatchWork(&state);
+
+	for (i = 0; i < cStarted; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(rgThreads[i], INFINITE);
+		CloseHandle(rgThreads[i]);
+#else
+		pthread_join(rgThreads[i], NULL);
+#endif
+	}
+
+	return true;
+
+errorReturn:
+	return false;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 
 #include "cose.h"
 #include "cose_int.h"
@@ -26,13 +27,15 @@ bool _COSE_Init(COSE_INIT_FLAGS flags, COSE* pobj, int msgType, CBOR_CONTEXT_COM
 
 	pobj->m_flags = flags;
 
-	pobj->m_protectedMap = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &errState);
+	//  The maps, array and tag of the skeleton come from the node pool
+
+	pobj->m_protectedMap = cn_cbor_map_create(CBOR_POOL_PARAM_COMMA &errState);
 	CHECK_CONDITION_CBOR(pobj->m_protectedMap != NULL, errState);
 
-	pobj->m_dontSendMap = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &errState);
+	pobj->m_dontSendMap = cn_cbor_map_create(CBOR_POOL_PARAM_COMMA &errState);
 	CHECK_CONDITION_CBOR(pobj->m_dontSendMap != NULL, errState);
 
-	pobj->m_cborRoot = pobj->m_cbor = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA &errState);
+	pobj->m_cborRoot = pobj->m_cbor = cn_cbor_array_create(CBOR_POOL_PARAM_COMMA &errState);
 	CHECK_CONDITION_CBOR(pobj->m_cbor != NULL, errState);
 	pobj->m_ownMsg = 1;
 
@@ -47,7 +50,7 @@ bool _COSE_Init(COSE_INIT_FLAGS flags, COSE* pobj, int msgType, CBOR_CONTEXT_COM
 	pobj->m_msgType = msgType;
 #endif
 
-	pobj->m_unprotectMap = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &errState);
+	pobj->m_unprotectMap = cn_cbor_map_create(CBOR_POOL_PARAM_COMMA &errState);
 	CHECK_CONDITION_CBOR(pobj->m_unprotectMap != NULL, errState);
 	CHECK_CONDITION_CBOR(_COSE_array_replace(pobj, pobj->m_unprotectMap, INDEX_UNPROTECTED, CBOR_CONTEXT_PARAM_COMMA &errState), errState);
 	pobj->m_ownUnprotectedMap = false;
@@ -55,7 +58,7 @@ bool _COSE_Init(COSE_INIT_FLAGS flags, COSE* pobj, int msgType, CBOR_CONTEXT_COM
 	
 	if (!(flags & COSE_INIT_FLAGS_NO_CBOR_TAG)) {
 		cn_cbor_errback cbor_error;
-		cn_cbor * cn = cn_cbor_tag_create(msgType, pobj->m_cborRoot, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+		cn_cbor * cn = cn_cbor_tag_create(msgType, pobj->m_cborRoot, CBOR_POOL_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
 		pobj->m_cborRoot = cn;
 	}
@@ -104,7 +107,7 @@ bool _COSE_Init_From_Object(COSE* pobj, cn_cbor * pcbor, CBOR_CONTEXT_COMMA cose
 		CHECK_CONDITION(pmap->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
 
 		if (pmap->length == 0) {
-			pobj->m_protectedMap = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+			pobj->m_protectedMap = cn_cbor_map_create(CBOR_POOL_PARAM_COMMA NULL);
 			CHECK_CONDITION(pobj->m_protectedMap, COSE_ERR_OUT_OF_MEMORY);
 		}
 		else {
@@ -117,7 +120,7 @@ bool _COSE_Init_From_Object(COSE* pobj, cn_cbor * pcbor, CBOR_CONTEXT_COMMA cose
 	CHECK_CONDITION((pobj->m_unprotectMap != NULL) && (pobj->m_unprotectMap->type == CN_CBOR_MAP), COSE_ERR_INVALID_PARAMETER);
 	pobj->m_ownUnprotectedMap = false;
 
-	pobj->m_dontSendMap = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	pobj->m_dontSendMap = cn_cbor_map_create(CBOR_POOL_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(pobj->m_dontSendMap != NULL, cbor_error);
 
 	pobj->m_ownMsg = true;
@@ -135,10 +138,46 @@ void _COSE_Release(COSE * pobj)
 	cn_cbor_context * context = &pobj->m_allocContext;
 #endif
 
-	if (pobj->m_protectedMap != NULL) CN_CBOR_FREE(pobj->m_protectedMap, context);
-	if (pobj->m_ownUnprotectedMap && (pobj->m_unprotectMap != NULL)) CN_CBOR_FREE(pobj->m_unprotectMap, context);
-	if (pobj->m_dontSendMap != NULL) CN_CBOR_FREE(pobj->m_dontSendMap, context);
-	if (pobj->m_ownMsg && (pobj->m_cborRoot != NULL) && (pobj->m_cborRoot->parent == NULL)) CN_CBOR_FREE(pobj->m_cborRoot, context);
+	if (pobj->m_protectedMap != NULL) COSE_POOL_CBOR_FREE(pobj->m_protectedMap, context);
+	if (pobj->m_ownUnprotectedMap && (pobj->m_unprotectMap != NULL)) COSE_POOL_CBOR_FREE(pobj->m_unprotectMap, context);
+	if (pobj->m_dontSendMap != NULL) COSE_POOL_CBOR_FREE(pobj->m_dontSendMap, context);
+	if (pobj->m_ownMsg && (pobj->m_cborRoot != NULL) && (pobj->m_cborRoot->parent == NULL)) COSE_POOL_CBOR_FREE(pobj->m_cborRoot, context);
+}
+
+/*! \private
+* @brief Take the tree of a child object out of its parent message
+*
+* Called when a message is released while the application still holds a
+* handle to one of its signers.  The child keeps its own
+* tree, and frees it when its handle is freed, rather than pointing into
+* the freed tree of the parent.
+*
+* @param pobj child object still referenced by the application
+*/
+
+void _COSE_Detach(COSE * pobj)
+{
+	cn_cbor * cn = pobj->m_cborRoot;
+	cn_cbor * pParent;
+	cn_cbor * pPrev;
+
+	if ((cn == NULL) || (cn->parent == NULL)) return;
+	pParent = cn->parent;
+
+	if (pParent->first_child == cn) {
+		pParent->first_child = cn->next;
+		pPrev = NULL;
+	}
+	else {
+		for (pPrev = pParent->first_child; pPrev->next != cn; pPrev = pPrev->next);
+		pPrev->next = cn->next;
+	}
+	if (pParent->last_child == cn) pParent->last_child = pPrev;
+	pParent->length -= 1;
+
+	cn->parent = NULL;
+	cn->next = NULL;
+	pobj->m_ownMsg = true;
 }
 
 
@@ -151,6 +190,7 @@ HCOSE COSE_Decode(const byte * rgbData, size_t cbData, int * ptype, COSE_object_
 #endif
 	cn_cbor_errback cbor_err;
 	HCOSE h;
+	int iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECODE);
 
 	CHECK_CONDITION((rgbData != NULL) && (ptype != NULL), COSE_ERR_INVALID_PARAMETER);
 
@@ -229,21 +269,254 @@ HCOSE COSE_Decode(const byte * rgbData, size_t cbData, int * ptype, COSE_object_
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
+	_COSE_Stats_Leave(iStats);
 	return h;
 
 errorReturn:
 	COSE_FREE(cbor, context);
+	_COSE_Stats_Leave(iStats);
 	return NULL;
 }
 
-byte RgbDontUse[8 * 1024];   //  Remove this array when we can compute the size of a cbor serialization without this hack.
-
 size_t COSE_Encode(HCOSE msg, byte * rgb, size_t ib, size_t cb)
 {
-	if (rgb == NULL) return cn_cbor_encoder_write(RgbDontUse, 0, sizeof(RgbDontUse), ((COSE *)msg)->m_cbor) + ib;
+	if (rgb == NULL) return cn_cbor_encode_size(((COSE *)msg)->m_cbor) + ib;
 	return cn_cbor_encoder_write(rgb, ib, cb, ((COSE*)msg)->m_cbor);
 }
 
+/*! \private
+* @brief Serialize a CBOR object into an exactly sized buffer
+*
+* The size of the encoding is computed first so that the object is only
+* serialized once and there is no limit on the size of the object.
+*
+* @param pcbor object to be serialized
+* @param pcb returns the size of the serialized object
+* @param perr location to return errors
+* @return buffer holding the serialization, NULL on failure
+*/
+
+byte * _COSE_encode_cbor(const cn_cbor * pcbor, size_t * pcb, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	byte * pb = NULL;
+	size_t cb;
+
+	cb = cn_cbor_encode_size(pcbor);
+	CHECK_CONDITION(cb > 0, COSE_ERR_CBOR);
+
+	pb = (byte *)COSE_CALLOC(cb, 1, context);
+	CHECK_CONDITION(pb != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	CHECK_CONDITION((size_t)cn_cbor_encoder_write(pb, 0, cb, pcbor) == cb, COSE_ERR_CBOR);
+
+	*pcb = cb;
+	return pb;
+
+errorReturn:
+	if (pb != NULL) COSE_FREE(pb, context);
+	return NULL;
+}
+
+/*! \private
+* @brief Write the head of a CBOR item
+*
+* @param pb location to write to, NULL to only return the size
+* @param majorType CBOR major type
+* @param value length, count or value for the head
+* @return number of bytes in the head
+*/
+
+size_t _COSE_cbor_head(byte * pb, int majorType, uint64_t value)
+{
+	int cbArg;
+	int ai;
+	int i;
+
+	if (value < 24) {
+		if (pb != NULL) pb[0] = (byte)((majorType << 5) | (int)value);
+		return 1;
+	}
+	else if (value <= 0xff) { cbArg = 1; ai = 24; }
+	else if (value <= 0xffff) { cbArg = 2; ai = 25; }
+	else if (value <= 0xffffffff) { cbArg = 4; ai = 26; }
+	else { cbArg = 8; ai = 27; }
+
+	if (pb != NULL) {
+		pb[0] = (byte)((majorType << 5) | ai);
+		for (i = cbArg; i > 0; i--) {
+			pb[i] = (byte)value;
+			value >>= 8;
+		}
+	}
+	return 1 + cbArg;
+}
+
+/*! \private
+* @brief Write the to-be-processed structure for a message
+*
+* Serializes the Enc_structure, MAC_structure or Sig_structure from RFC 8152
+* directly without building a temporary cn_cbor tree.  The structure is
+*
+*     [ context, protected, ?signProtected, external_aad, ?payload ]
+*
+* where a protected map encoded as an empty map (0xa0) is written as a zero
+* length byte string.
+*
+* @param pbOut buffer to write into, NULL to only compute the size
+* @param cbOut size of pbOut
+* @param szContext context string for the structure
+* @param pcnProtected protected attributes of the message
+* @param pcnProtectedSign protected attributes of the signer, NULL if not present
+* @param pbExternal external data
+* @param cbExternal size of the external data
+* @param pcnBody payload, NULL if not part of the structure.  A payload which
+*		is not a byte string (detached content) is written as an empty string.
+* @param fPrefixOnly stop after the head of the payload, the payload bytes
+*		are then fed to the hash separately by the caller
+* @return size of the structure, 0 if the output buffer is too small
+*/
+
+size_t _COSE_Structure_Write(byte * pbOut, size_t cbOut, const char * szContext, const cn_cbor * pcnProtected, const cn_cbor * pcnProtectedSign, const byte * pbExternal, size_t cbExternal, const cn_cbor * pcnBody, bool fPrefixOnly)
+{
+	const byte * rgpb[4];
+	size_t rgcb[4];
+	int cItems = 0;
+	size_t cbContext = strlen(szContext);
+	size_t cb;
+	size_t ib;
+	int i;
+
+	rgpb[cItems] = pcnProtected->v.bytes;
+	rgcb[cItems] = ((pcnProtected->length == 1) && (pcnProtected->v.bytes[0] == 0xa0)) ? 0 : pcnProtected->length;
+	cItems++;
+
+	if (pcnProtectedSign != NULL) {
+		rgpb[cItems] = pcnProtectedSign->v.bytes;
+		rgcb[cItems] = ((pcnProtectedSign->length == 1) && (pcnProtectedSign->v.bytes[0] == 0xa0)) ? 0 : pcnProtectedSign->length;
+		cItems++;
+	}
+
+	rgpb[cItems] = pbExternal;
+	rgcb[cItems] = cbExternal;
+	cItems++;
+
+	if (pcnBody != NULL) {
+		rgpb[cItems] = pcnBody->v.bytes;
+		rgcb[cItems] = (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0;
+		cItems++;
+	}
+
+	cb = 1 + _COSE_cbor_head(NULL, 3, cbContext) + cbContext;
+	for (i = 0; i < cItems; i++) {
+		cb += _COSE_cbor_head(NULL, 2, rgcb[i]) + rgcb[i];
+	}
+	if (fPrefixOnly && (pcnBody != NULL)) cb -= rgcb[cItems - 1];
+
+	if (pbOut == NULL) return cb;
+	if (cbOut < cb) return 0;
+
+	ib = _COSE_cbor_head(pbOut, 4, cItems + 1);
+	ib += _COSE_cbor_head(&pbOut[ib], 3, cbContext);
+	memcpy(&pbOut[ib], szContext, cbContext);
+	ib += cbContext;
+
+	for (i = 0; i < cItems; i++) {
+		ib += _COSE_cbor_head(&pbOut[ib], 2, rgcb[i]);
+		if (fPrefixOnly && (pcnBody != NULL) && (i == cItems - 1)) break;
+		if (rgcb[i] > 0) memcpy(&pbOut[ib], rgpb[i], rgcb[i]);
+		ib += rgcb[i];
+	}
+
+	return cb;
+}
+
+/*! \private
+* @brief Build the to-be-processed structure for a message
+*
+* Allocates an exactly sized buffer from the allocation context and writes
+* the structure into it.  See _COSE_Structure_Write for the parameters.
+*
+* @param ppb returns the allocated structure
+* @param pcb returns the size of the structure
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool _COSE_Structure_Build(const char * szContext, const cn_cbor * pcnProtected, const cn_cbor * pcnProtectedSign, const byte * pbExternal, size_t cbExternal, const cn_cbor * pcnBody, bool fPrefixOnly, byte ** ppb, size_t * pcb, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	byte * pb = NULL;
+	size_t cb;
+
+	CHECK_CONDITION((pcnProtected != NULL) && (pcnProtected->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((pcnProtectedSign == NULL) || (pcnProtectedSign->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+
+	cb = _COSE_Structure_Write(NULL, 0, szContext, pcnProtected, pcnProtectedSign, pbExternal, cbExternal, pcnBody, fPrefixOnly);
+
+	pb = (byte *)COSE_CALLOC(cb, 1, context);
+	CHECK_CONDITION(pb != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	CHECK_CONDITION(_COSE_Structure_Write(pb, cb, szContext, pcnProtected, pcnProtectedSign, pbExternal, cbExternal, pcnBody, fPrefixOnly) == cb, COSE_ERR_INTERNAL);
+
+	*ppb = pb;
+	*pcb = cb;
+	return true;
+
+errorReturn:
+	if (pb != NULL) COSE_FREE(pb, context);
+	return false;
+}
+
+/*! \private
+* @brief Write the encoding of a message up to the bytes of its body
+*
+* Writes the array head, every element ahead of the body and the byte string
+* head for a body of cbBody bytes.  The body must be the last element of the
+* message, the caller then produces the body bytes directly after the prefix.
+*
+* @param pMessage message to be encoded
+* @param cbBody size of the body which will follow
+* @param pbOut buffer to write into, NULL to only compute the size
+* @param cbOut size of pbOut
+* @return size of the prefix, 0 on failure or if the buffer is too small
+*/
+
+size_t _COSE_Encode_Prefix(COSE * pMessage, size_t cbBody, byte * pbOut, size_t cbOut)
+{
+	int iBody = INDEX_BODY;
+	int i;
+	const cn_cbor * cn;
+	size_t cb;
+	size_t ib;
+	ssize_t cbWrite;
+
+#ifdef TAG_IN_ARRAY
+	if (pMessage->m_msgType != 0) iBody += 1;
+#endif
+
+	if (pMessage->m_cbor->length > iBody + 1) return 0;
+
+	cb = _COSE_cbor_head(NULL, 4, iBody + 1);
+	for (i = 0; i < iBody; i++) {
+		cn = cn_cbor_index(pMessage->m_cbor, i);
+		if (cn == NULL) return 0;
+		cb += cn_cbor_encode_size(cn);
+	}
+	cb += _COSE_cbor_head(NULL, 2, cbBody);
+
+	if (pbOut == NULL) return cb;
+	if (cbOut < cb) return 0;
+
+	ib = _COSE_cbor_head(pbOut, 4, iBody + 1);
+	for (i = 0; i < iBody; i++) {
+		cbWrite = cn_cbor_encoder_write(pbOut, ib, cbOut, cn_cbor_index(pMessage->m_cbor, i));
+		if (cbWrite <= 0) return 0;
+		ib += cbWrite;
+	}
+	ib += _COSE_cbor_head(&pbOut[ib], 2, cbBody);
+
+	return (ib == cb) ? cb : 0;
+}
+
 
 cn_cbor * COSE_get_cbor(HCOSE h)
 {
@@ -346,12 +619,76 @@ errorReturn:
 	return f;
 }
 
-byte RgbDontUse3[1024];
+/*! \private
+* @brief Replace a header parameter in one of the header maps
+*
+* Any value the map already has for the key is unlinked and freed, then the
+* new value is added.  The new value is owned by the map on success.
+*
+* @param pCose  Message to change
+* @param key  Header parameter to replace
+* @param value  New value for the parameter
+* @param flags  Map to change, exactly one of the COSE_*_ONLY flags
+* @param perr  Location to return errors
+* @return Did the function succeed?
+*/
+
+bool _COSE_map_replace(COSE * pCose, int key, cn_cbor * value, int flags, cose_errback * perr)
+{
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pCose->m_allocContext;
+#endif
+	cn_cbor_errback error;
+	cn_cbor * pMap;
+	cn_cbor * pKey;
+	cn_cbor * pPrev = NULL;
+	cn_cbor * pOld;
+
+	CHECK_CONDITION(value != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	switch (flags) {
+	case COSE_PROTECT_ONLY:
+		pMap = pCose->m_protectedMap;
+		break;
+
+	case COSE_UNPROTECT_ONLY:
+		pMap = pCose->m_unprotectMap;
+		break;
+
+	case COSE_DONT_SEND:
+		pMap = pCose->m_dontSendMap;
+		break;
+
+	default:
+		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+	}
+
+	pOld = cn_cbor_mapget_int(pMap, key);
+	if (pOld != NULL) {
+		for (pKey = pMap->first_child; pKey->next != pOld; pKey = pKey->next) pPrev = pKey;
+
+		if (pPrev == NULL) pMap->first_child = pOld->next;
+		else pPrev->next = pOld->next;
+		if (pMap->last_child == pOld) pMap->last_child = pPrev;
+		pMap->length -= 2;
+
+		pKey->next = pKey->parent = NULL;
+		pOld->next = pOld->parent = NULL;
+		CN_CBOR_FREE(pKey, context);
+		CN_CBOR_FREE(pOld, context);
+	}
+
+	CHECK_CONDITION(cn_cbor_mapput_int(pMap, key, value, CBOR_CONTEXT_PARAM_COMMA &error), _MapFromCBOR(error));
+	return true;
+
+errorReturn:
+	return false;
+}
 
 cn_cbor * _COSE_encode_protected(COSE * pMessage, cose_errback * perr)
 {
 	cn_cbor * pProtected;
-	int cbProtected;
+	size_t cbProtected;
 	byte * pbProtected = NULL;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pMessage->m_allocContext;
@@ -369,17 +706,14 @@ cn_cbor * _COSE_encode_protected(COSE * pMessage, cose_errback * perr)
 	}
 
 	if (pMessage->m_protectedMap->length > 0) {
-		cbProtected = cn_cbor_encoder_write(RgbDontUse3, 0, sizeof(RgbDontUse3), pMessage->m_protectedMap);
-		pbProtected = (byte *)COSE_CALLOC(cbProtected, 1, context);
-		CHECK_CONDITION(pbProtected != NULL, COSE_ERR_OUT_OF_MEMORY);
-
-		CHECK_CONDITION(cn_cbor_encoder_write(pbProtected, 0, cbProtected, pMessage->m_protectedMap) == cbProtected, COSE_ERR_CBOR);
+		pbProtected = _COSE_encode_cbor(pMessage->m_protectedMap, &cbProtected, CBOR_CONTEXT_PARAM_COMMA perr);
+		if (pbProtected == NULL) goto errorReturn;
 	}
 	else {
 		cbProtected = 0;
 	}
 
-	pProtected = cn_cbor_data_create(pbProtected, cbProtected, CBOR_CONTEXT_PARAM_COMMA NULL);
+	pProtected = cn_cbor_data_create(pbProtected, (int) cbProtected, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(pProtected != NULL, COSE_ERR_OUT_OF_MEMORY);
 	pbProtected = NULL;
 
@@ -503,48 +837,3 @@ cose_error _MapFromCBOR(cn_cbor_errback err)
 		return COSE_ERR_CBOR;
 	}
 }
-
-void _COSE_InsertInList(COSE ** root, COSE * newMsg)
-{
-	if (*root == NULL) {
-		*root = newMsg;
-		return;
-	}
-
-	newMsg->m_handleList = *root;
-	*root = newMsg;
-	return;
-}
-
-bool _COSE_IsInList(COSE * root, COSE * thisMsg)
-{
-	COSE * walk;
-
-	if (root == NULL) return false;
-	if (thisMsg == NULL) return false;
-
-	for (walk = root; walk != NULL; walk = walk->m_handleList) {
-		if (walk == thisMsg) return true;		
-	}
-	return false;
-}
-
-void _COSE_RemoveFromList(COSE ** root, COSE * thisMsg)
-{
-	COSE * walk;
-
-	if (*root == thisMsg) {
-		*root = thisMsg->m_handleList;
-		thisMsg->m_handleList = NULL;
-		return;
-	}
-
-	for (walk = *root; walk->m_handleList != NULL; walk = walk->m_handleList) {
-		if (walk->m_handleList == thisMsg) {
-			walk->m_handleList = thisMsg->m_handleList;
-			thisMsg->m_handleList = NULL;
-			return;
-		}
-	}
-	return;
-}
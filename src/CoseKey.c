@@ -0,0 +1,165 @@
+/** \file CoseKey.c
+* Contains the implementation of key objects.
+*
+* A key object wraps a COSE_Key map supplied by the application.  EC2 keys
+* are parsed into the crypto library's own form when the object is created,
+* and with mbedTLS the multiples of the curve generator are computed at the
+* same time, so signing, verification and ECDH key agreement with the key object do not
+* decode the key each time.  OKP keys for EdDSA are parsed in the same way.
+*
+* EC2 keys are parsed by the provider of ECDSA with SHA-256 and OKP keys by
+* the provider of EdDSA.  An operation performed by another provider works
+* from the COSE_Key map instead of the parsed key.
+*
+* The parsed key is not changed after it is created and can be used by more
+* than one thread at a time.  The COSE_Key map is referenced, not copied,
+* and must stay valid for the life of the key object.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+/*! \private
+* @brief Fill in a key object which refers to a COSE_Key map
+*
+* The key is not parsed, the crypto code will decode the map each time it
+* is used.  This is how the functions taking a cn_cbor key work.
+*
+* @param pKey  Key object to fill in
+* @param pcborKey  COSE_Key map, may be NULL
+*/
+
+void _COSE_KEY_Wrap(COSE_KEY * pKey, const cn_cbor * pcborKey)
+{
+	memset(pKey, 0, sizeof(*pKey));
+	pKey->m_cborKey = pcborKey;
+}
+
+/*! \private
+* @brief Copy a key object for use by a provider
+*
+* The parsed key is only copied when it belongs to the provider, otherwise
+* the copy refers to the COSE_Key map alone.
+*
+* @param pKeyOut  Key object to fill in
+* @param pKey  Key object to copy
+* @param pProvider  Provider which will use the copy
+*/
+
+void _COSE_KEY_Copy(COSE_KEY * pKeyOut, const COSE_KEY * pKey, const COSE_CRYPTO_PROVIDER * pProvider)
+{
+	if ((pKey->m_pProvider == NULL) || (pKey->m_pProvider == pProvider)) *pKeyOut = *pKey;
+	else _COSE_KEY_Wrap(pKeyOut, pKey->m_cborKey);
+}
+
+/*! \private
+* @brief Test if a HCOSE_KEY handle is valid
+*
+* @param h  Handle to be validated
+* @return result of the check
+*/
+
+bool IsValidKeyHandle(HCOSE_KEY h)
+{
+	return _COSE_Handle_IsValid(COSE_HANDLE_KEY, (const COSE *)h);
+}
+
+/*!
+* @brief Create a key object from a COSE_Key map
+*
+* EC2 and OKP keys are parsed when the object is created.  Keys of any other
+* type, including those whose kty is a text string, are accepted but are
+* only referenced, the crypto code then works from the COSE_Key map.
+*
+* @param pcborKey  COSE_Key map, must remain valid until the key object is freed
+* @param context  Allocation context, may be NULL
+* @param perr  Location to return errors
+* @return handle to the key object or NULL on failure
+*/
+
+HCOSE_KEY COSE_KEY_FromCbor(const cn_cbor * pcborKey, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	COSE_KEY * pKey = NULL;
+	const cn_cbor * cn;
+	const COSE_CRYPTO_PROVIDER * pProvider;
+
+	CHECK_CONDITION(pcborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	cn = cn_cbor_mapget_int(pcborKey, COSE_Key_Type);
+	CHECK_CONDITION((cn != NULL) && ((cn->type == CN_CBOR_UINT) || (cn->type == CN_CBOR_INT) || (cn->type == CN_CBOR_TEXT)), COSE_ERR_INVALID_PARAMETER);
+
+	pKey = (COSE_KEY *)COSE_CALLOC(1, sizeof(COSE_KEY), context);
+	CHECK_CONDITION(pKey != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	_COSE_KEY_Wrap(pKey, pcborKey);
+#ifdef USE_CBOR_CONTEXT
+	if (context != NULL) pKey->m_allocContext = *context;
+#endif
+
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_KEY, (COSE *)pKey CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
+
+	if ((cn->type == CN_CBOR_UINT) && (cn->v.uint == COSE_Key_Type_EC2)) {
+		pProvider = _COSE_Provider_Get(COSE_Algorithm_ECDSA_SHA_256);
+		if (pProvider->pfnECKey_Prepare != NULL) {
+			if (!pProvider->pfnECKey_Prepare(pKey, perr)) goto errorReturn;
+			pKey->m_pProvider = pProvider;
+			pKey->m_kty = COSE_Key_Type_EC2;
+		}
+	}
+	else if ((cn->type == CN_CBOR_UINT) && (cn->v.uint == COSE_Key_Type_OKP)) {
+		pProvider = _COSE_Provider_Get(COSE_Algorithm_EdDSA);
+		if (pProvider->pfnOKPKey_Prepare != NULL) {
+			if (!pProvider->pfnOKPKey_Prepare(pKey, perr)) goto errorReturn;
+			pKey->m_pProvider = pProvider;
+			pKey->m_kty = COSE_Key_Type_OKP;
+		}
+	}
+
+	return (HCOSE_KEY)pKey;
+
+errorReturn:
+	if (pKey != NULL) {
+		_COSE_Handle_Remove(COSE_HANDLE_KEY, (COSE *)pKey);
+		COSE_FREE(pKey, context);
+	}
+	return NULL;
+}
+
+/*!
+* @brief Free a key object
+*
+* Objects which were given the key must be freed first.  The COSE_Key map
+* is not freed.
+*
+* @param h  Handle of the key object
+* @return result of the operation
+*/
+
+bool COSE_KEY_Free(HCOSE_KEY h)
+{
+	COSE_KEY * pKey = (COSE_KEY *)h;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context context;
+#endif
+
+	if (!IsValidKeyHandle(h)) return false;
+	_COSE_Handle_Remove(COSE_HANDLE_KEY, (COSE *)pKey);
+
+#ifdef USE_CBOR_CONTEXT
+	context = pKey->m_allocContext;
+#endif
+
+	if (pKey->m_kty == COSE_Key_Type_EC2) {
+		if (pKey->m_pProvider->pfnECKey_Release != NULL) pKey->m_pProvider->pfnECKey_Release(pKey);
+	}
+	else if (pKey->m_kty == COSE_Key_Type_OKP) {
+		if (pKey->m_pProvider->pfnOKPKey_Release != NULL) pKey->m_pProvider->pfnOKPKey_Release(pKey);
+	}
+	COSE_FREE(pKey, &context);
+
+	return true;
+}
@@ -14,19 +14,16 @@
 
 void _COSE_Enveloped_Release(COSE_Enveloped * p);
 
-byte RgbDontUse[8 * 1024];   //  Remove this array when we can compute the size of a cbor serialization without this hack.
-
-COSE * EnvelopedRoot = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_ENVELOPED handle is valid
 *
 *  Internal function to test if a enveloped message handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -35,7 +32,7 @@ COSE * EnvelopedRoot = NULL;
 bool IsValidEnvelopedHandle(HCOSE_ENVELOPED h)
 {
 	COSE_Enveloped * p = (COSE_Enveloped *)h;
-	return _COSE_IsInList(EnvelopedRoot, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_ENVELOPED, (COSE *) p);
 }
 
 
@@ -58,16 +55,20 @@ bool IsValidEnvelopedHandle(HCOSE_ENVELOPED h)
 */
 HCOSE_ENVELOPED COSE_Enveloped_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
-	COSE_Enveloped * pobj = (COSE_Enveloped *)COSE_CALLOC(1, sizeof(COSE_Enveloped), context);
+	COSE_Enveloped * pobj = (COSE_Enveloped *)COSE_POOL_CALLOC(COSE_POOL_ENVELOPED, sizeof(COSE_Enveloped), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags,&pobj->m_message, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		_COSE_Enveloped_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
 		return NULL;
 	}
 
-	_COSE_InsertInList(&EnvelopedRoot, &pobj->m_message);
+	if (!_COSE_Handle_Add(COSE_HANDLE_ENVELOPED, &pobj->m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_Enveloped_Release(pobj);
+		COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
+		FAIL_CONDITION(COSE_ERR_OUT_OF_MEMORY);
+	}
 
 	return (HCOSE_ENVELOPED) pobj;
 
@@ -82,13 +83,13 @@ HCOSE_ENVELOPED _COSE_Enveloped_Init_From_Object(cn_cbor * cbor, COSE_Enveloped
 	cose_errback error = { 0 };
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_Enveloped *)COSE_CALLOC(1, sizeof(COSE_Enveloped), context);
+	if (pobj == NULL) pobj = (COSE_Enveloped *)COSE_POOL_CALLOC(COSE_POOL_ENVELOPED, sizeof(COSE_Enveloped), context);
 	if (pobj == NULL) {
 		perr->err = COSE_ERR_OUT_OF_MEMORY;
 	errorReturn:
 		if (pobj != NULL) {
 			_COSE_Enveloped_Release(pobj);
-			if (pIn == NULL) COSE_FREE(pobj, context);
+			if (pIn == NULL) COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
 		}
 		return NULL;
 	}
@@ -112,7 +113,7 @@ HCOSE_ENVELOPED _COSE_Enveloped_Init_From_Object(cn_cbor * cbor, COSE_Enveloped
 		}
 	}
 
-	if (pIn == NULL) _COSE_InsertInList(&EnvelopedRoot, &pobj->m_message);
+	CHECK_CONDITION((pIn != NULL) || _COSE_Handle_Add(COSE_HANDLE_ENVELOPED, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_ENVELOPED) pobj;
 }
@@ -135,11 +136,11 @@ bool COSE_Enveloped_Free(HCOSE_ENVELOPED h)
 	context = ((COSE_Enveloped *)h)->m_message.m_allocContext;
 #endif
 
-	_COSE_RemoveFromList(&EnvelopedRoot, &p->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_ENVELOPED, &p->m_message);
 
 	_COSE_Enveloped_Release((COSE_Enveloped *)h);
 
-	COSE_FREE((COSE_Enveloped *)h, &context);
+	COSE_POOL_FREE(COSE_POOL_ENVELOPED, (COSE_Enveloped *)h, &context);
 
 	return true;
 }
@@ -149,13 +150,14 @@ void _COSE_Enveloped_Release(COSE_Enveloped * p)
 	COSE_RecipientInfo * pRecipient1;
 	COSE_RecipientInfo * pRecipient2;
 
-	if (p->pbContent != NULL) COSE_FREE((void *) p->pbContent, &p->m_message.m_allocContext);
+	if ((p->pbContent != NULL) && !p->m_contentBorrowed) COSE_FREE((void *) p->pbContent, &p->m_message.m_allocContext);
 	//	if (p->pbIV != NULL) COSE_FREE(p->pbIV, &p->m_message.m_allocContext);
 
 	for (pRecipient1 = p->m_recipientFirst; pRecipient1 != NULL; pRecipient1 = pRecipient2) {
 		pRecipient2 = pRecipient1->m_recipientNext;
 		COSE_Recipient_Free((HCOSE_RECIPIENT)pRecipient1);
 	}
+	p->m_recipientFirst = NULL;
 
 	_COSE_Release(&p->m_message);
 }
@@ -165,21 +167,107 @@ bool COSE_Enveloped_decrypt(HCOSE_ENVELOPED h, HCOSE_RECIPIENT hRecip, cose_errb
 	COSE_Enveloped * pcose = (COSE_Enveloped *)h;
 	COSE_RecipientInfo * pRecip = (COSE_RecipientInfo *)hRecip;
 	bool f = false;
+	int iStats;
 
 	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(IsValidRecipientHandle(hRecip), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	f = _COSE_Enveloped_decrypt(pcose, pRecip, NULL, 0, "Encrypt", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt(pcose, pRecip, NULL, NULL, 0, NULL, NULL, 0, "Encrypt", perr);
+	_COSE_Stats_Leave(iStats);
+
+	errorReturn:
+	return f;
+}
+
+/*!
+* @brief Decrypt an Enveloped message with the keys of a key set
+*
+* Only the recipients whose kid is found in the key set, or supplied by its
+* resolver, are processed.  The other recipients are tried only if the key
+* set was created with COSE_KEYSET_TRIAL.
+*
+* @param h  Handle to the Enveloped message
+* @param hKeys  Key set of the receiver
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Enveloped_decrypt_keyset(HCOSE_ENVELOPED h, HCOSE_KEYSET hKeys, cose_errback * perr)
+{
+	COSE_Enveloped * pcose = (COSE_Enveloped *)h;
+	bool f = false;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeySetHandle(hKeys), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt(pcose, NULL, (const COSE_KeySet *)hKeys, NULL, 0, NULL, NULL, 0, "Encrypt", perr);
+	_COSE_Stats_Leave(iStats);
 
 	errorReturn:
 	return f;
 }
 
-bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip, const byte *pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr)
+/*!
+* @brief Decrypt an Enveloped message into a caller supplied buffer
+*
+* The plaintext is written to pbOut rather than to memory allocated by
+* the library.  If pbOut is NULL the ciphertext in the message is decrypted
+* in place.  This modifies the buffer which was passed to COSE_Decode, and
+* the message cannot be decrypted a second time.
+*
+* The content returned by COSE_Enveloped_GetContent points into the
+* buffer, which must remain valid until the handle has been freed.
+*
+* @param h  Handle to the Enveloped message
+* @param hRecip  Recipient to use for obtaining the key
+* @param pbOut  Buffer for the plaintext or NULL to decrypt in place
+* @param cbOut  Size of pbOut
+* @param pcbOut  Location to return the size of the plaintext
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Enveloped_decrypt_into(HCOSE_ENVELOPED h, HCOSE_RECIPIENT hRecip, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr)
+{
+	COSE_Enveloped * pcose = (COSE_Enveloped *)h;
+	COSE_RecipientInfo * pRecip = (COSE_RecipientInfo *)hRecip;
+	const cn_cbor * cn;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidRecipientHandle(hRecip), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	if (pbOut == NULL) {
+		cn = _COSE_arrayget_int(&pcose->m_message, INDEX_BODY);
+		CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+		pbOut = (byte *) cn->v.bytes;
+		cbOut = cn->length;
+	}
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt(pcose, pRecip, NULL, NULL, 0, NULL, pbOut, cbOut, "Encrypt", perr);
+	_COSE_Stats_Leave(iStats);
+	if (!f) return false;
+
+	if (pcbOut != NULL) *pcbOut = pcose->cbContent;
+	return true;
+
+errorReturn:
+	return false;
+}
+
+bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip, const COSE_KeySet * pKeys, const byte *pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, byte * pbOut, size_t cbOut, const char * szContext, cose_errback * perr)
 {
 	int alg;
 	const cn_cbor * cn = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 
 	byte * pbKey = NULL;
 	size_t cbitKey = 0;
@@ -194,6 +282,7 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 #endif
 
 	CHECK_CONDITION(!((pRecip != NULL) && (pbKeyIn != NULL)), COSE_ERR_INTERNAL);
+	CHECK_CONDITION(!((pKeys != NULL) && ((pRecip != NULL) || (pbKeyIn != NULL))), COSE_ERR_INTERNAL);
 
 	cn = _COSE_map_get_int(&pcose->m_message, COSE_Header_Algorithm, COSE_BOTH, perr);
 	if (cn == NULL) {
@@ -208,6 +297,7 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 	}
 	CHECK_CONDITION((cn->type == CN_CBOR_UINT) || (cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 	alg = (int) cn->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
 
 	switch (alg) {
 #ifdef USE_AES_CCM_16_64_128
@@ -276,17 +366,29 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 		break;
 #endif
 
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		cbitKey = 256;
+		break;
+#endif
+
 	default:
 		FAIL_CONDITION(COSE_ERR_UNKNOWN_ALGORITHM);
 		break;
 	}
 
+	pProvider = _COSE_Provider_Get(alg);
+
 	//
 	//  We are doing the enveloped item - so look for the passed in recipient
 	//
 
 	if (pbKeyIn != NULL) {
 		CHECK_CONDITION(cbKeyIn == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION((pKeyIn == NULL) || (pKeyIn->m_alg == alg), COSE_ERR_INVALID_PARAMETER);
+
+		//  A prepared key from another provider is used as raw key bytes
+		if ((pKeyIn != NULL) && (pKeyIn->m_pProvider != pProvider)) pKeyIn = NULL;
 		pbKey = pbKeyIn;
 	}
 	else {
@@ -313,6 +415,9 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 			}
 			CHECK_CONDITION(pRecipX != NULL, COSE_ERR_NO_RECIPIENT_FOUND);
 		}
+		else if (pKeys != NULL) {
+			if (!_COSE_KeySet_Recipient_decrypt(pKeys, pcose->m_recipientFirst, alg, cbitKey, pbKey, perr)) goto errorReturn;
+		}
 		else {
 			for (pRecip = pcose->m_recipientFirst; pRecip != NULL; pRecip = pRecip->m_recipientNext) {
 				if (_COSE_Recipient_decrypt(pRecip, NULL, alg, cbitKey, pbKey, perr)) break;
@@ -328,70 +433,82 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 	cn = _COSE_arrayget_int(&pcose->m_message, INDEX_BODY);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_INVALID_PARAMETER);
 
+	//  Drop the content from any previous decryption
+
+	if ((pcose->pbContent != NULL) && !pcose->m_contentBorrowed) COSE_FREE((void *) pcose->pbContent, context);
+	pcose->pbContent = NULL;
+	pcose->cbContent = 0;
+
 	switch (alg) {
 #ifdef USE_AES_CCM_16_64_128
 	case COSE_Algorithm_AES_CCM_16_64_128:
-		if (!AES_CCM_Decrypt(pcose, 64, 16, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 64, 16, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_64_256
 	case COSE_Algorithm_AES_CCM_16_64_256:
-		if (!AES_CCM_Decrypt(pcose, 64, 16, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 64, 16, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_128_128
 	case COSE_Algorithm_AES_CCM_16_128_128:
-		if (!AES_CCM_Decrypt(pcose, 128, 16, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 128, 16, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_128_256
 	case COSE_Algorithm_AES_CCM_16_128_256:
-		if (!AES_CCM_Decrypt(pcose, 128, 16, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 128, 16, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_64_128
 	case COSE_Algorithm_AES_CCM_64_64_128:
-		if (!AES_CCM_Decrypt(pcose, 64, 64, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 64, 64, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_64_256
 	case COSE_Algorithm_AES_CCM_64_64_256:
-		if (!AES_CCM_Decrypt(pcose, 64, 64, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 64, 64, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_128_128
 	case COSE_Algorithm_AES_CCM_64_128_128:
-		if (!AES_CCM_Decrypt(pcose, 128, 64, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 128, 64, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_128_256
 	case COSE_Algorithm_AES_CCM_64_128_256:
-		if (!AES_CCM_Decrypt(pcose, 128, 64, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_CCM_Decrypt(pcose, 128, 64, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_128
 	case COSE_Algorithm_AES_GCM_128:
-		if (!AES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_192
 	case COSE_Algorithm_AES_GCM_192:
-		if (!AES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_256
 	case COSE_Algorithm_AES_GCM_256:
-		if (!AES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, cn->v.bytes, cn->length, pbAuthData, cbAuthData, perr)) goto error;
+		if (!pProvider->pfnAES_GCM_Decrypt(pcose, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
+		break;
+#endif
+
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		if (!pProvider->pfnChaCha20_Poly1305_Decrypt(pcose, pbKey, cbitKey / 8, pKeyIn, cn->v.bytes, cn->length, pbAuthData, cbAuthData, pbOut, cbOut, perr)) goto error;
 		break;
 #endif
 
@@ -410,21 +527,128 @@ bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip
 bool COSE_Enveloped_encrypt(HCOSE_ENVELOPED h, cose_errback * perr)
 {
 	COSE_Enveloped * pcose = (COSE_Enveloped *)h;
+	bool f;
+	int iStats;
 
 	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_HANDLE);
 
-	return _COSE_Enveloped_encrypt(pcose, NULL, 0, "Encrypt", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_ENCRYPT);
+	f = _COSE_Enveloped_encrypt(pcose, NULL, 0, NULL, "Encrypt", NULL, 0, NULL, perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
 
 errorReturn:
 	return false;
 }
 
-bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr)
+/*! \private
+* @brief Make sure the message has a nonce before it is laid out
+*
+* The AEAD functions create a missing nonce themselves.  When the encoding
+* is written ahead of the ciphertext the unprotected map has to be complete
+* before that happens, so the nonce is created here instead.
+*
+* @param pcose message to be encrypted
+* @param alg content encryption algorithm
+* @param pcbTag returns the size of the authentication tag
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool _COSE_Enveloped_SetupNonce(COSE_Enveloped * pcose, int alg, size_t * pcbTag, cose_errback * perr)
+{
+	size_t cbNonce;
+	byte * pbNonce = NULL;
+	cn_cbor * cbor_iv_t = NULL;
+	cn_cbor_errback cbor_error;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	switch (alg) {
+	case COSE_Algorithm_AES_CCM_16_64_128:
+	case COSE_Algorithm_AES_CCM_16_64_256:
+		*pcbTag = 64 / 8;
+		cbNonce = 13;
+		break;
+
+	case COSE_Algorithm_AES_CCM_16_128_128:
+	case COSE_Algorithm_AES_CCM_16_128_256:
+		*pcbTag = 128 / 8;
+		cbNonce = 13;
+		break;
+
+	case COSE_Algorithm_AES_CCM_64_64_128:
+	case COSE_Algorithm_AES_CCM_64_64_256:
+		*pcbTag = 64 / 8;
+		cbNonce = 7;
+		break;
+
+	case COSE_Algorithm_AES_CCM_64_128_128:
+	case COSE_Algorithm_AES_CCM_64_128_256:
+		*pcbTag = 128 / 8;
+		cbNonce = 7;
+		break;
+
+	case COSE_Algorithm_AES_GCM_128:
+	case COSE_Algorithm_AES_GCM_192:
+	case COSE_Algorithm_AES_GCM_256:
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		*pcbTag = 128 / 8;
+		cbNonce = 96 / 8;
+		break;
+
+	default:
+		FAIL_CONDITION(COSE_ERR_UNKNOWN_ALGORITHM);
+	}
+
+	if (_COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL) != NULL) return true;
+
+	pbNonce = (byte *)COSE_CALLOC(cbNonce, 1, context);
+	CHECK_CONDITION(pbNonce != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(_COSE_Random(pbNonce, cbNonce), COSE_ERR_CRYPTO_FAIL);
+
+	cbor_iv_t = cn_cbor_data_create(pbNonce, (int)cbNonce, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
+	pbNonce = NULL;
+
+	if (!_COSE_map_put(&pcose->m_message, COSE_Header_IV, cbor_iv_t, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
+
+	return true;
+
+errorReturn:
+	if (pbNonce != NULL) COSE_FREE(pbNonce, context);
+	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
+	return false;
+}
+
+/*! \private
+* @brief Encrypt the content of an Enveloped or Encrypt message
+*
+* When pcbWire is not NULL the message must not have recipients.  The
+* encoding of the message is then written to pbWire ahead of the body and the
+* AEAD produces the ciphertext and tag directly in their final position.
+* Passing a NULL pbWire only returns the size of the encoding.
+*
+* @param pcose message to be encrypted
+* @param pbKeyIn key for an Encrypt message, NULL to use the recipients
+* @param cbKeyIn size of the key
+* @param szContext context string for the Enc_structure
+* @param pbWire buffer for the encoded message, NULL to get the size
+* @param cbWire size of pbWire
+* @param pcbWire returns the size of the encoded message, NULL if the
+*		message is not to be encoded
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, byte * pbWire, size_t cbWire, size_t * pcbWire, cose_errback * perr)
 {
 	int alg;
 	int t;
 	COSE_RecipientInfo * pri;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 	const cn_cbor * cn_Alg = NULL;
 	byte * pbAuthData = NULL;
 	size_t cbitKey;
@@ -434,6 +658,10 @@ bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_
 	bool fRet = false;
 	byte * pbKey = NULL;
 	size_t cbKey = 0;
+	byte * pbBody = NULL;
+	size_t cbBody = 0;
+	size_t cbTag;
+	size_t cbPrefix;
 
 	cn_Alg = _COSE_map_get_int(&pcose->m_message, COSE_Header_Algorithm, COSE_BOTH, perr);
 	if (cn_Alg == NULL) goto errorReturn;
@@ -441,6 +669,7 @@ bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_
 	CHECK_CONDITION((cn_Alg->type != CN_CBOR_TEXT), COSE_ERR_UNKNOWN_ALGORITHM);
 	CHECK_CONDITION((cn_Alg->type == CN_CBOR_UINT) || (cn_Alg->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 	alg = (int) cn_Alg->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
 
 	//  Get the key size
 
@@ -511,14 +740,26 @@ bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_
 		break;
 #endif
 
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		cbitKey = 256;
+		break;
+#endif
+
 	default:
 		FAIL_CONDITION(COSE_ERR_UNKNOWN_ALGORITHM);
 	}
 
+	pProvider = _COSE_Provider_Get(alg);
+
 	//  Enveloped or Encrypted?
 
 	if (pbKeyIn != NULL) {
 		CHECK_CONDITION(cbKeyIn == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION((pKeyIn == NULL) || (pKeyIn->m_alg == alg), COSE_ERR_INVALID_PARAMETER);
+
+		//  A prepared key from another provider is used as raw key bytes
+		if ((pKeyIn != NULL) && (pKeyIn->m_pProvider != pProvider)) pKeyIn = NULL;
 		pbKey = pbKeyIn;
 		cbKey = cbKeyIn;
 	}
@@ -545,7 +786,7 @@ bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_
 			pbKey = (byte *)COSE_CALLOC(cbitKey / 8, 1, context);
 			CHECK_CONDITION(pbKey != NULL, COSE_ERR_OUT_OF_MEMORY);
 			cbKey = cbitKey / 8;
-			rand_bytes(pbKey, cbKey);
+			CHECK_CONDITION(_COSE_Random(pbKey, cbKey), COSE_ERR_CRYPTO_FAIL);
 		}
 	}
 
@@ -566,70 +807,97 @@ bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_
 	size_t cbAuthData = 0;
 	if (!_COSE_Encrypt_Build_AAD(&pcose->m_message, &pbAuthData, &cbAuthData, szContext, perr)) goto errorReturn;
 
+	//  Lay out the encoded message so the ciphertext can be written in place
+
+	if (pcbWire != NULL) {
+		CHECK_CONDITION(pcose->m_recipientFirst == NULL, COSE_ERR_INVALID_PARAMETER);
+		if (!_COSE_Enveloped_SetupNonce(pcose, alg, &cbTag, perr)) goto errorReturn;
+
+		cbBody = pcose->cbContent + cbTag;
+		cbPrefix = _COSE_Encode_Prefix(&pcose->m_message, cbBody, NULL, 0);
+		CHECK_CONDITION(cbPrefix != 0, COSE_ERR_INVALID_PARAMETER);
+		*pcbWire = cbPrefix + cbBody;
+
+		if (pbWire == NULL) {
+			fRet = true;
+			goto errorReturn;
+		}
+
+		CHECK_CONDITION(cbWire >= cbPrefix + cbBody, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(_COSE_Encode_Prefix(&pcose->m_message, cbBody, pbWire, cbWire) == cbPrefix, COSE_ERR_CBOR);
+		pbBody = pbWire + cbPrefix;
+	}
+
 	switch (alg) {
 #ifdef USE_AES_CCM_16_64_128
 	case COSE_Algorithm_AES_CCM_16_64_128:
-		if (!AES_CCM_Encrypt(pcose, 64, 16, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 64, 16, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_64_256
 	case COSE_Algorithm_AES_CCM_16_64_256:
-		if (!AES_CCM_Encrypt(pcose, 64, 16, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 64, 16, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_128_128
 	case COSE_Algorithm_AES_CCM_16_128_128:
-		if (!AES_CCM_Encrypt(pcose, 128, 16, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 128, 16, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_16_128_256
 	case COSE_Algorithm_AES_CCM_16_128_256:
-		if (!AES_CCM_Encrypt(pcose, 128, 16, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 128, 16, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_64_128
 	case COSE_Algorithm_AES_CCM_64_64_128:
-		if (!AES_CCM_Encrypt(pcose, 64, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 64, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_64_256
 	case COSE_Algorithm_AES_CCM_64_64_256:
-		if (!AES_CCM_Encrypt(pcose, 64, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 64, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_128_128
 	case COSE_Algorithm_AES_CCM_64_128_128:
-		if (!AES_CCM_Encrypt(pcose, 128, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 128, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CCM_64_128_256
 	case COSE_Algorithm_AES_CCM_64_128_256:
-		if (!AES_CCM_Encrypt(pcose, 128, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CCM_Encrypt(pcose, 128, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_128
 	case COSE_Algorithm_AES_GCM_128:
-		if (!AES_GCM_Encrypt(pcose, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_GCM_Encrypt(pcose, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_192
 	case COSE_Algorithm_AES_GCM_192:
-		if (!AES_GCM_Encrypt(pcose, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_GCM_Encrypt(pcose, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_GCM_256
 	case COSE_Algorithm_AES_GCM_256:
-		if (!AES_GCM_Encrypt(pcose, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_GCM_Encrypt(pcose, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
+		break;
+#endif
+
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		if (!pProvider->pfnChaCha20_Poly1305_Encrypt(pcose, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, pbBody, cbBody, perr)) goto errorReturn;
 		break;
 #endif
 
@@ -665,6 +933,65 @@ errorReturn:
 	return false;
 }
 
+/*!
+* @brief Set the content of an Enveloped message without copying it
+*
+* The message references the application buffer rather than making a copy.
+* The buffer is not freed by the library and must stay valid, and unchanged,
+* until the message handle has been freed.
+*
+* @param h  Handle to the Enveloped message
+* @param rgb  Content to be encrypted
+* @param cb  Size of the content
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Enveloped_SetContentRef(HCOSE_ENVELOPED h, const byte * rgb, size_t cb, cose_errback * perr)
+{
+	COSE_Enveloped * cose = (COSE_Enveloped *)h;
+
+	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(rgb != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	if ((cose->pbContent != NULL) && !cose->m_contentBorrowed) COSE_FREE((void *) cose->pbContent, &cose->m_message.m_allocContext);
+
+	cose->pbContent = rgb;
+	cose->cbContent = cb;
+	cose->m_contentBorrowed = true;
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Get the content of an Enveloped message
+*
+* Returns the plaintext after a successful decrypt, or the content which
+* was set for encryption.  The memory belongs to the message.
+*
+* @param h  Handle to the Enveloped message
+* @param pcbContent  Location to return the size of the content
+* @param perr  Location to return errors
+* @return pointer to the content or NULL on failure
+*/
+
+byte * COSE_Enveloped_GetContent(HCOSE_ENVELOPED h, size_t * pcbContent, cose_errback * perr)
+{
+	COSE_Enveloped * cose = (COSE_Enveloped *)h;
+
+	CHECK_CONDITION(IsValidEnvelopedHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(cose->pbContent != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	if (pcbContent != NULL) *pcbContent = cose->cbContent;
+	return (byte *) cose->pbContent;
+
+errorReturn:
+	return NULL;
+}
+
 /*!
 * @brief Set the application external data for authentication
 *
@@ -695,13 +1022,19 @@ errorReturn:
 bool _COSE_Enveloped_SetContent(COSE_Enveloped * cose, const byte * rgb, size_t cb, cose_errback * perror)
 {
 	byte * pb;
-	cose->pbContent = pb = (byte *)COSE_CALLOC(cb, 1, &cose->m_message.m_allocContext);
-	if (cose->pbContent == NULL) {
+
+	pb = (byte *)COSE_CALLOC(cb, 1, &cose->m_message.m_allocContext);
+	if (pb == NULL) {
 		if (perror != NULL) perror->err = COSE_ERR_INVALID_PARAMETER;
 		return false;
 	}
 	memcpy(pb, rgb, cb);
+
+	if ((cose->pbContent != NULL) && !cose->m_contentBorrowed) COSE_FREE((void *) cose->pbContent, &cose->m_message.m_allocContext);
+
+	cose->pbContent = pb;
 	cose->cbContent = cb;
+	cose->m_contentBorrowed = false;
 
 	return true;
 }
@@ -790,54 +1123,14 @@ bool _COSE_Encrypt_Build_AAD(COSE * pMessage, byte ** ppbAAD, size_t * pcbAAD, c
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pMessage->m_allocContext;
 #endif
-	cn_cbor_errback cbor_error;
-	byte  * pbAuthData;
-	size_t cbAuthData;
-	cn_cbor * pAuthData;
 	cn_cbor * pItem;
-	cn_cbor * ptmp = NULL;
-
-	//  Build authenticated data
-	pbAuthData = NULL;
-	pAuthData = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(pAuthData != NULL, cbor_error);
-
-	ptmp = cn_cbor_string_create(szContext, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
 
 	pItem = _COSE_arrayget_int(pMessage, INDEX_PROTECTED);
 	CHECK_CONDITION(pItem != NULL, COSE_ERR_INVALID_PARAMETER);
-	if ((pItem->length == 1) && (pItem->v.bytes[0] == 0xa0)) {
-		ptmp = cn_cbor_data_create(NULL, 0, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	}
-	else {
-		ptmp = cn_cbor_data_create(pItem->v.bytes, (int)pItem->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	}
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
 
-	ptmp = cn_cbor_data_create(pMessage->m_pbExternal, (int) pMessage->m_cbExternal, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
-
-	cbAuthData = cn_cbor_encoder_write(RgbDontUse, 0, sizeof(RgbDontUse), pAuthData);
-	pbAuthData = (byte *)COSE_CALLOC(cbAuthData, 1, context);
-	CHECK_CONDITION(pbAuthData != NULL, COSE_ERR_OUT_OF_MEMORY);
-	CHECK_CONDITION((size_t)cn_cbor_encoder_write(pbAuthData, 0, cbAuthData, pAuthData) == cbAuthData, COSE_ERR_CBOR);
-
-	*ppbAAD = pbAuthData;
-	*pcbAAD = cbAuthData;
-
-	return true;
+	return _COSE_Structure_Build(szContext, pItem, NULL, pMessage->m_pbExternal, pMessage->m_cbExternal, NULL, false, ppbAAD, pcbAAD, CBOR_CONTEXT_PARAM_COMMA perr);
 
 errorReturn:
-	if (pbAuthData != NULL) COSE_FREE(pbAuthData, context);
-	if (ptmp != NULL) CN_CBOR_FREE(ptmp, NULL);
-	if (pAuthData != NULL) CN_CBOR_FREE(pAuthData, context);
 	return false;
 }
 
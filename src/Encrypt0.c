@@ -12,21 +12,18 @@
 #include "configure.h"
 #include "crypto.h"
 
-byte RgbDontUse[8 * 1024];   //  Remove this array when we can compute the size of a cbor serialization without this hack.
-
 void _COSE_Encrypt_Release(COSE_Encrypt * p);
 
-COSE * EncryptRoot = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_ENCRYPT handle is valid
 *
 *  Internal function to test if an encrypt message handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -35,23 +32,27 @@ COSE * EncryptRoot = NULL;
 bool IsValidEncryptHandle(HCOSE_ENCRYPT h)
 {
 	COSE_Encrypt * p = (COSE_Encrypt *)h;
-	return _COSE_IsInList(EncryptRoot, (COSE *)p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_ENCRYPT, (COSE *)p);
 }
 
 
 HCOSE_ENCRYPT COSE_Encrypt_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
-	COSE_Encrypt * pobj = (COSE_Encrypt *)COSE_CALLOC(1, sizeof(COSE_Encrypt), context);
+	COSE_Encrypt * pobj = (COSE_Encrypt *)COSE_POOL_CALLOC(COSE_POOL_ENVELOPED, sizeof(COSE_Encrypt), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags, &pobj->m_message, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		_COSE_Encrypt_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
 		return NULL;
 	}
 
-	_COSE_InsertInList(&EncryptRoot, &pobj->m_message);
+	if (!_COSE_Handle_Add(COSE_HANDLE_ENCRYPT, &pobj->m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_Encrypt_Release(pobj);
+		COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
+		FAIL_CONDITION(COSE_ERR_OUT_OF_MEMORY);
+	}
 
 	return (HCOSE_ENCRYPT) pobj;
 
@@ -66,13 +67,13 @@ HCOSE_ENCRYPT _COSE_Encrypt_Init_From_Object(cn_cbor * cbor, COSE_Encrypt * pIn,
 	cose_errback error = { 0 };
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_Encrypt *)COSE_CALLOC(1, sizeof(COSE_Encrypt), context);
+	if (pobj == NULL) pobj = (COSE_Encrypt *)COSE_POOL_CALLOC(COSE_POOL_ENVELOPED, sizeof(COSE_Encrypt), context);
 	if (pobj == NULL) {
 		perr->err = COSE_ERR_OUT_OF_MEMORY;
 	errorReturn:
 		if (pobj != NULL) {
 			_COSE_Encrypt_Release(pobj);
-			if (pIn == NULL)  COSE_FREE(pobj, context);
+			if (pIn == NULL)  COSE_POOL_FREE(COSE_POOL_ENVELOPED, pobj, context);
 		}
 		return NULL;
 	}
@@ -84,7 +85,7 @@ HCOSE_ENCRYPT _COSE_Encrypt_Init_From_Object(cn_cbor * cbor, COSE_Encrypt * pIn,
 	pRecipients = _COSE_arrayget_int(&pobj->m_message, INDEX_RECIPIENTS);
 	CHECK_CONDITION(pRecipients == NULL, COSE_ERR_INVALID_PARAMETER);
 
-	_COSE_InsertInList(&EncryptRoot, &pobj->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_ENCRYPT, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_ENCRYPT) pobj;
 }
@@ -104,16 +105,16 @@ bool COSE_Encrypt_Free(HCOSE_ENCRYPT h)
 
 	_COSE_Encrypt_Release(pEncrypt);
 
-	_COSE_RemoveFromList(&EncryptRoot, &pEncrypt->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_ENCRYPT, &pEncrypt->m_message);
 	
-	COSE_FREE((COSE_Encrypt *)h, &context);
+	COSE_POOL_FREE(COSE_POOL_ENVELOPED, (COSE_Encrypt *)h, &context);
 
 	return true;
 }
 
 void _COSE_Encrypt_Release(COSE_Encrypt * p)
 {
-	if (p->pbContent != NULL) COSE_FREE((void *) p->pbContent, &p->m_message.m_allocContext);
+	if ((p->pbContent != NULL) && !p->m_contentBorrowed) COSE_FREE((void *) p->pbContent, &p->m_message.m_allocContext);
 
 	_COSE_Release(&p->m_message);
 }
@@ -122,22 +123,508 @@ bool COSE_Encrypt_decrypt(HCOSE_ENCRYPT h, const byte * pbKey, size_t cbKey, cos
 {
 	COSE_Encrypt * pcose = (COSE_Encrypt *)h;
 	bool f;
+	int iStats;
 
 	if (!IsValidEncryptHandle(h)) {
 		if (perr != NULL) perr->err = COSE_ERR_INVALID_PARAMETER;
 		return false;
 	}
 
-	f = _COSE_Enveloped_decrypt(pcose, NULL, pbKey, cbKey, "Encrypt1", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt(pcose, NULL, NULL, pbKey, cbKey, NULL, NULL, 0, "Encrypt1", perr);
+	_COSE_Stats_Leave(iStats);
 	return f;
 }
 
+/*!
+* @brief Decrypt an Encrypt message into a caller supplied buffer
+*
+* The plaintext is written to pbOut rather than to memory allocated by
+* the library.  If pbOut is NULL the ciphertext in the message is decrypted
+* in place.  This modifies the buffer which was passed to COSE_Decode, and
+* the message cannot be decrypted a second time.
+*
+* The content returned by COSE_Encrypt_GetContent points into the
+* buffer, which must remain valid until the handle has been freed.
+*
+* @param h  Handle to the Encrypt message
+* @param pbKey  Key to decrypt with
+* @param cbKey  Size of the key
+* @param pbOut  Buffer for the plaintext or NULL to decrypt in place
+* @param cbOut  Size of pbOut
+* @param pcbOut  Location to return the size of the plaintext
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Encrypt_decrypt_into(HCOSE_ENCRYPT h, const byte * pbKey, size_t cbKey, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr)
+{
+	COSE_Encrypt * pcose = (COSE_Encrypt *)h;
+	const cn_cbor * cn;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pbKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	if (pbOut == NULL) {
+		cn = _COSE_arrayget_int(&pcose->m_message, INDEX_BODY);
+		CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+		pbOut = (byte *) cn->v.bytes;
+		cbOut = cn->length;
+	}
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt(pcose, NULL, NULL, pbKey, cbKey, NULL, pbOut, cbOut, "Encrypt1", perr);
+	_COSE_Stats_Leave(iStats);
+	if (!f) return false;
+
+	if (pcbOut != NULL) *pcbOut = pcose->cbContent;
+	return true;
+
+errorReturn:
+	return false;
+}
+
 bool COSE_Encrypt_encrypt(HCOSE_ENCRYPT h, const byte * pbKey, size_t cbKey, cose_errback * perr)
 {
+	bool f;
+	int iStats;
+
 	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pbKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	return _COSE_Enveloped_encrypt((COSE_Encrypt *)h, pbKey, cbKey, "Encrypt1", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_ENCRYPT);
+	f = _COSE_Enveloped_encrypt((COSE_Encrypt *)h, pbKey, cbKey, NULL, "Encrypt1", NULL, 0, NULL, perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Encrypt an Encrypt message and encode it in a single pass
+*
+* The headers are written to pbOut first and the ciphertext and tag are then
+* produced directly behind them, so the encoded message is built without
+* any intermediate copies of the ciphertext.  The output is the same as
+* calling COSE_Encrypt_encrypt followed by COSE_Encode.
+*
+* Call with pbOut set to NULL to find the size of the buffer needed.  After
+* a successful encryption the body of the message references pbOut, which
+* must remain valid until the handle has been freed.
+*
+* @param h  Handle to the Encrypt message
+* @param pbKey  Key to encrypt with
+* @param cbKey  Size of the key
+* @param pbOut  Buffer for the encoded message or NULL
+* @param cbOut  Size of pbOut
+* @param pcbOut  Location to return the size of the encoded message
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Encrypt_encrypt_encode(HCOSE_ENCRYPT h, const byte * pbKey, size_t cbKey, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr)
+{
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION((pbKey != NULL) && (pcbOut != NULL), COSE_ERR_INVALID_PARAMETER);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_ENCRYPT);
+	f = _COSE_Enveloped_encrypt((COSE_Encrypt *)h, pbKey, cbKey, NULL, "Encrypt1", pbOut, cbOut, pcbOut, perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Encrypt an Encrypt message with a prepared key
+*
+* The algorithm of the message must be the one the key was prepared for.
+*
+* @param h  Handle to the Encrypt message
+* @param hKey  Prepared key to encrypt with
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Encrypt_encrypt_prepared(HCOSE_ENCRYPT h, HCOSE_PREPARED_KEY hKey, cose_errback * perr)
+{
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)hKey;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidPreparedKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_ENCRYPT);
+	f = _COSE_Enveloped_encrypt((COSE_Encrypt *)h, pKey->m_rgbKey, pKey->m_cbKey, pKey, "Encrypt1", NULL, 0, NULL, perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Decrypt an Encrypt message with a prepared key
+*
+* The algorithm of the message must be the one the key was prepared for.
+*
+* @param h  Handle to the Encrypt message
+* @param hKey  Prepared key to decrypt with
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Encrypt_decrypt_prepared(HCOSE_ENCRYPT h, HCOSE_PREPARED_KEY hKey, cose_errback * perr)
+{
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)hKey;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidPreparedKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_DECRYPT);
+	f = _COSE_Enveloped_decrypt((COSE_Encrypt *)h, NULL, NULL, pKey->m_rgbKey, pKey->m_cbKey, pKey, NULL, 0, "Encrypt1", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*! \private
+* @brief Give the template of a batch a new nonce for one item
+*
+* A new nonce node is built from the item's nonce, or from random bytes
+* when the item has none, and replaces the nonce in the unprotected map.
+* The previous node may belong to the application and is never written.
+*
+* @param pcose  Template message
+* @param cbNonce  Size of the nonce for the algorithm
+* @param pItem  Item about to be encrypted
+* @param perr  Location to return errors
+* @return Did the function succeed?
+*/
+
+static bool _COSE_Encrypt_BatchNonce(COSE_Encrypt * pcose, size_t cbNonce, const COSE_ENCRYPT_ITEM * pItem, cose_errback * perr)
+{
+	byte * pbNonce = NULL;
+	cn_cbor * cnIV = NULL;
+	cn_cbor_errback cbor_error;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	CHECK_CONDITION((pItem->pbIV == NULL) || (pItem->cbIV == cbNonce), COSE_ERR_INVALID_PARAMETER);
+
+	pbNonce = (byte *)COSE_CALLOC(cbNonce, 1, context);
+	CHECK_CONDITION(pbNonce != NULL, COSE_ERR_OUT_OF_MEMORY);
+	if (pItem->pbIV != NULL) memcpy(pbNonce, pItem->pbIV, cbNonce);
+	else CHECK_CONDITION(_COSE_Random(pbNonce, cbNonce), COSE_ERR_CRYPTO_FAIL);
+
+	cnIV = cn_cbor_data_create(pbNonce, (int)cbNonce, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(cnIV != NULL, cbor_error);
+	pbNonce = NULL;
+
+	if (!_COSE_map_replace(&pcose->m_message, COSE_Header_IV, cnIV, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
+
+	return true;
+
+errorReturn:
+	if (pbNonce != NULL) COSE_FREE(pbNonce, context);
+	if (cnIV != NULL) CN_CBOR_FREE(cnIV, context);
+	return false;
+}
+
+/*! \private
+* @brief Encrypt one item of a batch through the backend AEAD
+*
+* @param pcose  Template message
+* @param pKey  Prepared key to encrypt with
+* @param cbNonce  Size of the nonce for the algorithm
+* @param pItem  Item to be encrypted, the result is returned in it
+*/
+
+static void _COSE_Encrypt_BatchOne(COSE_Encrypt * pcose, COSE_PreparedKey * pKey, size_t cbNonce, COSE_ENCRYPT_ITEM * pItem)
+{
+	cose_errback error;
+
+	error.err = COSE_ERR_NONE;
+	pItem->cbWritten = 0;
+
+	if ((pItem->pbContent == NULL) || (pItem->pbOut == NULL)) {
+		pItem->err = COSE_ERR_INVALID_PARAMETER;
+		return;
+	}
+	if (!_COSE_Encrypt_BatchNonce(pcose, cbNonce, pItem, &error)) {
+		pItem->err = error.err;
+		return;
+	}
+
+	pcose->pbContent = pItem->pbContent;
+	pcose->cbContent = pItem->cbContent;
+
+	_COSE_Enveloped_encrypt(pcose, pKey->m_rgbKey, pKey->m_cbKey, pKey, "Encrypt1", pItem->pbOut, pItem->cbOut, &pItem->cbWritten, &error);
+	pItem->err = error.err;
+	if (pItem->err != COSE_ERR_NONE) pItem->cbWritten = 0;
+}
+
+#if defined(USE_AES_GCM_128) || defined(USE_AES_GCM_192) || defined(USE_AES_GCM_256)
+
+#define GCM_BATCH_CHUNK 64
+#define GCM_NONCE_SIZE (96 / 8)
+#define GCM_TAG_SIZE (128 / 8)
+
+/*! \private
+* @brief Is the batch for an AES-GCM key of the template's algorithm?
+*/
+
+static bool _COSE_Encrypt_BatchIsGCM(COSE_Encrypt * pcose, int alg)
+{
+	const cn_cbor * cn;
+
+	switch (alg) {
+#ifdef USE_AES_GCM_128
+	case COSE_Algorithm_AES_GCM_128:
+#endif
+#ifdef USE_AES_GCM_192
+	case COSE_Algorithm_AES_GCM_192:
+#endif
+#ifdef USE_AES_GCM_256
+	case COSE_Algorithm_AES_GCM_256:
+#endif
+		break;
+
+	default:
+		return false;
+	}
+
+	cn = _COSE_map_get_int(&pcose->m_message, COSE_Header_Algorithm, COSE_BOTH, NULL);
+	return (cn != NULL) && ((cn->type == CN_CBOR_UINT) || (cn->type == CN_CBOR_INT)) && ((int) cn->v.sint == alg);
+}
+
+/*! \private
+* @brief Encrypt a batch with the multi-buffer AES-GCM code
+*
+* The authenticated data and the encoding ahead of the body are the same
+* for every item except for the nonce and the length of the body, so both
+* are built from the template once.  Laying the message out with a nonce
+* of zeros and again with a nonce of ones gives the position of the nonce.
+* Each item gets a copy of the layout with its own nonce and body length,
+* and the cipher text and tag are written behind it.
+*
+* @param pcose  Template message
+* @param pKey  Prepared AES-GCM key of the template's algorithm
+* @param rgItems  Messages to be encrypted
+* @param cItems  Number of messages
+* @return false if the batch could not be set up, no item has been written then
+*/
+
+static bool _COSE_Encrypt_BatchGCM(COSE_Encrypt * pcose, COSE_PreparedKey * pKey, COSE_ENCRYPT_ITEM * rgItems, size_t cItems)
+{
+	byte * pbNonceAlloc = NULL;
+	byte * pbNonce;
+	cn_cbor * cnIV = NULL;
+	byte * pbAuthData = NULL;
+	size_t cbAuthData = 0;
+	byte * pbPrefix = NULL;
+	size_t cbPrefix;
+	size_t ibNonce;
+	size_t cbHead;
+	size_t cbWire;
+	GCM_BATCH_KEY * pGCM = NULL;
+	GCM_BATCH_ITEM rgGCM[GCM_BATCH_CHUNK];
+	COSE_ENCRYPT_ITEM * rgpItem[GCM_BATCH_CHUNK];
+	COSE_ENCRYPT_ITEM * pItem;
+	const byte * pbLastNonce = NULL;
+	cn_cbor_errback cbor_error;
+	cose_errback error;
+	cose_errback * perr = &error;
+	size_t cGCM;
+	size_t i;
+	size_t j;
+	bool fRet = false;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+#ifdef USE_COUNTER_SIGNATURES
+	if (pcose->m_message.m_counterSigners != NULL) return false;
+#endif
+
+	//  A nonce node of the batch's own, its bytes are rewritten for the layout
+
+	pbNonceAlloc = (byte *)COSE_CALLOC(GCM_NONCE_SIZE, 1, context);
+	CHECK_CONDITION(pbNonceAlloc != NULL, COSE_ERR_OUT_OF_MEMORY);
+	cnIV = cn_cbor_data_create(pbNonceAlloc, GCM_NONCE_SIZE, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(cnIV != NULL, cbor_error);
+	pbNonce = pbNonceAlloc;
+	pbNonceAlloc = NULL;
+	if (!_COSE_map_replace(&pcose->m_message, COSE_Header_IV, cnIV, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
+	cnIV = NULL;
+
+	if (_COSE_encode_protected(&pcose->m_message, perr) == NULL) goto errorReturn;
+	if (!_COSE_Encrypt_Build_AAD(&pcose->m_message, &pbAuthData, &cbAuthData, "Encrypt1", perr)) goto errorReturn;
+
+	pGCM = GCM_Batch_New(pKey->m_rgbKey, pKey->m_cbKey, pbAuthData, cbAuthData CBOR_CONTEXT_PARAM);
+	CHECK_CONDITION(pGCM != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	cbPrefix = _COSE_Encode_Prefix(&pcose->m_message, 0, NULL, 0);
+	CHECK_CONDITION(cbPrefix > GCM_NONCE_SIZE, COSE_ERR_CBOR);
+	pbPrefix = (byte *)COSE_CALLOC(cbPrefix, 2, context);
+	CHECK_CONDITION(pbPrefix != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	memset(pbNonce, 0, GCM_NONCE_SIZE);
+	CHECK_CONDITION(_COSE_Encode_Prefix(&pcose->m_message, 0, pbPrefix, cbPrefix) == cbPrefix, COSE_ERR_CBOR);
+	memset(pbNonce, 0xff, GCM_NONCE_SIZE);
+	CHECK_CONDITION(_COSE_Encode_Prefix(&pcose->m_message, 0, pbPrefix + cbPrefix, cbPrefix) == cbPrefix, COSE_ERR_CBOR);
+
+	ibNonce = 0;
+	while ((ibNonce < cbPrefix) && (pbPrefix[ibNonce] == pbPrefix[cbPrefix + ibNonce])) ibNonce++;
+	CHECK_CONDITION(ibNonce + GCM_NONCE_SIZE < cbPrefix, COSE_ERR_CBOR);
+	for (j = 0; j < GCM_NONCE_SIZE; j++) CHECK_CONDITION((pbPrefix[ibNonce + j] == 0) && (pbPrefix[cbPrefix + ibNonce + j] == 0xff), COSE_ERR_CBOR);
+	CHECK_CONDITION(memcmp(pbPrefix + ibNonce + GCM_NONCE_SIZE, pbPrefix + cbPrefix + ibNonce + GCM_NONCE_SIZE, cbPrefix - ibNonce - GCM_NONCE_SIZE) == 0, COSE_ERR_CBOR);
+
+	//  The layout ends in the one byte head of the empty body
+
+	cbPrefix -= 1;
+
+	i = 0;
+	while (i < cItems) {
+		cGCM = 0;
+		for (; (i < cItems) && (cGCM < GCM_BATCH_CHUNK); i++) {
+			pItem = &rgItems[i];
+			pItem->cbWritten = 0;
+			pItem->err = COSE_ERR_INVALID_PARAMETER;
+
+			if ((pItem->pbContent == NULL) || (pItem->pbOut == NULL)) continue;
+			if ((pItem->pbIV != NULL) && (pItem->cbIV != GCM_NONCE_SIZE)) continue;
+
+			//  GCM limits the plain text to 2^39 - 256 bits
+			if ((uint64_t) pItem->cbContent > ((uint64_t) 1 << 36) - 32) continue;
+
+			cbHead = _COSE_cbor_head(NULL, 2, pItem->cbContent + GCM_TAG_SIZE);
+			cbWire = cbPrefix + cbHead + pItem->cbContent + GCM_TAG_SIZE;
+			if (pItem->cbOut < cbWire) continue;
+
+			memcpy(pItem->pbOut, pbPrefix, cbPrefix);
+			if (pItem->pbIV != NULL) memcpy(pItem->pbOut + ibNonce, pItem->pbIV, GCM_NONCE_SIZE);
+			else if (!_COSE_Random(pItem->pbOut + ibNonce, GCM_NONCE_SIZE)) {
+				pItem->err = COSE_ERR_CRYPTO_FAIL;
+				continue;
+			}
+			_COSE_cbor_head(pItem->pbOut + cbPrefix, 2, pItem->cbContent + GCM_TAG_SIZE);
+
+			rgGCM[cGCM].pbNonce = pItem->pbOut + ibNonce;
+			rgGCM[cGCM].pbIn = pItem->pbContent;
+			rgGCM[cGCM].cbIn = pItem->cbContent;
+			rgGCM[cGCM].pbOut = pItem->pbOut + cbPrefix + cbHead;
+			rgpItem[cGCM] = pItem;
+			cGCM += 1;
+		}
+
+		GCM_Batch_Encrypt(pGCM, rgGCM, cGCM);
+
+		for (j = 0; j < cGCM; j++) {
+			rgpItem[j]->cbWritten = (size_t)(rgGCM[j].pbOut - rgpItem[j]->pbOut) + rgGCM[j].cbIn + GCM_TAG_SIZE;
+			rgpItem[j]->err = COSE_ERR_NONE;
+		}
+		if (cGCM > 0) pbLastNonce = rgGCM[cGCM - 1].pbNonce;
+	}
+
+	if (pbLastNonce != NULL) memcpy(pbNonce, pbLastNonce, GCM_NONCE_SIZE);
+	fRet = true;
+
+errorReturn:
+	if (pbNonceAlloc != NULL) COSE_FREE(pbNonceAlloc, context);
+	if (cnIV != NULL) CN_CBOR_FREE(cnIV, context);
+	if (pbPrefix != NULL) COSE_FREE(pbPrefix, context);
+	if (pbAuthData != NULL) COSE_FREE(pbAuthData, context);
+	if (pGCM != NULL) GCM_Batch_Delete(pGCM CBOR_CONTEXT_PARAM);
+	return fRet;
+}
+
+#endif
+
+/*!
+* @brief Encrypt and encode a set of messages with one prepared key
+*
+* The template message supplies the headers shared by every message of the
+* batch, it needs at least the algorithm and must not have recipients or a
+* protected nonce.  The handle, the protected header encoding and the keyed
+* cipher context are set up once for the whole batch.
+*
+* AES-GCM batches are encrypted by a multi-buffer kernel when the processor
+* has AES-NI and PCLMULQDQ and no provider is registered for the algorithm.
+* It runs several messages at a time so their AES and GHASH work is
+* interleaved, and lays out each encoded message by patching the nonce and
+* body length into an encoding built once from the template.  Otherwise each
+* item in turn is given to the template with a new nonce node, encrypted
+* through the backend AEAD and encoded straight into its output buffer.
+*
+* Results are returned in the items, a failed item does not stop the rest
+* of the batch.  The template keeps the nonce of the last item and no
+* content when the call returns.
+*
+* @param hTemplate  Encrypt message holding the shared headers
+* @param hKey  Prepared key to encrypt with
+* @param rgItems  Messages to be encrypted
+* @param cItems  Number of messages
+* @param perr  Location to return errors
+* @return true if the batch was processed, the individual results are in the items
+*/
+
+bool COSE_Encrypt_encrypt_batch(HCOSE_ENCRYPT hTemplate, HCOSE_PREPARED_KEY hKey, COSE_ENCRYPT_ITEM * rgItems, size_t cItems, cose_errback * perr)
+{
+	COSE_Encrypt * pcose = (COSE_Encrypt *)hTemplate;
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)hKey;
+	cn_cbor * cnIV;
+	size_t cbNonce;
+	size_t cbTag;
+	size_t i;
+	int iStats;
+	bool fDone = false;
+
+	CHECK_CONDITION(IsValidEncryptHandle(hTemplate), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidPreparedKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION((rgItems != NULL) || (cItems == 0), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pcose->m_recipientFirst == NULL, COSE_ERR_INVALID_PARAMETER);
+
+	//  Each message gets a nonce node of its own in the unprotected map
+
+	CHECK_CONDITION(_COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_PROTECT_ONLY | COSE_DONT_SEND, NULL) == NULL, COSE_ERR_INVALID_PARAMETER);
+	if (!_COSE_Enveloped_SetupNonce(pcose, pKey->m_alg, &cbTag, perr)) goto errorReturn;
+	cnIV = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_UNPROTECT_ONLY, perr);
+	CHECK_CONDITION((cnIV != NULL) && (cnIV->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	cbNonce = cnIV->length;
+
+	if ((pcose->pbContent != NULL) && !pcose->m_contentBorrowed) COSE_FREE((void *) pcose->pbContent, &pcose->m_message.m_allocContext);
+	pcose->m_contentBorrowed = true;
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_ENCRYPT);
+#if defined(USE_AES_GCM_128) || defined(USE_AES_GCM_192) || defined(USE_AES_GCM_256)
+	if (_COSE_Encrypt_BatchIsGCM(pcose, pKey->m_alg) && (cbNonce == GCM_NONCE_SIZE) && GCM_Batch_Available() && (COSE_Provider_Get(pKey->m_alg) == COSE_Provider_Default())) {
+		_COSE_Stats_SetAlgorithm(pKey->m_alg);
+		fDone = _COSE_Encrypt_BatchGCM(pcose, pKey, rgItems, cItems);
+	}
+#endif
+	if (!fDone) {
+		for (i = 0; i < cItems; i++) _COSE_Encrypt_BatchOne(pcose, pKey, cbNonce, &rgItems[i]);
+	}
+	_COSE_Stats_Leave(iStats);
+
+	pcose->pbContent = NULL;
+	pcose->cbContent = 0;
+
+	return true;
 
 errorReturn:
 	return false;
@@ -153,16 +640,80 @@ bool COSE_Encrypt_SetContent(HCOSE_ENCRYPT h, const byte * rgb, size_t cb, cose_
 	return _COSE_Encrypt_SetContent((COSE_Encrypt *)h, rgb, cb, perror);
 }
 
+/*!
+* @brief Set the content of an Encrypt message without copying it
+*
+* The message references the application buffer rather than making a copy.
+* The buffer is not freed by the library and must stay valid, and unchanged,
+* until the message handle has been freed.
+*
+* @param h  Handle to the Encrypt message
+* @param rgb  Content to be encrypted
+* @param cb  Size of the content
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Encrypt_SetContentRef(HCOSE_ENCRYPT h, const byte * rgb, size_t cb, cose_errback * perr)
+{
+	COSE_Encrypt * cose = (COSE_Encrypt *)h;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h) && (rgb != NULL), COSE_ERR_INVALID_PARAMETER);
+
+	if ((cose->pbContent != NULL) && !cose->m_contentBorrowed) COSE_FREE((void *) cose->pbContent, &cose->m_message.m_allocContext);
+
+	cose->pbContent = rgb;
+	cose->cbContent = cb;
+	cose->m_contentBorrowed = true;
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Get the content of an Encrypt message
+*
+* Returns the plaintext after a successful decrypt, or the content which
+* was set for encryption.  The memory belongs to the message.
+*
+* @param h  Handle to the Encrypt message
+* @param pcbContent  Location to return the size of the content
+* @param perr  Location to return errors
+* @return pointer to the content or NULL on failure
+*/
+
+byte * COSE_Encrypt_GetContent(HCOSE_ENCRYPT h, size_t * pcbContent, cose_errback * perr)
+{
+	COSE_Encrypt * cose = (COSE_Encrypt *)h;
+
+	CHECK_CONDITION(IsValidEncryptHandle(h), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(cose->pbContent != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	if (pcbContent != NULL) *pcbContent = cose->cbContent;
+	return (byte *) cose->pbContent;
+
+errorReturn:
+	return NULL;
+}
+
 bool _COSE_Encrypt_SetContent(COSE_Encrypt * cose, const byte * rgb, size_t cb, cose_errback * perror)
 {
 	byte * pb;
-	cose->pbContent = pb = (byte *)COSE_CALLOC(cb, 1, &cose->m_message.m_allocContext);
-	if (cose->pbContent == NULL) {
+
+	pb = (byte *)COSE_CALLOC(cb, 1, &cose->m_message.m_allocContext);
+	if (pb == NULL) {
 		if (perror != NULL) perror->err = COSE_ERR_INVALID_PARAMETER;
 		return false;
 	}
 	memcpy(pb, rgb, cb);
+
+	if ((cose->pbContent != NULL) && !cose->m_contentBorrowed) COSE_FREE((void *) cose->pbContent, &cose->m_message.m_allocContext);
+
+	cose->pbContent = pb;
 	cose->cbContent = cb;
+	cose->m_contentBorrowed = false;
 
 	return true;
 }
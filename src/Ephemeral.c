@@ -0,0 +1,512 @@
+/** \file Ephemeral.c
+* Contains the pools of pre-generated ephemeral keys for ECDH-ES senders.
+*
+* Every ECDH-ES recipient needs a fresh EC key pair, and generating it is
+* the most expensive part of encrypting a message.  Each curve can be given
+* a pool of key pairs which a background thread generates ahead of time, so
+* a sender only has to take one.  A key is handed out once and the backend
+* wipes its private value when the message is done with it.  If the pool is
+* empty the key is generated inline as before and the exhaustion is counted.
+*
+* The refill thread generates up to a set number of keys for each curve and
+* then sleeps for the refill interval, which bounds the CPU it takes.
+*
+* A forked child starts with a copy of its parent's keys.  They are thrown
+* away in the child before it takes a key and the refill thread, which does
+* not exist in the child, is started again.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static SRWLOCK EphemeralLock = SRWLOCK_INIT;
+static SRWLOCK EphemeralConfigLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE EphemeralWake = CONDITION_VARIABLE_INIT;
+static HANDLE EphemeralThread = NULL;
+#define EPHEMERAL_LOCK() AcquireSRWLockExclusive(&EphemeralLock)
+#define EPHEMERAL_UNLOCK() ReleaseSRWLockExclusive(&EphemeralLock)
+#define EPHEMERAL_WAKE() WakeAllConditionVariable(&EphemeralWake)
+#define EPHEMERAL_CONFIG_LOCK() AcquireSRWLockExclusive(&EphemeralConfigLock)
+#define EPHEMERAL_CONFIG_UNLOCK() ReleaseSRWLockExclusive(&EphemeralConfigLock)
+#else
+#include <pthread.h>
+#include <time.h>
+
+static pthread_mutex_t EphemeralLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t EphemeralConfigLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t EphemeralWake = PTHREAD_COND_INITIALIZER;
+static pthread_t EphemeralThread;
+#define EPHEMERAL_LOCK() pthread_mutex_lock(&EphemeralLock)
+#define EPHEMERAL_UNLOCK() pthread_mutex_unlock(&EphemeralLock)
+#define EPHEMERAL_WAKE() pthread_cond_broadcast(&EphemeralWake)
+#define EPHEMERAL_CONFIG_LOCK() pthread_mutex_lock(&EphemeralConfigLock)
+#define EPHEMERAL_CONFIG_UNLOCK() pthread_mutex_unlock(&EphemeralConfigLock)
+#endif
+
+#define EPHEMERAL_CURVES 3		//  P-256, P-384 and P-521
+#define EPHEMERAL_MAX_DEPTH 1024
+#define EPHEMERAL_INTERVAL_DEFAULT 100
+
+//  EphemeralLock guards the pools and is held only briefly.  Starting and
+//  stopping the refill thread is serialized by EphemeralConfigLock, which
+//  is taken first.
+
+typedef struct {
+	size_t m_cDepth;		//  Keys to keep ready, zero if the pool is off
+	size_t m_cRefill;		//  Keys generated in each refill pass
+	void ** m_rgKeys;		//  Ready keys, taken from the end
+	size_t m_cKeys;
+	COSE_EPHEMERAL_STATS m_stats;
+} EphemeralPool;
+
+static EphemeralPool RgEphemeral[EPHEMERAL_CURVES];
+static unsigned int MsEphemeralInterval = EPHEMERAL_INTERVAL_DEFAULT;
+static bool FEphemeralRunning = false;
+static bool FEphemeralStop = false;
+
+#ifndef _WIN32
+//  Bumped in the child after each fork.  Both locks are held over the fork
+//  so the child never starts with one taken by a thread which does not
+//  exist.
+
+static unsigned int EphemeralForkCount = 0;
+static unsigned int EphemeralForkSeen = 0;
+static pthread_once_t EphemeralForkOnce = PTHREAD_ONCE_INIT;
+
+static void EphemeralForkPrepare(void)
+{
+	EPHEMERAL_CONFIG_LOCK();
+	EPHEMERAL_LOCK();
+}
+
+static void EphemeralForkParent(void)
+{
+	EPHEMERAL_UNLOCK();
+	EPHEMERAL_CONFIG_UNLOCK();
+}
+
+static void EphemeralForkChild(void)
+{
+	EphemeralForkCount += 1;
+	FEphemeralRunning = false;
+	FEphemeralStop = false;
+	EPHEMERAL_UNLOCK();
+	EPHEMERAL_CONFIG_UNLOCK();
+}
+
+static void EphemeralForkRegister(void)
+{
+	pthread_atfork(EphemeralForkPrepare, EphemeralForkParent, EphemeralForkChild);
+}
+#endif
+
+static unsigned int EphemeralForkGeneration()
+{
+#ifndef _WIN32
+	return EphemeralForkCount;
+#else
+	return 0;
+#endif
+}
+
+/*! \private
+* @brief Wait for the refill interval or until the refill thread is woken
+*
+* The lock must be held by the caller, it is released while waiting.
+*/
+
+static void EphemeralWait()
+{
+#ifdef _WIN32
+	SleepConditionVariableSRW(&EphemeralWake, &EphemeralLock, MsEphemeralInterval, 0);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += MsEphemeralInterval / 1000;
+	ts.tv_nsec += (long) (MsEphemeralInterval % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&EphemeralWake, &EphemeralLock, &ts);
+#endif
+}
+
+/*! \private
+* @brief Destroy every key held for a curve
+*
+* The lock must be held by the caller.
+*/
+
+static void EphemeralPool_Empty(EphemeralPool * pPool)
+{
+	while (pPool->m_cKeys > 0) {
+		pPool->m_cKeys -= 1;
+		ECKey_Destroy(pPool->m_rgKeys[pPool->m_cKeys]);
+		pPool->m_rgKeys[pPool->m_cKeys] = NULL;
+		pPool->m_stats.cDiscarded += 1;
+	}
+}
+
+/*! \private
+* @brief Body of the refill thread
+*
+* Keys are generated without the lock held, so senders are never blocked
+* behind a key generation.
+*/
+
+static void EphemeralRefill()
+{
+	EphemeralPool * pPool;
+	size_t cGenerate;
+	unsigned int iFork;
+	void * pKey;
+	int i;
+
+	EPHEMERAL_LOCK();
+
+	while (!FEphemeralStop) {
+		for (i = 0; (i < EPHEMERAL_CURVES) && !FEphemeralStop; i++) {
+			pPool = &RgEphemeral[i];
+
+			for (cGenerate = pPool->m_cRefill; (cGenerate > 0) && (pPool->m_cKeys < pPool->m_cDepth) && !FEphemeralStop; cGenerate--) {
+				iFork = EphemeralForkGeneration();
+				EPHEMERAL_UNLOCK();
+				pKey = ECKey_Generate(i + 1);
+				EPHEMERAL_LOCK();
+
+				if (pKey == NULL) break;
+
+				//  The pool may have been shrunk while the key was made
+
+				if ((iFork == EphemeralForkGeneration()) && (pPool->m_cKeys < pPool->m_cDepth)) {
+					pPool->m_rgKeys[pPool->m_cKeys] = pKey;
+					pPool->m_cKeys += 1;
+					pPool->m_stats.cGenerated += 1;
+				}
+				else ECKey_Destroy(pKey);
+			}
+		}
+
+		if (!FEphemeralStop) EphemeralWait();
+	}
+
+	EPHEMERAL_UNLOCK();
+
+	COSE_Random_Clear();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI EphemeralThreadProc(LPVOID pv)
+{
+	UNUSED_PARAM(pv);
+	EphemeralRefill();
+	return 0;
+}
+#else
+static void * EphemeralThreadProc(void * pv)
+{
+	UNUSED_PARAM(pv);
+	EphemeralRefill();
+	return NULL;
+}
+#endif
+
+/*! \private
+* @brief Start the refill thread if it is not running
+*
+* The lock must be held by the caller.
+*
+* @return result of the operation
+*/
+
+static bool EphemeralStart()
+{
+	if (FEphemeralRunning) return true;
+
+	FEphemeralStop = false;
+#ifdef _WIN32
+	EphemeralThread = CreateThread(NULL, 0, EphemeralThreadProc, NULL, 0, NULL);
+	if (EphemeralThread == NULL) return false;
+#else
+	if (pthread_create(&EphemeralThread, NULL, EphemeralThreadProc, NULL) != 0) return false;
+#endif
+	FEphemeralRunning = true;
+	return true;
+}
+
+/*! \private
+* @brief Stop the refill thread and wait for it to exit
+*
+* Both locks must be held by the caller, the pool lock is released while
+* waiting.
+*/
+
+static void EphemeralJoin()
+{
+	if (!FEphemeralRunning) return;
+
+	FEphemeralStop = true;
+	EPHEMERAL_WAKE();
+	EPHEMERAL_UNLOCK();
+
+#ifdef _WIN32
+	WaitForSingleObject(EphemeralThread, INFINITE);
+	CloseHandle(EphemeralThread);
+	EphemeralThread = NULL;
+#else
+	pthread_join(EphemeralThread, NULL);
+#endif
+
+	EPHEMERAL_LOCK();
+	FEphemeralRunning = false;
+	FEphemeralStop = false;
+}
+
+/*! \private
+* @brief Throw away keys copied from the parent in a forked child
+*
+* Both locks must be held by the caller, since the refill thread may be
+* started again.
+*
+* @return result of the operation
+*/
+
+static bool EphemeralCheckFork()
+{
+#ifndef _WIN32
+	bool fActive = false;
+	int i;
+
+	if (EphemeralForkSeen == EphemeralForkCount) return true;
+	EphemeralForkSeen = EphemeralForkCount;
+
+	for (i = 0; i < EPHEMERAL_CURVES; i++) {
+		EphemeralPool_Empty(&RgEphemeral[i]);
+		if (RgEphemeral[i].m_cDepth > 0) fActive = true;
+	}
+
+	if (fActive) return EphemeralStart();
+#endif
+	return true;
+}
+
+/*! \private
+* @brief Take the pool lock, dealing with a fork first if there was one
+*
+* Paths which only need the pool lock come through here.  After a fork the
+* lock is dropped and both locks are taken in order, so the refill thread
+* is only ever started under the configuration lock.
+*/
+
+static void EphemeralLockAfterFork()
+{
+	EPHEMERAL_LOCK();
+#ifndef _WIN32
+	if (EphemeralForkSeen != EphemeralForkCount) {
+		EPHEMERAL_UNLOCK();
+		EPHEMERAL_CONFIG_LOCK();
+		EPHEMERAL_LOCK();
+		EphemeralCheckFork();
+		EPHEMERAL_CONFIG_UNLOCK();
+	}
+#endif
+}
+
+/*! \private
+* @brief Take a pre-generated key for a curve
+*
+* The key is in the form used by the backend and belongs to the caller, who
+* frees it with ECKey_Destroy once it has been used.
+*
+* @param iCurve COSE curve of the key wanted
+* @return the key, or NULL if there is no pool for the curve or it is empty
+*/
+
+void * _COSE_Ephemeral_Take(int iCurve)
+{
+	EphemeralPool * pPool;
+	void * pKey = NULL;
+
+	if ((iCurve < 1) || (iCurve > EPHEMERAL_CURVES)) return NULL;
+	pPool = &RgEphemeral[iCurve - 1];
+
+	EphemeralLockAfterFork();
+
+	if (pPool->m_cDepth > 0) {
+		if (pPool->m_cKeys > 0) {
+			pPool->m_cKeys -= 1;
+			pKey = pPool->m_rgKeys[pPool->m_cKeys];
+			pPool->m_rgKeys[pPool->m_cKeys] = NULL;
+			pPool->m_stats.cTaken += 1;
+		}
+		else pPool->m_stats.cExhausted += 1;
+	}
+
+	EPHEMERAL_UNLOCK();
+	return pKey;
+}
+
+/*!
+* @brief Set the number of ephemeral keys kept ready for a curve
+*
+* The refill thread is started when the first pool is given a depth and
+* stopped when the last one is set to zero.  A depth of zero destroys the
+* keys held for the curve.
+*
+* @param iCurve COSE curve - 1 for P-256, 2 for P-384 or 3 for P-521
+* @param cDepth number of keys to keep ready
+* @param cRefill number of keys generated for the curve in each refill pass
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Ephemeral_SetPool(int iCurve, size_t cDepth, size_t cRefill, cose_errback * perr)
+{
+	EphemeralPool * pPool;
+	void ** rgNew = NULL;
+	void ** rgOld = NULL;
+	bool fActive = false;
+	bool fRet = true;
+	int i;
+
+	CHECK_CONDITION((iCurve >= 1) && (iCurve <= EPHEMERAL_CURVES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(cDepth <= EPHEMERAL_MAX_DEPTH, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((cDepth == 0) || (cRefill > 0), COSE_ERR_INVALID_PARAMETER);
+
+#ifndef _WIN32
+	pthread_once(&EphemeralForkOnce, EphemeralForkRegister);
+#endif
+
+	if (cDepth > 0) {
+		rgNew = (void **)calloc(cDepth, sizeof(void *));
+		CHECK_CONDITION(rgNew != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	pPool = &RgEphemeral[iCurve - 1];
+
+	EPHEMERAL_CONFIG_LOCK();
+	EPHEMERAL_LOCK();
+
+	EphemeralCheckFork();
+
+	//  Keep the keys which fit in the new pool
+
+	while (pPool->m_cKeys > cDepth) {
+		pPool->m_cKeys -= 1;
+		ECKey_Destroy(pPool->m_rgKeys[pPool->m_cKeys]);
+		pPool->m_stats.cDiscarded += 1;
+	}
+	if (pPool->m_cKeys > 0) memcpy(rgNew, pPool->m_rgKeys, pPool->m_cKeys * sizeof(void *));
+
+	rgOld = pPool->m_rgKeys;
+	pPool->m_rgKeys = rgNew;
+	pPool->m_cDepth = cDepth;
+	pPool->m_cRefill = cRefill;
+
+	for (i = 0; i < EPHEMERAL_CURVES; i++) {
+		if (RgEphemeral[i].m_cDepth > 0) fActive = true;
+	}
+
+	if (fActive) {
+		if (!EphemeralStart()) fRet = false;
+		EPHEMERAL_WAKE();
+	}
+	else EphemeralJoin();
+
+	EPHEMERAL_UNLOCK();
+	EPHEMERAL_CONFIG_UNLOCK();
+
+	if (rgOld != NULL) free(rgOld);
+
+	CHECK_CONDITION(fRet, COSE_ERR_OUT_OF_MEMORY);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Set the time the refill thread sleeps between refill passes
+*
+* Together with the refill count of each pool this sets the most keys per
+* second the thread generates.
+*
+* @param msInterval interval in milliseconds
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Ephemeral_SetInterval(unsigned int msInterval, cose_errback * perr)
+{
+	CHECK_CONDITION(msInterval > 0, COSE_ERR_INVALID_PARAMETER);
+
+	EPHEMERAL_LOCK();
+	MsEphemeralInterval = msInterval;
+	EPHEMERAL_WAKE();
+	EPHEMERAL_UNLOCK();
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Stop the refill thread and destroy every pre-generated key
+*
+* All of the pools are turned off.  Call this before the library is
+* unloaded.  The counters are not reset.
+*/
+
+void COSE_Ephemeral_Stop()
+{
+	int i;
+
+	EPHEMERAL_CONFIG_LOCK();
+	EPHEMERAL_LOCK();
+
+	EphemeralJoin();
+
+	for (i = 0; i < EPHEMERAL_CURVES; i++) {
+		EphemeralPool_Empty(&RgEphemeral[i]);
+		RgEphemeral[i].m_cDepth = 0;
+		RgEphemeral[i].m_cRefill = 0;
+		if (RgEphemeral[i].m_rgKeys != NULL) free(RgEphemeral[i].m_rgKeys);
+		RgEphemeral[i].m_rgKeys = NULL;
+	}
+
+	EPHEMERAL_UNLOCK();
+	EPHEMERAL_CONFIG_UNLOCK();
+}
+
+/*!
+* @brief Get the statistics for the ephemeral key pool of a curve
+*
+* @param iCurve COSE curve of the pool
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Ephemeral_GetStats(int iCurve, COSE_EPHEMERAL_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION((iCurve >= 1) && (iCurve <= EPHEMERAL_CURVES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	EphemeralLockAfterFork();
+	*pStats = RgEphemeral[iCurve - 1].m_stats;
+	pStats->cReady = RgEphemeral[iCurve - 1].m_cKeys;
+	EPHEMERAL_UNLOCK();
+	return true;
+
+errorReturn:
+	return false;
+}
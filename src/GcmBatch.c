@@ -0,0 +1,530 @@
+/** \file GcmBatch.c
+* Contains the multi-buffer AES-GCM encryption used for batches of messages.
+*
+* A short message gives AES-GCM too few blocks to keep the AES and carry-less
+* multiply units busy, each block waits for the previous one in the GHASH
+* chain.  Here up to GCM_BATCH_LANES messages are encrypted side by side.
+* Each step encrypts one counter block for every lane and folds one cipher
+* text block into the GHASH of every lane, so the chains of separate
+* messages overlap in the pipeline.  A lane which finishes its message
+* writes the tag and picks up the next message of the batch straight away.
+*
+* The authenticated data is the same for every message of a batch, its
+* GHASH is computed once when the key is set up.
+*
+* The code uses the AES-NI, PCLMULQDQ and SSSE3 instructions.  Whether the
+* processor has them is checked at run time, callers use the backend AEAD
+* when GCM_Batch_Available returns false.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define GCM_BATCH_X86
+#define GCM_BATCH_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#include <cpuid.h>
+#elif defined(_M_X64) && defined(_MSC_VER)
+#define GCM_BATCH_X86
+#define GCM_BATCH_TARGET
+#include <intrin.h>
+#endif
+
+#ifdef GCM_BATCH_X86
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#define GCM_BATCH_LANES 4			//  Messages encrypted side by side
+#define GCM_BATCH_BLOCKS 4			//  Blocks of each message per step
+
+struct _gcm_batch_key {
+	byte m_rgbRoundKeys[15][16];
+	int m_cRounds;
+	byte m_rgbH[GCM_BATCH_BLOCKS][16];	//  Powers of the hash key, bytes reversed
+	byte m_rgbY[16];			//  GHASH of the authenticated data, bytes reversed
+	uint64_t m_cbitAuthData;
+};
+
+static bool s_fDisabled = false;
+
+/*!
+* @brief Turn the multi-buffer code on or off
+*
+* Used by the tests and the benchmark to run the backend path on a
+* processor which has the instructions.
+*
+* @param fEnable false to always use the backend
+*/
+
+void GCM_Batch_Enable(bool fEnable)
+{
+	s_fDisabled = !fEnable;
+}
+
+#ifdef GCM_BATCH_X86
+
+static const byte s_rgbSBox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/*! \private
+* @brief Does the processor have AES-NI, PCLMULQDQ and SSSE3?
+*/
+
+static bool GCM_Batch_CPU()
+{
+	unsigned int ecx;
+
+#ifdef _MSC_VER
+	int rgInfo[4];
+
+	__cpuid(rgInfo, 1);
+	ecx = (unsigned int) rgInfo[2];
+#else
+	unsigned int eax, ebx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+#endif
+
+	//  PCLMULQDQ is bit 1, SSSE3 bit 9 and AES-NI bit 25
+	return (ecx & ((1u << 1) | (1u << 9) | (1u << 25))) == ((1u << 1) | (1u << 9) | (1u << 25));
+}
+
+/*!
+* @brief Can the multi-buffer code be used?
+*
+* @return true if the processor has the instructions and the code has not
+*		been turned off
+*/
+
+bool GCM_Batch_Available()
+{
+	static int s_iCPU = 0;		//  0 - not checked yet, 1 - present, 2 - missing
+
+	if (s_fDisabled) return false;
+	if (s_iCPU == 0) s_iCPU = GCM_Batch_CPU() ? 1 : 2;
+	return s_iCPU == 1;
+}
+
+/*! \private
+* @brief Expand an AES key into its round keys (FIPS 197 section 5.2)
+*
+* The round keys are laid out as the AESENC instruction takes them.
+*/
+
+static void GCM_Batch_ExpandKey(const byte * pbKey, size_t cbKey, byte rgbW[15][16], int * pcRounds)
+{
+	byte * pbW = &rgbW[0][0];
+	int cWords = (int)(cbKey / 4);
+	int cRounds = cWords + 6;
+	byte rcon = 1;
+	byte rgbT[4];
+	byte b;
+	int i;
+	int j;
+
+	memcpy(pbW, pbKey, cbKey);
+	for (i = cWords; i < 4 * (cRounds + 1); i++) {
+		memcpy(rgbT, pbW + 4 * (i - 1), 4);
+		if (i % cWords == 0) {
+			b = rgbT[0];
+			rgbT[0] = s_rgbSBox[rgbT[1]] ^ rcon;
+			rgbT[1] = s_rgbSBox[rgbT[2]];
+			rgbT[2] = s_rgbSBox[rgbT[3]];
+			rgbT[3] = s_rgbSBox[b];
+			rcon = (byte)((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0));
+		}
+		else if ((cWords > 6) && (i % cWords == 4)) {
+			for (j = 0; j < 4; j++) rgbT[j] = s_rgbSBox[rgbT[j]];
+		}
+		for (j = 0; j < 4; j++) pbW[4 * i + j] = pbW[4 * (i - cWords) + j] ^ rgbT[j];
+	}
+	memset(rgbT, 0, sizeof(rgbT));
+
+	*pcRounds = cRounds;
+}
+
+/*! \private
+* @brief Reverse the bytes of a block, GHASH works on the reversed form
+*/
+
+GCM_BATCH_TARGET static inline __m128i GCM_Batch_Reverse(__m128i x)
+{
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/*! \private
+* @brief Add the carry-less product of two byte reversed blocks to a sum
+*
+* The 256 bit sum is kept unreduced, so the products of several blocks with
+* different powers of H need only one reduction.
+*/
+
+GCM_BATCH_TARGET static inline void GCM_Batch_Product(__m128i a, __m128i b, __m128i * plo, __m128i * phi)
+{
+	__m128i mid;
+
+	mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+	*plo = _mm_xor_si128(*plo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+	*phi = _mm_xor_si128(*phi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+/*! \private
+* @brief Reduce a 256 bit carry-less product to an element of GF(2^128)
+*
+* The product is shifted left by one bit for the reflected bit order and
+* reduced modulo x^128 + x^7 + x^2 + x + 1, as in Gueron and Kounavis,
+* "Intel Carry-Less Multiplication Instruction and its Usage for Computing
+* the GCM Mode".
+*/
+
+GCM_BATCH_TARGET static inline __m128i GCM_Batch_Reduce(__m128i lo, __m128i hi)
+{
+	__m128i t1, t2, t3;
+
+	t1 = _mm_srli_epi32(lo, 31);
+	t2 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t3 = _mm_srli_si128(t1, 12);
+	t2 = _mm_slli_si128(t2, 4);
+	t1 = _mm_slli_si128(t1, 4);
+	lo = _mm_or_si128(lo, t1);
+	hi = _mm_or_si128(hi, t2);
+	hi = _mm_or_si128(hi, t3);
+
+	t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	t2 = _mm_srli_si128(t1, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(t1, 12));
+	t3 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	t3 = _mm_xor_si128(t3, t2);
+	lo = _mm_xor_si128(lo, t3);
+	return _mm_xor_si128(hi, lo);
+}
+
+/*! \private
+* @brief Multiply two byte reversed elements of GF(2^128)
+*/
+
+GCM_BATCH_TARGET static inline __m128i GCM_Batch_Multiply(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128();
+	__m128i hi = _mm_setzero_si128();
+
+	GCM_Batch_Product(a, b, &lo, &hi);
+	return GCM_Batch_Reduce(lo, hi);
+}
+
+/*! \private
+* @brief Encrypt eight blocks in place
+*
+* The blocks are independent, so the rounds of one block run while the
+* previous ones are still in the AES unit.
+*/
+
+GCM_BATCH_TARGET static inline void GCM_Batch_Blocks(const __m128i * rgKeys, int cRounds, __m128i * rgX)
+{
+	__m128i k = rgKeys[0];
+	__m128i x0 = _mm_xor_si128(rgX[0], k);
+	__m128i x1 = _mm_xor_si128(rgX[1], k);
+	__m128i x2 = _mm_xor_si128(rgX[2], k);
+	__m128i x3 = _mm_xor_si128(rgX[3], k);
+	__m128i x4 = _mm_xor_si128(rgX[4], k);
+	__m128i x5 = _mm_xor_si128(rgX[5], k);
+	__m128i x6 = _mm_xor_si128(rgX[6], k);
+	__m128i x7 = _mm_xor_si128(rgX[7], k);
+	int i;
+
+	for (i = 1; i < cRounds; i++) {
+		k = rgKeys[i];
+		x0 = _mm_aesenc_si128(x0, k);
+		x1 = _mm_aesenc_si128(x1, k);
+		x2 = _mm_aesenc_si128(x2, k);
+		x3 = _mm_aesenc_si128(x3, k);
+		x4 = _mm_aesenc_si128(x4, k);
+		x5 = _mm_aesenc_si128(x5, k);
+		x6 = _mm_aesenc_si128(x6, k);
+		x7 = _mm_aesenc_si128(x7, k);
+	}
+
+	k = rgKeys[cRounds];
+	rgX[0] = _mm_aesenclast_si128(x0, k);
+	rgX[1] = _mm_aesenclast_si128(x1, k);
+	rgX[2] = _mm_aesenclast_si128(x2, k);
+	rgX[3] = _mm_aesenclast_si128(x3, k);
+	rgX[4] = _mm_aesenclast_si128(x4, k);
+	rgX[5] = _mm_aesenclast_si128(x5, k);
+	rgX[6] = _mm_aesenclast_si128(x6, k);
+	rgX[7] = _mm_aesenclast_si128(x7, k);
+}
+
+/*! \private
+* @brief Wipe memory holding key material
+*/
+
+static void GCM_Batch_Wipe(void * pv, size_t cb)
+{
+	volatile byte * pb = (volatile byte *) pv;
+
+	while (cb-- > 0) *pb++ = 0;
+}
+
+/*!
+* @brief Set up a key and the authenticated data for a batch
+*
+* @param pbKey AES key, 16, 24 or 32 bytes
+* @param cbKey size of the key
+* @param pbAuthData authenticated data shared by every message
+* @param cbAuthData size of the authenticated data
+* @return the key, NULL if the key size is wrong or no memory is left
+*/
+
+GCM_BATCH_TARGET GCM_BATCH_KEY * GCM_Batch_New(const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData CBOR_CONTEXT)
+{
+	GCM_BATCH_KEY * pKey;
+	__m128i rgKeys[15];
+	__m128i rgX[8];
+	__m128i H;
+	__m128i Y;
+	byte rgb[16];
+	size_t cb;
+	int i;
+
+	if ((cbKey != 16) && (cbKey != 24) && (cbKey != 32)) return NULL;
+
+	pKey = (GCM_BATCH_KEY *) COSE_CALLOC(1, sizeof(GCM_BATCH_KEY), context);
+	if (pKey == NULL) return NULL;
+
+	GCM_Batch_ExpandKey(pbKey, cbKey, pKey->m_rgbRoundKeys, &pKey->m_cRounds);
+	for (i = 0; i <= pKey->m_cRounds; i++) rgKeys[i] = _mm_loadu_si128((const __m128i *) pKey->m_rgbRoundKeys[i]);
+
+	memset(rgX, 0, sizeof(rgX));
+	GCM_Batch_Blocks(rgKeys, pKey->m_cRounds, rgX);
+	H = GCM_Batch_Reverse(rgX[0]);
+
+	_mm_storeu_si128((__m128i *) pKey->m_rgbH[0], H);
+	for (i = 1; i < GCM_BATCH_BLOCKS; i++) {
+		_mm_storeu_si128((__m128i *) pKey->m_rgbH[i], GCM_Batch_Multiply(_mm_loadu_si128((const __m128i *) pKey->m_rgbH[i - 1]), H));
+	}
+
+	Y = _mm_setzero_si128();
+	while (cbAuthData > 0) {
+		cb = (cbAuthData < 16) ? cbAuthData : 16;
+		memset(rgb, 0, sizeof(rgb));
+		memcpy(rgb, pbAuthData, cb);
+		Y = GCM_Batch_Multiply(_mm_xor_si128(Y, GCM_Batch_Reverse(_mm_loadu_si128((const __m128i *) rgb))), H);
+		pKey->m_cbitAuthData += cb * 8;
+		pbAuthData += cb;
+		cbAuthData -= cb;
+	}
+	_mm_storeu_si128((__m128i *) pKey->m_rgbY, Y);
+
+	GCM_Batch_Wipe(rgKeys, sizeof(rgKeys));
+	GCM_Batch_Wipe(rgX, sizeof(rgX));
+	return pKey;
+}
+
+/*!
+* @brief Encrypt a set of messages
+*
+* Each item gets its cipher text followed by the 16 byte tag at pbOut.
+*
+* @param pKey key and authenticated data from GCM_Batch_New
+* @param rgItems messages to be encrypted
+* @param cItems number of messages
+*/
+
+GCM_BATCH_TARGET void GCM_Batch_Encrypt(const GCM_BATCH_KEY * pKey, const GCM_BATCH_ITEM * rgItems, size_t cItems)
+{
+	__m128i rgKeys[15];
+	__m128i rgH[GCM_BATCH_BLOCKS];		//  H, H^2, ... bytes reversed
+	__m128i rgCounter[GCM_BATCH_LANES];	//  Next counter block, bytes reversed
+	__m128i rgY[GCM_BATCH_LANES];		//  GHASH so far, bytes reversed
+	__m128i rgMask[GCM_BATCH_LANES];	//  Encrypted first counter block, masks the tag
+	__m128i rgX[GCM_BATCH_LANES * GCM_BATCH_BLOCKS];
+	__m128i lo;
+	__m128i hi;
+	__m128i C;
+	const GCM_BATCH_ITEM * rgpItem[GCM_BATCH_LANES] = { NULL };
+	size_t rgib[GCM_BATCH_LANES];
+	bool rgfStart[GCM_BATCH_LANES];		//  First counter block not used yet
+	size_t iNext = 0;
+	const GCM_BATCH_ITEM * pItem;
+	__m128i * pX;
+	byte rgb[16];
+	size_t cb;
+	uint64_t cbit;
+	int cRounds = pKey->m_cRounds;
+	int cActive;
+	int iFirst;
+	int cBlocks;
+	int i;
+	int j;
+	int l;
+
+	for (i = 0; i <= cRounds; i++) rgKeys[i] = _mm_loadu_si128((const __m128i *) pKey->m_rgbRoundKeys[i]);
+	for (i = 0; i < GCM_BATCH_BLOCKS; i++) rgH[i] = _mm_loadu_si128((const __m128i *) pKey->m_rgbH[i]);
+
+	for (;;) {
+		//  Give each idle lane the next message
+
+		cActive = 0;
+		for (l = 0; l < GCM_BATCH_LANES; l++) {
+			if ((rgpItem[l] == NULL) && (iNext < cItems)) {
+				pItem = &rgItems[iNext++];
+				memcpy(rgb, pItem->pbNonce, 12);
+				rgb[12] = rgb[13] = rgb[14] = 0;
+				rgb[15] = 1;
+				rgCounter[l] = GCM_Batch_Reverse(_mm_loadu_si128((const __m128i *) rgb));
+				rgY[l] = _mm_loadu_si128((const __m128i *) pKey->m_rgbY);
+				rgfStart[l] = true;
+				rgib[l] = 0;
+				rgpItem[l] = pItem;
+			}
+			if (rgpItem[l] != NULL) cActive += 1;
+		}
+		if (cActive == 0) break;
+
+		//  The next counter blocks of every lane, the rounds of eight blocks
+		//  at a time are interleaved.  Idle lanes encrypt stale blocks which
+		//  are not used.  In the reversed form the 32 bit counter is the low
+		//  lane and wraps on its own as GCM requires.
+
+		for (l = 0; l < GCM_BATCH_LANES; l++) {
+			for (j = 0; j < GCM_BATCH_BLOCKS; j++) {
+				rgX[l * GCM_BATCH_BLOCKS + j] = GCM_Batch_Reverse(_mm_add_epi32(rgCounter[l], _mm_cvtsi32_si128(j)));
+			}
+		}
+		for (i = 0; i < GCM_BATCH_LANES * GCM_BATCH_BLOCKS; i += 8) GCM_Batch_Blocks(rgKeys, cRounds, &rgX[i]);
+
+		//  Apply the key stream, the cipher text blocks of a lane are hashed
+		//  with decreasing powers of H and reduced once
+
+		for (l = 0; l < GCM_BATCH_LANES; l++) {
+			pItem = rgpItem[l];
+			if (pItem == NULL) continue;
+			pX = &rgX[l * GCM_BATCH_BLOCKS];
+
+			iFirst = 0;
+			if (rgfStart[l]) {
+				rgMask[l] = pX[0];
+				rgfStart[l] = false;
+				iFirst = 1;
+			}
+
+			cb = pItem->cbIn - rgib[l];
+			cBlocks = (int) ((cb + 15) / 16);
+			if (cBlocks > GCM_BATCH_BLOCKS - iFirst) cBlocks = GCM_BATCH_BLOCKS - iFirst;
+
+			lo = _mm_setzero_si128();
+			hi = _mm_setzero_si128();
+			for (j = 0; j < cBlocks; j++) {
+				cb = pItem->cbIn - rgib[l];
+				if (cb >= 16) {
+					C = _mm_xor_si128(pX[iFirst + j], _mm_loadu_si128((const __m128i *) (pItem->pbIn + rgib[l])));
+					_mm_storeu_si128((__m128i *) (pItem->pbOut + rgib[l]), C);
+					cb = 16;
+				}
+				else {
+					memset(rgb, 0, sizeof(rgb));
+					memcpy(rgb, pItem->pbIn + rgib[l], cb);
+					_mm_storeu_si128((__m128i *) rgb, _mm_xor_si128(pX[iFirst + j], _mm_loadu_si128((const __m128i *) rgb)));
+					memcpy(pItem->pbOut + rgib[l], rgb, cb);
+					memset(rgb + cb, 0, sizeof(rgb) - cb);
+					C = _mm_loadu_si128((const __m128i *) rgb);
+				}
+				C = GCM_Batch_Reverse(C);
+				if (j == 0) C = _mm_xor_si128(C, rgY[l]);
+				GCM_Batch_Product(C, rgH[cBlocks - 1 - j], &lo, &hi);
+				rgib[l] += cb;
+			}
+			if (cBlocks > 0) rgY[l] = GCM_Batch_Reduce(lo, hi);
+			rgCounter[l] = _mm_add_epi32(rgCounter[l], _mm_cvtsi32_si128(iFirst + cBlocks));
+
+			if (rgib[l] < pItem->cbIn) continue;
+
+			//  Last block - hash the lengths and write the tag
+
+			cbit = (uint64_t) pItem->cbIn * 8;
+			for (i = 0; i < 8; i++) {
+				rgb[i] = (byte)(pKey->m_cbitAuthData >> (56 - 8 * i));
+				rgb[8 + i] = (byte)(cbit >> (56 - 8 * i));
+			}
+			rgY[l] = GCM_Batch_Multiply(_mm_xor_si128(rgY[l], GCM_Batch_Reverse(_mm_loadu_si128((const __m128i *) rgb))), rgH[0]);
+			_mm_storeu_si128((__m128i *) (pItem->pbOut + pItem->cbIn), _mm_xor_si128(GCM_Batch_Reverse(rgY[l]), rgMask[l]));
+			rgpItem[l] = NULL;
+		}
+	}
+
+	GCM_Batch_Wipe(rgKeys, sizeof(rgKeys));
+	GCM_Batch_Wipe(rgH, sizeof(rgH));
+	GCM_Batch_Wipe(rgX, sizeof(rgX));
+	GCM_Batch_Wipe(rgMask, sizeof(rgMask));
+	GCM_Batch_Wipe(rgb, sizeof(rgb));
+}
+
+/*!
+* @brief Free a key from GCM_Batch_New
+*/
+
+void GCM_Batch_Delete(GCM_BATCH_KEY * pKey CBOR_CONTEXT)
+{
+	GCM_Batch_Wipe(pKey, sizeof(GCM_BATCH_KEY));
+	COSE_FREE(pKey, context);
+}
+
+#else
+
+bool GCM_Batch_Available()
+{
+	return false;
+}
+
+GCM_BATCH_KEY * GCM_Batch_New(const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData CBOR_CONTEXT)
+{
+	UNUSED_PARAM(pbKey);
+	UNUSED_PARAM(cbKey);
+	UNUSED_PARAM(pbAuthData);
+	UNUSED_PARAM(cbAuthData);
+#ifdef USE_CBOR_CONTEXT
+	UNUSED_PARAM(context);
+#endif
+	return NULL;
+}
+
+void GCM_Batch_Encrypt(const GCM_BATCH_KEY * pKey, const GCM_BATCH_ITEM * rgItems, size_t cItems)
+{
+	UNUSED_PARAM(pKey);
+	UNUSED_PARAM(rgItems);
+	UNUSED_PARAM(cItems);
+}
+
+void GCM_Batch_Delete(GCM_BATCH_KEY * pKey CBOR_CONTEXT)
+{
+	UNUSED_PARAM(pKey);
+#ifdef USE_CBOR_CONTEXT
+	UNUSED_PARAM(context);
+#endif
+}
+
+#endif // GCM_BATCH_X86
@@ -0,0 +1,343 @@
+/** \file Handle.c
+* Contains the registry used to check the handles given out by the library.
+*
+* Every live object is entered into a single hash table keyed by its address
+* and the type of handle.  Checking a handle is a constant time lookup rather
+* than a walk over every live object of that type.  The table is guarded by a
+* reader/writer lock, so handles can be created, checked and freed from many
+* threads at the same time while checks do not block each other.
+*
+* Handles of objects allocated from an arena also point at a record shared
+* by every handle of that arena generation.  Resetting the arena marks the
+* record dead, which invalidates all of those handles at once.  The stale
+* slots are only cleared when they are reused or the table is rebuilt.
+* The record also counts the key and prepared key handles of the generation,
+* those objects hold crypto library objects which the reset cannot release.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static SRWLOCK HandleLock = SRWLOCK_INIT;
+#define HANDLE_READ_LOCK() AcquireSRWLockShared(&HandleLock)
+#define HANDLE_READ_UNLOCK() ReleaseSRWLockShared(&HandleLock)
+#define HANDLE_WRITE_LOCK() AcquireSRWLockExclusive(&HandleLock)
+#define HANDLE_WRITE_UNLOCK() ReleaseSRWLockExclusive(&HandleLock)
+#else
+#include <pthread.h>
+
+static pthread_rwlock_t HandleLock = PTHREAD_RWLOCK_INITIALIZER;
+#define HANDLE_READ_LOCK() pthread_rwlock_rdlock(&HandleLock)
+#define HANDLE_READ_UNLOCK() pthread_rwlock_unlock(&HandleLock)
+#define HANDLE_WRITE_LOCK() pthread_rwlock_wrlock(&HandleLock)
+#define HANDLE_WRITE_UNLOCK() pthread_rwlock_unlock(&HandleLock)
+#endif
+
+#define HANDLE_TABLE_MIN 64
+#define HANDLE_NOT_FOUND ((size_t) -1)
+
+struct _COSE_HandleEpoch {
+	size_t m_cSlots;		//  Slots which still point at the record
+	size_t m_cPinned;		//  Live handles of objects holding crypto library objects
+	bool m_fLive;			//  Cleared when the arena is reset
+};
+
+typedef struct {
+	const COSE * m_pMessage;		//  NULL if empty, HANDLE_DELETED if removed
+	COSE_HANDLE_TYPE m_type;
+	COSE_HandleEpoch * m_pEpoch;	//  NULL unless allocated from an arena
+} HandleSlot;
+
+static const COSE HandleDeleted;
+#define HANDLE_DELETED (&HandleDeleted)
+
+static HandleSlot * RgHandles = NULL;
+static size_t CHandleSlots = 0;		//  Always a power of two
+static size_t CHandleUsed = 0;		//  Live and deleted slots
+static size_t CHandleLive = 0;
+
+static size_t _COSE_Handle_Hash(const COSE * pMessage)
+{
+	size_t h = (size_t)pMessage;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+#define HANDLE_IS_DEAD(p) (((p)->m_pEpoch != NULL) && !(p)->m_pEpoch->m_fLive)
+#define HANDLE_PINS(type) (((type) == COSE_HANDLE_KEY) || ((type) == COSE_HANDLE_PREPARED_KEY))
+
+/*! \private
+* @brief Detach a slot from its arena generation
+*
+* The record is freed once the generation has ended and no slot points at
+* it any longer.  The handle lock must be held for writing.
+*
+* @param pSlot slot being emptied or reused
+*/
+
+static void _COSE_Handle_Unlink(HandleSlot * pSlot)
+{
+	COSE_HandleEpoch * pEpoch = pSlot->m_pEpoch;
+
+	if (pEpoch == NULL) return;
+	pSlot->m_pEpoch = NULL;
+
+	pEpoch->m_cSlots -= 1;
+	if (!pEpoch->m_fLive && (pEpoch->m_cSlots == 0)) free(pEpoch);
+}
+
+/*! \private
+* @brief Find the slot holding a handle
+*
+* The handle lock must be held by the caller.
+*
+* @param type type of the handle
+* @param pMessage object the handle refers to
+* @return index of the slot or HANDLE_NOT_FOUND
+*/
+
+static size_t _COSE_Handle_Find(COSE_HANDLE_TYPE type, const COSE * pMessage)
+{
+	size_t mask = CHandleSlots - 1;
+	size_t i;
+
+	if (RgHandles == NULL) return HANDLE_NOT_FOUND;
+
+	for (i = _COSE_Handle_Hash(pMessage) & mask; RgHandles[i].m_pMessage != NULL; i = (i + 1) & mask) {
+		if ((RgHandles[i].m_pMessage == pMessage) && (RgHandles[i].m_type == type) && !HANDLE_IS_DEAD(&RgHandles[i])) return i;
+	}
+	return HANDLE_NOT_FOUND;
+}
+
+/*! \private
+* @brief Rebuild the table so it has room for one more handle
+*
+* Deleted slots and those of reset arenas are dropped and the table is grown
+* so that it is never more than half full afterwards.  The handle lock must
+* be held for writing.
+*
+* @return false if memory could not be allocated
+*/
+
+static bool _COSE_Handle_Grow()
+{
+	HandleSlot * rgNew;
+	size_t cNew = HANDLE_TABLE_MIN;
+	size_t mask;
+	size_t i;
+	size_t j;
+
+	while ((CHandleLive + 1) * 2 > cNew) cNew *= 2;
+
+	rgNew = (HandleSlot *)calloc(cNew, sizeof(HandleSlot));
+	if (rgNew == NULL) return false;
+
+	mask = cNew - 1;
+	for (i = 0; i < CHandleSlots; i++) {
+		if ((RgHandles[i].m_pMessage == NULL) || (RgHandles[i].m_pMessage == HANDLE_DELETED)) continue;
+		if (HANDLE_IS_DEAD(&RgHandles[i])) {
+			_COSE_Handle_Unlink(&RgHandles[i]);
+			continue;
+		}
+
+		for (j = _COSE_Handle_Hash(RgHandles[i].m_pMessage) & mask; rgNew[j].m_pMessage != NULL; j = (j + 1) & mask);
+		rgNew[j] = RgHandles[i];
+	}
+
+	free(RgHandles);
+	RgHandles = rgNew;
+	CHandleSlots = cNew;
+	CHandleUsed = CHandleLive;
+
+	return true;
+}
+
+/*! \private
+* @brief Register an object so that its handle is accepted
+*
+* Objects allocated from an arena are tied to the current generation of
+* the arena, so resetting it drops the handle as well.
+*
+* @param type type of the handle
+* @param pMessage object to register
+* @param context allocation context of the object
+* @return false if memory could not be allocated
+*/
+
+bool _COSE_Handle_Add(COSE_HANDLE_TYPE type, COSE * pMessage CBOR_CONTEXT)
+{
+	size_t mask;
+	size_t i;
+	COSE_HandleEpoch * pEpoch = NULL;
+	bool fRet = false;
+#ifdef USE_CBOR_CONTEXT
+	COSE_HandleEpoch ** ppEpoch = _COSE_Arena_HandleEpoch(context);
+#endif
+
+	HANDLE_WRITE_LOCK();
+
+#ifdef USE_CBOR_CONTEXT
+	if (ppEpoch != NULL) {
+		if (*ppEpoch == NULL) {
+			*ppEpoch = (COSE_HandleEpoch *)calloc(1, sizeof(COSE_HandleEpoch));
+			if (*ppEpoch == NULL) goto errorReturn;
+			(*ppEpoch)->m_fLive = true;
+		}
+		pEpoch = *ppEpoch;
+	}
+#endif
+
+	if ((CHandleUsed + 1) * 4 > CHandleSlots * 3) {
+		if (!_COSE_Handle_Grow()) goto errorReturn;
+	}
+
+	mask = CHandleSlots - 1;
+	for (i = _COSE_Handle_Hash(pMessage) & mask; ; i = (i + 1) & mask) {
+		if (RgHandles[i].m_pMessage == NULL) {
+			CHandleUsed += 1;
+			break;
+		}
+		if (RgHandles[i].m_pMessage == HANDLE_DELETED) break;
+		if (HANDLE_IS_DEAD(&RgHandles[i])) {
+			_COSE_Handle_Unlink(&RgHandles[i]);
+			break;
+		}
+	}
+
+	RgHandles[i].m_pMessage = pMessage;
+	RgHandles[i].m_type = type;
+	RgHandles[i].m_pEpoch = pEpoch;
+	if (pEpoch != NULL) {
+		pEpoch->m_cSlots += 1;
+		if (HANDLE_PINS(type)) pEpoch->m_cPinned += 1;
+	}
+	CHandleLive += 1;
+	fRet = true;
+
+errorReturn:
+	HANDLE_WRITE_UNLOCK();
+	return fRet;
+}
+
+/*! \private
+* @brief Check that a handle refers to a live object of the right type
+*
+* The object is not dereferenced, so it is safe to pass stale or garbage
+* handles.
+*
+* @param type type of the handle
+* @param pMessage object the handle refers to
+* @return result of the check
+*/
+
+bool _COSE_Handle_IsValid(COSE_HANDLE_TYPE type, const COSE * pMessage)
+{
+	bool f;
+
+	if (pMessage == NULL) return false;
+
+	HANDLE_READ_LOCK();
+	f = _COSE_Handle_Find(type, pMessage) != HANDLE_NOT_FOUND;
+	HANDLE_READ_UNLOCK();
+
+	return f;
+}
+
+/*! \private
+* @brief Unregister an object, its handle is no longer accepted
+*
+* @param type type of the handle
+* @param pMessage object to unregister
+*/
+
+void _COSE_Handle_Remove(COSE_HANDLE_TYPE type, COSE * pMessage)
+{
+	size_t i;
+
+	HANDLE_WRITE_LOCK();
+
+	i = _COSE_Handle_Find(type, pMessage);
+	if (i != HANDLE_NOT_FOUND) {
+		if ((RgHandles[i].m_pEpoch != NULL) && HANDLE_PINS(type)) RgHandles[i].m_pEpoch->m_cPinned -= 1;
+		RgHandles[i].m_pMessage = HANDLE_DELETED;
+		_COSE_Handle_Unlink(&RgHandles[i]);
+		CHandleLive -= 1;
+	}
+
+	HANDLE_WRITE_UNLOCK();
+}
+
+/*! \private
+* @brief Check if an arena generation still has key objects
+*
+* Key objects and prepared keys hold objects of the crypto library which
+* are only released when they are freed.
+*
+* @param pEpoch generation to check, may be NULL
+* @return true if any of them has not been freed
+*/
+
+bool _COSE_Handle_EpochPinned(const COSE_HandleEpoch * pEpoch)
+{
+	bool f;
+
+	if (pEpoch == NULL) return false;
+
+	HANDLE_READ_LOCK();
+	f = pEpoch->m_cPinned != 0;
+	HANDLE_READ_UNLOCK();
+
+	return f;
+}
+
+/*! \private
+* @brief Unregister every object of an arena generation
+*
+* Called when the arena is reset or destroyed.  The handles are no longer
+* accepted, without having to visit the slots holding them.
+*
+* @param pEpoch generation to end, may be NULL
+*/
+
+void _COSE_Handle_EndEpoch(COSE_HandleEpoch * pEpoch)
+{
+	if (pEpoch == NULL) return;
+
+	HANDLE_WRITE_LOCK();
+
+	pEpoch->m_fLive = false;
+	CHandleLive -= pEpoch->m_cSlots;
+	if (pEpoch->m_cSlots == 0) free(pEpoch);
+
+	HANDLE_WRITE_UNLOCK();
+}
+
+/*!
+* @brief Get the number of live handles
+*
+* Every message, recipient, signer, key set, key and prepared key object
+* which has not been freed holds one handle.  Objects allocated from an arena give up their
+* handles when the arena is reset or destroyed.
+*
+* @return number of registered handles
+*/
+
+size_t COSE_Handle_Count()
+{
+	size_t c;
+
+	HANDLE_READ_LOCK();
+	c = CHandleLive;
+	HANDLE_READ_UNLOCK();
+
+	return c;
+}
@@ -0,0 +1,493 @@
+/** \file KeyCache.c
+* Contains the cache of keys derived for ECDH-SS and direct HKDF recipients.
+*
+* With static keys on both sides, or a shared secret, the derived key only
+* changes when the parties or the context information change.  Devices
+* which send many messages to the same peer would otherwise pay for an EC
+* scalar multiplication and an HKDF on every message.  The cache holds the
+* most recently used keys, looked up by a SHA-256 digest of everything the
+* derivation depends on: the two keys, the KDF, the salt and the encoded
+* COSE_KDF_Context.
+*
+* Keys are identified by a digest of their public parameters rather than by
+* their kid.  A kid is chosen by the sender, so a message carrying a
+* different static key under a known kid must not find the key derived for
+* the real one.  Leaving the private value out means a key pair and its
+* public half have the same identity.
+*
+* The cache is shared by all threads and guarded by a mutex.  It is off
+* until COSE_KeyCache_SetSize is called.  Keys are wiped from memory as
+* soon as they leave the cache, with stores the compiler may not drop.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static SRWLOCK KeyCacheLock = SRWLOCK_INIT;
+#define KEYCACHE_LOCK() AcquireSRWLockExclusive(&KeyCacheLock)
+#define KEYCACHE_UNLOCK() ReleaseSRWLockExclusive(&KeyCacheLock)
+#else
+#include <pthread.h>
+
+static pthread_mutex_t KeyCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#define KEYCACHE_LOCK() pthread_mutex_lock(&KeyCacheLock)
+#define KEYCACHE_UNLOCK() pthread_mutex_unlock(&KeyCacheLock)
+#endif
+
+#define KEYCACHE_MAX_ENTRIES 65536
+#define KEYCACHE_KEY_MAX (512 / 8)
+#define KEYCACHE_NONE (-1)
+
+typedef struct {
+	COSE_KeyCacheId m_id;
+	int m_iPrev;			//  Next more recently used entry
+	int m_iNext;			//  Next less recently used entry, or next free entry
+	int m_iChain;			//  Next entry in the same hash bucket
+	size_t m_cbKey;			//  Zero if the entry is free
+	byte m_rgbKey[KEYCACHE_KEY_MAX];
+} KeyCacheEntry;
+
+static KeyCacheEntry * RgKeyCache = NULL;
+static int * RgKeyCacheBuckets = NULL;
+static size_t CKeyCacheEntries = 0;
+static size_t CKeyCacheBuckets = 0;		//  Always a power of two
+static int IKeyCacheFirst = KEYCACHE_NONE;	//  Most recently used
+static int IKeyCacheLast = KEYCACHE_NONE;	//  Least recently used
+static int IKeyCacheFree = KEYCACHE_NONE;
+static COSE_KEYCACHE_STATS KeyCacheStats;
+
+static size_t KeyCache_Bucket(const byte * rgbDigest)
+{
+	size_t h = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(size_t); i++) h = (h << 8) | rgbDigest[i];
+	return h & (CKeyCacheBuckets - 1);
+}
+
+/*! \private
+* @brief Zero memory holding key material
+*
+* memset on memory which is not read again may be removed by the compiler,
+* stores through a volatile pointer are not.
+*
+* @param pv memory to wipe
+* @param cb size of the memory
+*/
+
+static void KeyCache_Wipe(void * pv, size_t cb)
+{
+	volatile byte * pb = (volatile byte *) pv;
+
+	while (cb-- > 0) *pb++ = 0;
+}
+
+/*! \private
+* @brief Put every entry on the free list and wipe it
+*
+* The cache lock must be held by the caller.
+*/
+
+static void KeyCache_Reset()
+{
+	size_t i;
+
+	IKeyCacheFirst = KEYCACHE_NONE;
+	IKeyCacheLast = KEYCACHE_NONE;
+	IKeyCacheFree = KEYCACHE_NONE;
+
+	for (i = CKeyCacheEntries; i > 0; i--) {
+		KeyCache_Wipe(&RgKeyCache[i - 1], sizeof(KeyCacheEntry));
+		RgKeyCache[i - 1].m_iNext = IKeyCacheFree;
+		IKeyCacheFree = (int) (i - 1);
+	}
+	for (i = 0; i < CKeyCacheBuckets; i++) RgKeyCacheBuckets[i] = KEYCACHE_NONE;
+
+	KeyCacheStats.cEntries = 0;
+}
+
+static void KeyCache_Unlink(int i)
+{
+	KeyCacheEntry * pEntry = &RgKeyCache[i];
+
+	if (pEntry->m_iPrev == KEYCACHE_NONE) IKeyCacheFirst = pEntry->m_iNext;
+	else RgKeyCache[pEntry->m_iPrev].m_iNext = pEntry->m_iNext;
+	if (pEntry->m_iNext == KEYCACHE_NONE) IKeyCacheLast = pEntry->m_iPrev;
+	else RgKeyCache[pEntry->m_iNext].m_iPrev = pEntry->m_iPrev;
+}
+
+static void KeyCache_LinkFirst(int i)
+{
+	KeyCacheEntry * pEntry = &RgKeyCache[i];
+
+	pEntry->m_iPrev = KEYCACHE_NONE;
+	pEntry->m_iNext = IKeyCacheFirst;
+	if (IKeyCacheFirst != KEYCACHE_NONE) RgKeyCache[IKeyCacheFirst].m_iPrev = i;
+	IKeyCacheFirst = i;
+	if (IKeyCacheLast == KEYCACHE_NONE) IKeyCacheLast = i;
+}
+
+/*! \private
+* @brief Take an entry out of the cache, wipe it and put it on the free list
+*
+* The cache lock must be held by the caller.
+*
+* @param i index of the entry to remove
+*/
+
+static void KeyCache_Remove(int i)
+{
+	int * piChain = &RgKeyCacheBuckets[KeyCache_Bucket(RgKeyCache[i].m_id.m_rgbDigest)];
+
+	while (*piChain != i) piChain = &RgKeyCache[*piChain].m_iChain;
+	*piChain = RgKeyCache[i].m_iChain;
+
+	KeyCache_Unlink(i);
+
+	KeyCache_Wipe(&RgKeyCache[i], sizeof(KeyCacheEntry));
+	RgKeyCache[i].m_iNext = IKeyCacheFree;
+	IKeyCacheFree = i;
+
+	KeyCacheStats.cEntries -= 1;
+}
+
+static int KeyCache_Lookup(const byte * rgbDigest)
+{
+	int i;
+
+	for (i = RgKeyCacheBuckets[KeyCache_Bucket(rgbDigest)]; i != KEYCACHE_NONE; i = RgKeyCache[i].m_iChain) {
+		if (memcmp(RgKeyCache[i].m_id.m_rgbDigest, rgbDigest, sizeof(RgKeyCache[i].m_id.m_rgbDigest)) == 0) return i;
+	}
+	return KEYCACHE_NONE;
+}
+
+/*! \private
+* @brief Compute the digest identifying a COSE_Key
+*
+* The key type and the parameters -1 to -3 are digested, which covers the
+* secret of a symmetric key and the curve and coordinates of an EC or OKP
+* key.  The private value -4 is only digested when the map has no x
+* coordinate, so a key pair and its public half give the same digest.
+*
+* @param pKey COSE_Key map
+* @param rgbId buffer of 32 bytes to return the digest in
+* @return false if the key cannot be described
+*/
+
+static bool KeyCache_KeyId(const cn_cbor * pKey, byte * rgbId)
+{
+	static const int rgLabels[] = { COSE_Key_Type, -1, -2, -3, -4 };
+	bool fPublic;
+	const byte * rgpb[2 * 5];
+	size_t rgcb[2 * 5];
+	byte rgbHeader[5][2 + 8];
+	const cn_cbor * cn;
+	int c = 0;
+	int i;
+	int ib;
+	size_t u;
+
+	if ((pKey == NULL) || (pKey->type != CN_CBOR_MAP)) return false;
+	fPublic = cn_cbor_mapget_int(pKey, -2) != NULL;
+
+	for (i = 0; i < 5; i++) {
+		if (fPublic && (rgLabels[i] == -4)) continue;
+		cn = cn_cbor_mapget_int(pKey, rgLabels[i]);
+		if (cn == NULL) continue;
+
+		rgbHeader[i][0] = (byte) i;
+		rgbHeader[i][1] = (byte) cn->type;
+		switch (cn->type) {
+		case CN_CBOR_BYTES:
+		case CN_CBOR_TEXT:
+		case CN_CBOR_UINT:
+		case CN_CBOR_INT:
+			u = ((cn->type == CN_CBOR_BYTES) || (cn->type == CN_CBOR_TEXT)) ? (size_t) cn->length : (size_t) cn->v.uint;
+			for (ib = 0; ib < 8; ib++, u >>= 8) rgbHeader[i][2 + ib] = (byte) u;
+			break;
+
+		case CN_CBOR_TRUE:
+		case CN_CBOR_FALSE:
+			memset(&rgbHeader[i][2], 0, 8);
+			break;
+
+		default:
+			return false;
+		}
+
+		rgpb[c] = rgbHeader[i];
+		rgcb[c] = sizeof(rgbHeader[i]);
+		c += 1;
+		if ((cn->type == CN_CBOR_BYTES) || (cn->type == CN_CBOR_TEXT)) {
+			rgpb[c] = cn->v.bytes;
+			rgcb[c] = cn->length;
+			c += 1;
+		}
+	}
+
+	return sha256_digest(c, rgpb, rgcb, rgbId);
+}
+
+/*! \private
+* @brief Compute the identity of a key derivation for the cache
+*
+* @param pKeyPrivate own private key, or the shared key for direct HKDF
+* @param pKeyPeer static key of the other party, NULL for direct HKDF
+* @param fHMAC HKDF with HMAC rather than with AES
+* @param cbitHash size of the hash or of the AES key used by the KDF
+* @param pbSalt salt from the message, NULL if there is none
+* @param cbSalt size of the salt
+* @param pbContext encoded COSE_KDF_Context
+* @param cbContext size of the context
+* @param pId location to return the identity
+* @return false if the cache is off or the derivation cannot be cached
+*/
+
+bool _COSE_KeyCache_Id(const cn_cbor * pKeyPrivate, const cn_cbor * pKeyPeer, bool fHMAC, size_t cbitHash, const byte * pbSalt, size_t cbSalt, const byte * pbContext, size_t cbContext, COSE_KeyCacheId * pId)
+{
+	const byte * rgpb[5];
+	size_t rgcb[5];
+	byte rgbKdf[2];
+	size_t cEntries;
+	int c = 0;
+
+	//  Only a hint, the lookup and the insert check again under the lock
+
+	KEYCACHE_LOCK();
+	cEntries = CKeyCacheEntries;
+	KEYCACHE_UNLOCK();
+	if (cEntries == 0) return false;
+
+	if (!KeyCache_KeyId(pKeyPrivate, pId->m_rgbPrivate)) return false;
+	if (pKeyPeer == NULL) memset(pId->m_rgbPeer, 0, sizeof(pId->m_rgbPeer));
+	else if (!KeyCache_KeyId(pKeyPeer, pId->m_rgbPeer)) return false;
+
+	//  The result algorithm and key size are part of the context.  The KDF
+	//  bytes also say if there is a salt, so an empty salt and no salt
+	//  give different digests.
+
+	rgbKdf[0] = (byte) ((fHMAC ? 1 : 0) | ((pbSalt != NULL) ? 2 : 0));
+	rgbKdf[1] = (byte) (cbitHash / 8);
+
+	rgpb[c] = pId->m_rgbPrivate;
+	rgcb[c++] = sizeof(pId->m_rgbPrivate);
+	rgpb[c] = pId->m_rgbPeer;
+	rgcb[c++] = sizeof(pId->m_rgbPeer);
+	rgpb[c] = rgbKdf;
+	rgcb[c++] = sizeof(rgbKdf);
+	if (pbSalt != NULL) {
+		rgpb[c] = pbSalt;
+		rgcb[c++] = cbSalt;
+	}
+	rgpb[c] = pbContext;
+	rgcb[c++] = cbContext;
+
+	return sha256_digest(c, rgpb, rgcb, pId->m_rgbDigest);
+}
+
+/*! \private
+* @brief Look for a derived key in the cache
+*
+* @param pId identity of the derivation
+* @param pbKey buffer to return the key in
+* @param cbKey size of the key wanted
+* @return true if the key was found
+*/
+
+bool _COSE_KeyCache_Find(const COSE_KeyCacheId * pId, byte * pbKey, size_t cbKey)
+{
+	int i;
+	bool f = false;
+
+	KEYCACHE_LOCK();
+
+	if (CKeyCacheEntries != 0) {
+		i = KeyCache_Lookup(pId->m_rgbDigest);
+		if ((i != KEYCACHE_NONE) && (RgKeyCache[i].m_cbKey == cbKey)) {
+			memcpy(pbKey, RgKeyCache[i].m_rgbKey, cbKey);
+			KeyCache_Unlink(i);
+			KeyCache_LinkFirst(i);
+			f = true;
+		}
+		if (f) KeyCacheStats.cHits += 1;
+		else KeyCacheStats.cMisses += 1;
+	}
+
+	KEYCACHE_UNLOCK();
+	return f;
+}
+
+/*! \private
+* @brief Add a derived key to the cache
+*
+* The least recently used key is dropped if the cache is full.
+*
+* @param pId identity of the derivation
+* @param pbKey derived key
+* @param cbKey size of the key
+*/
+
+void _COSE_KeyCache_Add(const COSE_KeyCacheId * pId, const byte * pbKey, size_t cbKey)
+{
+	int i;
+	size_t iBucket;
+
+	if (cbKey > KEYCACHE_KEY_MAX) return;
+
+	KEYCACHE_LOCK();
+
+	if (CKeyCacheEntries != 0) {
+		i = KeyCache_Lookup(pId->m_rgbDigest);
+		if (i != KEYCACHE_NONE) KeyCache_Remove(i);
+
+		if (IKeyCacheFree == KEYCACHE_NONE) {
+			KeyCache_Remove(IKeyCacheLast);
+			KeyCacheStats.cEvictions += 1;
+		}
+
+		i = IKeyCacheFree;
+		IKeyCacheFree = RgKeyCache[i].m_iNext;
+
+		RgKeyCache[i].m_id = *pId;
+		RgKeyCache[i].m_cbKey = cbKey;
+		memcpy(RgKeyCache[i].m_rgbKey, pbKey, cbKey);
+
+		iBucket = KeyCache_Bucket(pId->m_rgbDigest);
+		RgKeyCache[i].m_iChain = RgKeyCacheBuckets[iBucket];
+		RgKeyCacheBuckets[iBucket] = i;
+		KeyCache_LinkFirst(i);
+
+		KeyCacheStats.cEntries += 1;
+	}
+
+	KEYCACHE_UNLOCK();
+}
+
+/*!
+* @brief Set the number of derived keys the cache holds
+*
+* Every key held by the cache is dropped.  A size of zero turns the cache
+* off and frees its memory.
+*
+* @param cEntries number of keys to hold
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeyCache_SetSize(size_t cEntries, cose_errback * perr)
+{
+	KeyCacheEntry * rgNew = NULL;
+	int * rgBuckets = NULL;
+	size_t cBuckets = 1;
+
+	CHECK_CONDITION(cEntries <= KEYCACHE_MAX_ENTRIES, COSE_ERR_INVALID_PARAMETER);
+
+	if (cEntries != 0) {
+		while (cBuckets < cEntries) cBuckets *= 2;
+
+		rgNew = (KeyCacheEntry *)calloc(cEntries, sizeof(KeyCacheEntry));
+		rgBuckets = (int *)calloc(cBuckets, sizeof(int));
+		CHECK_CONDITION((rgNew != NULL) && (rgBuckets != NULL), COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	KEYCACHE_LOCK();
+
+	if (RgKeyCache != NULL) {
+		KeyCache_Wipe(RgKeyCache, CKeyCacheEntries * sizeof(KeyCacheEntry));
+		free(RgKeyCache);
+		free(RgKeyCacheBuckets);
+	}
+
+	RgKeyCache = rgNew;
+	RgKeyCacheBuckets = rgBuckets;
+	CKeyCacheEntries = cEntries;
+	CKeyCacheBuckets = (cEntries != 0) ? cBuckets : 0;
+	KeyCache_Reset();
+
+	KEYCACHE_UNLOCK();
+	return true;
+
+errorReturn:
+	if (rgNew != NULL) free(rgNew);
+	if (rgBuckets != NULL) free(rgBuckets);
+	return false;
+}
+
+/*!
+* @brief Drop every key which was derived using a key
+*
+* Call this when a key is revoked or replaced.  Either party's key may be
+* given, only the public parameters of the key are compared, not its kid,
+* so the public half of a key pair drops the keys derived with the pair.
+*
+* @param pcborKey COSE_Key map of the key
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeyCache_Invalidate(const cn_cbor * pcborKey, cose_errback * perr)
+{
+	byte rgbId[256 / 8];
+	size_t i;
+
+	CHECK_CONDITION(pcborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(KeyCache_KeyId(pcborKey, rgbId), COSE_ERR_INVALID_PARAMETER);
+
+	KEYCACHE_LOCK();
+
+	for (i = 0; i < CKeyCacheEntries; i++) {
+		if (RgKeyCache[i].m_cbKey == 0) continue;
+		if ((memcmp(RgKeyCache[i].m_id.m_rgbPrivate, rgbId, sizeof(rgbId)) == 0) ||
+			(memcmp(RgKeyCache[i].m_id.m_rgbPeer, rgbId, sizeof(rgbId)) == 0)) {
+			KeyCache_Remove((int) i);
+			KeyCacheStats.cInvalidated += 1;
+		}
+	}
+
+	KEYCACHE_UNLOCK();
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Drop and wipe every key held by the cache
+*
+* The size of the cache and the counters are not changed.
+*/
+
+void COSE_KeyCache_Clear()
+{
+	KEYCACHE_LOCK();
+	if (CKeyCacheEntries != 0) KeyCache_Reset();
+	KEYCACHE_UNLOCK();
+}
+
+/*!
+* @brief Get the statistics for the derived key cache
+*
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeyCache_GetStats(COSE_KEYCACHE_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	KEYCACHE_LOCK();
+	*pStats = KeyCacheStats;
+	KEYCACHE_UNLOCK();
+	return true;
+
+errorReturn:
+	return false;
+}
@@ -0,0 +1,417 @@
+/** \file KeySet.c
+* Contains the implementation of key sets.
+*
+* A key set holds the keys a receiver owns, indexed by their key identifier.
+* When an Enveloped or MAC message is processed with a key set, the kid
+* header of each recipient is looked up in the index and only recipients
+* addressed to one of the receiver's keys are processed.  A message sent to
+* a large group then costs one key agreement or key unwrap rather than one
+* for every recipient ahead of the receiver's own.
+*
+* Keys which are not held by the set can be supplied by a resolver which the
+* application registers on the set.  It is called with the kid of each
+* recipient which is not found in the index.
+*
+* Trying every key against every recipient is only done if the set was
+* created with COSE_KEYSET_TRIAL, and only after the lookup by kid has found
+* nothing.
+*
+* The COSE_Key maps are referenced, not copied, and must stay valid for the
+* life of the set.  A set is not changed by processing a message and can be
+* used by more than one thread at a time once all of its keys are added.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#define KEYSET_BUCKETS_MIN 16
+
+typedef struct _KeySetEntry {
+	COSE_KEY m_key;
+	const byte * m_pbKid;		//  Points into the COSE_Key map, NULL if the key has no kid
+	size_t m_cbKid;
+	size_t m_hash;
+	struct _KeySetEntry * m_bucketNext;
+	struct _KeySetEntry * m_entryNext;	//  All keys in the order they were added
+} KeySetEntry;
+
+struct _cose_keyset {
+	int m_flags;
+	KeySetEntry ** m_rgBuckets;	//  Keys with a kid, chained by m_bucketNext
+	size_t m_cBuckets;			//  Always a power of two
+	size_t m_cKids;
+	KeySetEntry * m_entryFirst;
+	KeySetEntry * m_entryLast;
+	COSE_KEY_RESOLVER m_pfnResolver;
+	void * m_pResolverContext;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context m_allocContext;
+#endif
+};
+
+static size_t KeySet_Hash(const byte * pb, size_t cb)
+{
+	size_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < cb; i++) {
+		h ^= pb[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static bool KeySet_KidMatch(const KeySetEntry * pEntry, const byte * pbKid, size_t cbKid)
+{
+	return (pEntry->m_pbKid != NULL) && (pEntry->m_cbKid == cbKid) && (memcmp(pEntry->m_pbKid, pbKid, cbKid) == 0);
+}
+
+/*! \private
+* @brief Double the number of hash buckets once there are more kids than buckets
+*
+* @param pSet  Key set to grow
+* @return false if memory could not be allocated
+*/
+
+static bool KeySet_Grow(COSE_KeySet * pSet)
+{
+	KeySetEntry ** rgNew;
+	KeySetEntry * pEntry;
+	size_t cNew = pSet->m_cBuckets * 2;
+	size_t i;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSet->m_allocContext;
+#endif
+
+	if (cNew < KEYSET_BUCKETS_MIN) cNew = KEYSET_BUCKETS_MIN;
+
+	rgNew = (KeySetEntry **)COSE_CALLOC(cNew, sizeof(KeySetEntry *), context);
+	if (rgNew == NULL) return false;
+
+	for (pEntry = pSet->m_entryFirst; pEntry != NULL; pEntry = pEntry->m_entryNext) {
+		if (pEntry->m_pbKid == NULL) continue;
+		i = pEntry->m_hash & (cNew - 1);
+		pEntry->m_bucketNext = rgNew[i];
+		rgNew[i] = pEntry;
+	}
+
+	if (pSet->m_rgBuckets != NULL) COSE_FREE(pSet->m_rgBuckets, context);
+	pSet->m_rgBuckets = rgNew;
+	pSet->m_cBuckets = cNew;
+
+	return true;
+}
+
+/*! \private
+* @brief Add a key object to the set
+*
+* @param pSet  Key set to add to
+* @param pKey  Key object, copied into the set
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+static bool KeySet_Add(COSE_KeySet * pSet, const COSE_KEY * pKey, cose_errback * perr)
+{
+	KeySetEntry * pEntry = NULL;
+	const cn_cbor * cn;
+	size_t i;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSet->m_allocContext;
+#endif
+
+	cn = cn_cbor_mapget_int(pKey->m_cborKey, COSE_Key_ID);
+	CHECK_CONDITION((cn == NULL) || (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+
+	if ((cn != NULL) && (pSet->m_cKids + 1 > pSet->m_cBuckets)) {
+		CHECK_CONDITION(KeySet_Grow(pSet), COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	pEntry = (KeySetEntry *)COSE_CALLOC(1, sizeof(KeySetEntry), context);
+	CHECK_CONDITION(pEntry != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	pEntry->m_key = *pKey;
+	if (cn != NULL) {
+		pEntry->m_pbKid = cn->v.bytes;
+		pEntry->m_cbKid = cn->length;
+		pEntry->m_hash = KeySet_Hash(cn->v.bytes, cn->length);
+
+		i = pEntry->m_hash & (pSet->m_cBuckets - 1);
+		pEntry->m_bucketNext = pSet->m_rgBuckets[i];
+		pSet->m_rgBuckets[i] = pEntry;
+		pSet->m_cKids += 1;
+	}
+
+	if (pSet->m_entryLast == NULL) pSet->m_entryFirst = pEntry;
+	else pSet->m_entryLast->m_entryNext = pEntry;
+	pSet->m_entryLast = pEntry;
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*! \private
+* @brief Check that a key set handle refers to a live key set
+*
+* @param h  Handle to be validated
+* @return result of the check
+*/
+
+bool IsValidKeySetHandle(HCOSE_KEYSET h)
+{
+	return _COSE_Handle_IsValid(COSE_HANDLE_KEYSET, (const COSE *)h);
+}
+
+/*!
+* @brief Create an empty key set
+*
+* @param flags  COSE_KEYSET_TRIAL to try every key against every recipient
+*               when no recipient is found by kid
+* @param context  Allocation context, may be NULL
+* @param perr  Location to return errors
+* @return handle to the key set or NULL on failure
+*/
+
+HCOSE_KEYSET COSE_KeySet_Init(COSE_KEYSET_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	COSE_KeySet * pSet = NULL;
+
+	CHECK_CONDITION((flags & ~COSE_KEYSET_TRIAL) == 0, COSE_ERR_INVALID_PARAMETER);
+
+	pSet = (COSE_KeySet *)COSE_CALLOC(1, sizeof(COSE_KeySet), context);
+	CHECK_CONDITION(pSet != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+#ifdef USE_CBOR_CONTEXT
+	if (context != NULL) pSet->m_allocContext = *context;
+#endif
+	pSet->m_flags = flags;
+
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_KEYSET, (COSE *)pSet CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
+
+	return (HCOSE_KEYSET)pSet;
+
+errorReturn:
+	if (pSet != NULL) COSE_FREE(pSet, context);
+	return NULL;
+}
+
+/*!
+* @brief Free a key set
+*
+* The key objects and COSE_Key maps which were added to the set are not
+* freed.
+*
+* @param h  Handle of the key set
+* @return result of the operation
+*/
+
+bool COSE_KeySet_Free(HCOSE_KEYSET h)
+{
+	COSE_KeySet * pSet = (COSE_KeySet *)h;
+	KeySetEntry * pEntry;
+	KeySetEntry * pEntryNext;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context context;
+#endif
+
+	if (!IsValidKeySetHandle(h)) return false;
+	_COSE_Handle_Remove(COSE_HANDLE_KEYSET, (COSE *)pSet);
+
+#ifdef USE_CBOR_CONTEXT
+	context = pSet->m_allocContext;
+#endif
+
+	for (pEntry = pSet->m_entryFirst; pEntry != NULL; pEntry = pEntryNext) {
+		pEntryNext = pEntry->m_entryNext;
+		COSE_FREE(pEntry, &context);
+	}
+	if (pSet->m_rgBuckets != NULL) COSE_FREE(pSet->m_rgBuckets, &context);
+	COSE_FREE(pSet, &context);
+
+	return true;
+}
+
+/*!
+* @brief Add a key to a key set
+*
+* The key is indexed by its kid (label 2).  A key without a kid is only
+* used when the set was created with COSE_KEYSET_TRIAL.
+*
+* @param h  Handle of the key set
+* @param pKey  COSE_Key map, must remain valid until the key set is freed
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeySet_AddKey(HCOSE_KEYSET h, const cn_cbor * pKey, cose_errback * perr)
+{
+	COSE_KEY key;
+
+	CHECK_CONDITION(IsValidKeySetHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(pKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	_COSE_KEY_Wrap(&key, pKey);
+	return KeySet_Add((COSE_KeySet *)h, &key, perr);
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Add a key object to a key set
+*
+* EC keys held by the key object are not parsed again for each message.
+* The key object must not be freed before the key set.
+*
+* @param h  Handle of the key set
+* @param hKey  Handle of the key object
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeySet_AddKey2(HCOSE_KEYSET h, HCOSE_KEY hKey, cose_errback * perr)
+{
+	CHECK_CONDITION(IsValidKeySetHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	return KeySet_Add((COSE_KeySet *)h, (COSE_KEY *)hKey, perr);
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Set the function which supplies keys not held by a key set
+*
+* The resolver is called with the kid of a recipient which was not found
+* in the set.  It returns the COSE_Key map for the kid or NULL if it does
+* not know the kid.  The map must stay valid until the message has been
+* processed.  The resolver may be called from more than one thread at a
+* time if the set is shared.
+*
+* @param h  Handle of the key set
+* @param pfnResolver  Resolver function, NULL to remove it
+* @param pContext  Passed to the resolver function
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_KeySet_SetResolver(HCOSE_KEYSET h, COSE_KEY_RESOLVER pfnResolver, void * pContext, cose_errback * perr)
+{
+	COSE_KeySet * pSet = (COSE_KeySet *)h;
+
+	CHECK_CONDITION(IsValidKeySetHandle(h), COSE_ERR_INVALID_HANDLE);
+
+	pSet->m_pfnResolver = pfnResolver;
+	pSet->m_pResolverContext = pContext;
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*! \private
+* @brief Decrypt a recipient with a key from the set
+*
+* The key given to the recipient by the application is put back afterwards.
+*
+* @return true if the recipient was decrypted
+*/
+
+static bool KeySet_Try(COSE_RecipientInfo * pRecip, const COSE_KEY * pKey, int alg, int cbitKey, byte * pbKey, cose_errback * perr)
+{
+	COSE_KEY keySave = pRecip->m_key;
+	bool f;
+
+	pRecip->m_key = *pKey;
+	f = _COSE_Recipient_decrypt(pRecip, NULL, alg, cbitKey, pbKey, perr);
+	pRecip->m_key = keySave;
+
+	return f;
+}
+
+/*! \private
+* @brief Get the kid header of a recipient
+*
+* @return the kid or NULL if the recipient does not have one
+*/
+
+static const cn_cbor * KeySet_RecipientKid(COSE_RecipientInfo * pRecip)
+{
+	const cn_cbor * cn = _COSE_map_get_int(&pRecip->m_encrypt.m_message, COSE_Header_KID, COSE_BOTH, NULL);
+
+	if ((cn == NULL) || (cn->type != CN_CBOR_BYTES)) return NULL;
+	return cn;
+}
+
+/*! \private
+* @brief Find the recipient of a message addressed to a key in the set and obtain the key from it
+*
+* Recipients are matched by kid against the set and then the resolver.
+* Only when no match could be decrypted, and the set was created with
+* COSE_KEYSET_TRIAL, is every key in the set tried against every recipient.
+*
+* @param pSet  Key set of the receiver
+* @param pRecipFirst  First recipient of the message
+* @param alg  Algorithm of the message
+* @param cbitKey  Size of the key to obtain
+* @param pbKey  Location to return the key
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool _COSE_KeySet_Recipient_decrypt(const COSE_KeySet * pSet, COSE_RecipientInfo * pRecipFirst, int alg, int cbitKey, byte * pbKey, cose_errback * perr)
+{
+	COSE_RecipientInfo * pRecip;
+	const KeySetEntry * pEntry;
+	const cn_cbor * cnKid;
+	const cn_cbor * pcborKey;
+	COSE_KEY key;
+	size_t hash;
+	bool fFound;
+
+	for (pRecip = pRecipFirst; pRecip != NULL; pRecip = pRecip->m_recipientNext) {
+		cnKid = KeySet_RecipientKid(pRecip);
+		if (cnKid == NULL) continue;
+
+		fFound = false;
+		if (pSet->m_cKids != 0) {
+			hash = KeySet_Hash(cnKid->v.bytes, cnKid->length);
+			for (pEntry = pSet->m_rgBuckets[hash & (pSet->m_cBuckets - 1)]; pEntry != NULL; pEntry = pEntry->m_bucketNext) {
+				if ((pEntry->m_hash != hash) || !KeySet_KidMatch(pEntry, cnKid->v.bytes, cnKid->length)) continue;
+				fFound = true;
+				if (KeySet_Try(pRecip, &pEntry->m_key, alg, cbitKey, pbKey, perr)) return true;
+			}
+		}
+
+		if (!fFound && (pSet->m_pfnResolver != NULL)) {
+			pcborKey = pSet->m_pfnResolver(cnKid->v.bytes, cnKid->length, pSet->m_pResolverContext);
+			if (pcborKey != NULL) {
+				_COSE_KEY_Wrap(&key, pcborKey);
+				if (KeySet_Try(pRecip, &key, alg, cbitKey, pbKey, perr)) return true;
+			}
+		}
+	}
+
+	if (pSet->m_flags & COSE_KEYSET_TRIAL) {
+		for (pRecip = pRecipFirst; pRecip != NULL; pRecip = pRecip->m_recipientNext) {
+			cnKid = KeySet_RecipientKid(pRecip);
+			for (pEntry = pSet->m_entryFirst; pEntry != NULL; pEntry = pEntry->m_entryNext) {
+				//  Already tried by kid
+				if ((cnKid != NULL) && KeySet_KidMatch(pEntry, cnKid->v.bytes, cnKid->length)) continue;
+				if (KeySet_Try(pRecip, &pEntry->m_key, alg, cbitKey, pbKey, perr)) return true;
+			}
+		}
+	}
+
+	FAIL_CONDITION(COSE_ERR_NO_RECIPIENT_FOUND);
+
+errorReturn:
+	return false;
+}
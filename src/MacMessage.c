@@ -13,19 +13,17 @@
 #include "configure.h"
 #include "crypto.h"
 
-byte RgbDontUse2[8 * 1024];   //  Remove this array when we can compute the size of a cbor serialization without this hack.
-
-COSE * MacRoot = NULL;
 
 /*! \private
 * @brief Test if a HCOSE_MAC handle is valid
 *
 *  Internal function to test if a MAC message handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -34,7 +32,7 @@ COSE * MacRoot = NULL;
 bool IsValidMacHandle(HCOSE_MAC h)
 {
 	COSE_MacMessage * p = (COSE_MacMessage *)h;
-	return _COSE_IsInList(MacRoot, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_MAC, (COSE *) p);
 }
 
 
@@ -44,21 +42,21 @@ HCOSE_MAC COSE_Mac_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback *
 
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
 
-	pobj = (COSE_MacMessage *)COSE_CALLOC(1, sizeof(COSE_MacMessage), context);
+	pobj = (COSE_MacMessage *)COSE_POOL_CALLOC(COSE_POOL_MAC, sizeof(COSE_MacMessage), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags, &pobj->m_message, COSE_mac_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		goto errorReturn;
 	}
 
-	_COSE_InsertInList(&MacRoot, &pobj->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_MAC, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return (HCOSE_MAC)pobj;
 
 errorReturn:
 	if (pobj != NULL) {
 		_COSE_Mac_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_MAC, pobj, context);
 	}
 	return NULL;
 }
@@ -71,14 +69,14 @@ HCOSE_MAC _COSE_Mac_Init_From_Object(cn_cbor * cbor, COSE_MacMessage * pIn, CBOR
 	cose_errback error = { COSE_ERR_NONE };
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_MacMessage *)COSE_CALLOC(1, sizeof(COSE_MacMessage), context);
+	if (pobj == NULL) pobj = (COSE_MacMessage *)COSE_POOL_CALLOC(COSE_POOL_MAC, sizeof(COSE_MacMessage), context);
 	if (pobj == NULL) {
 		perr->err = COSE_ERR_OUT_OF_MEMORY;
 	errorReturn:
 		if (pobj != NULL) {
 			_COSE_Mac_Release(pobj);
 			if (pIn == NULL) {
-				COSE_FREE(pobj, context);
+				COSE_POOL_FREE(COSE_POOL_MAC, pobj, context);
 			}
 		}
 		return NULL;
@@ -103,7 +101,7 @@ HCOSE_MAC _COSE_Mac_Init_From_Object(cn_cbor * cbor, COSE_MacMessage * pIn, CBOR
 		}
 	}
 
-	_COSE_InsertInList(&MacRoot, &pobj->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_MAC, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_MAC)pobj;
 }
@@ -122,7 +120,7 @@ bool COSE_Mac_Free(HCOSE_MAC h)
 		return true;
 	}
 
-	_COSE_RemoveFromList(&MacRoot, &p->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_MAC, &p->m_message);
 
 #ifdef USE_CBOR_CONTEXT
 	context = ((COSE_MacMessage *)h)->m_message.m_allocContext;
@@ -130,7 +128,7 @@ bool COSE_Mac_Free(HCOSE_MAC h)
 
 	_COSE_Mac_Release((COSE_MacMessage *)h);
 
-	COSE_FREE((COSE_MacMessage *)h, &context);
+	COSE_POOL_FREE(COSE_POOL_MAC, (COSE_MacMessage *)h, &context);
 
 	return true;
 }
@@ -150,6 +148,18 @@ bool _COSE_Mac_Release(COSE_MacMessage * p)
 	return true;
 }
 
+/*!
+* @brief Set the content to be MACed
+*
+* The content is not copied, the message references the application buffer.
+* It must stay valid and unchanged until the message handle has been freed.
+*
+* @param cose  Handle to the MAC message
+* @param rgbContent  Content to be MACed
+* @param cbContent  Size of the content
+* @param perr  Location to return errors
+* @return result of the operation
+*/
 
 bool COSE_Mac_SetContent(HCOSE_MAC cose, const byte * rgbContent, size_t cbContent, cose_errback * perr)
 {
@@ -225,97 +235,51 @@ bool COSE_Mac_map_put_int(HCOSE_MAC h, int key, cn_cbor * value, int flags, cose
 
 bool _COSE_Mac_Build_AAD(COSE * pCose, char * szContext, byte ** ppbAuthData, size_t * pcbAuthData, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
-	cn_cbor * pAuthData = NULL;
-	bool fRet = false;
-	cn_cbor_errback cbor_error;
-	cn_cbor * ptmp = NULL;
-	cn_cbor * pcn;
-	size_t cbAuthData;
-	byte * pbAuthData = NULL;
+	cn_cbor * pcnProtected;
+	cn_cbor * pcnBody;
 
 	//  Build authenticated data
 	//  Protected headers
 	//  external data
 	//  body
 
-	pAuthData = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA NULL);
-	CHECK_CONDITION(pAuthData != NULL, COSE_ERR_OUT_OF_MEMORY);
-
-	//  Add the context string
-
-	ptmp = cn_cbor_string_create(szContext, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
-
-	// Add the protected attributes
-
-	pcn = _COSE_arrayget_int(pCose, INDEX_PROTECTED);
-	CHECK_CONDITION((pcn != NULL) && (pcn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
-
-	if ((pcn->length == 1) && (pcn->v.bytes[0] == 0xa0)) {
-		ptmp = cn_cbor_data_create(NULL, 0, CBOR_CONTEXT_PARAM_COMMA NULL);
-	}
-	else {
-		ptmp = cn_cbor_data_create(pcn->v.bytes, (int)pcn->length, CBOR_CONTEXT_PARAM_COMMA NULL);
-	}
-	CHECK_CONDITION(ptmp != NULL, COSE_ERR_CBOR);
-
-	CHECK_CONDITION(cn_cbor_array_append(pAuthData, ptmp, NULL), COSE_ERR_CBOR);
-	ptmp = NULL;
-
-	//  Add the external bytes
+	pcnProtected = _COSE_arrayget_int(pCose, INDEX_PROTECTED);
+	CHECK_CONDITION((pcnProtected != NULL) && (pcnProtected->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 
-	ptmp = cn_cbor_data_create(pCose->m_pbExternal, (int) pCose->m_cbExternal, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
-
-	//  Add the content
-	pcn = _COSE_arrayget_int(pCose, INDEX_BODY);
-	ptmp = cn_cbor_data_create(pcn->v.bytes, (int)pcn->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(ptmp != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pAuthData, ptmp, &cbor_error), cbor_error);
-	ptmp = NULL;
+	pcnBody = _COSE_arrayget_int(pCose, INDEX_BODY);
+	CHECK_CONDITION(pcnBody != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	//  Turn it into bytes
-	cbAuthData = cn_cbor_encoder_write(RgbDontUse2, 0, sizeof(RgbDontUse2), pAuthData);
-	CHECK_CONDITION(cbAuthData > 0, COSE_ERR_CBOR);
-	pbAuthData = (byte *)COSE_CALLOC(cbAuthData, 1, context);
-	CHECK_CONDITION(pbAuthData != NULL, COSE_ERR_OUT_OF_MEMORY);
-	CHECK_CONDITION(cn_cbor_encoder_write(pbAuthData, 0, cbAuthData, pAuthData) == cbAuthData, COSE_ERR_CBOR);
-
-	*ppbAuthData = pbAuthData;
-	*pcbAuthData = cbAuthData;
-	pbAuthData = NULL;
-	fRet = true;
+	return _COSE_Structure_Build(szContext, pcnProtected, NULL, pCose->m_pbExternal, pCose->m_cbExternal, pcnBody, false, ppbAuthData, pcbAuthData, CBOR_CONTEXT_PARAM_COMMA perr);
 
 errorReturn:
-	if (pbAuthData != NULL) COSE_FREE(pbAuthData, context);
-	if (pAuthData != NULL) CN_CBOR_FREE(pAuthData, context);
-	if (ptmp != NULL) CN_CBOR_FREE(ptmp, context);
-	return fRet;
+	return false;
 }
 
 bool COSE_Mac_encrypt(HCOSE_MAC h, cose_errback * perr)
 {
 	COSE_MacMessage * pcose = (COSE_MacMessage *)h;
+	bool f;
+	int iStats;
 
 	CHECK_CONDITION(IsValidMacHandle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_PARAMETER);
 
-		return _COSE_Mac_compute(pcose, NULL, 0, "MAC", perr);
+		iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC);
+		f = _COSE_Mac_compute(pcose, NULL, 0, NULL, "MAC", perr);
+		_COSE_Stats_Leave(iStats);
+		return f;
 
 	errorReturn:
 		return false;
 }
 
-bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr)
+bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, cose_errback * perr)
 {
 	int alg;
 	int t;
 	COSE_RecipientInfo * pri;
 	const cn_cbor * cn_Alg = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 	byte * pbAuthData = NULL;
 	size_t cbitKey;
 #ifdef USE_CBOR_CONTEXT
@@ -332,6 +296,7 @@ bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbK
 	CHECK_CONDITION(((cn_Alg->type == CN_CBOR_UINT || cn_Alg->type == CN_CBOR_INT)), COSE_ERR_INVALID_PARAMETER);
 
 	alg = (int) cn_Alg->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
 
 	//  Get the key size
 
@@ -392,6 +357,7 @@ bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbK
 
 	if (pbKeyIn != NULL) {
 		CHECK_CONDITION(cbKeyIn == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION((pKeyIn == NULL) || (pKeyIn->m_alg == alg), COSE_ERR_INVALID_PARAMETER);
 		pbKey = pbKeyIn;
 		cbKey = cbKeyIn;
 	}
@@ -417,7 +383,7 @@ bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbK
 			CHECK_CONDITION(pbKey != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 			cbKey = cbitKey / 8;
-			rand_bytes(pbKey, cbKey);
+			CHECK_CONDITION(_COSE_Random(pbKey, cbKey), COSE_ERR_CRYPTO_FAIL);
 		}
 	}
 
@@ -430,52 +396,57 @@ bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbK
 
 	if (!_COSE_Mac_Build_AAD(&pcose->m_message, szContext, &pbAuthData, &cbAuthData, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
+	pProvider = _COSE_Provider_Get(alg);
+
+	//  A prepared key from another provider is used as raw key bytes
+	if ((pKeyIn != NULL) && (pKeyIn->m_pProvider != pProvider)) pKeyIn = NULL;
+
 	switch (alg) {
 #ifdef USE_AES_CBC_MAC_128_64
 	case COSE_Algorithm_CBC_MAC_128_64:
-		if (!AES_CBC_MAC_Create(pcose, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Create(pcose, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_256_64
 	case COSE_Algorithm_CBC_MAC_256_64:
-		if (!AES_CBC_MAC_Create(pcose, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Create(pcose, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_128_128
 	case COSE_Algorithm_CBC_MAC_128_128:
-		if (!AES_CBC_MAC_Create(pcose, 128, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Create(pcose, 128, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_256_128
 	case COSE_Algorithm_CBC_MAC_256_128:
-		if (!AES_CBC_MAC_Create(pcose, 128, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Create(pcose, 128, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_256_64
 	case COSE_Algorithm_HMAC_256_64:
-		if (!HMAC_Create(pcose, 256, 64, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Create(pcose, 256, 64, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_256_256
 	case COSE_Algorithm_HMAC_256_256:
-		if (!HMAC_Create(pcose, 256, 256, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Create(pcose, 256, 256, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_384_384
 	case COSE_Algorithm_HMAC_384_384:
-		if (!HMAC_Create(pcose, 384, 384, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Create(pcose, 384, 384, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_512_512
 	case COSE_Algorithm_HMAC_512_512:
-		if (!HMAC_Create(pcose, 512, 512, pbKey, cbKey, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Create(pcose, 512, 512, pbKey, cbKey, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
@@ -504,16 +475,53 @@ bool COSE_Mac_validate(HCOSE_MAC h, HCOSE_RECIPIENT hRecip, cose_errback * perr)
 {
 	COSE_MacMessage * pcose = (COSE_MacMessage *)h;
 	COSE_RecipientInfo * pRecip = (COSE_RecipientInfo *)hRecip;
+	bool f;
+	int iStats;
 
 	CHECK_CONDITION(IsValidMacHandle(h) && IsValidRecipientHandle(hRecip), COSE_ERR_INVALID_PARAMETER);
 
-	return _COSE_Mac_validate(pcose, pRecip, NULL, 0, "MAC", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC_VERIFY);
+	f = _COSE_Mac_validate(pcose, pRecip, NULL, NULL, 0, NULL, "MAC", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
 
 errorReturn:
 	return false;
 }
 
-bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr)
+/*!
+* @brief Validate a MAC message with the keys of a key set
+*
+* Only the recipients whose kid is found in the key set, or supplied by its
+* resolver, are processed.  The other recipients are tried only if the key
+* set was created with COSE_KEYSET_TRIAL.
+*
+* @param h  Handle to the MAC message
+* @param hKeys  Key set of the receiver
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Mac_validate_keyset(HCOSE_MAC h, HCOSE_KEYSET hKeys, cose_errback * perr)
+{
+	COSE_MacMessage * pcose = (COSE_MacMessage *)h;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidMacHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeySetHandle(hKeys), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(pcose->m_recipientFirst != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC_VERIFY);
+	f = _COSE_Mac_validate(pcose, NULL, (const COSE_KeySet *)hKeys, NULL, 0, NULL, "MAC", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, const COSE_KeySet * pKeys, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, cose_errback * perr)
 {
 	byte * pbAuthData = NULL;
 	int cbitKey = 0;
@@ -521,6 +529,7 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 
 	int alg;
 	const cn_cbor * cn = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 
 	byte * pbKey = NULL;
 #ifdef USE_CBOR_CONTEXT
@@ -529,6 +538,7 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 	size_t cbAuthData;
 
 	CHECK_CONDITION(!((pRecip != NULL) && (pbKeyIn != NULL)), COSE_ERR_INTERNAL);
+	CHECK_CONDITION(!((pKeys != NULL) && ((pRecip != NULL) || (pbKeyIn != NULL))), COSE_ERR_INTERNAL);
 
 	cn = _COSE_map_get_int(&pcose->m_message, COSE_Header_Algorithm, COSE_BOTH, perr);
 	if (cn == NULL) goto errorReturn;
@@ -540,6 +550,7 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 		CHECK_CONDITION((cn->type == CN_CBOR_UINT || cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 
 		alg = (int)cn->v.uint;
+		_COSE_Stats_SetAlgorithm(alg);
 
 		switch (alg) {
 #ifdef USE_AES_CBC_MAC_128_64
@@ -599,6 +610,7 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 
 	if (pbKeyIn != NULL) {
 		CHECK_CONDITION(cbitKey / 8 == cbKeyIn, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION((pKeyIn == NULL) || (pKeyIn->m_alg == alg), COSE_ERR_INVALID_PARAMETER);
 		pbKey = pbKeyIn;
 	}
 	else {
@@ -623,6 +635,9 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 			}
 			CHECK_CONDITION(pRecipX != NULL, COSE_ERR_NO_RECIPIENT_FOUND);
 		}
+		else if (pKeys != NULL) {
+			if (!_COSE_KeySet_Recipient_decrypt(pKeys, pcose->m_recipientFirst, alg, cbitKey, pbKey, perr)) goto errorReturn;
+		}
 		else {
 			for (pRecip = pcose->m_recipientFirst; pRecip != NULL; pRecip = pRecip->m_recipientNext) {
 				if (_COSE_Recipient_decrypt(pRecip, NULL, alg, cbitKey, pbKey, perr)) break;
@@ -635,52 +650,57 @@ bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, co
 
 	if (!_COSE_Mac_Build_AAD(&pcose->m_message, szContext, &pbAuthData, &cbAuthData, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
+	pProvider = _COSE_Provider_Get(alg);
+
+	//  A prepared key from another provider is used as raw key bytes
+	if ((pKeyIn != NULL) && (pKeyIn->m_pProvider != pProvider)) pKeyIn = NULL;
+
 	switch (alg) {
 #ifdef USE_HMAC_256_256
 	case COSE_Algorithm_HMAC_256_256:
-		if (!HMAC_Validate(pcose, 256, 256, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Validate(pcose, 256, 256, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_256_64
 	case COSE_Algorithm_HMAC_256_64:
-		if (!HMAC_Validate(pcose, 256, 64, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Validate(pcose, 256, 64, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_384_384
 	case COSE_Algorithm_HMAC_384_384:
-		if (!HMAC_Validate(pcose, 384, 384, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Validate(pcose, 384, 384, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_HMAC_512_512
 	case COSE_Algorithm_HMAC_512_512:
-		if (!HMAC_Validate(pcose, 512, 512, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnHMAC_Validate(pcose, 512, 512, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_128_64
 	case COSE_Algorithm_CBC_MAC_128_64:
-		if (!AES_CBC_MAC_Validate(pcose, 64, pbKey, cbitKey / 8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Validate(pcose, 64, pbKey, cbitKey / 8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_256_64
 	case COSE_Algorithm_CBC_MAC_256_64:
-		if (!AES_CBC_MAC_Validate(pcose, 64, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Validate(pcose, 64, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_128_128
 	case COSE_Algorithm_CBC_MAC_128_128:
-		if (!AES_CBC_MAC_Validate(pcose, 128, pbKey, cbitKey / 8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Validate(pcose, 128, pbKey, cbitKey / 8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_AES_CBC_MAC_256_128
 	case COSE_Algorithm_CBC_MAC_256_128:
-		if (!AES_CBC_MAC_Validate(pcose, 128, pbKey, cbitKey/8, pbAuthData, cbAuthData, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_CBC_MAC_Validate(pcose, 128, pbKey, cbitKey/8, pKeyIn, pbAuthData, cbAuthData, perr)) goto errorReturn;
 		break;
 #endif
 
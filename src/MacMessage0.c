@@ -13,17 +13,16 @@
 #include "configure.h"
 #include "crypto.h"
 
-COSE * Mac0Root = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_MAC0 handle is valid
 *
 *  Internal function to test if a MAC0 message handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -32,7 +31,7 @@ COSE * Mac0Root = NULL;
 bool IsValidMac0Handle(HCOSE_MAC0 h)
 {
 	COSE_Mac0Message * p = (COSE_Mac0Message *)h;
-	return _COSE_IsInList(Mac0Root, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_MAC0, (COSE *) p);
 }
 
 HCOSE_MAC0 COSE_Mac0_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
@@ -41,21 +40,21 @@ HCOSE_MAC0 COSE_Mac0_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback
 
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
 
-	pobj = (COSE_Mac0Message *)COSE_CALLOC(1, sizeof(COSE_Mac0Message), context);
+	pobj = (COSE_Mac0Message *)COSE_POOL_CALLOC(COSE_POOL_MAC0, sizeof(COSE_Mac0Message), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags, &pobj->m_message, COSE_mac0_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		goto errorReturn;
 	}
 
-	_COSE_InsertInList(&Mac0Root, &pobj->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_MAC0, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return (HCOSE_MAC0)pobj;
 
 errorReturn:
 	if (pobj != NULL) {
 		_COSE_Mac0_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_MAC0, pobj, context);
 	}
 	return NULL;
 }
@@ -68,14 +67,14 @@ HCOSE_MAC0 _COSE_Mac0_Init_From_Object(cn_cbor * cbor, COSE_Mac0Message * pIn, C
 	cose_errback error = { COSE_ERR_NONE };
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_Mac0Message *)COSE_CALLOC(1, sizeof(COSE_Mac0Message), context);
+	if (pobj == NULL) pobj = (COSE_Mac0Message *)COSE_POOL_CALLOC(COSE_POOL_MAC0, sizeof(COSE_Mac0Message), context);
 	if (pobj == NULL) {
 		perr->err = COSE_ERR_OUT_OF_MEMORY;
 	errorReturn:
 		if (pobj != NULL) {
 			_COSE_Mac0_Release(pobj);
 			if (pIn == NULL) {
-				COSE_FREE(pobj, context);
+				COSE_POOL_FREE(COSE_POOL_MAC0, pobj, context);
 			}
 		}
 		return NULL;
@@ -88,7 +87,7 @@ HCOSE_MAC0 _COSE_Mac0_Init_From_Object(cn_cbor * cbor, COSE_Mac0Message * pIn, C
 	pRecipients = _COSE_arrayget_int(&pobj->m_message, INDEX_MAC_RECIPIENTS);
 	CHECK_CONDITION(pRecipients == NULL, COSE_ERR_INVALID_PARAMETER);
 
-	_COSE_InsertInList(&Mac0Root, &pobj->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_MAC0, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_MAC0)pobj;
 }
@@ -107,7 +106,7 @@ bool COSE_Mac0_Free(HCOSE_MAC0 h)
 		return true;
 	}
 
-	_COSE_RemoveFromList(&Mac0Root, &p->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_MAC0, &p->m_message);
 
 #ifdef USE_CBOR_CONTEXT
 	context = p->m_message.m_allocContext;
@@ -115,7 +114,7 @@ bool COSE_Mac0_Free(HCOSE_MAC0 h)
 
 	_COSE_Mac0_Release(p);
 
-	COSE_FREE(p, &context);
+	COSE_POOL_FREE(COSE_POOL_MAC0, p, &context);
 
 	return true;
 }
@@ -201,11 +200,16 @@ bool COSE_Mac0_map_put_int(HCOSE_MAC0 h, int key, cn_cbor * value, int flags, co
 bool COSE_Mac0_encrypt(HCOSE_MAC0 h, const byte * pbKey, size_t cbKey, cose_errback * perr)
 {
 	COSE_Mac0Message * pcose = (COSE_Mac0Message *)h;
+	bool f;
+	int iStats;
 
 	CHECK_CONDITION(IsValidMac0Handle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pbKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	return _COSE_Mac_compute(pcose, pbKey, cbKey, "MAC0", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC);
+	f = _COSE_Mac_compute(pcose, pbKey, cbKey, NULL, "MAC0", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
 
 errorReturn:
 	return false;
@@ -214,10 +218,76 @@ errorReturn:
 bool COSE_Mac0_validate(HCOSE_MAC0 h, const byte * pbKey, size_t cbKey, cose_errback * perr)
 {
 	COSE_Mac0Message * pcose = (COSE_Mac0Message *)h;
+	bool f;
+	int iStats;
+
 	CHECK_CONDITION(IsValidMac0Handle(h), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(pbKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	return _COSE_Mac_validate(pcose, NULL, pbKey, cbKey, "MAC0", perr);
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC_VERIFY);
+	f = _COSE_Mac_validate(pcose, NULL, NULL, pbKey, cbKey, NULL, "MAC0", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Compute the tag of a MAC0 message with a prepared key
+*
+* The algorithm of the message must be the one the key was prepared for.
+*
+* @param h  Handle to the MAC0 message
+* @param hKey  Prepared key to compute the tag with
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Mac0_encrypt_prepared(HCOSE_MAC0 h, HCOSE_PREPARED_KEY hKey, cose_errback * perr)
+{
+	COSE_Mac0Message * pcose = (COSE_Mac0Message *)h;
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)hKey;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidMac0Handle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidPreparedKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC);
+	f = _COSE_Mac_compute(pcose, pKey->m_rgbKey, pKey->m_cbKey, pKey, "MAC0", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Validate the tag of a MAC0 message with a prepared key
+*
+* The algorithm of the message must be the one the key was prepared for.
+*
+* @param h  Handle to the MAC0 message
+* @param hKey  Prepared key to validate the tag with
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Mac0_validate_prepared(HCOSE_MAC0 h, HCOSE_PREPARED_KEY hKey, cose_errback * perr)
+{
+	COSE_Mac0Message * pcose = (COSE_Mac0Message *)h;
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)hKey;
+	bool f;
+	int iStats;
+
+	CHECK_CONDITION(IsValidMac0Handle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidPreparedKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_MAC_VERIFY);
+	f = _COSE_Mac_validate(pcose, NULL, NULL, pKey->m_rgbKey, pKey->m_cbKey, pKey, "MAC0", perr);
+	_COSE_Stats_Leave(iStats);
+	return f;
 
 errorReturn:
 	return false;
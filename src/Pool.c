@@ -0,0 +1,312 @@
+/** \file Pool.c
+* Contains the per-thread pools used to recycle message, recipient and signer
+* objects and the CBOR nodes which make up their skeletons.
+*
+* Objects which are allocated without an application allocation context are
+* kept on a short free list when they are released and handed out again by
+* the next Init or Decode call on the same thread, so steady state message
+* processing does not go to the heap for them.  Objects allocated from an
+* application context are always given back to that context.
+*
+* The maps, arrays and tag which every message is built on come from a pool
+* of CBOR nodes in the same way.  cn-cbor only takes an allocator through
+* its context, so the nodes are pooled only when USE_CBOR_CONTEXT is set.
+*
+* A thread's pools are given back to the heap when the thread exits.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _MSC_VER
+#define COSE_THREAD_LOCAL __declspec(thread)
+#else
+#define COSE_THREAD_LOCAL __thread
+#endif
+
+#define POOL_MAX_CACHED 32
+
+typedef struct _PoolItem {
+	struct _PoolItem * m_next;
+} PoolItem;
+
+typedef struct {
+	PoolItem * m_first;
+	COSE_POOL_STATS m_stats;
+} Pool;
+
+static COSE_THREAD_LOCAL Pool RgPools[COSE_POOL_MAX];
+static COSE_THREAD_LOCAL bool FPoolThreadHooked = false;
+
+#ifdef USE_CBOR_CONTEXT
+#define POOL_USE_CONTEXT() ((context != NULL) && (context->calloc_func != NULL))
+#else
+#define POOL_USE_CONTEXT() false
+#endif
+
+//  The skeleton of a message is the tag, the array under it and the maps
+//  in the array, nodes deeper than this are freed as before
+
+#define POOL_CBOR_DEPTH 3
+
+/*! \private
+* @brief Give the calling thread's pools back to the heap when it exits
+*
+* A thread exit hook is registered the first time a thread caches an
+* object, a pthread key destructor or a fiber local storage callback on
+* Windows.
+*/
+
+#ifdef _WIN32
+static DWORD PoolFlsIndex = FLS_OUT_OF_INDEXES;
+static INIT_ONCE PoolHookOnce = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI PoolThreadExit(PVOID pv)
+{
+	UNUSED_PARAM(pv);
+	COSE_Pool_Trim();
+}
+
+static BOOL CALLBACK PoolHookInit(PINIT_ONCE pOnce, PVOID pv, PVOID * ppv)
+{
+	UNUSED_PARAM(pOnce);
+	UNUSED_PARAM(pv);
+	UNUSED_PARAM(ppv);
+	PoolFlsIndex = FlsAlloc(PoolThreadExit);
+	return TRUE;
+}
+
+static void PoolHookThread()
+{
+	InitOnceExecuteOnce(&PoolHookOnce, PoolHookInit, NULL, NULL);
+	if (PoolFlsIndex != FLS_OUT_OF_INDEXES) FlsSetValue(PoolFlsIndex, (PVOID) 1);
+	FPoolThreadHooked = true;
+}
+#else
+static pthread_key_t PoolThreadKey;
+static bool FPoolThreadKey = false;
+static pthread_once_t PoolHookOnce = PTHREAD_ONCE_INIT;
+
+static void PoolThreadExit(void * pv)
+{
+	UNUSED_PARAM(pv);
+	COSE_Pool_Trim();
+}
+
+static void PoolHookInit(void)
+{
+	FPoolThreadKey = (pthread_key_create(&PoolThreadKey, PoolThreadExit) == 0);
+}
+
+static void PoolHookThread()
+{
+	pthread_once(&PoolHookOnce, PoolHookInit);
+	if (FPoolThreadKey) pthread_setspecific(PoolThreadKey, (void *) 1);
+	FPoolThreadHooked = true;
+}
+#endif
+
+/*! \private
+* @brief Allocate a zeroed object, from the pool if possible
+*
+* @param type which pool the object belongs to
+* @param cb size of the object, always the same for a given pool
+* @param context application allocation context, may be NULL
+* @return the object or NULL on failure
+*/
+
+void * _COSE_Pool_Calloc(COSE_POOL_TYPE type, size_t cb CBOR_CONTEXT)
+{
+	Pool * pPool = &RgPools[type];
+	PoolItem * pItem;
+
+	if (POOL_USE_CONTEXT()) return COSE_CALLOC(1, cb, context);
+
+	pItem = pPool->m_first;
+	if (pItem != NULL) {
+		pPool->m_first = pItem->m_next;
+		pPool->m_stats.cCached -= 1;
+		pPool->m_stats.cHits += 1;
+		memset(pItem, 0, cb);
+		return pItem;
+	}
+
+	pPool->m_stats.cMisses += 1;
+	return calloc(1, cb);
+}
+
+/*! \private
+* @brief Release an object allocated with _COSE_Pool_Calloc
+*
+* The context is examined before the object is touched, so it may point
+* into the object being released.
+*
+* @param type which pool the object belongs to
+* @param pv object to be released
+* @param context application allocation context, may be NULL
+*/
+
+void _COSE_Pool_Free(COSE_POOL_TYPE type, void * pv CBOR_CONTEXT)
+{
+	Pool * pPool = &RgPools[type];
+	PoolItem * pItem = (PoolItem *)pv;
+
+	if (pv == NULL) return;
+
+	if (POOL_USE_CONTEXT()) {
+		COSE_FREE(pv, context);
+		return;
+	}
+
+	if (pPool->m_stats.cCached >= POOL_MAX_CACHED) {
+		pPool->m_stats.cReleased += 1;
+		free(pv);
+		return;
+	}
+
+	if (!FPoolThreadHooked) PoolHookThread();
+
+	pItem->m_next = pPool->m_first;
+	pPool->m_first = pItem;
+	pPool->m_stats.cCached += 1;
+}
+
+#ifdef USE_CBOR_CONTEXT
+static void * PoolCborCalloc(size_t count, size_t size, void * context)
+{
+	UNUSED_PARAM(context);
+	if (count * size != sizeof(cn_cbor)) return calloc(count, size);
+	return _COSE_Pool_Calloc(COSE_POOL_CBOR, sizeof(cn_cbor), NULL);
+}
+
+static void PoolCborFree(void * pv, void * context)
+{
+	UNUSED_PARAM(context);
+	_COSE_Pool_Free(COSE_POOL_CBOR, pv, NULL);
+}
+
+static cn_cbor_context PoolCborContext = { PoolCborCalloc, PoolCborFree, NULL };
+
+/*! \private
+* @brief Get the allocation context for the skeleton nodes of a message
+*
+* The nodes come from the CBOR node pool unless the message has an
+* application allocation context.  Only pass the result to the cn-cbor
+* functions which create maps, arrays and tags.
+*
+* @param context application allocation context, may be NULL
+* @return context to create the nodes with
+*/
+
+cn_cbor_context * _COSE_Pool_CborContext(cn_cbor_context * context)
+{
+	if (POOL_USE_CONTEXT()) return context;
+	return &PoolCborContext;
+}
+
+/*! \private
+* @brief Free a tree, recycling the nodes of its skeleton
+*
+* Maps, arrays and tags near the top of the tree go back to the CBOR node
+* pool, they own nothing but their children.  Everything else is freed by
+* cn-cbor as before.
+*/
+
+static void PoolCborFreeTree(cn_cbor * cn, int iDepth, cn_cbor_context * context)
+{
+	cn_cbor * pChild;
+	cn_cbor * pNext;
+
+	if ((iDepth >= POOL_CBOR_DEPTH) || (cn->flags & CN_CBOR_FL_EXT_SELF) ||
+		((cn->type != CN_CBOR_MAP) && (cn->type != CN_CBOR_ARRAY) && (cn->type != CN_CBOR_TAG))) {
+		CN_CBOR_FREE(cn, context);
+		return;
+	}
+
+	for (pChild = cn->first_child; pChild != NULL; pChild = pNext) {
+		pNext = pChild->next;
+		pChild->parent = NULL;
+		pChild->next = NULL;
+		PoolCborFreeTree(pChild, iDepth + 1 CBOR_CONTEXT_PARAM);
+	}
+
+	_COSE_Pool_Free(COSE_POOL_CBOR, cn, NULL);
+}
+#endif
+
+/*! \private
+* @brief Free a CBOR tree which has no parent
+*
+* Trees from an application allocation context are freed to that context.
+* Without a context the CBOR allocations are plain heap blocks, so the
+* skeleton nodes can go back to the node pool whichever way they were made.
+*
+* @param cn tree to be freed, may be NULL
+* @param context application allocation context, may be NULL
+*/
+
+void _COSE_Pool_CborFree(cn_cbor * cn CBOR_CONTEXT)
+{
+	if (cn == NULL) return;
+
+#ifdef USE_CBOR_CONTEXT
+	if (!POOL_USE_CONTEXT()) {
+		PoolCborFreeTree(cn, 0 CBOR_CONTEXT_PARAM);
+		return;
+	}
+#endif
+
+	CN_CBOR_FREE(cn, context);
+}
+
+/*!
+* @brief Get the statistics for one of the calling thread's pools
+*
+* @param type which pool to report on
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Pool_GetStats(COSE_POOL_TYPE type, COSE_POOL_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION((type >= 0) && (type < COSE_POOL_MAX), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	*pStats = RgPools[type].m_stats;
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Give the objects cached by the calling thread back to the heap
+*
+* This is done for each thread when it exits, a thread can call it sooner
+* to give the memory back.  The counters are not reset.
+*/
+
+void COSE_Pool_Trim()
+{
+	int i;
+	PoolItem * pItem;
+
+	for (i = 0; i < COSE_POOL_MAX; i++) {
+		while (RgPools[i].m_first != NULL) {
+			pItem = RgPools[i].m_first;
+			RgPools[i].m_first = pItem->m_next;
+			free(pItem);
+		}
+		RgPools[i].m_stats.cCached = 0;
+	}
+}
@@ -0,0 +1,302 @@
+/** \file PreparedKey.c
+* Contains the implementation of prepared content encryption and MAC keys.
+*
+* A prepared key holds a cipher context which has already been keyed for one
+* algorithm, so the key schedule (and for AES-GCM the hash table) is computed
+* once rather than for every message.  Messages processed with the key only
+* load their nonce and authenticated data into the context.
+*
+* For the HMAC algorithms the context has already hashed the inner and
+* outer padded key.  Each message starts from a copy of it, which saves two
+* hash compressions per message.  For the AES CBC-MAC algorithms the block
+* cipher context is keyed once and every message runs through it.
+*
+* The context belongs to the provider of the algorithm when the key is
+* created.  If another provider is registered for the algorithm later the
+* key is used as raw key bytes.
+*
+* The context is modified while a message is processed, so a prepared key
+* must not be used by more than one thread at a time.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+/*! \private
+* @brief Check if an algorithm is one of the HMAC algorithms
+*
+* @param alg  Algorithm to check
+* @return true for an HMAC algorithm
+*/
+
+static bool IsHMAC(int alg)
+{
+	switch (alg) {
+	case COSE_Algorithm_HMAC_256_64:
+	case COSE_Algorithm_HMAC_256_256:
+	case COSE_Algorithm_HMAC_384_384:
+	case COSE_Algorithm_HMAC_512_512:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*! \private
+* @brief Check if an algorithm is one of the AES CBC-MAC algorithms
+*
+* @param alg  Algorithm to check
+* @return true for an AES CBC-MAC algorithm
+*/
+
+static bool IsCBCMAC(int alg)
+{
+	switch (alg) {
+	case COSE_Algorithm_CBC_MAC_128_64:
+	case COSE_Algorithm_CBC_MAC_128_128:
+	case COSE_Algorithm_CBC_MAC_256_64:
+	case COSE_Algorithm_CBC_MAC_256_128:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*! \private
+* @brief Test if a HCOSE_PREPARED_KEY handle is valid
+*
+* @param h  Handle to be validated
+* @return result of the check
+*/
+
+bool IsValidPreparedKeyHandle(HCOSE_PREPARED_KEY h)
+{
+	return _COSE_Handle_IsValid(COSE_HANDLE_PREPARED_KEY, (const COSE *)h);
+}
+
+/*!
+* @brief Create a prepared key for one of the AES-CCM, AES-GCM, ChaCha20/Poly1305, HMAC or AES CBC-MAC algorithms
+*
+* @param alg  Content encryption or MAC algorithm the key will be used with
+* @param pbKey  Raw key bytes
+* @param cbKey  Size of the key, must match the algorithm
+* @param context  Allocation context, may be NULL
+* @param perr  Location to return errors
+* @return handle to the prepared key or NULL on failure
+*/
+
+HCOSE_PREPARED_KEY COSE_PreparedKey_Create(int alg, const byte * pbKey, size_t cbKey, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	COSE_PreparedKey * pKey = NULL;
+	int cbitKey;
+	int cbitTag;
+	int cbitL = 0;
+
+	switch (alg) {
+#ifdef USE_AES_CCM_16_64_128
+	case COSE_Algorithm_AES_CCM_16_64_128:
+		cbitKey = 128; cbitTag = 64; cbitL = 16;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_16_64_256
+	case COSE_Algorithm_AES_CCM_16_64_256:
+		cbitKey = 256; cbitTag = 64; cbitL = 16;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_16_128_128
+	case COSE_Algorithm_AES_CCM_16_128_128:
+		cbitKey = 128; cbitTag = 128; cbitL = 16;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_16_128_256
+	case COSE_Algorithm_AES_CCM_16_128_256:
+		cbitKey = 256; cbitTag = 128; cbitL = 16;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_64_64_128
+	case COSE_Algorithm_AES_CCM_64_64_128:
+		cbitKey = 128; cbitTag = 64; cbitL = 64;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_64_64_256
+	case COSE_Algorithm_AES_CCM_64_64_256:
+		cbitKey = 256; cbitTag = 64; cbitL = 64;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_64_128_128
+	case COSE_Algorithm_AES_CCM_64_128_128:
+		cbitKey = 128; cbitTag = 128; cbitL = 64;
+		break;
+#endif
+
+#ifdef USE_AES_CCM_64_128_256
+	case COSE_Algorithm_AES_CCM_64_128_256:
+		cbitKey = 256; cbitTag = 128; cbitL = 64;
+		break;
+#endif
+
+#ifdef USE_AES_GCM_128
+	case COSE_Algorithm_AES_GCM_128:
+		cbitKey = 128; cbitTag = 128;
+		break;
+#endif
+
+#ifdef USE_AES_GCM_192
+	case COSE_Algorithm_AES_GCM_192:
+		cbitKey = 192; cbitTag = 128;
+		break;
+#endif
+
+#ifdef USE_AES_GCM_256
+	case COSE_Algorithm_AES_GCM_256:
+		cbitKey = 256; cbitTag = 128;
+		break;
+#endif
+
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+		cbitKey = 256; cbitTag = 128;
+		break;
+#endif
+
+#ifdef USE_HMAC_256_64
+	case COSE_Algorithm_HMAC_256_64:
+		cbitKey = 256; cbitTag = 64;
+		break;
+#endif
+
+#ifdef USE_HMAC_256_256
+	case COSE_Algorithm_HMAC_256_256:
+		cbitKey = 256; cbitTag = 256;
+		break;
+#endif
+
+#ifdef USE_HMAC_384_384
+	case COSE_Algorithm_HMAC_384_384:
+		cbitKey = 384; cbitTag = 384;
+		break;
+#endif
+
+#ifdef USE_HMAC_512_512
+	case COSE_Algorithm_HMAC_512_512:
+		cbitKey = 512; cbitTag = 512;
+		break;
+#endif
+
+#ifdef USE_AES_CBC_MAC_128_64
+	case COSE_Algorithm_CBC_MAC_128_64:
+		cbitKey = 128; cbitTag = 64;
+		break;
+#endif
+
+#ifdef USE_AES_CBC_MAC_128_128
+	case COSE_Algorithm_CBC_MAC_128_128:
+		cbitKey = 128; cbitTag = 128;
+		break;
+#endif
+
+#ifdef USE_AES_CBC_MAC_256_64
+	case COSE_Algorithm_CBC_MAC_256_64:
+		cbitKey = 256; cbitTag = 64;
+		break;
+#endif
+
+#ifdef USE_AES_CBC_MAC_256_128
+	case COSE_Algorithm_CBC_MAC_256_128:
+		cbitKey = 256; cbitTag = 128;
+		break;
+#endif
+
+	default:
+		FAIL_CONDITION(COSE_ERR_UNKNOWN_ALGORITHM);
+	}
+
+	CHECK_CONDITION((pbKey != NULL) && (cbKey == (size_t) cbitKey / 8), COSE_ERR_INVALID_PARAMETER);
+
+	pKey = (COSE_PreparedKey *)COSE_CALLOC(1, sizeof(COSE_PreparedKey), context);
+	CHECK_CONDITION(pKey != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+#ifdef USE_CBOR_CONTEXT
+	if (context != NULL) pKey->m_allocContext = *context;
+#endif
+	pKey->m_alg = alg;
+	pKey->m_cbitTag = cbitTag;
+	pKey->m_cbitL = cbitL;
+	pKey->m_cbKey = cbKey;
+	memcpy(pKey->m_rgbKey, pbKey, cbKey);
+
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_PREPARED_KEY, (COSE *)pKey CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
+
+	pKey->m_pProvider = _COSE_Provider_Get(alg);
+	if (IsHMAC(alg)) {
+		if (pKey->m_pProvider->pfnHMAC_Prepare_Key != NULL) {
+			if (!pKey->m_pProvider->pfnHMAC_Prepare_Key(pKey, perr)) goto errorReturn;
+		}
+	}
+	else if (IsCBCMAC(alg)) {
+		if (pKey->m_pProvider->pfnAES_CBC_MAC_Prepare_Key != NULL) {
+			if (!pKey->m_pProvider->pfnAES_CBC_MAC_Prepare_Key(pKey, perr)) goto errorReturn;
+		}
+	}
+	else if (pKey->m_pProvider->pfnAEAD_Prepare_Key != NULL) {
+		if (!pKey->m_pProvider->pfnAEAD_Prepare_Key(pKey, perr)) goto errorReturn;
+	}
+
+	return (HCOSE_PREPARED_KEY)pKey;
+
+errorReturn:
+	if (pKey != NULL) {
+		_COSE_Handle_Remove(COSE_HANDLE_PREPARED_KEY, (COSE *)pKey);
+		memset(pKey->m_rgbKey, 0, sizeof(pKey->m_rgbKey));
+		COSE_FREE(pKey, context);
+	}
+	return NULL;
+}
+
+/*!
+* @brief Free a prepared key
+*
+* The key must not be in use by any other thread.
+*
+* @param h  Handle of the prepared key
+* @return result of the operation
+*/
+
+bool COSE_PreparedKey_Free(HCOSE_PREPARED_KEY h)
+{
+	COSE_PreparedKey * pKey = (COSE_PreparedKey *)h;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context context;
+#endif
+
+	if (!IsValidPreparedKeyHandle(h)) return false;
+	_COSE_Handle_Remove(COSE_HANDLE_PREPARED_KEY, (COSE *)pKey);
+
+#ifdef USE_CBOR_CONTEXT
+	context = pKey->m_allocContext;
+#endif
+
+	if (IsHMAC(pKey->m_alg)) {
+		if (pKey->m_pProvider->pfnHMAC_Release_Key != NULL) pKey->m_pProvider->pfnHMAC_Release_Key(pKey);
+	}
+	else if (IsCBCMAC(pKey->m_alg)) {
+		if (pKey->m_pProvider->pfnAES_CBC_MAC_Release_Key != NULL) pKey->m_pProvider->pfnAES_CBC_MAC_Release_Key(pKey);
+	}
+	else if (pKey->m_pProvider->pfnAEAD_Release_Key != NULL) pKey->m_pProvider->pfnAEAD_Release_Key(pKey);
+	memset(pKey->m_rgbKey, 0, sizeof(pKey->m_rgbKey));
+	COSE_FREE(pKey, &context);
+
+	return true;
+}
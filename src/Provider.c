@@ -0,0 +1,1110 @@
+/** \file Provider.c
+* Contains the registry of crypto providers.
+*
+* Every algorithm is dispatched through a table of message level
+* operations.  The backend table holds the functions of the backend
+* compiled into the library.  Applications may register providers at run
+* time which take over the algorithms they claim, so for example content
+* encryption can come from one library and the elliptic curve operations
+* from another.
+*
+* A registered provider only implements primitives over keys and buffers.
+* Algorithms it claims are dispatched to the bridge table in this file,
+* which does the same message handling as the backend - nonces, tags,
+* salts, signatures and ephemeral keys - and calls the primitives of the
+* provider registered for the algorithm of the message.
+*
+* The provider for each algorithm is resolved when the provider is
+* registered and kept in a table indexed by the algorithm, so finding the
+* provider during message processing is a single lookup.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+#if defined(USE_OPEN_SSL)
+#define BACKEND_NAME "OpenSSL"
+#elif defined(USE_MBED_TLS)
+#define BACKEND_NAME "mbedTLS"
+#else
+#define BACKEND_NAME "default"
+#endif
+
+static const COSE_CRYPTO_PROVIDER s_defaultProvider = {
+	BACKEND_NAME,
+
+	AES_CCM_Encrypt,
+	AES_CCM_Decrypt,
+#ifdef USE_AES_GCM
+	AES_GCM_Encrypt,
+	AES_GCM_Decrypt,
+#else
+	NULL, NULL,
+#endif
+#ifdef USE_CHACHA20_POLY1305
+	ChaCha20_Poly1305_Encrypt,
+	ChaCha20_Poly1305_Decrypt,
+#else
+	NULL, NULL,
+#endif
+	AEAD_Prepare_Key,
+	AEAD_Release_Key,
+
+#if defined(USE_AES_KW_128) || defined(USE_AES_KW_192) || defined(USE_AES_KW_256) || defined(USE_HKDF_AES)
+	AES_KW_Encrypt,
+	AES_KW_Decrypt,
+#else
+	NULL, NULL,
+#endif
+
+#if defined(USE_AES_CBC_MAC_128_64) || defined(USE_AES_CBC_MAC_128_128) || defined(USE_AES_CBC_MAC_256_64) || defined(USE_AES_CBC_MAC_256_128)
+	AES_CBC_MAC_Create,
+	AES_CBC_MAC_Validate,
+	AES_CBC_MAC_Prepare_Key,
+	AES_CBC_MAC_Release_Key,
+#else
+	NULL, NULL,
+	NULL, NULL,
+#endif
+	HMAC_Create,
+	HMAC_Validate,
+#ifdef USE_OPEN_SSL
+	HMAC_Prepare_Key,
+	HMAC_Release_Key,
+#else
+	NULL, NULL,
+#endif
+
+	HKDF_Extract,
+	HKDF_Expand,
+	HKDF_AES_Expand,
+
+#ifdef USE_ECDSA
+	ECDSA_Sign,
+	ECDSA_Verify,
+#else
+	NULL, NULL,
+#endif
+#ifdef USE_ECDH
+	ECDH_ComputeSecret,
+#else
+	NULL,
+#endif
+#if defined(USE_ECDSA) || defined(USE_ECDH)
+	ECKey_Prepare,
+	ECKey_Release,
+#else
+	NULL, NULL,
+#endif
+
+#ifdef USE_EDDSA
+	EdDSA_Sign,
+	EdDSA_Verify,
+	OKPKey_Prepare,
+	OKPKey_Release,
+#else
+	NULL, NULL, NULL, NULL,
+#endif
+};
+
+
+//  The public face of the backend.  Its primitives are not exposed, the
+//  backend is only reached through s_defaultProvider.
+
+static const COSE_PROVIDER s_defaultDescriptor = {
+	BACKEND_NAME,
+	NULL, 0, NULL,
+
+	NULL, NULL,
+	NULL,
+	NULL, NULL,
+	NULL, NULL, NULL,
+	NULL, NULL,
+	NULL, NULL
+};
+
+//  Operations each algorithm needs, as offsets into the backend table and
+//  into a registered provider
+
+#define PFN(x) offsetof(COSE_CRYPTO_PROVIDER, x)
+#define PRIM(x) offsetof(COSE_PROVIDER, x)
+#define MAX_REQUIRED 5
+#define MAX_PRIMITIVES 6
+
+#define AEAD_PRIMITIVES { PRIM(pfnAEAD_Encrypt), PRIM(pfnAEAD_Decrypt) }
+#define MAC_PRIMITIVES { PRIM(pfnMAC_Create) }
+#define KW_PRIMITIVES { PRIM(pfnKeyWrap), PRIM(pfnKeyUnwrap) }
+#define HKDF_PRIMITIVES { PRIM(pfnHKDF_Extract), PRIM(pfnHKDF_Expand) }
+#define HKDF_AES_PRIMITIVES { PRIM(pfnHKDF_AES_Expand) }
+#define ECDH_ES_PRIMITIVES { PRIM(pfnECDH), PRIM(pfnEC_Generate), PRIM(pfnHKDF_Extract), PRIM(pfnHKDF_Expand) }
+#define ECDH_SS_PRIMITIVES { PRIM(pfnECDH), PRIM(pfnHKDF_Extract), PRIM(pfnHKDF_Expand) }
+#define ECDH_ES_KW_PRIMITIVES { PRIM(pfnECDH), PRIM(pfnEC_Generate), PRIM(pfnHKDF_Extract), PRIM(pfnHKDF_Expand), PRIM(pfnKeyWrap), PRIM(pfnKeyUnwrap) }
+#define ECDH_SS_KW_PRIMITIVES { PRIM(pfnECDH), PRIM(pfnHKDF_Extract), PRIM(pfnHKDF_Expand), PRIM(pfnKeyWrap), PRIM(pfnKeyUnwrap) }
+#define SIGN_PRIMITIVES { PRIM(pfnSign), PRIM(pfnVerify) }
+
+typedef void (*PFN_ANY)(void);
+
+typedef struct {
+	int m_alg;
+	size_t m_rgRequired[MAX_REQUIRED];		//  Zero terminated, offset zero is the name
+	size_t m_rgPrimitives[MAX_PRIMITIVES];	//  Zero terminated, offset zero is the name
+} ProviderRequirement;
+
+static const ProviderRequirement s_rgRequirements[] = {
+	{ COSE_Algorithm_AES_GCM_128, { PFN(pfnAES_GCM_Encrypt), PFN(pfnAES_GCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_GCM_192, { PFN(pfnAES_GCM_Encrypt), PFN(pfnAES_GCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_GCM_256, { PFN(pfnAES_GCM_Encrypt), PFN(pfnAES_GCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_16_64_128, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_16_64_256, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_64_64_128, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_64_64_256, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_16_128_128, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_16_128_256, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_64_128_128, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_AES_CCM_64_128_256, { PFN(pfnAES_CCM_Encrypt), PFN(pfnAES_CCM_Decrypt) }, AEAD_PRIMITIVES },
+	{ COSE_Algorithm_CHACHA20_POLY1305, { PFN(pfnChaCha20_Poly1305_Encrypt), PFN(pfnChaCha20_Poly1305_Decrypt) }, AEAD_PRIMITIVES },
+
+	{ COSE_Algorithm_HMAC_256_64, { PFN(pfnHMAC_Create), PFN(pfnHMAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_HMAC_256_256, { PFN(pfnHMAC_Create), PFN(pfnHMAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_HMAC_384_384, { PFN(pfnHMAC_Create), PFN(pfnHMAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_HMAC_512_512, { PFN(pfnHMAC_Create), PFN(pfnHMAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_CBC_MAC_128_64, { PFN(pfnAES_CBC_MAC_Create), PFN(pfnAES_CBC_MAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_CBC_MAC_256_64, { PFN(pfnAES_CBC_MAC_Create), PFN(pfnAES_CBC_MAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_CBC_MAC_128_128, { PFN(pfnAES_CBC_MAC_Create), PFN(pfnAES_CBC_MAC_Validate) }, MAC_PRIMITIVES },
+	{ COSE_Algorithm_CBC_MAC_256_128, { PFN(pfnAES_CBC_MAC_Create), PFN(pfnAES_CBC_MAC_Validate) }, MAC_PRIMITIVES },
+
+	{ COSE_Algorithm_AES_KW_128, { PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, KW_PRIMITIVES },
+	{ COSE_Algorithm_AES_KW_192, { PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, KW_PRIMITIVES },
+	{ COSE_Algorithm_AES_KW_256, { PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, KW_PRIMITIVES },
+	{ COSE_Algorithm_Direct_HKDF_HMAC_SHA_256, { PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, HKDF_PRIMITIVES },
+	{ COSE_Algorithm_Direct_HKDF_HMAC_SHA_512, { PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, HKDF_PRIMITIVES },
+	{ COSE_Algorithm_Direct_HKDF_AES_128, { PFN(pfnHKDF_AES_Expand) }, HKDF_AES_PRIMITIVES },
+	{ COSE_Algorithm_Direct_HKDF_AES_256, { PFN(pfnHKDF_AES_Expand) }, HKDF_AES_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_ES_HKDF_256, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, ECDH_ES_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_ES_HKDF_512, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, ECDH_ES_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_SS_HKDF_256, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, ECDH_SS_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_SS_HKDF_512, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand) }, ECDH_SS_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_ES_A128KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_ES_KW_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_ES_A192KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_ES_KW_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_ES_A256KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_ES_KW_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_SS_A128KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_SS_KW_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_SS_A192KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_SS_KW_PRIMITIVES },
+	{ COSE_Algorithm_ECDH_SS_A256KW, { PFN(pfnECDH_ComputeSecret), PFN(pfnHKDF_Extract), PFN(pfnHKDF_Expand), PFN(pfnAES_KW_Encrypt), PFN(pfnAES_KW_Decrypt) }, ECDH_SS_KW_PRIMITIVES },
+
+	{ COSE_Algorithm_ECDSA_SHA_256, { PFN(pfnECDSA_Sign), PFN(pfnECDSA_Verify) }, SIGN_PRIMITIVES },
+	{ COSE_Algorithm_ECDSA_SHA_384, { PFN(pfnECDSA_Sign), PFN(pfnECDSA_Verify) }, SIGN_PRIMITIVES },
+	{ COSE_Algorithm_ECDSA_SHA_512, { PFN(pfnECDSA_Sign), PFN(pfnECDSA_Verify) }, SIGN_PRIMITIVES },
+	{ COSE_Algorithm_EdDSA, { PFN(pfnEdDSA_Sign), PFN(pfnEdDSA_Verify) }, SIGN_PRIMITIVES },
+};
+
+//  Algorithms from -64 to 63 are dispatched through the table, which covers
+//  every algorithm the library implements.
+
+#define ALG_OFFSET 64
+#define ALG_SLOTS 128
+
+static HCOSE_PROVIDER s_rgByAlg[ALG_SLOTS];
+
+/*! \private
+* @brief Find the operations an algorithm needs
+*
+* @param alg  Algorithm to look up
+* @return the requirement entry or NULL for an unknown algorithm
+*/
+
+static const ProviderRequirement * FindRequirement(int alg)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(s_rgRequirements) / sizeof(s_rgRequirements[0]); i++) {
+		if (s_rgRequirements[i].m_alg == alg) return &s_rgRequirements[i];
+	}
+	return NULL;
+}
+
+/*! \private
+* @brief Check that a table has every function at a list of offsets
+*
+* @param pTable  Backend table or registered provider
+* @param rgOffsets  Offsets of the functions, zero terminated
+* @param cOffsets  Size of rgOffsets
+* @return true if none of the functions is NULL
+*/
+
+static bool HasFunctions(const void * pTable, const size_t * rgOffsets, size_t cOffsets)
+{
+	size_t i;
+
+	for (i = 0; (i < cOffsets) && (rgOffsets[i] != 0); i++) {
+		if (*(const PFN_ANY *)((const byte *)pTable + rgOffsets[i]) == NULL) return false;
+	}
+	return true;
+}
+
+/*! \private
+* @brief Find the registered provider for an algorithm
+*
+* @param alg  Algorithm to look up
+* @return the provider, NULL if the backend handles the algorithm
+*/
+
+static HCOSE_PROVIDER RegisteredProvider(int alg)
+{
+	if ((alg >= -ALG_OFFSET) && (alg < ALG_SLOTS - ALG_OFFSET)) return s_rgByAlg[alg + ALG_OFFSET];
+	return NULL;
+}
+
+/*!
+* @brief Check if a provider can perform an algorithm
+*
+* A provider supports an algorithm when it claims it and has every
+* primitive the algorithm needs.  The default provider supports the
+* algorithms the backend was built with.
+*
+* @param hProvider  Provider to check
+* @param alg  Algorithm to check for
+* @return true if the provider would be used for the algorithm
+*/
+
+bool COSE_Provider_Supports(HCOSE_PROVIDER hProvider, int alg)
+{
+	const ProviderRequirement * pReq = FindRequirement(alg);
+	size_t i;
+
+	if ((hProvider == NULL) || (pReq == NULL)) return false;
+
+	if (hProvider == &s_defaultDescriptor) {
+		return HasFunctions(&s_defaultProvider, pReq->m_rgRequired, MAX_REQUIRED);
+	}
+
+	for (i = 0; i < hProvider->m_cAlgorithms; i++) {
+		if (hProvider->m_rgAlgorithms[i] == alg) break;
+	}
+	if (i == hProvider->m_cAlgorithms) return false;
+
+	return HasFunctions(hProvider, pReq->m_rgPrimitives, MAX_PRIMITIVES);
+}
+
+/*!
+* @brief Register a provider for the algorithms it claims
+*
+* The provider replaces whichever provider handled each of its algorithms
+* before.  Every algorithm claimed must be supported by the provider or
+* nothing is registered.  The provider is referenced, not copied.
+*
+* Registration must not run at the same time as any other call into the
+* library.  Key objects and prepared keys created before the call keep
+* the provider they were created with.
+*
+* @param hProvider  Provider to register
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Provider_Register(HCOSE_PROVIDER hProvider, cose_errback * perr)
+{
+	size_t i;
+
+	CHECK_CONDITION(hProvider != NULL, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((hProvider->m_rgAlgorithms != NULL) || (hProvider->m_cAlgorithms == 0), COSE_ERR_INVALID_PARAMETER);
+
+	for (i = 0; i < hProvider->m_cAlgorithms; i++) {
+		CHECK_CONDITION(COSE_Provider_Supports(hProvider, hProvider->m_rgAlgorithms[i]), COSE_ERR_UNKNOWN_ALGORITHM);
+	}
+
+	for (i = 0; i < hProvider->m_cAlgorithms; i++) {
+		s_rgByAlg[hProvider->m_rgAlgorithms[i] + ALG_OFFSET] = hProvider;
+	}
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Return every algorithm to the default provider
+*/
+
+void COSE_Provider_Reset()
+{
+	memset(s_rgByAlg, 0, sizeof(s_rgByAlg));
+}
+
+/*!
+* @brief Return the provider of the compiled backend
+*
+* The default provider only carries the name of the backend, its
+* primitives are not exposed and may not be called by the application.
+*/
+
+HCOSE_PROVIDER COSE_Provider_Default()
+{
+	return &s_defaultDescriptor;
+}
+
+/*!
+* @brief Return the provider which handles an algorithm
+*
+* @param alg  Algorithm to look up
+* @return the registered provider, or the default provider
+*/
+
+HCOSE_PROVIDER COSE_Provider_Get(int alg)
+{
+	HCOSE_PROVIDER hProvider = RegisteredProvider(alg);
+
+	return (hProvider != NULL) ? hProvider : &s_defaultDescriptor;
+}
+
+/*!
+* @brief Return the name of a provider
+*/
+
+const char * COSE_Provider_Name(HCOSE_PROVIDER hProvider)
+{
+	if (hProvider == NULL) return NULL;
+	return hProvider->m_szName;
+}
+
+/*
+ *  The bridge - message level operations built on the primitives of a
+ *  registered provider.  Prepared keys and key objects are not parsed for
+ *  a registered provider, so the prepared key arguments are not used.
+ */
+
+/*! \private
+* @brief Find the registered provider for the algorithm of a message
+*
+* @param pcose  Message, recipient or signer being processed
+* @param palg  Returns the algorithm of the message
+* @param perr  Location to return errors
+* @return the provider, NULL on error
+*/
+
+static HCOSE_PROVIDER BridgeProvider(COSE * pcose, int * palg, cose_errback * perr)
+{
+	const cn_cbor * cn = _COSE_map_get_int(pcose, COSE_Header_Algorithm, COSE_BOTH, NULL);
+	HCOSE_PROVIDER hProvider;
+
+	CHECK_CONDITION((cn != NULL) && ((cn->type == CN_CBOR_UINT) || (cn->type == CN_CBOR_INT)), COSE_ERR_UNKNOWN_ALGORITHM);
+	*palg = (int) cn->v.sint;
+
+	hProvider = RegisteredProvider(*palg);
+	CHECK_CONDITION(hProvider != NULL, COSE_ERR_UNKNOWN_ALGORITHM);
+	return hProvider;
+
+errorReturn:
+	return NULL;
+}
+
+/*! \private
+* @brief Encrypt the content of a message with an AEAD primitive
+*
+* The nonce is taken from the message, or generated and added to it, and
+* the cipher text followed by the tag becomes the body of the message.
+*
+* @param pcose  Message to encrypt
+* @param cbNonce  Size of the nonce for the algorithm
+* @param cbTag  Size of the tag for the algorithm
+* @param pbKey  Content encryption key
+* @param cbKey  Size of the key
+* @param pbAuthData  Encoded Enc_structure
+* @param cbAuthData  Size of the Enc_structure
+* @param pbOutput  Buffer for the body, NULL to allocate it
+* @param cbOutput  Size of pbOutput
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+static bool Bridge_Encrypt(COSE_Enveloped * pcose, size_t cbNonce, size_t cbTag, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	size_t cbAlgTag;
+	const cn_cbor * cbor_iv;
+	byte * rgbOut = NULL;
+	cn_cbor * cnTmp = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	hProvider = BridgeProvider(&pcose->m_message, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	if (!_COSE_Enveloped_SetupNonce(pcose, alg, &cbAlgTag, perr)) goto errorReturn;
+	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
+	CHECK_CONDITION((cbor_iv != NULL) && (cbor_iv->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((size_t) cbor_iv->length == cbNonce, COSE_ERR_INVALID_PARAMETER);
+
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + cbTag, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + cbTag, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	CHECK_CONDITION(hProvider->pfnAEAD_Encrypt(alg, pbKey, cbKey, cbor_iv->v.bytes, cbNonce, pbAuthData, cbAuthData, pcose->pbContent, pcose->cbContent, rgbOut, rgbOut + pcose->cbContent, cbTag, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+	cnTmp = cn_cbor_data_create(rgbOut, (int)(pcose->cbContent + cbTag), CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
+	rgbOut = NULL;
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+
+	return true;
+
+errorReturn:
+	if (cnTmp != NULL) CN_CBOR_FREE(cnTmp, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	return false;
+}
+
+/*! \private
+* @brief Decrypt the body of a message with an AEAD primitive
+*
+* On success the plain text becomes the content of the message.
+*
+* @param pcose  Message to decrypt
+* @param cbNonce  Size of the nonce for the algorithm
+* @param cbTag  Size of the tag for the algorithm
+* @param pbKey  Content encryption key
+* @param cbKey  Size of the key
+* @param pbCrypto  Cipher text followed by the tag
+* @param cbCrypto  Size of pbCrypto
+* @param pbAuthData  Encoded Enc_structure
+* @param cbAuthData  Size of the Enc_structure
+* @param pbOutput  Buffer for the plain text, NULL to allocate it
+* @param cbOutput  Size of pbOutput
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+static bool Bridge_Decrypt(COSE_Enveloped * pcose, size_t cbNonce, size_t cbTag, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	const cn_cbor * cbor_iv;
+	byte * rgbOut = NULL;
+	size_t cbOut = 0;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	hProvider = BridgeProvider(&pcose->m_message, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION(cbCrypto >= cbTag, COSE_ERR_INVALID_PARAMETER);
+	cbOut = cbCrypto - cbTag;
+
+	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
+	CHECK_CONDITION((cbor_iv != NULL) && (cbor_iv->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((size_t) cbor_iv->length == cbNonce, COSE_ERR_INVALID_PARAMETER);
+
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	CHECK_CONDITION(hProvider->pfnAEAD_Decrypt(alg, pbKey, cbKey, cbor_iv->v.bytes, cbNonce, pbAuthData, cbAuthData, pbCrypto, cbOut, pbCrypto + cbOut, cbTag, rgbOut, hProvider->m_pContext), COSE_ERR_DECRYPT_FAILED);
+
+	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
+	pcose->cbContent = cbOut;
+	return true;
+
+errorReturn:
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	else if (rgbOut != NULL) memset(rgbOut, 0, cbOut);
+	return false;
+}
+
+static bool Bridge_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_Encrypt(pcose, 15 - LSize / 8, TSize / 8, pbKey, cbKey, pbAuthData, cbAuthData, pbOutput, cbOutput, perr);
+}
+
+static bool Bridge_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_Decrypt(pcose, 15 - LSize / 8, TSize / 8, pbKey, cbKey, pbCrypto, cbCrypto, pbAuthData, cbAuthData, pbOutput, cbOutput, perr);
+}
+
+//  AES-GCM and ChaCha20/Poly1305 both have a 96 bit nonce and a 128 bit tag
+
+static bool Bridge_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_Encrypt(pcose, 96 / 8, 128 / 8, pbKey, cbKey, pbAuthData, cbAuthData, pbOutput, cbOutput, perr);
+}
+
+static bool Bridge_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_Decrypt(pcose, 96 / 8, 128 / 8, pbKey, cbKey, pbCrypto, cbCrypto, pbAuthData, cbAuthData, pbOutput, cbOutput, perr);
+}
+
+static bool Bridge_KW_Encrypt(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKey, const byte * pbContent, int cbContent, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte * pbOut = NULL;
+	cn_cbor * cnTmp = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_encrypt.m_message.m_allocContext;
+#endif
+
+	hProvider = BridgeProvider(&pcose->m_encrypt.m_message, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	pbOut = (byte *)COSE_CALLOC(cbContent + 8, 1, context);
+	CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	CHECK_CONDITION(hProvider->pfnKeyWrap(pbKeyIn, cbitKey / 8, pbContent, cbContent, pbOut, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+	cnTmp = cn_cbor_data_create(pbOut, cbContent + 8, CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
+	pbOut = NULL;
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_encrypt.m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+
+	return true;
+
+errorReturn:
+	if (cnTmp != NULL) CN_CBOR_FREE(cnTmp, context);
+	if (pbOut != NULL) COSE_FREE(pbOut, context);
+	return false;
+}
+
+static bool Bridge_KW_Decrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey, const byte * pbCipherText, size_t cbCipherText, byte * pbKeyOut, int * pcbKeyOut, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte rgbOut[512 / 8];
+
+	hProvider = BridgeProvider(&pcose->m_message, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION((cbCipherText > 8) && (cbCipherText - 8 <= sizeof(rgbOut)), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(hProvider->pfnKeyUnwrap(pbKeyIn, cbitKey / 8, pbCipherText, cbCipherText, rgbOut, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+	memcpy(pbKeyOut, rgbOut, cbCipherText - 8);
+	*pcbKeyOut = (int)(cbCipherText - 8);
+
+	memset(rgbOut, 0, sizeof(rgbOut));
+	return true;
+
+errorReturn:
+	memset(rgbOut, 0, sizeof(rgbOut));
+	return false;
+}
+
+/*! \private
+* @brief Create or check the tag of a MAC message with a MAC primitive
+*
+* The tag is compared in constant time.
+*
+* @param pcose  Message to tag or check
+* @param cbTag  Size of the tag for the algorithm
+* @param pbKey  MAC key
+* @param cbKey  Size of the key
+* @param pbAuthData  Encoded MAC_structure
+* @param cbAuthData  Size of the MAC_structure
+* @param fValidate  Check the tag of the message rather than set it
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+static bool Bridge_MAC(COSE_MacMessage * pcose, size_t cbTag, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, bool fValidate, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte rgbTag[512 / 8];
+	byte * pbTag = NULL;
+	const cn_cbor * cn;
+	cn_cbor * cnTmp = NULL;
+	bool f = false;
+	size_t i;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	hProvider = BridgeProvider(&pcose->m_message, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION(cbTag <= sizeof(rgbTag), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(hProvider->pfnMAC_Create(alg, pbKey, cbKey, pbAuthData, cbAuthData, rgbTag, cbTag, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+	if (fValidate) {
+		cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
+		CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
+		CHECK_CONDITION((cn->type == CN_CBOR_BYTES) && ((size_t) cn->length == cbTag), COSE_ERR_CBOR);
+
+		for (i = 0; i < cbTag; i++) f |= (cn->v.bytes[i] != rgbTag[i]);
+		CHECK_CONDITION(!f, COSE_ERR_CRYPTO_FAIL);
+	}
+	else {
+		pbTag = (byte *)COSE_CALLOC(cbTag, 1, context);
+		CHECK_CONDITION(pbTag != NULL, COSE_ERR_OUT_OF_MEMORY);
+		memcpy(pbTag, rgbTag, cbTag);
+
+		cnTmp = cn_cbor_data_create(pbTag, (int) cbTag, CBOR_CONTEXT_PARAM_COMMA NULL);
+		CHECK_CONDITION(cnTmp != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pbTag = NULL;
+		CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_MAC_TAG, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	}
+
+	memset(rgbTag, 0, sizeof(rgbTag));
+	return true;
+
+errorReturn:
+	if (cnTmp != NULL) CN_CBOR_FREE(cnTmp, context);
+	if (pbTag != NULL) COSE_FREE(pbTag, context);
+	memset(rgbTag, 0, sizeof(rgbTag));
+	return false;
+}
+
+static bool Bridge_HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	UNUSED_PARAM(HSize);
+	UNUSED_PARAM(pPrepared);
+	return Bridge_MAC(pcose, TSize / 8, pbKey, cbKey, pbAuthData, cbAuthData, false, perr);
+}
+
+static bool Bridge_HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	UNUSED_PARAM(HSize);
+	UNUSED_PARAM(pPrepared);
+	return Bridge_MAC(pcose, TSize / 8, pbKey, cbKey, pbAuthData, cbAuthData, true, perr);
+}
+
+static bool Bridge_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_MAC(pcose, TSize / 8, pbKey, cbKey, pbAuthData, cbAuthData, false, perr);
+}
+
+static bool Bridge_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	UNUSED_PARAM(pPrepared);
+	return Bridge_MAC(pcose, TSize / 8, pbKey, cbKey, pbAuthData, cbAuthData, true, perr);
+}
+
+//  The salt comes from the recipient, a zero salt of the hash size is used without one
+
+static bool Bridge_HKDF_Extract(COSE * pcose, const byte * pbKey, size_t cbKey, size_t cbitDigest, byte * rgbDigest, size_t * pcbDigest, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte rgbSalt[512 / 8] = { 0 };
+	const byte * pbSalt = rgbSalt;
+	size_t cbSalt = cbitDigest / 8;
+	const cn_cbor * cnSalt;
+
+#ifdef USE_CBOR_CONTEXT
+	UNUSED_PARAM(context);
+#endif
+
+	hProvider = BridgeProvider(pcose, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION(cbitDigest / 8 <= sizeof(rgbSalt), COSE_ERR_INVALID_PARAMETER);
+
+	cnSalt = _COSE_map_get_int(pcose, COSE_Header_HKDF_salt, COSE_BOTH, NULL);
+	if (cnSalt != NULL) {
+		CHECK_CONDITION(cnSalt->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
+		pbSalt = cnSalt->v.bytes;
+		cbSalt = cnSalt->length;
+	}
+
+	CHECK_CONDITION(hProvider->pfnHKDF_Extract((int) cbitDigest, pbSalt, cbSalt, pbKey, cbKey, rgbDigest, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+	*pcbDigest = cbitDigest / 8;
+	return true;
+
+errorReturn:
+	return false;
+}
+
+static bool Bridge_HKDF_Expand(COSE * pcose, size_t cbitDigest, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+
+	hProvider = BridgeProvider(pcose, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION(hProvider->pfnHKDF_Expand((int) cbitDigest, pbPRK, cbPRK, pbInfo, cbInfo, pbOutput, cbOutput, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+static bool Bridge_HKDF_AES_Expand(COSE * pcose, size_t cbitKey, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+
+	hProvider = BridgeProvider(pcose, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+
+	CHECK_CONDITION(cbPRK == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(hProvider->pfnHKDF_AES_Expand(pbPRK, cbPRK, pbInfo, cbInfo, pbOutput, cbOutput, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*! \private
+* @brief Join the encoded prefix and the payload of a ToBeSigned structure
+*
+* @param pcose  Message whose allocator is used
+* @param rgbToSign  Encoded prefix
+* @param cbToSign  Size of the prefix
+* @param pbPayload  Payload which follows the prefix
+* @param cbPayload  Size of the payload
+* @param ppbJoined  Returns the buffer to free, NULL if none was needed
+* @param pcbJoined  Returns the size of the structure
+* @param perr  Location to return errors
+* @return the structure, NULL on error
+*/
+
+static const byte * Bridge_ToBeSigned(COSE * pcose, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, byte ** ppbJoined, size_t * pcbJoined, cose_errback * perr)
+{
+	byte * pb;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_allocContext;
+#else
+	UNUSED_PARAM(pcose);
+#endif
+
+	*ppbJoined = NULL;
+	*pcbJoined = cbToSign + cbPayload;
+	if (cbPayload == 0) return rgbToSign;
+
+	pb = (byte *)COSE_CALLOC(cbToSign + cbPayload, 1, context);
+	CHECK_CONDITION(pb != NULL, COSE_ERR_OUT_OF_MEMORY);
+	memcpy(pb, rgbToSign, cbToSign);
+	memcpy(pb + cbToSign, pbPayload, cbPayload);
+
+	*ppbJoined = pb;
+	return pb;
+
+errorReturn:
+	return NULL;
+}
+
+/*! \private
+* @brief Sign a message with a signature primitive
+*
+* The signature is written to the message at index.  The largest
+* signature is an ECDSA P-521 signature of 132 bytes.
+*
+* @param pSigner  Message or signer holding the signature
+* @param index  Index of the signature in the message array
+* @param pKey  Key to sign with
+* @param rgbToSign  Encoded prefix of the ToBeSigned structure
+* @param cbToSign  Size of the prefix
+* @param pbPayload  Payload which follows the prefix
+* @param cbPayload  Size of the payload
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+static bool Bridge_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte * pbJoined = NULL;
+	const byte * pbTBS;
+	size_t cbTBS;
+	byte rgbSig[2 * 66];
+	size_t cbSig = sizeof(rgbSig);
+	byte * pbSig = NULL;
+	cn_cbor * p = NULL;
+	cn_cbor_errback cbor_error;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSigner->m_allocContext;
+#endif
+	bool fRet = false;
+
+	hProvider = BridgeProvider(pSigner, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+	CHECK_CONDITION(pKey->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	pbTBS = Bridge_ToBeSigned(pSigner, rgbToSign, cbToSign, pbPayload, cbPayload, &pbJoined, &cbTBS, perr);
+	if (pbTBS == NULL) goto errorReturn;
+
+	CHECK_CONDITION(hProvider->pfnSign(alg, pKey->m_cborKey, pbTBS, cbTBS, rgbSig, &cbSig, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(cbSig <= sizeof(rgbSig), COSE_ERR_CRYPTO_FAIL);
+
+	pbSig = (byte *)COSE_CALLOC(cbSig, 1, context);
+	CHECK_CONDITION(pbSig != NULL, COSE_ERR_OUT_OF_MEMORY);
+	memcpy(pbSig, rgbSig, cbSig);
+
+	p = cn_cbor_data_create(pbSig, (int) cbSig, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	pbSig = NULL;
+
+	CHECK_CONDITION(_COSE_array_replace(pSigner, p, index, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	p = NULL;
+
+	fRet = true;
+
+errorReturn:
+	if (p != NULL) CN_CBOR_FREE(p, context);
+	if (pbSig != NULL) COSE_FREE(pbSig, context);
+	if (pbJoined != NULL) COSE_FREE(pbJoined, context);
+	return fRet;
+}
+
+static bool Bridge_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	byte * pbJoined = NULL;
+	const byte * pbTBS;
+	size_t cbTBS;
+	const cn_cbor * pSig;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSigner->m_allocContext;
+#endif
+	bool fRet = false;
+
+	hProvider = BridgeProvider(pSigner, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+	CHECK_CONDITION(pKey->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	pSig = _COSE_arrayget_int(pSigner, index);
+	CHECK_CONDITION((pSig != NULL) && (pSig->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+
+	pbTBS = Bridge_ToBeSigned(pSigner, rgbToSign, cbToSign, pbPayload, cbPayload, &pbJoined, &cbTBS, perr);
+	if (pbTBS == NULL) goto errorReturn;
+
+	CHECK_CONDITION(hProvider->pfnVerify(alg, pKey->m_cborKey, pbTBS, cbTBS, pSig->v.bytes, pSig->length, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+	fRet = true;
+
+errorReturn:
+	if (pbJoined != NULL) COSE_FREE(pbJoined, context);
+	return fRet;
+}
+
+//  The hash of ECDSA follows from the algorithm the provider is given
+
+static bool Bridge_ECDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	UNUSED_PARAM(cbitsDigest);
+	return Bridge_Sign(pSigner, index, pKey, rgbToSign, cbToSign, pbPayload, cbPayload, perr);
+}
+
+static bool Bridge_ECDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	UNUSED_PARAM(cbitsDigest);
+	return Bridge_Verify(pSigner, index, pKey, rgbToSign, cbToSign, pbPayload, cbPayload, perr);
+}
+
+/*! \private
+* @brief Build the COSE_Key map of an EC2 key
+*
+* The map references the coordinate buffers, they are not copied and must
+* live as long as the map.
+*
+* @param iCurve  COSE curve of the key
+* @param pbX  x coordinate
+* @param pbY  y coordinate
+* @param fCompressed  Only record the sign bit of y
+* @param pbD  Private value, NULL for a public key
+* @param cbCoord  Size of each value
+* @param perr  Location to return errors
+* @return the map, NULL on error
+*/
+
+static cn_cbor * Bridge_ECKey(int iCurve, const byte * pbX, const byte * pbY, bool fCompressed, const byte * pbD, size_t cbCoord, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	cn_cbor * pkey = NULL;
+	cn_cbor * p = NULL;
+	cn_cbor_errback cbor_error;
+
+	pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(pkey != NULL, cbor_error);
+
+	p = cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_Type, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+
+	p = cn_cbor_int_create(iCurve, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC2_Curve, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+
+	p = cn_cbor_data_create(pbX, (int) cbCoord, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC2_X, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+
+	if (fCompressed) p = cn_cbor_bool_create(pbY[cbCoord - 1] & 1, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	else p = cn_cbor_data_create(pbY, (int) cbCoord, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC2_Y, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+
+	if (pbD != NULL) {
+		p = cn_cbor_data_create(pbD, (int) cbCoord, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+		CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+		CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, -4, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+	}
+
+	return pkey;
+
+errorReturn:
+	if ((p != NULL) && (p->parent == NULL)) CN_CBOR_FREE(p, context);
+	if (pkey != NULL) CN_CBOR_FREE(pkey, context);
+	return NULL;
+}
+
+/*! \private
+* @brief Compute an ECDH secret with the primitives of a provider
+*
+* When the private key has no map an ephemeral key is generated on the
+* curve of the public key, and its public half is returned in the key for
+* the caller to place in the message.
+*/
+
+static bool Bridge_ECDH_ComputeSecret(COSE * pRecipient, COSE_KEY * pKeyPrivate, const COSE_KEY * pKeyPublic, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	HCOSE_PROVIDER hProvider;
+	int alg;
+	const cn_cbor * cn;
+	int iCurve;
+	size_t cbCoord;
+	byte rgbX[66];
+	byte rgbY[66];
+	byte rgbD[66];
+	byte * pbPublic = NULL;
+	cn_cbor * pkeyEphemeral = NULL;
+	cn_cbor * pkeyPublic = NULL;
+	const cn_cbor * pkeyPrivate;
+	byte * pbSecret = NULL;
+	size_t cbSecret;
+	bool fCompressed;
+	bool fRet = false;
+
+	hProvider = BridgeProvider(pRecipient, &alg, perr);
+	if (hProvider == NULL) goto errorReturn;
+	CHECK_CONDITION(pKeyPublic->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	cn = cn_cbor_mapget_int(pKeyPublic->m_cborKey, COSE_Key_EC2_Curve);
+	CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_UINT), COSE_ERR_INVALID_PARAMETER);
+	iCurve = (int) cn->v.uint;
+	switch (iCurve) {
+	case 1: cbCoord = 256 / 8; break;
+	case 2: cbCoord = 384 / 8; break;
+	case 3: cbCoord = (521 + 7) / 8; break;
+	default:
+		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+	}
+
+	if (pKeyPrivate->m_cborKey == NULL) {
+		cn = _COSE_map_get_int(pRecipient, COSE_Header_UseCompressedECDH, COSE_BOTH, NULL);
+		fCompressed = (cn != NULL) && (cn->type == CN_CBOR_TRUE);
+
+		CHECK_CONDITION(hProvider->pfnEC_Generate != NULL, COSE_ERR_UNKNOWN_ALGORITHM);
+		CHECK_CONDITION(hProvider->pfnEC_Generate(iCurve, rgbX, rgbY, rgbD, cbCoord, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+
+		pkeyEphemeral = Bridge_ECKey(iCurve, rgbX, rgbY, false, rgbD, cbCoord, CBOR_CONTEXT_PARAM_COMMA perr);
+		if (pkeyEphemeral == NULL) goto errorReturn;
+		pkeyPrivate = pkeyEphemeral;
+
+		//  The public half goes into the message and keeps its own copy of the point
+
+		pbPublic = (byte *)COSE_CALLOC(cbCoord, 2, context);
+		CHECK_CONDITION(pbPublic != NULL, COSE_ERR_OUT_OF_MEMORY);
+		memcpy(pbPublic, rgbX, cbCoord);
+		memcpy(pbPublic + cbCoord, rgbY, cbCoord);
+
+		pkeyPublic = Bridge_ECKey(iCurve, pbPublic, pbPublic + cbCoord, fCompressed, NULL, cbCoord, CBOR_CONTEXT_PARAM_COMMA perr);
+		if (pkeyPublic == NULL) goto errorReturn;
+		pbPublic = NULL;
+	}
+	else {
+		pkeyPrivate = pKeyPrivate->m_cborKey;
+	}
+
+	pbSecret = (byte *)COSE_CALLOC(cbCoord, 1, context);
+	CHECK_CONDITION(pbSecret != NULL, COSE_ERR_OUT_OF_MEMORY);
+	cbSecret = cbCoord;
+
+	CHECK_CONDITION(hProvider->pfnECDH(pkeyPrivate, pKeyPublic->m_cborKey, pbSecret, &cbSecret, hProvider->m_pContext), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION((cbSecret > 0) && (cbSecret <= cbCoord), COSE_ERR_CRYPTO_FAIL);
+
+	if (pkeyPublic != NULL) {
+		pKeyPrivate->m_cborKey = pkeyPublic;
+		pkeyPublic = NULL;
+	}
+	*ppbSecret = pbSecret;
+	*pcbSecret = cbSecret;
+	pbSecret = NULL;
+
+	fRet = true;
+
+errorReturn:
+	if (pbSecret != NULL) {
+		memset(pbSecret, 0, cbCoord);
+		COSE_FREE(pbSecret, context);
+	}
+	if (pkeyPublic != NULL) CN_CBOR_FREE(pkeyPublic, context);
+	if (pbPublic != NULL) COSE_FREE(pbPublic, context);
+	if (pkeyEphemeral != NULL) CN_CBOR_FREE(pkeyEphemeral, context);
+	memset(rgbD, 0, sizeof(rgbD));
+	return fRet;
+}
+
+static const COSE_CRYPTO_PROVIDER s_bridgeProvider = {
+	"bridge",
+
+	Bridge_CCM_Encrypt,
+	Bridge_CCM_Decrypt,
+	Bridge_GCM_Encrypt,
+	Bridge_GCM_Decrypt,
+	Bridge_GCM_Encrypt,
+	Bridge_GCM_Decrypt,
+	NULL, NULL,
+
+	Bridge_KW_Encrypt,
+	Bridge_KW_Decrypt,
+
+	Bridge_CBC_MAC_Create,
+	Bridge_CBC_MAC_Validate,
+	NULL, NULL,
+	Bridge_HMAC_Create,
+	Bridge_HMAC_Validate,
+	NULL, NULL,
+
+	Bridge_HKDF_Extract,
+	Bridge_HKDF_Expand,
+	Bridge_HKDF_AES_Expand,
+
+	Bridge_ECDSA_Sign,
+	Bridge_ECDSA_Verify,
+	Bridge_ECDH_ComputeSecret,
+	NULL, NULL,
+
+	Bridge_Sign,
+	Bridge_Verify,
+	NULL, NULL,
+};
+
+const COSE_CRYPTO_PROVIDER * _COSE_Provider_Get(int alg)
+{
+	if (RegisteredProvider(alg) != NULL) return &s_bridgeProvider;
+	return &s_defaultProvider;
+}
@@ -0,0 +1,162 @@
+/** \file Random.c
+* Contains the per-thread pool of random bytes.
+*
+* Nonces, IVs, content keys and ephemeral keys are all short, and asking the
+* backend generator for each of them costs a lock or a DRBG update per
+* request.  Each thread instead keeps a buffer which is filled from the
+* backend in one request and handed out from the front.  Bytes are wiped
+* from the buffer as soon as they are handed out, so nothing which has been
+* used stays in memory.  Requests which are large compared to the buffer go
+* straight to the backend.
+*
+* A forked child starts with a copy of its parent's buffer.  The buffer is
+* thrown away in the child before it is used again, so the two processes
+* never hand out the same bytes.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+#include "crypto.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#ifdef _MSC_VER
+#define COSE_THREAD_LOCAL __declspec(thread)
+#else
+#define COSE_THREAD_LOCAL __thread
+#endif
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+#define RANDOM_POOL_SIZE 1024
+#define RANDOM_DIRECT_MIN (RANDOM_POOL_SIZE / 4)
+
+typedef struct {
+	size_t m_cbLeft;		//  Unused bytes at the end of the buffer
+	unsigned int m_iFork;	//  Fork count when the buffer was filled
+	COSE_RANDOM_STATS m_stats;
+	byte m_rgb[RANDOM_POOL_SIZE];
+} RandomPool;
+
+static COSE_THREAD_LOCAL RandomPool RandomPoolThread;
+
+#ifndef _WIN32
+//  Bumped in the child after each fork, only the forking thread exists in
+//  the child so no other thread can be reading it.
+
+static volatile unsigned int RandomForkCount = 0;
+static pthread_once_t RandomForkOnce = PTHREAD_ONCE_INIT;
+
+static void RandomForkChild(void)
+{
+	RandomForkCount += 1;
+}
+
+static void RandomForkRegister(void)
+{
+	pthread_atfork(NULL, NULL, RandomForkChild);
+}
+#endif
+
+static void RandomPool_Wipe(RandomPool * pPool)
+{
+	memset(pPool->m_rgb, 0, sizeof(pPool->m_rgb));
+	pPool->m_cbLeft = 0;
+}
+
+/*! \private
+* @brief Fill a buffer with random bytes from the calling thread's pool
+*
+* @param pb buffer to be filled
+* @param cb number of bytes wanted
+* @return result of the operation, the buffer is zeroed on failure
+*/
+
+bool _COSE_Random(byte * pb, size_t cb)
+{
+	RandomPool * pPool = &RandomPoolThread;
+	byte * pbOut = pb;
+	size_t cbOut = cb;
+	byte * pbPool;
+	size_t cbChunk;
+
+#ifndef _WIN32
+	pthread_once(&RandomForkOnce, RandomForkRegister);
+	if (pPool->m_iFork != RandomForkCount) {
+		RandomPool_Wipe(pPool);
+		pPool->m_iFork = RandomForkCount;
+		pPool->m_stats.cForks += 1;
+	}
+#endif
+
+	pPool->m_stats.cRequests += 1;
+	pPool->m_stats.cbRequested += cb;
+
+	if (cb >= RANDOM_DIRECT_MIN) {
+		pPool->m_stats.cDirect += 1;
+		if (!rand_bytes(pb, cb)) {
+			memset(pb, 0, cb);
+			return false;
+		}
+		return true;
+	}
+
+	while (cb > 0) {
+		if (pPool->m_cbLeft == 0) {
+			if (!rand_bytes(pPool->m_rgb, sizeof(pPool->m_rgb))) {
+				RandomPool_Wipe(pPool);
+				memset(pbOut, 0, cbOut);
+				return false;
+			}
+			pPool->m_cbLeft = sizeof(pPool->m_rgb);
+			pPool->m_stats.cRefills += 1;
+		}
+
+		cbChunk = MIN(cb, pPool->m_cbLeft);
+		pbPool = &pPool->m_rgb[sizeof(pPool->m_rgb) - pPool->m_cbLeft];
+		memcpy(pb, pbPool, cbChunk);
+		memset(pbPool, 0, cbChunk);
+		pPool->m_cbLeft -= cbChunk;
+		pb += cbChunk;
+		cb -= cbChunk;
+	}
+
+	return true;
+}
+
+/*!
+* @brief Get the statistics for the calling thread's random pool
+*
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Random_GetStats(COSE_RANDOM_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	*pStats = RandomPoolThread.m_stats;
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Wipe the random bytes held by the calling thread
+*
+* Threads which have used the library should call this before they exit so
+* that unused random bytes do not stay in memory.  The next request refills
+* the pool.  The counters are not reset.
+*/
+
+void COSE_Random_Clear()
+{
+	RandomPool_Wipe(&RandomPoolThread);
+}
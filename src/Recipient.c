@@ -9,17 +9,16 @@
 extern bool BuildContextBytes(COSE * pcose, int algID, size_t cbitKey, byte ** ppbContext, size_t * pcbContext, CBOR_CONTEXT_COMMA cose_errback * perr);
 
 
-COSE* RecipientRoot = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_RECIPIENT handle is valid
 *
 *  Internal function to test if a recipient handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -29,13 +28,13 @@ bool IsValidRecipientHandle(HCOSE_RECIPIENT h)
 	COSE_RecipientInfo * p = (COSE_RecipientInfo *)h;
 
 	if (p == NULL) return false;
-	return _COSE_IsInList(RecipientRoot, &p->m_encrypt.m_message);
+	return _COSE_Handle_IsValid(COSE_HANDLE_RECIPIENT, &p->m_encrypt.m_message);
 }
 
 HCOSE_RECIPIENT COSE_Recipient_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
-	COSE_RecipientInfo * pobj = (COSE_RecipientInfo *)COSE_CALLOC(1, sizeof(COSE_RecipientInfo), context);
+	COSE_RecipientInfo * pobj = (COSE_RecipientInfo *)COSE_POOL_CALLOC(COSE_POOL_RECIPIENT, sizeof(COSE_RecipientInfo), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags | COSE_INIT_FLAGS_NO_CBOR_TAG, &pobj->m_encrypt.m_message, COSE_recipient_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
@@ -43,7 +42,10 @@ HCOSE_RECIPIENT COSE_Recipient_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA co
 		return NULL;
 	}
 
-	_COSE_InsertInList(&RecipientRoot, &pobj->m_encrypt.m_message);
+	if (!_COSE_Handle_Add(COSE_HANDLE_RECIPIENT, &pobj->m_encrypt.m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_Recipient_Free(pobj);
+		FAIL_CONDITION(COSE_ERR_OUT_OF_MEMORY);
+	}
 	return (HCOSE_RECIPIENT)pobj;
 
 errorReturn:
@@ -53,10 +55,7 @@ errorReturn:
 bool COSE_Recipient_Free(HCOSE_RECIPIENT hRecipient)
 {
 	if (IsValidRecipientHandle(hRecipient)) {
-		COSE_RecipientInfo * p = (COSE_RecipientInfo *)hRecipient;
-		_COSE_RemoveFromList(&RecipientRoot, &p->m_encrypt.m_message);
-
-		_COSE_Recipient_Free(p);
+		_COSE_Recipient_Free((COSE_RecipientInfo *)hRecipient);
 		return true;
 	}
 
@@ -85,7 +84,7 @@ COSE_RecipientInfo * _COSE_Recipient_Init_From_Object(cn_cbor * cbor, CBOR_CONTE
 {
 	COSE_RecipientInfo * pRecipient = NULL;
 
-	pRecipient = (COSE_RecipientInfo *)COSE_CALLOC(1, sizeof(COSE_RecipientInfo), context);
+	pRecipient = (COSE_RecipientInfo *)COSE_POOL_CALLOC(COSE_POOL_RECIPIENT, sizeof(COSE_RecipientInfo), context);
 	CHECK_CONDITION(pRecipient != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 #ifdef USE_ARRAY
@@ -93,7 +92,7 @@ COSE_RecipientInfo * _COSE_Recipient_Init_From_Object(cn_cbor * cbor, CBOR_CONTE
 #else
 	if (cbor->type != CN_CBOR_MAP) {
 		if (errp != NULL) errp->err = COSE_ERR_INVALID_PARAMETER;
-		COSE_FREE(pRecipient, context);
+		COSE_POOL_FREE(COSE_POOL_RECIPIENT, pRecipient, context);
 		return NULL;
 	}
 #endif
@@ -102,7 +101,7 @@ COSE_RecipientInfo * _COSE_Recipient_Init_From_Object(cn_cbor * cbor, CBOR_CONTE
 		goto errorReturn;
 	}
 
-	_COSE_InsertInList(&RecipientRoot, &pRecipient->m_encrypt.m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_RECIPIENT, &pRecipient->m_encrypt.m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return pRecipient;
 
@@ -113,12 +112,21 @@ errorReturn:
 
 void _COSE_Recipient_Free(COSE_RecipientInfo * pRecipient)
 {
+	COSE_RecipientInfo * pRecip2;
+	COSE_RecipientInfo * pRecip3;
+
 	if (pRecipient->m_encrypt.m_message.m_refCount > 1) {
 		pRecipient->m_encrypt.m_message.m_refCount--;
 		return;
 	}
 
-	COSE_FREE(pRecipient, &pRecipient->m_encrypt.m_message.m_allocContext);
+	for (pRecip2 = pRecipient->m_encrypt.m_recipientFirst; pRecip2 != NULL; pRecip2 = pRecip3) {
+		pRecip3 = pRecip2->m_recipientNext;
+		_COSE_Recipient_Free(pRecip2);
+	}
+
+	_COSE_Handle_Remove(COSE_HANDLE_RECIPIENT, &pRecipient->m_encrypt.m_message);
+	COSE_POOL_FREE(COSE_POOL_RECIPIENT, pRecipient, &pRecipient->m_encrypt.m_message.m_allocContext);
 
 	return;
 }
@@ -128,9 +136,10 @@ void _COSE_Recipient_Free(COSE_RecipientInfo * pRecipient)
 * Perform an AES-CCM Decryption operation
 *
 * @param[in]	COSE *		Pointer to COSE Encryption context object
+* @param[in]	COSE_CRYPTO_PROVIDER * Provider of the recipient algorithm
 * @param[in]	int			Alorithm key is being generated for
-* @param[in]	cn_cbor *	Private key
-* @param[in]	cn_cbor *	Public Key
+* @param[in]	COSE_KEY *	Private key
+* @param[in]	COSE_KEY *	Public Key
 * @param[out]	byte *		Buffer to return new key in	
 * @param[in]	size_t       Size of key to create in bits
 * @param[in]    size_t		Size of digest function
@@ -139,7 +148,41 @@ void _COSE_Recipient_Free(COSE_RecipientInfo * pRecipient)
 * @return                   Did the function succeed?
 */
 
-static bool HKDF_X(COSE * pCose, bool fHMAC, bool fECDH, bool fStatic, bool fSend, int algResult, const cn_cbor * pKeyPrivate, const cn_cbor * pKeyPublic, byte * pbKey, size_t cbitKey, size_t cbitHash, CBOR_CONTEXT_COMMA cose_errback * perr)
+/*! \private
+* @brief Compute the identity of an HKDF derivation in the derived key cache
+*
+* Ephemeral keys are never seen twice, so only ECDH-SS and direct HKDF
+* derivations are cached.
+*
+* @return false if the derivation is not to be cached
+*/
+
+static bool HKDF_CacheId(COSE * pCose, bool fHMAC, bool fECDH, bool fStatic, bool fSend, const COSE_KEY * pKeyPrivate, const COSE_KEY * pKeyPublic, size_t cbitHash, const byte * pbContext, size_t cbContext, COSE_KeyCacheId * pId)
+{
+	const cn_cbor * pPrivate = NULL;
+	const cn_cbor * pPeer = NULL;
+	const cn_cbor * cnSalt;
+
+	if (fECDH && !fStatic) return false;
+
+	if (pKeyPrivate != NULL) pPrivate = pKeyPrivate->m_cborKey;
+	if (pPrivate == NULL) return false;
+
+	if (fECDH) {
+		if (fSend) {
+			if (pKeyPublic != NULL) pPeer = pKeyPublic->m_cborKey;
+		}
+		else pPeer = _COSE_map_get_int(pCose, COSE_Header_ECDH_STATIC, COSE_BOTH, NULL);
+		if (pPeer == NULL) return false;
+	}
+
+	cnSalt = _COSE_map_get_int(pCose, COSE_Header_HKDF_salt, COSE_BOTH, NULL);
+	if (cnSalt == NULL) return _COSE_KeyCache_Id(pPrivate, pPeer, fHMAC, cbitHash, NULL, 0, pbContext, cbContext, pId);
+	if (cnSalt->type != CN_CBOR_BYTES) return false;
+	return _COSE_KeyCache_Id(pPrivate, pPeer, fHMAC, cbitHash, cnSalt->v.bytes, cnSalt->length, pbContext, cbContext, pId);
+}
+
+static bool HKDF_X(COSE * pCose, const COSE_CRYPTO_PROVIDER * pProvider, bool fHMAC, bool fECDH, bool fStatic, bool fSend, int algResult, const COSE_KEY * pKeyPrivate, const COSE_KEY * pKeyPublic, byte * pbKey, size_t cbitKey, size_t cbitHash, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	byte * pbContext = NULL;
 	size_t cbContext;
@@ -149,31 +192,44 @@ static bool HKDF_X(COSE * pCose, bool fHMAC, bool fECDH, bool fStatic, bool fSen
 	size_t cbDigest;
 	byte * pbSecret = NULL;
 	size_t cbSecret = 0;
+	COSE_KeyCacheId cacheId;
+	bool fCache;
 
 	if (!BuildContextBytes(pCose, algResult, cbitKey, &pbContext, &cbContext, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
+	fCache = HKDF_CacheId(pCose, fHMAC, fECDH, fStatic, fSend, pKeyPrivate, pKeyPublic, cbitHash, pbContext, cbContext, &cacheId);
+	if (fCache && _COSE_KeyCache_Find(&cacheId, pbKey, cbitKey / 8)) {
+		COSE_FREE(pbContext, context);
+		return true;
+	}
 
 	if (fECDH) {
 #ifdef USE_ECDH
 		cn_cbor * pkeyMessage;
+		COSE_KEY keyMessage;
+		COSE_KEY keyPrivate;
+		COSE_KEY keyPublic;
 
-		if (pKeyPrivate != NULL) {
-			cn = cn_cbor_mapget_int(pKeyPrivate, COSE_Key_Type);
+		if (pKeyPrivate != NULL && pKeyPrivate->m_cborKey != NULL) {
+			cn = cn_cbor_mapget_int(pKeyPrivate->m_cborKey, COSE_Key_Type);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_UINT), COSE_ERR_INVALID_PARAMETER);
 			CHECK_CONDITION(cn->v.uint == COSE_Key_Type_EC2, COSE_ERR_INVALID_PARAMETER);
 		}
 
-		if (pKeyPublic != NULL) {
-			cn = cn_cbor_mapget_int(pKeyPublic, COSE_Key_Type);
+		if (pKeyPublic != NULL && pKeyPublic->m_cborKey != NULL) {
+			cn = cn_cbor_mapget_int(pKeyPublic->m_cborKey, COSE_Key_Type);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_UINT), COSE_ERR_INVALID_PARAMETER);
 			CHECK_CONDITION(cn->v.uint == COSE_Key_Type_EC2, COSE_ERR_INVALID_PARAMETER);
 		}
 
 		if (fSend) {
-			CHECK_CONDITION(pKeyPublic != NULL, COSE_ERR_INVALID_PARAMETER);
-			pkeyMessage = (cn_cbor *) pKeyPrivate;
+			CHECK_CONDITION(pKeyPublic != NULL && pKeyPublic->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+			if (pKeyPrivate != NULL) _COSE_KEY_Copy(&keyMessage, pKeyPrivate, pProvider);
+			else _COSE_KEY_Wrap(&keyMessage, NULL);
+			_COSE_KEY_Copy(&keyPublic, pKeyPublic, pProvider);
 
-			if (!ECDH_ComputeSecret(pCose, &pkeyMessage, pKeyPublic, &pbSecret, &cbSecret, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+			if (!pProvider->pfnECDH_ComputeSecret(pCose, &keyMessage, &keyPublic, &pbSecret, &cbSecret, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+			pkeyMessage = (cn_cbor *) keyMessage.m_cborKey;
 			if (!fStatic && pkeyMessage->parent == NULL) {
 				if (!_COSE_map_put(pCose, COSE_Header_ECDH_EPHEMERAL, pkeyMessage, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
 			}
@@ -183,23 +239,26 @@ static bool HKDF_X(COSE * pCose, bool fHMAC, bool fECDH, bool fStatic, bool fSen
 			pkeyMessage = _COSE_map_get_int(pCose, fStatic ? COSE_Header_ECDH_STATIC : COSE_Header_ECDH_EPHEMERAL, COSE_BOTH, perr);
 
 			CHECK_CONDITION(pkeyMessage != NULL, COSE_ERR_INVALID_PARAMETER);
-			CHECK_CONDITION(pKeyPrivate != NULL, COSE_ERR_INVALID_PARAMETER);
+			CHECK_CONDITION(pKeyPrivate != NULL && pKeyPrivate->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
-			if (!ECDH_ComputeSecret(pCose, (cn_cbor **)&pKeyPrivate, pkeyMessage, &pbSecret, &cbSecret, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+			_COSE_KEY_Wrap(&keyMessage, pkeyMessage);
+			_COSE_KEY_Copy(&keyPrivate, pKeyPrivate, pProvider);
+
+			if (!pProvider->pfnECDH_ComputeSecret(pCose, &keyPrivate, &keyMessage, &pbSecret, &cbSecret, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		}
 #else
                 goto errorReturn;
 #endif
 	}
 	else {
-		CHECK_CONDITION(pKeyPrivate != NULL, COSE_ERR_INVALID_PARAMETER);
-			cn = cn_cbor_mapget_int(pKeyPrivate, COSE_Key_Type);
+		CHECK_CONDITION(pKeyPrivate != NULL && pKeyPrivate->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+			cn = cn_cbor_mapget_int(pKeyPrivate->m_cborKey, COSE_Key_Type);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_UINT), COSE_ERR_INVALID_PARAMETER);
 			CHECK_CONDITION(cn->v.uint == COSE_Key_Type_OCTET, COSE_ERR_INVALID_PARAMETER);
 
 		CHECK_CONDITION(cn->v.sint == 4, COSE_ERR_INVALID_PARAMETER);
 
-		cn = cn_cbor_mapget_int(pKeyPrivate, -1);
+		cn = cn_cbor_mapget_int(pKeyPrivate->m_cborKey, -1);
 		CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 		pbSecret = (byte *) cn->v.bytes;
 		cbSecret = cn->length;
@@ -207,20 +266,22 @@ static bool HKDF_X(COSE * pCose, bool fHMAC, bool fECDH, bool fStatic, bool fSen
 
 	if (fHMAC) {
 #ifdef USE_HKDF_SHA2
-		if (!HKDF_Extract(pCose, pbSecret, cbSecret, cbitHash, rgbDigest, &cbDigest, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnHKDF_Extract(pCose, pbSecret, cbSecret, cbitHash, rgbDigest, &cbDigest, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!HKDF_Expand(pCose, cbitHash, rgbDigest, cbDigest, pbContext, cbContext, pbKey, cbitKey / 8, perr)) goto errorReturn;
+		if (!pProvider->pfnHKDF_Expand(pCose, cbitHash, rgbDigest, cbDigest, pbContext, cbContext, pbKey, cbitKey / 8, perr)) goto errorReturn;
 #else
                 goto errorReturn;
 #endif
 	}
 	else {
 #ifdef USE_HKDF_AES
-		if (!HKDF_AES_Expand(pCose, cbitHash, pbSecret, cbSecret, pbContext, cbContext, pbKey, cbitKey / 8, perr)) goto errorReturn;
+		if (!pProvider->pfnHKDF_AES_Expand(pCose, cbitHash, pbSecret, cbSecret, pbContext, cbContext, pbKey, cbitKey / 8, perr)) goto errorReturn;
 #else
                 goto errorReturn;
 #endif
 	}
+
+	if (fCache) _COSE_KeyCache_Add(&cacheId, pbKey, cbitKey / 8);
 	fRet = true;
 
 errorReturn:
@@ -239,6 +300,7 @@ bool _COSE_Recipient_decrypt(COSE_RecipientInfo * pRecip, COSE_RecipientInfo * p
 	int alg;
 	const cn_cbor * cn = NULL;
 	COSE_RecipientInfo * pRecip2;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context;
 #endif
@@ -269,13 +331,15 @@ bool _COSE_Recipient_decrypt(COSE_RecipientInfo * pRecip, COSE_RecipientInfo * p
 	CHECK_CONDITION(cn->type != CN_CBOR_TEXT, COSE_ERR_UNKNOWN_ALGORITHM);
 	CHECK_CONDITION((cn->type == CN_CBOR_UINT) || (cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 	alg = (int)cn->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
+	pProvider = _COSE_Provider_Get(alg);
 
 	CHECK_CONDITION(pbKeyOut != NULL, COSE_ERR_INVALID_PARAMETER);
 
 	switch (alg) {
 	case COSE_Algorithm_Direct:
-		CHECK_CONDITION(pRecip->m_pkey != NULL, COSE_ERR_INVALID_PARAMETER);
-		cn = cn_cbor_mapget_int(pRecip->m_pkey, -1);
+		CHECK_CONDITION(pRecip->m_key.m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+		cn = cn_cbor_mapget_int(pRecip->m_key.m_cborKey, -1);
 		CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 		CHECK_CONDITION((cn->length == (unsigned int)cbitKeyOut / 8), COSE_ERR_INVALID_PARAMETER);
 		memcpy(pbKeyOut, cn->v.bytes, cn->length);
@@ -395,15 +459,15 @@ bool _COSE_Recipient_decrypt(COSE_RecipientInfo * pRecip, COSE_RecipientInfo * p
 	case COSE_Algorithm_AES_KW_128:
 		if (pbKeyX != NULL) {
 			int x = cbitKeyOut / 8;
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		else {
-			CHECK_CONDITION(pRecip->m_pkey != NULL, COSE_ERR_INVALID_PARAMETER);
+			CHECK_CONDITION(pRecip->m_key.m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
 			int x = cbitKeyOut / 8;
-			cn = cn_cbor_mapget_int(pRecip->m_pkey, -1);
+			cn = cn_cbor_mapget_int(pRecip->m_key.m_cborKey, -1);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		break;
 #endif
@@ -412,15 +476,15 @@ bool _COSE_Recipient_decrypt(COSE_RecipientInfo * pRecip, COSE_RecipientInfo * p
 	case COSE_Algorithm_AES_KW_192:
 		if (pbKeyX != NULL) {
 			int x = cbitKeyOut / 8;
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		else {
-			CHECK_CONDITION(pRecip->m_pkey != NULL, COSE_ERR_INVALID_PARAMETER);
+			CHECK_CONDITION(pRecip->m_key.m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
 			int x = cbitKeyOut / 8;
-			cn = cn_cbor_mapget_int(pRecip->m_pkey, -1);
+			cn = cn_cbor_mapget_int(pRecip->m_key.m_cborKey, -1);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		break;
 #endif
@@ -429,117 +493,117 @@ bool _COSE_Recipient_decrypt(COSE_RecipientInfo * pRecip, COSE_RecipientInfo * p
 	case COSE_Algorithm_AES_KW_256:
 		if (pbKeyX != NULL) {
 			int x = cbitKeyOut / 8;
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, pbKeyX, cbitKeyX, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		else {
-			CHECK_CONDITION(pRecip->m_pkey != NULL, COSE_ERR_INVALID_PARAMETER);
+			CHECK_CONDITION(pRecip->m_key.m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
 			int x = cbitKeyOut / 8;
-			cn = cn_cbor_mapget_int(pRecip->m_pkey, -1);
+			cn = cn_cbor_mapget_int(pRecip->m_key.m_cborKey, -1);
 			CHECK_CONDITION((cn != NULL) && (cn->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 
-			if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, cn->v.bytes, cn->length * 8, cnBody->v.bytes, cnBody->length, pbKeyOut, &x, perr)) goto errorReturn;
 		}
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_HMAC_SHA_256
 	case COSE_Algorithm_Direct_HKDF_HMAC_SHA_256:
-		if (!HKDF_X(&pcose->m_message, true, false, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, false, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_HMAC_SHA_512
 	case COSE_Algorithm_Direct_HKDF_HMAC_SHA_512:
-		if (!HKDF_X(&pcose->m_message, true, false, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, false, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_AES_128
 	case COSE_Algorithm_Direct_HKDF_AES_128:
-		if (!HKDF_X(&pcose->m_message, false, false, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 128, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, false, false, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 128, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_AES_256
 	case COSE_Algorithm_Direct_HKDF_AES_256:
-		if (!HKDF_X(&pcose->m_message, false, false, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, false, false, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_HKDF_256
 	case COSE_Algorithm_ECDH_ES_HKDF_256:
-		if (!HKDF_X(&pcose->m_message, true, true, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_HKDF_512
 	case COSE_Algorithm_ECDH_ES_HKDF_512:
-		if (!HKDF_X(&pcose->m_message, true, true, false, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, false, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_HKDF_256
 	case COSE_Algorithm_ECDH_SS_HKDF_256:
-		if (!HKDF_X(&pcose->m_message, true, true, true, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, true, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_HKDF_512
 	case COSE_Algorithm_ECDH_SS_HKDF_512:
-		if (!HKDF_X(&pcose->m_message, true, true, true, false, algIn, pRecip->m_pkey, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, true, false, algIn, &pRecip->m_key, NULL, pbKeyOut, cbitKeyOut, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A128KW
 	case COSE_Algorithm_ECDH_ES_A128KW:
-		if (!HKDF_X(&pcose->m_message, true, true, false, false, COSE_Algorithm_AES_KW_128, pRecip->m_pkey, NULL, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, false, false, COSE_Algorithm_AES_KW_128, &pRecip->m_key, NULL, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 128, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 128, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A192KW
 	case COSE_Algorithm_ECDH_ES_A192KW:
-		if (!HKDF_X(&pcose->m_message, true, true, false, false, COSE_Algorithm_AES_KW_192, pRecip->m_pkey, NULL, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, false, false, COSE_Algorithm_AES_KW_192, &pRecip->m_key, NULL, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 192, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 192, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A256KW
 	case COSE_Algorithm_ECDH_ES_A256KW:
-		if (!HKDF_X(&pcose->m_message, true, true, false, false, COSE_Algorithm_AES_KW_256, pRecip->m_pkey, NULL, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, false, false, COSE_Algorithm_AES_KW_256, &pRecip->m_key, NULL, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 256, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 256, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A128KW
 	case COSE_Algorithm_ECDH_SS_A128KW:
-		if (!HKDF_X(&pcose->m_message, true, true, true, false, COSE_Algorithm_AES_KW_128, pRecip->m_pkey, NULL, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, true, false, COSE_Algorithm_AES_KW_128, &pRecip->m_key, NULL, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 128, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 128, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A192KW
 	case COSE_Algorithm_ECDH_SS_A192KW:
-		if (!HKDF_X(&pcose->m_message, true, true, true, false, COSE_Algorithm_AES_KW_192, pRecip->m_pkey, NULL, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, true, false, COSE_Algorithm_AES_KW_192, &pRecip->m_key, NULL, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 192, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 192, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A256KW
 	case COSE_Algorithm_ECDH_SS_A256KW:
-		if (!HKDF_X(&pcose->m_message, true, true, true, false, COSE_Algorithm_AES_KW_256, pRecip->m_pkey, NULL, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pcose->m_message, pProvider, true, true, true, false, COSE_Algorithm_AES_KW_256, &pRecip->m_key, NULL, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-		if (!AES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 256, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Decrypt((COSE_Enveloped *)pcose, rgbKey, 256, cnBody->v.bytes, cnBody->length, pbKeyOut, &cbKey2, perr)) goto errorReturn;
 
 		break;
 #endif
@@ -557,6 +621,7 @@ bool _COSE_Recipient_encrypt(COSE_RecipientInfo * pRecipient, const byte * pbCon
 	int alg;
 	int t = 0;
 	COSE_RecipientInfo * pri;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 	const cn_cbor * cn_Alg = NULL;
 	byte * pbAuthData = NULL;
 	cn_cbor * ptmp = NULL;
@@ -582,6 +647,8 @@ bool _COSE_Recipient_encrypt(COSE_RecipientInfo * pRecipient, const byte * pbCon
 	CHECK_CONDITION(cn_Alg->type != CN_CBOR_TEXT, COSE_ERR_UNKNOWN_ALGORITHM);
 	CHECK_CONDITION((cn_Alg->type == CN_CBOR_UINT) || (cn_Alg->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 	alg = (int)cn_Alg->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
+	pProvider = _COSE_Provider_Get(alg);
 
 	//  Get the key size
 
@@ -699,7 +766,7 @@ bool _COSE_Recipient_encrypt(COSE_RecipientInfo * pRecipient, const byte * pbCon
 			pbKey = (byte *)COSE_CALLOC(cbitKey / 8, 1, context);
 			CHECK_CONDITION(pbKey != NULL, COSE_ERR_OUT_OF_MEMORY);
 			cbKey = cbitKey / 8;
-			rand_bytes(pbKey, cbKey);
+			CHECK_CONDITION(_COSE_Random(pbKey, cbKey), COSE_ERR_CRYPTO_FAIL);
 		}
 	}
 
@@ -749,82 +816,82 @@ bool _COSE_Recipient_encrypt(COSE_RecipientInfo * pRecipient, const byte * pbCon
 
 #ifdef USE_AES_KW_128
 	case COSE_Algorithm_AES_KW_128:
-		if (pRecipient->m_pkey != NULL) {
-			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_pkey, -1);
+		if (pRecipient->m_key.m_cborKey != NULL) {
+			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_key.m_cborKey, -1);
 			CHECK_CONDITION(pK != NULL, COSE_ERR_INVALID_PARAMETER);
-			if (!AES_KW_Encrypt(pRecipient, pK->v.bytes, (int)pK->length * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pK->v.bytes, (int)pK->length * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
 		}
 		else {
-			if (!AES_KW_Encrypt(pRecipient, pbKey, (int)cbKey * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pbKey, (int)cbKey * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
 		}
 		break;
 #endif
 
 #ifdef USE_AES_KW_192
 	case COSE_Algorithm_AES_KW_192:
-		if (pRecipient->m_pkey != NULL) {
-			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_pkey, -1);
+		if (pRecipient->m_key.m_cborKey != NULL) {
+			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_key.m_cborKey, -1);
 			CHECK_CONDITION(pK != NULL, COSE_ERR_INVALID_PARAMETER);
-			if (!AES_KW_Encrypt(pRecipient, pK->v.bytes, (int)pK->length * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pK->v.bytes, (int)pK->length * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
 		}
 		else {
-			if (!AES_KW_Encrypt(pRecipient, pbKey, (int)cbKey * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pbKey, (int)cbKey * 8, pbContent, (int)cbContent, perr)) goto errorReturn;
 		}
 		break;
 #endif
 
 #ifdef USE_AES_KW_256
 	case COSE_Algorithm_AES_KW_256:
-		if (pRecipient->m_pkey != NULL) {
-			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_pkey, -1);
+		if (pRecipient->m_key.m_cborKey != NULL) {
+			cn_cbor * pK = cn_cbor_mapget_int(pRecipient->m_key.m_cborKey, -1);
 			CHECK_CONDITION(pK != NULL, COSE_ERR_INVALID_PARAMETER);
-			if (!AES_KW_Encrypt(pRecipient, pK->v.bytes, (int) pK->length*8, pbContent, (int) cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pK->v.bytes, (int) pK->length*8, pbContent, (int) cbContent, perr)) goto errorReturn;
 		}
 		else {
-			if (!AES_KW_Encrypt(pRecipient, pbKey, (int) cbKey*8, pbContent, (int) cbContent, perr)) goto errorReturn;
+			if (!pProvider->pfnAES_KW_Encrypt(pRecipient, pbKey, (int) cbKey*8, pbContent, (int) cbContent, perr)) goto errorReturn;
 		}
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A128KW
 	case COSE_Algorithm_ECDH_ES_A128KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, false, true, COSE_Algorithm_AES_KW_128, NULL, pRecipient->m_pkey, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 128, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, false, true, COSE_Algorithm_AES_KW_128, NULL, &pRecipient->m_key, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 128, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A192KW
 	case COSE_Algorithm_ECDH_ES_A192KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, false, true, COSE_Algorithm_AES_KW_192, NULL, pRecipient->m_pkey, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 192, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, false, true, COSE_Algorithm_AES_KW_192, NULL, &pRecipient->m_key, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 192, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_A256KW
 	case COSE_Algorithm_ECDH_ES_A256KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, false, true, COSE_Algorithm_AES_KW_256, NULL, pRecipient->m_pkey, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 256, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, false, true, COSE_Algorithm_AES_KW_256, NULL, &pRecipient->m_key, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 256, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A128KW
 	case COSE_Algorithm_ECDH_SS_A128KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, true, true, COSE_Algorithm_AES_KW_128, pRecipient->m_pkeyStatic, pRecipient->m_pkey, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 128, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, true, true, COSE_Algorithm_AES_KW_128, &pRecipient->m_keyStatic, &pRecipient->m_key, rgbKey, 128, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 128, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A192KW
 	case COSE_Algorithm_ECDH_SS_A192KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, true, true, COSE_Algorithm_AES_KW_192, pRecipient->m_pkeyStatic, pRecipient->m_pkey, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 192, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, true, true, COSE_Algorithm_AES_KW_192, &pRecipient->m_keyStatic, &pRecipient->m_key, rgbKey, 192, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 192, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_A256KW
 	case COSE_Algorithm_ECDH_SS_A256KW:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, true, true, COSE_Algorithm_AES_KW_256, pRecipient->m_pkeyStatic, pRecipient->m_pkey, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
-		if (!AES_KW_Encrypt(pRecipient, rgbKey, 256, pbContent, (int)cbContent, perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, true, true, COSE_Algorithm_AES_KW_256, &pRecipient->m_keyStatic, &pRecipient->m_key, rgbKey, 256, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!pProvider->pfnAES_KW_Encrypt(pRecipient, rgbKey, 256, pbContent, (int)cbContent, perr)) goto errorReturn;
 		break;
 #endif
 
@@ -864,10 +931,13 @@ byte * _COSE_RecipientInfo_generateKey(COSE_RecipientInfo * pRecipient, int algI
 #endif
 	const cn_cbor * pK;
 	byte *pbSecret = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
 
 	CHECK_CONDITION(cn_Alg != NULL, COSE_ERR_INVALID_PARAMETER);
 	CHECK_CONDITION((cn_Alg->type == CN_CBOR_UINT) || (cn_Alg->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 	alg = (int)cn_Alg->v.uint;
+	_COSE_Stats_SetAlgorithm(alg);
+	pProvider = _COSE_Provider_Get(alg);
 
 	_COSE_encode_protected(&pRecipient->m_encrypt.m_message, perr);
 
@@ -876,8 +946,8 @@ byte * _COSE_RecipientInfo_generateKey(COSE_RecipientInfo * pRecipient, int algI
 
 	switch (alg) {
 	case COSE_Algorithm_Direct:
-		CHECK_CONDITION(pRecipient->m_pkey != NULL, COSE_ERR_INVALID_PARAMETER);
-			pK = cn_cbor_mapget_int(pRecipient->m_pkey, -1);
+		CHECK_CONDITION(pRecipient->m_key.m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+			pK = cn_cbor_mapget_int(pRecipient->m_key.m_cborKey, -1);
 			CHECK_CONDITION((pK != NULL) && (pK->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 			CHECK_CONDITION(pK->length == cbitKeySize / 8, COSE_ERR_INVALID_PARAMETER);
 			memcpy(pb, pK->v.bytes, cbitKeySize / 8);
@@ -885,49 +955,49 @@ byte * _COSE_RecipientInfo_generateKey(COSE_RecipientInfo * pRecipient, int algI
 
 #ifdef USE_Direct_HKDF_HMAC_SHA_256
 	case COSE_Algorithm_Direct_HKDF_HMAC_SHA_256:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, false, false, true, algIn, pRecipient->m_pkey, NULL, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, false, false, true, algIn, &pRecipient->m_key, NULL, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_HMAC_SHA_512
 	case COSE_Algorithm_Direct_HKDF_HMAC_SHA_512:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, false, false, true, algIn, pRecipient->m_pkey, NULL, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, false, false, true, algIn, &pRecipient->m_key, NULL, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_AES_128
 	case COSE_Algorithm_Direct_HKDF_AES_128:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, false, false, false, true, algIn, pRecipient->m_pkey, NULL, pb, cbitKeySize, 128, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, false, false, false, true, algIn, &pRecipient->m_key, NULL, pb, cbitKeySize, 128, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_Direct_HKDF_AES_256
 	case COSE_Algorithm_Direct_HKDF_AES_256:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, false, false, false, true, algIn, pRecipient->m_pkey, NULL, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, false, false, false, true, algIn, &pRecipient->m_key, NULL, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_HKDF_256
 	case COSE_Algorithm_ECDH_ES_HKDF_256:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, false, true, algIn, NULL, pRecipient->m_pkey, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, false, true, algIn, NULL, &pRecipient->m_key, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_ES_HKDF_512
 	case COSE_Algorithm_ECDH_ES_HKDF_512:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, false, true, algIn, NULL, pRecipient->m_pkey, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, false, true, algIn, NULL, &pRecipient->m_key, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_HKDF_256
 	case COSE_Algorithm_ECDH_SS_HKDF_256:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, true, true, algIn, pRecipient->m_pkeyStatic, pRecipient->m_pkey, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, true, true, algIn, &pRecipient->m_keyStatic, &pRecipient->m_key, pb, cbitKeySize, 256, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDH_SS_HKDF_512
 	case COSE_Algorithm_ECDH_SS_HKDF_512:
-		if (!HKDF_X(&pRecipient->m_encrypt.m_message, true, true, true, true, algIn, pRecipient->m_pkeyStatic, pRecipient->m_pkey, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
+		if (!HKDF_X(&pRecipient->m_encrypt.m_message, pProvider, true, true, true, true, algIn, &pRecipient->m_keyStatic, &pRecipient->m_key, pb, cbitKeySize, 512, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 		break;
 #endif
 
@@ -1031,7 +1101,35 @@ bool COSE_Recipient_SetKey(HCOSE_RECIPIENT h, const cn_cbor * pKey, cose_errback
 	CHECK_CONDITION(pKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
 	p = (COSE_RecipientInfo *)h;
-	p->m_pkey = pKey;
+	_COSE_KEY_Wrap(&p->m_key, pKey);
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Set the key for a recipient from a key object
+*
+* EC keys held by the key object are not parsed again for each message.
+* The key object must not be freed before the recipient object.
+*
+* @param h  Handle to the recipient object
+* @param hKey  Handle of the key object
+* @param perr  Location for return of error code
+* @return true on success
+*/
+
+bool COSE_Recipient_SetKey2(HCOSE_RECIPIENT h, HCOSE_KEY hKey, cose_errback * perr)
+{
+	COSE_RecipientInfo * p;
+
+	CHECK_CONDITION(IsValidRecipientHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	p = (COSE_RecipientInfo *)h;
+	p->m_key = *(COSE_KEY *)hKey;
 
 	return true;
 
@@ -1121,7 +1219,7 @@ bool COSE_Recipient_SetSenderKey(HCOSE_RECIPIENT h, const cn_cbor * pKey, int de
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
-	p->m_pkeyStatic = pKey;
+	_COSE_KEY_Wrap(&p->m_keyStatic, pKey);
 
 	f = true;
 errorReturn:
@@ -1130,6 +1228,35 @@ errorReturn:
 	return f;
 }
 
+/*!
+* @brief Set the senders static key from a key object
+*
+* Works as COSE_Recipient_SetSenderKey, but the EC key held by the key
+* object is used for the key agreement.  The key object must not be freed
+* before the recipient object.
+*
+* @param h  Handle to the recipient object
+* @param hKey  Handle of the key object containing the private key
+* @param destination 0 - set nothing, 1 - set spk_kid, 2 - set spk
+* @param perr location for return of error code
+* @return true on success
+*/
+
+bool COSE_Recipient_SetSenderKey2(HCOSE_RECIPIENT h, HCOSE_KEY hKey, int destination, cose_errback * perr)
+{
+	COSE_KEY * pKey = (COSE_KEY *)hKey;
+
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	if (!COSE_Recipient_SetSenderKey(h, pKey->m_cborKey, destination, perr)) goto errorReturn;
+	((COSE_RecipientInfo *)h)->m_keyStatic = *pKey;
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
 /*!
 * @brief Set the application external data for authentication
 *
@@ -1211,7 +1338,6 @@ errorReturn:
 }
 
 
-byte RgbDontUse4[8 * 1024];
 
 bool BuildContextBytes(COSE * pcose, int algID, size_t cbitKey, byte ** ppbContext, size_t * pcbContext, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
@@ -1343,11 +1469,8 @@ bool BuildContextBytes(COSE * pcose, int algID, size_t cbitKey, byte ** ppbConte
 		cnParam = NULL;
 	}
 
-	cbContext = cn_cbor_encoder_write(RgbDontUse4, 0, sizeof(RgbDontUse4), pArray);
-	CHECK_CONDITION(cbContext > 0, COSE_ERR_CBOR);
-	pbContext = (byte *)COSE_CALLOC(cbContext, 1, context);
-	CHECK_CONDITION(pbContext != NULL, COSE_ERR_OUT_OF_MEMORY);
-	CHECK_CONDITION(cn_cbor_encoder_write(pbContext, 0, cbContext, pArray), COSE_ERR_CBOR);
+	pbContext = _COSE_encode_cbor(pArray, &cbContext, CBOR_CONTEXT_PARAM_COMMA perr);
+	if (pbContext == NULL) goto errorReturn;
 
 	*ppbContext = pbContext;
 	*pcbContext = cbContext;
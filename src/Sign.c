@@ -7,17 +7,16 @@
 #include "cose.h"
 #include "cose_int.h"
 
-COSE * SignRoot = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_SIGN handle is valid
 *
 *  Internal function to test if a sign handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -28,7 +27,7 @@ bool IsValidSignHandle(HCOSE_SIGN h)
 	COSE_SignMessage * p = (COSE_SignMessage *)h;
 
 	if (p == NULL) return false;
-	return _COSE_IsInList(SignRoot, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_SIGN, (COSE *) p);
 }
 
 
@@ -42,16 +41,20 @@ bool IsValidSignHandle(HCOSE_SIGN h)
 HCOSE_SIGN COSE_Sign_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
-	COSE_SignMessage * pobj = (COSE_SignMessage *)COSE_CALLOC(1, sizeof(COSE_SignMessage), context);
+	COSE_SignMessage * pobj = (COSE_SignMessage *)COSE_POOL_CALLOC(COSE_POOL_SIGN, sizeof(COSE_SignMessage), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init(flags, &pobj->m_message, COSE_sign_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		_COSE_Sign_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_SIGN, pobj, context);
 		return NULL;
 	}
 
-	_COSE_InsertInList(&SignRoot, &pobj->m_message);
+	if (!_COSE_Handle_Add(COSE_HANDLE_SIGN, &pobj->m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_Sign_Release(pobj);
+		COSE_POOL_FREE(COSE_POOL_SIGN, pobj, context);
+		FAIL_CONDITION(COSE_ERR_OUT_OF_MEMORY);
+	}
 
 	return (HCOSE_SIGN)pobj;
 
@@ -67,7 +70,7 @@ HCOSE_SIGN _COSE_Sign_Init_From_Object(cn_cbor * cbor, COSE_SignMessage * pIn, C
 	cose_errback error = { 0 };
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_SignMessage *)COSE_CALLOC(1, sizeof(COSE_SignMessage), context);
+	if (pobj == NULL) pobj = (COSE_SignMessage *)COSE_POOL_CALLOC(COSE_POOL_SIGN, sizeof(COSE_SignMessage), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init_From_Object(&pobj->m_message, cbor, CBOR_CONTEXT_PARAM_COMMA perr)) {
@@ -89,14 +92,14 @@ HCOSE_SIGN _COSE_Sign_Init_From_Object(cn_cbor * cbor, COSE_SignMessage * pIn, C
 		pSigners = pSigners->next;
 	} while (pSigners != NULL);
 
-	if (pIn == NULL) _COSE_InsertInList(&SignRoot, &pobj->m_message);
+	CHECK_CONDITION((pIn != NULL) || _COSE_Handle_Add(COSE_HANDLE_SIGN, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_SIGN)pobj;
 
 errorReturn:
 	if (pobj != NULL) {
 		_COSE_Sign_Release(pobj);
-		if (pIn == NULL) COSE_FREE(pobj, context);
+		if (pIn == NULL) COSE_POOL_FREE(COSE_POOL_SIGN, pobj, context);
 	}
 	return NULL;
 }
@@ -116,7 +119,7 @@ bool COSE_Sign_Free(HCOSE_SIGN h)
 		return true;
 	}
 
-	_COSE_RemoveFromList(&SignRoot, &pMessage->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_SIGN, &pMessage->m_message);
 
 #ifdef USE_CBOR_CONTEXT
 	context = pMessage->m_message.m_allocContext;
@@ -124,7 +127,7 @@ bool COSE_Sign_Free(HCOSE_SIGN h)
 
 	_COSE_Sign_Release(pMessage);
 
-	COSE_FREE(pMessage, &context);
+	COSE_POOL_FREE(COSE_POOL_SIGN, pMessage, &context);
 
 	return true;
 }
@@ -137,7 +140,8 @@ void _COSE_Sign_Release(COSE_SignMessage * p)
 	for (pSigner = p->m_signerFirst; pSigner != NULL; pSigner = pSigner2)
 	{
 		pSigner2 = pSigner->m_signerNext;
-		_COSE_SignerInfo_Free(pSigner);
+		if (pSigner->m_message.m_refCount > 1) _COSE_Detach(&pSigner->m_message);
+		COSE_Signer_Free((HCOSE_SIGNER)pSigner);
 	}
 
 	_COSE_Release(&p->m_message);
@@ -229,6 +233,7 @@ bool COSE_Sign_Sign(HCOSE_SIGN h, cose_errback * perr)
 	COSE_SignerInfo * pSigner;
 	const cn_cbor * pcborBody;
 	const cn_cbor * pcborProtected;
+	int iStats;
 
 	if (!IsValidSignHandle(h)) {
 		CHECK_CONDITION(false, COSE_ERR_INVALID_HANDLE);
@@ -245,9 +250,14 @@ bool COSE_Sign_Sign(HCOSE_SIGN h, cose_errback * perr)
 	pcborProtected = _COSE_encode_protected(&pMessage->m_message, perr);
 	if (pcborProtected == NULL) goto errorReturn;
 
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_SIGN);
 	for (pSigner = pMessage->m_signerFirst; pSigner != NULL; pSigner = pSigner->m_signerNext) {
-		if (!_COSE_Signer_sign(pSigner, pcborBody, pcborProtected, perr)) goto errorReturn;
+		if (!_COSE_Signer_sign(pSigner, pcborBody, pcborProtected, perr)) {
+			_COSE_Stats_Leave(iStats);
+			goto errorReturn;
+		}
 	}
+	_COSE_Stats_Leave(iStats);
 
 	return true;
 }
@@ -259,6 +269,7 @@ bool COSE_Sign_validate(HCOSE_SIGN hSign, HCOSE_SIGNER hSigner, cose_errback * p
 	COSE_SignerInfo * pSigner;
 	const cn_cbor * cnContent;
 	const cn_cbor * cnProtected;
+	int iStats;
 
 	CHECK_CONDITION(IsValidSignHandle(hSign), COSE_ERR_INVALID_HANDLE);
 	CHECK_CONDITION(IsValidSignerHandle(hSigner), COSE_ERR_INVALID_HANDLE);
@@ -272,7 +283,9 @@ bool COSE_Sign_validate(HCOSE_SIGN hSign, HCOSE_SIGNER hSigner, cose_errback * p
 	cnProtected = _COSE_arrayget_int(&pSign->m_message, INDEX_PROTECTED);
 	CHECK_CONDITION(cnProtected != NULL && cnProtected->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
 
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_VERIFY);
 	f = _COSE_Signer_validate(pSign, pSigner, cnContent, cnProtected, perr);
+	_COSE_Stats_Leave(iStats);
 
 	return f;
 
@@ -8,21 +8,20 @@
 #include "cose_int.h"
 #include "crypto.h"
 
-bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const cn_cbor * pKey, cose_errback * perr);
-bool _COSE_Signer0_validate(COSE_Sign0Message * pSign, const cn_cbor * pKey, cose_errback * perr);
+bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const COSE_KEY * pKey, cose_errback * perr);
+bool _COSE_Signer0_validate(COSE_Sign0Message * pSign, const COSE_KEY * pKey, cose_errback * perr);
 void _COSE_Sign0_Release(COSE_Sign0Message * p);
 
-COSE * Sign0Root = NULL;
-
 /*! \private
 * @brief Test if a HCOSE_SIGN0 handle is valid
 *
 *  Internal function to test if a sign0 message handle is valid.
-*  This will start returning invalid results and cause the code to
-*  crash if handles are not released before the memory that underlies them
-*  is deallocated.  This is an issue of a block allocator is used since
-*  in that case it is common to allocate memory but never to de-allocate it
-*  and just do that in a single big block.
+*  The check is a lookup in the handle registry and does not touch the
+*  object.  It can still return invalid results if handles are not released
+*  before the memory that underlies them is reused for a new object.  This
+*  is an issue if a block allocator is used since in that case it is common
+*  to allocate memory but never to de-allocate it and just do that in a
+*  single big block.
 *
 *  @param h handle to be validated
 *  @returns result of check
@@ -33,14 +32,14 @@ bool IsValidSign0Handle(HCOSE_SIGN0 h)
 	COSE_Sign0Message * p = (COSE_Sign0Message *)h;
 
 	if (p == NULL) return false;
-	return _COSE_IsInList(Sign0Root, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_SIGN0, (COSE *) p);
 }
 
 
 HCOSE_SIGN0 COSE_Sign0_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	CHECK_CONDITION(flags == COSE_INIT_FLAGS_NONE, COSE_ERR_INVALID_PARAMETER);
-	COSE_Sign0Message * pobj = (COSE_Sign0Message *)COSE_CALLOC(1, sizeof(COSE_Sign0Message), context);
+	COSE_Sign0Message * pobj = (COSE_Sign0Message *)COSE_POOL_CALLOC(COSE_POOL_SIGN0, sizeof(COSE_Sign0Message), context);
 	if (pobj == NULL) {
 		if (perr != NULL) perr->err = COSE_ERR_OUT_OF_MEMORY;
 		return NULL;
@@ -48,11 +47,15 @@ HCOSE_SIGN0 COSE_Sign0_Init(COSE_INIT_FLAGS flags, CBOR_CONTEXT_COMMA cose_errba
 
 	if (!_COSE_Init(flags,&pobj->m_message, COSE_sign_object, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		_COSE_Sign0_Release(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_SIGN0, pobj, context);
 		return NULL;
 	}
 
-	_COSE_InsertInList(&Sign0Root, &pobj->m_message);
+	if (!_COSE_Handle_Add(COSE_HANDLE_SIGN0, &pobj->m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_Sign0_Release(pobj);
+		COSE_POOL_FREE(COSE_POOL_SIGN0, pobj, context);
+		FAIL_CONDITION(COSE_ERR_OUT_OF_MEMORY);
+	}
 
 	return (HCOSE_SIGN0)pobj;
 
@@ -67,21 +70,21 @@ HCOSE_SIGN0 _COSE_Sign0_Init_From_Object(cn_cbor * cbor, COSE_Sign0Message * pIn
 
 	if (perr == NULL) perr = &error;
 
-	if (pobj == NULL) pobj = (COSE_Sign0Message *)COSE_CALLOC(1, sizeof(COSE_Sign0Message), context);
+	if (pobj == NULL) pobj = (COSE_Sign0Message *)COSE_POOL_CALLOC(COSE_POOL_SIGN0, sizeof(COSE_Sign0Message), context);
 	CHECK_CONDITION(pobj != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	if (!_COSE_Init_From_Object(&pobj->m_message, cbor, CBOR_CONTEXT_PARAM_COMMA perr)) {
 		goto errorReturn;
 	}
 
-	if (pIn == NULL) _COSE_InsertInList(&Sign0Root, &pobj->m_message);
+	CHECK_CONDITION((pIn != NULL) || _COSE_Handle_Add(COSE_HANDLE_SIGN0, &pobj->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 
 	return(HCOSE_SIGN0)pobj;
 
 errorReturn:
 	if (pobj != NULL) {
 		_COSE_Sign0_Release(pobj);
-		if (pIn == NULL) COSE_FREE(pobj, context);
+		if (pIn == NULL) COSE_POOL_FREE(COSE_POOL_SIGN0, pobj, context);
 	}
 	return NULL;
 }
@@ -101,7 +104,7 @@ bool COSE_Sign0_Free(HCOSE_SIGN0 h)
 		return true;
 	}
 
-	_COSE_RemoveFromList(&Sign0Root, &pMessage->m_message);
+	_COSE_Handle_Remove(COSE_HANDLE_SIGN0, &pMessage->m_message);
 
 #ifdef USE_CBOR_CONTEXT
 	context = pMessage->m_message.m_allocContext;
@@ -109,7 +112,7 @@ bool COSE_Sign0_Free(HCOSE_SIGN0 h)
 
 	_COSE_Sign0_Release(pMessage);
 
-	COSE_FREE(pMessage, &context);
+	COSE_POOL_FREE(COSE_POOL_SIGN0, pMessage, &context);
 
 	return true;
 }
@@ -173,13 +176,15 @@ bool COSE_Sign0_SetExternal(HCOSE_SIGN0 hcose, const byte * pbExternalData, size
 	return _COSE_SetExternal(&((COSE_Sign0Message *)hcose)->m_message, pbExternalData, cbExternalData, perr);
 }
 
-bool COSE_Sign0_Sign(HCOSE_SIGN0 h, const cn_cbor * pKey, cose_errback * perr)
+static bool Sign0_Sign(HCOSE_SIGN0 h, const COSE_KEY * pKey, cose_errback * perr)
 {
 #ifdef USE_CBOR_CONTEXT
 	// cn_cbor_context * context = NULL;
 #endif
 	COSE_Sign0Message * pMessage = (COSE_Sign0Message *)h;
 	const cn_cbor * pcborProtected;
+	bool f;
+	int iStats;
 
 	if (!IsValidSign0Handle(h)) {
 		CHECK_CONDITION(false, COSE_ERR_INVALID_HANDLE);
@@ -193,17 +198,21 @@ bool COSE_Sign0_Sign(HCOSE_SIGN0 h, const cn_cbor * pKey, cose_errback * perr)
 	pcborProtected = _COSE_encode_protected(&pMessage->m_message, perr);
 	if (pcborProtected == NULL) goto errorReturn;
 
-	if (!_COSE_Signer0_sign(pMessage, pKey, perr)) goto errorReturn;
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_SIGN);
+	f = _COSE_Signer0_sign(pMessage, pKey, perr);
+	_COSE_Stats_Leave(iStats);
+	if (!f) goto errorReturn;
 
 	return true;
 }
 
-bool COSE_Sign0_validate(HCOSE_SIGN0 hSign, const cn_cbor * pKey, cose_errback * perr)
+static bool Sign0_validate(HCOSE_SIGN0 hSign, const COSE_KEY * pKey, cose_errback * perr)
 {
 	bool f;
 	COSE_Sign0Message * pSign;
 	const cn_cbor * cnContent;
 	const cn_cbor * cnProtected;
+	int iStats;
 
 	CHECK_CONDITION(IsValidSign0Handle(hSign), COSE_ERR_INVALID_HANDLE);
 
@@ -215,7 +224,9 @@ bool COSE_Sign0_validate(HCOSE_SIGN0 hSign, const cn_cbor * pKey, cose_errback *
 	cnProtected = _COSE_arrayget_int(&pSign->m_message, INDEX_PROTECTED);
 	CHECK_CONDITION(cnProtected != NULL && cnProtected->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
 
+	iStats = _COSE_Stats_Enter(COSE_STATS_OP_VERIFY);
 	f = _COSE_Signer0_validate(pSign, pKey,  perr);
+	_COSE_Stats_Leave(iStats);
 
 	return f;
 
@@ -223,6 +234,65 @@ errorReturn:
 	return false;
 }
 
+bool COSE_Sign0_Sign(HCOSE_SIGN0 h, const cn_cbor * pKey, cose_errback * perr)
+{
+	COSE_KEY key;
+
+	_COSE_KEY_Wrap(&key, pKey);
+	return Sign0_Sign(h, &key, perr);
+}
+
+bool COSE_Sign0_validate(HCOSE_SIGN0 hSign, const cn_cbor * pKey, cose_errback * perr)
+{
+	COSE_KEY key;
+
+	_COSE_KEY_Wrap(&key, pKey);
+	return Sign0_validate(hSign, &key, perr);
+}
+
+/*!
+* @brief Sign a message with a key object
+*
+* The EC key held by the key object is used directly rather than parsing
+* the COSE_Key map for each message.
+*
+* @param h  Handle of the message to be signed
+* @param hKey  Handle of the key object
+* @param perr  Location for return of error code
+* @return true on success
+*/
+
+bool COSE_Sign0_Sign2(HCOSE_SIGN0 h, HCOSE_KEY hKey, cose_errback * perr)
+{
+	CHECK_CONDITION(IsValidSign0Handle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	return Sign0_Sign(h, (COSE_KEY *)hKey, perr);
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Validate the signature of a message with a key object
+*
+* @param hSign  Handle of the message to be validated
+* @param hKey  Handle of the key object
+* @param perr  Location for return of error code
+* @return true if the signature is valid
+*/
+
+bool COSE_Sign0_validate2(HCOSE_SIGN0 hSign, HCOSE_KEY hKey, cose_errback * perr)
+{
+	CHECK_CONDITION(IsValidSign0Handle(hSign), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	return Sign0_validate(hSign, (COSE_KEY *)hKey, perr);
+
+errorReturn:
+	return false;
+}
+
 
 cn_cbor * COSE_Sign0_map_get_int(HCOSE_SIGN0 h, int key, int flags, cose_errback * perror)
 {
@@ -246,72 +316,33 @@ errorReturn:
 }
 
 
-byte RgbDontUse4[8 * 1024];
-byte RgbDontUseSign[8 * 1024];
+
+/*
+ *  Build the Sig_structure up to and including the head of the payload.
+ *  The payload itself is hashed in place by the signature algorithm.
+ */
 
 static bool CreateSign0AAD(COSE_Sign0Message * pMessage, byte ** ppbToSign, size_t * pcbToSign, char * szContext, cose_errback * perr)
 {
-	cn_cbor * pArray = NULL;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pMessage->m_message.m_allocContext;
 #endif
-	cn_cbor_errback cbor_error;
-	cn_cbor * cn = NULL;
-	cn_cbor * cn2;
-	size_t cbToSign;
-	byte * pbToSign = NULL;
-
-	pArray = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(pArray != NULL, cbor_error);
-
-	cn = cn_cbor_string_create(szContext, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
+	cn_cbor * pcnProtected;
+	cn_cbor * pcnBody;
 
-	cn2 = _COSE_arrayget_int(&pMessage->m_message, INDEX_PROTECTED);
-	CHECK_CONDITION(cn2 != NULL, COSE_ERR_INVALID_PARAMETER);
+	pcnProtected = _COSE_arrayget_int(&pMessage->m_message, INDEX_PROTECTED);
+	CHECK_CONDITION(pcnProtected != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	if ((cn2->length == 1) && (cn2->v.bytes[0] == 0xa0)) cn = cn_cbor_data_create(NULL, 0, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	else cn = cn_cbor_data_create(cn2->v.bytes, (int)cn2->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
+	pcnBody = _COSE_arrayget_int(&pMessage->m_message, INDEX_BODY);
+	CHECK_CONDITION(pcnBody != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	cn = cn_cbor_data_create(pMessage->m_message.m_pbExternal, (int) pMessage->m_message.m_cbExternal, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	cn2 = _COSE_arrayget_int(&pMessage->m_message, INDEX_BODY);
-	cn = cn_cbor_data_create(cn2->v.bytes, (int)cn2->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-
-	cbToSign = cn_cbor_encoder_write(RgbDontUse4, 0, sizeof(RgbDontUse4), pArray);
-	CHECK_CONDITION(cbToSign > 0, COSE_ERR_CBOR);
-	pbToSign = (byte *)COSE_CALLOC(cbToSign, 1, context);
-	CHECK_CONDITION(pbToSign != NULL, COSE_ERR_OUT_OF_MEMORY);
-	CHECK_CONDITION(cn_cbor_encoder_write(pbToSign, 0, cbToSign, pArray), COSE_ERR_CBOR);
-
-	*ppbToSign = pbToSign;
-	*pcbToSign = cbToSign;
-	pbToSign = NULL;
-
-	if (cn != NULL) CN_CBOR_FREE(cn, context);
-	if (pArray != NULL) COSE_FREE(pArray, context);
-	return true;
+	return _COSE_Structure_Build(szContext, pcnProtected, NULL, pMessage->m_message.m_pbExternal, pMessage->m_message.m_cbExternal, pcnBody, true, ppbToSign, pcbToSign, CBOR_CONTEXT_PARAM_COMMA perr);
 
 errorReturn:
-	if (pbToSign != NULL) COSE_FREE(pbToSign, context);
-	if (cn != NULL) CN_CBOR_FREE(cn, context);
-	if (pArray != NULL) COSE_FREE(pArray, context);
 	return false;
 }
 
-bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const cn_cbor * pKey, cose_errback * perr)
+bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const COSE_KEY * pKey, cose_errback * perr)
 {
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pSigner->m_message.m_allocContext;
@@ -320,10 +351,13 @@ bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const cn_cbor * pKey, cose_
 	cn_cbor * pcborProtected2 = NULL;
 	cn_cbor * pArray = NULL;
 	cn_cbor * cn = NULL;
+	const cn_cbor * pcnBody;
 	size_t cbToSign;
 	byte * pbToSign = NULL;
 	bool f;
 	int alg;
+	const COSE_CRYPTO_PROVIDER * pProvider;
+	COSE_KEY key;
 
 	pArray = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA NULL);
 	if (pArray == NULL) {
@@ -346,27 +380,38 @@ bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const cn_cbor * pKey, cose_
 		CHECK_CONDITION((cn->type == CN_CBOR_UINT || cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 
 		alg = (int)cn->v.uint;
+		_COSE_Stats_SetAlgorithm(alg);
 	}
 
 
 	if (!CreateSign0AAD(pSigner, &pbToSign, &cbToSign, "Signature1", perr)) goto errorReturn;
+	pcnBody = _COSE_arrayget_int(&pSigner->m_message, INDEX_BODY);
+
+	pProvider = _COSE_Provider_Get(alg);
+	_COSE_KEY_Copy(&key, pKey, pProvider);
 
 	switch (alg) {
 #ifdef USE_ECDSA_SHA_256
 	case COSE_Algorithm_ECDSA_SHA_256:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, pKey, 256, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, &key, 256, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr);
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_384
 	case COSE_Algorithm_ECDSA_SHA_384:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, pKey, 384, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, &key, 384, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr);
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_512
 	case COSE_Algorithm_ECDSA_SHA_512:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, pKey, 512, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, &key, 512, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr);
+		break;
+#endif
+
+#ifdef USE_EDDSA
+	case COSE_Algorithm_EdDSA:
+		f = pProvider->pfnEdDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE+1, &key, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr);
 		break;
 #endif
 	default:
@@ -379,16 +424,19 @@ bool _COSE_Signer0_sign(COSE_Sign0Message * pSigner, const cn_cbor * pKey, cose_
 	return f;
 }
 
-bool _COSE_Signer0_validate(COSE_Sign0Message * pSign, const cn_cbor * pKey, cose_errback * perr)
+bool _COSE_Signer0_validate(COSE_Sign0Message * pSign, const COSE_KEY * pKey, cose_errback * perr)
 {
 	byte * pbToSign = NULL;
 	int alg;
 	const cn_cbor * cn = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
+	COSE_KEY key;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = NULL;
 #endif
 	size_t cbToSign;
 	cn_cbor * cnSignature = NULL;
+	const cn_cbor * pcnBody;
 	bool fRet = false;
 
 #ifdef USE_CBOR_CONTEXT
@@ -405,30 +453,41 @@ bool _COSE_Signer0_validate(COSE_Sign0Message * pSign, const cn_cbor * pKey, cos
 		CHECK_CONDITION((cn->type == CN_CBOR_UINT || cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 
 		alg = (int)cn->v.uint;
+		_COSE_Stats_SetAlgorithm(alg);
 	}
 
 	//  Build protected headers
 
 	if (!CreateSign0AAD(pSign, &pbToSign, &cbToSign, "Signature1", perr)) goto errorReturn;
+	pcnBody = _COSE_arrayget_int(&pSign->m_message, INDEX_BODY);
 
 	cnSignature = _COSE_arrayget_int(&pSign->m_message, INDEX_SIGNATURE);
 
+	pProvider = _COSE_Provider_Get(alg);
+	_COSE_KEY_Copy(&key, pKey, pProvider);
+
 	switch (alg) {
 #ifdef USE_ECDSA_SHA_256
 	case COSE_Algorithm_ECDSA_SHA_256:
-		if (!ECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, pKey, 256, pbToSign, cbToSign, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, &key, 256, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_384
 	case COSE_Algorithm_ECDSA_SHA_384:
-		if (!ECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, pKey, 384, pbToSign, cbToSign, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, &key, 384, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_512
 	case COSE_Algorithm_ECDSA_SHA_512:
-		if (!ECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, pKey, 512, pbToSign, cbToSign, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, &key, 512, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr)) goto errorReturn;
+		break;
+#endif
+
+#ifdef USE_EDDSA
+	case COSE_Algorithm_EdDSA:
+		if (!pProvider->pfnEdDSA_Verify(&pSign->m_message, INDEX_SIGNATURE+1, &key, pbToSign, cbToSign, pcnBody->v.bytes, (pcnBody->type == CN_CBOR_BYTES) ? pcnBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
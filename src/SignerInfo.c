@@ -12,12 +12,10 @@
 
 extern bool IsValidSignHandle(HCOSE_SIGN h);
 
-COSE * SignerRoot = NULL;
-
 bool IsValidSignerHandle(HCOSE_SIGNER h)
 {
 	COSE_SignerInfo * p = (COSE_SignerInfo *)h;
-	return _COSE_IsInList(SignerRoot, (COSE *) p);
+	return _COSE_Handle_IsValid(COSE_HANDLE_SIGNER, (COSE *) p);
 }
 
 
@@ -29,6 +27,7 @@ bool _COSE_SignerInfo_Free(COSE_SignerInfo * pSigner)
 		return true;
 	}
 
+	_COSE_Handle_Remove(COSE_HANDLE_SIGNER, &pSigner->m_message);
 	_COSE_Release(&pSigner->m_message);
 
 	return true;
@@ -48,9 +47,7 @@ bool COSE_Signer_Free(HCOSE_SIGNER hSigner)
 
 	_COSE_SignerInfo_Free(pSigner);
 
-	_COSE_RemoveFromList(&SignerRoot, &pSigner->m_message);
-
-	COSE_FREE(pSigner, &pSigner->m_message.m_allocContext);
+	COSE_POOL_FREE(COSE_POOL_SIGNER, pSigner, &pSigner->m_message.m_allocContext);
 
 	fRet = true;
 errorReturn:
@@ -60,7 +57,7 @@ errorReturn:
 
 HCOSE_SIGNER COSE_Signer_Init(CBOR_CONTEXT_COMMA cose_errback * perror)
 {
-	COSE_SignerInfo * pobj = (COSE_SignerInfo *)COSE_CALLOC(1, sizeof(COSE_SignerInfo), context);
+	COSE_SignerInfo * pobj = (COSE_SignerInfo *)COSE_POOL_CALLOC(COSE_POOL_SIGNER, sizeof(COSE_SignerInfo), context);
 	if (pobj == NULL) {
 		if (perror != NULL) perror->err = COSE_ERR_OUT_OF_MEMORY;
 		return NULL;
@@ -68,11 +65,17 @@ HCOSE_SIGNER COSE_Signer_Init(CBOR_CONTEXT_COMMA cose_errback * perror)
 
 	if (!_COSE_SignerInfo_Init(COSE_INIT_FLAGS_NO_CBOR_TAG, pobj, COSE_recipient_object, CBOR_CONTEXT_PARAM_COMMA perror)) {
 		_COSE_SignerInfo_Free(pobj);
-		COSE_FREE(pobj, context);
+		COSE_POOL_FREE(COSE_POOL_SIGNER, pobj, context);
+		return NULL;
+	}
+
+	if (!_COSE_Handle_Add(COSE_HANDLE_SIGNER, &pobj->m_message CBOR_CONTEXT_PARAM)) {
+		_COSE_SignerInfo_Free(pobj);
+		COSE_POOL_FREE(COSE_POOL_SIGNER, pobj, context);
+		if (perror != NULL) perror->err = COSE_ERR_OUT_OF_MEMORY;
 		return NULL;
 	}
 
-	_COSE_InsertInList(&SignerRoot, &pobj->m_message);
 	return (HCOSE_SIGNER)pobj;
 }
 
@@ -87,7 +90,7 @@ COSE_SignerInfo * _COSE_SignerInfo_Init_From_Object(cn_cbor * cbor, COSE_SignerI
 	COSE_SignerInfo * pSigner = pIn;
 
 	if (pSigner == NULL) {
-		pSigner = (COSE_SignerInfo *)COSE_CALLOC(1, sizeof(COSE_SignerInfo), context);
+		pSigner = (COSE_SignerInfo *)COSE_POOL_CALLOC(COSE_POOL_SIGNER, sizeof(COSE_SignerInfo), context);
 		CHECK_CONDITION(pSigner != NULL, COSE_ERR_OUT_OF_MEMORY);
 	}
 
@@ -95,75 +98,30 @@ COSE_SignerInfo * _COSE_SignerInfo_Init_From_Object(cn_cbor * cbor, COSE_SignerI
 
 	if (!_COSE_Init_From_Object(&pSigner->m_message, cbor, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
-	_COSE_InsertInList(&SignerRoot, &pSigner->m_message);
+	CHECK_CONDITION(_COSE_Handle_Add(COSE_HANDLE_SIGNER, &pSigner->m_message CBOR_CONTEXT_PARAM), COSE_ERR_OUT_OF_MEMORY);
 	return pSigner;
 
 errorReturn:
 	if (pSigner != NULL) {
 		_COSE_SignerInfo_Free(pSigner);
-		if (pIn == NULL) COSE_FREE(pSigner, context);
+		if (pIn == NULL) COSE_POOL_FREE(COSE_POOL_SIGNER, pSigner, context);
 	}
 	return NULL;
 }
 
-byte RgbDontUse4[1024];
+/*
+ *  Build the Sig_structure up to and including the head of the payload.
+ *  The payload itself is hashed in place by the signature algorithm.
+ */
 
 bool BuildToBeSigned(byte ** ppbToSign, size_t * pcbToSign, const cn_cbor * pcborBody, const cn_cbor * pcborProtected, const cn_cbor * pcborProtectedSign, const byte * pbExternal, size_t cbExternal, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
-	cn_cbor * pArray = NULL;
-	cn_cbor_errback cbor_error;
-	size_t cbToSign;
-	byte * pbToSign = NULL;
-	bool f = false;
-	cn_cbor * cn = NULL;
-
-	pArray = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(pArray != NULL, cbor_error);
-
-	cn = cn_cbor_string_create("Signature", CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	if (pcborProtected->length == 1 && (pcborProtected->v.bytes[0] == 0xa0)) cn = cn_cbor_data_create(NULL, 0, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	else cn = cn_cbor_data_create(pcborProtected->v.bytes, (int)pcborProtected->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	if ((pcborProtectedSign->length == 1) && (pcborProtectedSign->v.bytes[0] == 0xa0)) cn = cn_cbor_data_create(NULL, 0, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	else cn = cn_cbor_data_create(pcborProtectedSign->v.bytes, (int)pcborProtectedSign->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	cn = cn_cbor_data_create(pbExternal, (int) cbExternal, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	cn = cn_cbor_data_create(pcborBody->v.bytes, (int)pcborBody->length, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-	CHECK_CONDITION_CBOR(cn != NULL, cbor_error);
-	CHECK_CONDITION_CBOR(cn_cbor_array_append(pArray, cn, &cbor_error), cbor_error);
-	cn = NULL;
-
-	cbToSign = cn_cbor_encoder_write(RgbDontUse4, 0, sizeof(RgbDontUse4), pArray);
-	CHECK_CONDITION(cbToSign > 0, COSE_ERR_CBOR);
-	pbToSign = (byte *)COSE_CALLOC(cbToSign, 1, context);
-	CHECK_CONDITION(pbToSign != NULL, COSE_ERR_OUT_OF_MEMORY);
-	CHECK_CONDITION(cn_cbor_encoder_write(pbToSign, 0, cbToSign, pArray), COSE_ERR_CBOR);
-
-	*ppbToSign = pbToSign;
-	*pcbToSign = cbToSign;
-	pbToSign = NULL;
-	f = true;
-	
-errorReturn:
-	if (cn != NULL) CN_CBOR_FREE(cn, context);
-	if (pArray != NULL) CN_CBOR_FREE(pArray, context);
-	if (pbToSign != NULL) COSE_FREE(pbToSign, context);
-	return f;
+	CHECK_CONDITION(pcborProtectedSign != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	return _COSE_Structure_Build("Signature", pcborProtected, pcborProtectedSign, pbExternal, cbExternal, pcborBody, true, ppbToSign, pcbToSign, CBOR_CONTEXT_PARAM_COMMA perr);
 
+errorReturn:
+	return false;
 }
 
 
@@ -180,6 +138,8 @@ bool _COSE_Signer_sign(COSE_SignerInfo * pSigner, const cn_cbor * pcborBody, con
 	bool f;
 	int alg;
 	bool fRet = false;
+	const COSE_CRYPTO_PROVIDER * pProvider;
+	COSE_KEY key;
 
 	pArray = cn_cbor_array_create(CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(pArray != NULL, COSE_ERR_OUT_OF_MEMORY);
@@ -194,6 +154,7 @@ bool _COSE_Signer_sign(COSE_SignerInfo * pSigner, const cn_cbor * pcborBody, con
 		CHECK_CONDITION((cnAlgorithm->type == CN_CBOR_UINT || cnAlgorithm->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 
 		alg = (int)cnAlgorithm->v.sint;
+		_COSE_Stats_SetAlgorithm(alg);
 	}
 
 	pcborProtectedSign = _COSE_encode_protected(&pSigner->m_message, perr);
@@ -201,22 +162,31 @@ bool _COSE_Signer_sign(COSE_SignerInfo * pSigner, const cn_cbor * pcborBody, con
 
 	if (!BuildToBeSigned(&pbToSign, &cbToSign, pcborBody, pcborProtected, pcborProtectedSign, pSigner->m_message.m_pbExternal, pSigner->m_message.m_cbExternal, CBOR_CONTEXT_PARAM_COMMA perr)) goto errorReturn;
 
+	pProvider = _COSE_Provider_Get(alg);
+	_COSE_KEY_Copy(&key, &pSigner->m_key, pProvider);
+
 	switch (alg) {
 #ifdef USE_ECDSA_SHA_256
 	case COSE_Algorithm_ECDSA_SHA_256:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 256, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, &key, 256, pbToSign, cbToSign, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr);
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_384
 	case COSE_Algorithm_ECDSA_SHA_384:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 384, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, &key, 384, pbToSign, cbToSign, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr);
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_512
 	case COSE_Algorithm_ECDSA_SHA_512:
-		f = ECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 512, pbToSign, cbToSign, perr);
+		f = pProvider->pfnECDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, &key, 512, pbToSign, cbToSign, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr);
+		break;
+#endif
+
+#ifdef USE_EDDSA
+	case COSE_Algorithm_EdDSA:
+		f = pProvider->pfnEdDSA_Sign(&pSigner->m_message, INDEX_SIGNATURE, &key, pbToSign, cbToSign, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr);
 		break;
 #endif
 
@@ -241,7 +211,36 @@ bool COSE_Signer_SetKey(HCOSE_SIGNER h, const cn_cbor * pKey, cose_errback * per
 	CHECK_CONDITION(pKey != NULL, COSE_ERR_INVALID_PARAMETER);
 
 	p = (COSE_SignerInfo *)h;
-	p->m_pkey = pKey;
+	_COSE_KEY_Wrap(&p->m_key, pKey);
+
+	fRet = true;
+errorReturn:
+	return fRet;
+}
+
+/*!
+* @brief Set the key for a signer from a key object
+*
+* The EC key held by the key object is used directly rather than parsing
+* the COSE_Key map for each signature.  The key object must not be freed
+* before the signer object.
+*
+* @param h  Handle of the signer object
+* @param hKey  Handle of the key object
+* @param perr  Location for return of error code
+* @return true on success
+*/
+
+bool COSE_Signer_SetKey2(HCOSE_SIGNER h, HCOSE_KEY hKey, cose_errback * perr)
+{
+	COSE_SignerInfo * p;
+	bool fRet = false;
+
+	CHECK_CONDITION(IsValidSignerHandle(h), COSE_ERR_INVALID_HANDLE);
+	CHECK_CONDITION(IsValidKeyHandle(hKey), COSE_ERR_INVALID_HANDLE);
+
+	p = (COSE_SignerInfo *)h;
+	p->m_key = *(COSE_KEY *)hKey;
 
 	fRet = true;
 errorReturn:
@@ -279,6 +278,8 @@ bool _COSE_Signer_validate(COSE_SignMessage * pSign, COSE_SignerInfo * pSigner,
 	byte * pbToBeSigned = NULL;
 	int alg;
 	const cn_cbor * cn = NULL;
+	const COSE_CRYPTO_PROVIDER * pProvider;
+	COSE_KEY key;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = NULL;
 #endif
@@ -299,6 +300,7 @@ bool _COSE_Signer_validate(COSE_SignMessage * pSign, COSE_SignerInfo * pSigner,
 		CHECK_CONDITION((cn->type == CN_CBOR_UINT || cn->type == CN_CBOR_INT), COSE_ERR_INVALID_PARAMETER);
 
 		alg = (int)cn->v.sint;
+		_COSE_Stats_SetAlgorithm(alg);
 	}
 
 	//  Build protected headers
@@ -313,22 +315,31 @@ bool _COSE_Signer_validate(COSE_SignMessage * pSign, COSE_SignerInfo * pSigner,
 	cn_cbor * cnSignature = _COSE_arrayget_int(&pSigner->m_message, INDEX_SIGNATURE);
 	CHECK_CONDITION((cnSignature != NULL) && (cnSignature->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 
+	pProvider = _COSE_Provider_Get(alg);
+	_COSE_KEY_Copy(&key, &pSigner->m_key, pProvider);
+
 	switch (alg) {
 #ifdef USE_ECDSA_SHA_256
 	case COSE_Algorithm_ECDSA_SHA_256:
-		if (!ECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 256, pbToBeSigned, cbToBeSigned, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, &key, 256, pbToBeSigned, cbToBeSigned, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_384
 	case COSE_Algorithm_ECDSA_SHA_384:
-		if (!ECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 384, pbToBeSigned, cbToBeSigned, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, &key, 384, pbToBeSigned, cbToBeSigned, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
 #ifdef USE_ECDSA_SHA_512
 	case COSE_Algorithm_ECDSA_SHA_512:
-		if (!ECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, pSigner->m_pkey, 512, pbToBeSigned, cbToBeSigned, perr)) goto errorReturn;
+		if (!pProvider->pfnECDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, &key, 512, pbToBeSigned, cbToBeSigned, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr)) goto errorReturn;
+		break;
+#endif
+
+#ifdef USE_EDDSA
+	case COSE_Algorithm_EdDSA:
+		if (!pProvider->pfnEdDSA_Verify(&pSigner->m_message, INDEX_SIGNATURE, &key, pbToBeSigned, cbToBeSigned, pcborBody->v.bytes, (pcborBody->type == CN_CBOR_BYTES) ? pcborBody->length : 0, perr)) goto errorReturn;
 		break;
 #endif
 
@@ -0,0 +1,429 @@
+/** \file Stats.c
+* Contains the allocation statistics kept by the library.
+*
+* The counting context returned by COSE_Stats_GetContext plugs into the
+* cn_cbor_context allocation hooks, so every allocation made for a message
+* which uses it, whether by the library through COSE_CALLOC or by cn-cbor,
+* is seen.  Each allocation carries a small header holding its size and the
+* library call and algorithm it was made for, so frees are charged back to
+* the same counters.
+*
+* Counters are kept per thread and are only updated by the owning thread, so
+* counting needs no locks.  The lock is taken when a thread makes its first
+* allocation and when the counters are read, at which point the counters of
+* all threads are added together.  Counters of threads which have exited are
+* kept so that the totals stay consistent.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <memory.h>
+
+#include "cose.h"
+#include "cose_int.h"
+
+#ifdef USE_CBOR_CONTEXT
+
+#ifdef _WIN32
+#include <windows.h>
+
+static SRWLOCK StatsLock = SRWLOCK_INIT;
+#define STATS_LOCK() AcquireSRWLockExclusive(&StatsLock)
+#define STATS_UNLOCK() ReleaseSRWLockExclusive(&StatsLock)
+#else
+#include <pthread.h>
+
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK() pthread_mutex_lock(&StatsLock)
+#define STATS_UNLOCK() pthread_mutex_unlock(&StatsLock)
+#endif
+
+#ifdef _MSC_VER
+#define COSE_THREAD_LOCAL __declspec(thread)
+#else
+#define COSE_THREAD_LOCAL __thread
+#endif
+
+//  Algorithms which are counted separately, slot zero is used for
+//  allocations made before an algorithm has been selected.
+
+static const int RgStatsAlgorithms[] = {
+	0,
+	COSE_Algorithm_AES_GCM_128, COSE_Algorithm_AES_GCM_192, COSE_Algorithm_AES_GCM_256,
+	COSE_Algorithm_CHACHA20_POLY1305,
+	COSE_Algorithm_HMAC_256_64, COSE_Algorithm_HMAC_256_256, COSE_Algorithm_HMAC_384_384, COSE_Algorithm_HMAC_512_512,
+	COSE_Algorithm_CBC_MAC_128_64, COSE_Algorithm_CBC_MAC_256_64, COSE_Algorithm_CBC_MAC_128_128, COSE_Algorithm_CBC_MAC_256_128,
+	COSE_Algorithm_AES_CCM_16_64_128, COSE_Algorithm_AES_CCM_16_64_256, COSE_Algorithm_AES_CCM_64_64_128, COSE_Algorithm_AES_CCM_64_64_256,
+	COSE_Algorithm_AES_CCM_16_128_128, COSE_Algorithm_AES_CCM_16_128_256, COSE_Algorithm_AES_CCM_64_128_128, COSE_Algorithm_AES_CCM_64_128_256,
+	COSE_Algorithm_ECDH_ES_HKDF_256, COSE_Algorithm_ECDH_ES_HKDF_512, COSE_Algorithm_ECDH_SS_HKDF_256, COSE_Algorithm_ECDH_SS_HKDF_512,
+	COSE_Algorithm_ECDH_ES_A128KW, COSE_Algorithm_ECDH_ES_A192KW, COSE_Algorithm_ECDH_ES_A256KW,
+	COSE_Algorithm_ECDH_SS_A128KW, COSE_Algorithm_ECDH_SS_A192KW, COSE_Algorithm_ECDH_SS_A256KW,
+	COSE_Algorithm_AES_KW_128, COSE_Algorithm_AES_KW_192, COSE_Algorithm_AES_KW_256,
+	COSE_Algorithm_Direct,
+	COSE_Algorithm_Direct_HKDF_HMAC_SHA_256, COSE_Algorithm_Direct_HKDF_HMAC_SHA_512,
+	COSE_Algorithm_Direct_HKDF_AES_128, COSE_Algorithm_Direct_HKDF_AES_256,
+	COSE_Algorithm_ECDSA_SHA_256, COSE_Algorithm_ECDSA_SHA_384, COSE_Algorithm_ECDSA_SHA_512,
+	COSE_Algorithm_EdDSA
+};
+
+#define STATS_ALG_MAX (sizeof(RgStatsAlgorithms) / sizeof(RgStatsAlgorithms[0]))
+
+typedef struct _StatsBlock {
+	struct _StatsBlock * m_next;
+	COSE_ALLOC_STATS m_total;
+	COSE_ALLOC_STATS m_rgOps[COSE_STATS_OP_MAX];
+	COSE_ALLOC_STATS m_rgAlgs[STATS_ALG_MAX];
+} StatsBlock;
+
+typedef struct {
+	size_t m_cb;			//  Size requested by the caller
+	unsigned short m_op;	//  Library call the memory was allocated for
+	unsigned short m_alg;	//  Algorithm slot the memory was allocated for
+} StatsHeader;
+
+#define STATS_ALIGN (2 * sizeof(void *))
+#define STATS_HEADER ((sizeof(StatsHeader) + STATS_ALIGN - 1) & ~(STATS_ALIGN - 1))
+
+static StatsBlock * StatsBlockFirst = NULL;
+
+static COSE_THREAD_LOCAL StatsBlock * StatsBlockThread = NULL;
+static COSE_THREAD_LOCAL int StatsOp = COSE_STATS_OP_OTHER;
+static COSE_THREAD_LOCAL int StatsAlg = 0;
+static COSE_THREAD_LOCAL size_t StatsCallLive = 0;		//  Bytes held by the current call
+
+static void * _COSE_Stats_Calloc(size_t count, size_t size, void * context);
+static void _COSE_Stats_Free(void * ptr, void * context);
+
+static cn_cbor_context StatsContext = { _COSE_Stats_Calloc, _COSE_Stats_Free, NULL };
+
+/*! \private
+* @brief Get the counters of the calling thread, creating them if needed
+*
+* @return the counters or NULL if they could not be allocated
+*/
+
+static StatsBlock * _COSE_Stats_Block()
+{
+	StatsBlock * pBlock = StatsBlockThread;
+
+	if (pBlock != NULL) return pBlock;
+
+	pBlock = (StatsBlock *)calloc(1, sizeof(StatsBlock));
+	if (pBlock == NULL) return NULL;
+
+	STATS_LOCK();
+	pBlock->m_next = StatsBlockFirst;
+	StatsBlockFirst = pBlock;
+	STATS_UNLOCK();
+
+	StatsBlockThread = pBlock;
+	return pBlock;
+}
+
+static void _COSE_Stats_Alloc(COSE_ALLOC_STATS * pStats, size_t cb)
+{
+	pStats->cAllocs += 1;
+	pStats->cbAllocated += cb;
+	pStats->cbLive += cb;
+	if ((ptrdiff_t)pStats->cbLive > (ptrdiff_t)pStats->cbPeak) pStats->cbPeak = pStats->cbLive;
+}
+
+static void _COSE_Stats_Release(COSE_ALLOC_STATS * pStats, size_t cb)
+{
+	pStats->cFrees += 1;
+	pStats->cbLive -= cb;
+}
+
+/*! \private
+* @brief Allocate zeroed memory and count it
+*
+* Matches the cn_calloc_func signature.
+*
+* @param count number of items
+* @param size size of each item
+* @param context not used
+* @returns zero filled memory or NULL on failure
+*/
+
+static void * _COSE_Stats_Calloc(size_t count, size_t size, void * context)
+{
+	StatsHeader * pHeader;
+	StatsBlock * pBlock;
+	COSE_ALLOC_STATS * pOp;
+	size_t cb;
+
+	UNUSED_PARAM(context);
+
+	if ((size != 0) && (count > ((size_t)-1 - STATS_HEADER) / size)) return NULL;
+	cb = count * size;
+
+	pHeader = (StatsHeader *)calloc(1, STATS_HEADER + cb);
+	if (pHeader == NULL) return NULL;
+
+	pHeader->m_cb = cb;
+	pHeader->m_op = (unsigned short)StatsOp;
+	pHeader->m_alg = (unsigned short)StatsAlg;
+
+	pBlock = _COSE_Stats_Block();
+	if (pBlock != NULL) {
+		_COSE_Stats_Alloc(&pBlock->m_total, cb);
+		_COSE_Stats_Alloc(&pBlock->m_rgAlgs[StatsAlg], cb);
+
+		//  The peak for a library call is the most memory held at one time
+		//  during a single call rather than over the life of the counters
+
+		pOp = &pBlock->m_rgOps[StatsOp];
+		pOp->cAllocs += 1;
+		pOp->cbAllocated += cb;
+		pOp->cbLive += cb;
+		StatsCallLive += cb;
+		if ((StatsOp != COSE_STATS_OP_OTHER) && ((ptrdiff_t)StatsCallLive > (ptrdiff_t)pOp->cbPeak)) pOp->cbPeak = StatsCallLive;
+	}
+
+	return ((byte *)pHeader) + STATS_HEADER;
+}
+
+/*! \private
+* @brief Free memory allocated by _COSE_Stats_Calloc
+*
+* Matches the cn_free_func signature.  The memory is charged back to the
+* library call and algorithm it was allocated for.
+*
+* @param ptr memory to be freed
+* @param context not used
+*/
+
+static void _COSE_Stats_Free(void * ptr, void * context)
+{
+	StatsHeader * pHeader;
+	StatsBlock * pBlock;
+
+	UNUSED_PARAM(context);
+
+	if (ptr == NULL) return;
+	pHeader = (StatsHeader *)(((byte *)ptr) - STATS_HEADER);
+
+	pBlock = _COSE_Stats_Block();
+	if (pBlock != NULL) {
+		_COSE_Stats_Release(&pBlock->m_total, pHeader->m_cb);
+		_COSE_Stats_Release(&pBlock->m_rgOps[pHeader->m_op], pHeader->m_cb);
+		_COSE_Stats_Release(&pBlock->m_rgAlgs[pHeader->m_alg], pHeader->m_cb);
+		StatsCallLive -= pHeader->m_cb;
+	}
+
+	free(pHeader);
+}
+
+static int _COSE_Stats_AlgSlot(int alg)
+{
+	size_t i;
+
+	for (i = 1; i < STATS_ALG_MAX; i++) {
+		if (RgStatsAlgorithms[i] == alg) return (int)i;
+	}
+	return -1;
+}
+
+/*! \private
+* @brief Mark the start of a library call on the calling thread
+*
+* Calls made from inside another library call are charged to the outer call.
+*
+* @param op the library call being started
+* @return value to be passed to _COSE_Stats_Leave
+*/
+
+int _COSE_Stats_Enter(COSE_STATS_OP op)
+{
+	StatsBlock * pBlock;
+
+	if (StatsOp != COSE_STATS_OP_OTHER) return -1;
+
+	pBlock = _COSE_Stats_Block();
+	if (pBlock != NULL) pBlock->m_rgOps[op].cCalls += 1;
+
+	StatsOp = op;
+	StatsAlg = 0;
+	StatsCallLive = 0;
+	return op;
+}
+
+/*! \private
+* @brief Mark the end of a library call on the calling thread
+*
+* @param iStats value returned by _COSE_Stats_Enter
+*/
+
+void _COSE_Stats_Leave(int iStats)
+{
+	if (iStats < 0) return;
+
+	StatsOp = COSE_STATS_OP_OTHER;
+	StatsAlg = 0;
+}
+
+/*! \private
+* @brief Charge further allocations on the calling thread to an algorithm
+*
+* Algorithms which are not counted separately are charged to slot zero.
+*
+* @param alg the COSE algorithm identifier
+*/
+
+void _COSE_Stats_SetAlgorithm(int alg)
+{
+	int i = _COSE_Stats_AlgSlot(alg);
+
+	StatsAlg = (i < 0) ? 0 : i;
+}
+
+/*!
+* @brief Get the allocation context which counts allocations
+*
+* Messages created or decoded with this context have their memory counted.
+* The memory comes from the C heap.
+*
+* @return the counting allocation context
+*/
+
+cn_cbor_context * COSE_Stats_GetContext()
+{
+	return &StatsContext;
+}
+
+/*! \private
+* @brief Add the counters of all threads for one entry together
+*
+* @param ib offset of the entry in StatsBlock
+* @param fPeakMax take the largest peak rather than adding the peaks
+* @param pStats location to return the statistics
+*/
+
+static void _COSE_Stats_Sum(size_t ib, bool fPeakMax, COSE_ALLOC_STATS * pStats)
+{
+	StatsBlock * pBlock;
+	const COSE_ALLOC_STATS * p;
+
+	memset(pStats, 0, sizeof(*pStats));
+
+	STATS_LOCK();
+	for (pBlock = StatsBlockFirst; pBlock != NULL; pBlock = pBlock->m_next) {
+		p = (const COSE_ALLOC_STATS *)(((const byte *)pBlock) + ib);
+
+		pStats->cCalls += p->cCalls;
+		pStats->cAllocs += p->cAllocs;
+		pStats->cFrees += p->cFrees;
+		pStats->cbAllocated += p->cbAllocated;
+		pStats->cbLive += p->cbLive;
+		if (!fPeakMax) pStats->cbPeak += p->cbPeak;
+		else if (p->cbPeak > pStats->cbPeak) pStats->cbPeak = p->cbPeak;
+	}
+	STATS_UNLOCK();
+}
+
+/*!
+* @brief Get the totals for all memory allocated through the counting context
+*
+* The peak is the sum of the peaks seen by each thread, which is an upper
+* bound on the real peak when several threads are in use.
+*
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Stats_Get(COSE_ALLOC_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	_COSE_Stats_Sum(offsetof(StatsBlock, m_total), false, pStats);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Get the statistics for one kind of library call
+*
+* The peak is the most memory held at one time during a single call.  Memory
+* which is still live after the call, such as the content of a decrypted
+* message, stays charged to the call until it is freed.
+*
+* @param op the library call to report on
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Stats_GetOperation(COSE_STATS_OP op, COSE_ALLOC_STATS * pStats, cose_errback * perr)
+{
+	CHECK_CONDITION((op >= 0) && (op < COSE_STATS_OP_MAX), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	_COSE_Stats_Sum(offsetof(StatsBlock, m_rgOps) + op * sizeof(COSE_ALLOC_STATS), true, pStats);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Get the statistics for one algorithm
+*
+* Memory is charged to the algorithm most recently selected by the library
+* call which allocated it.  Pass zero to get the memory allocated before any
+* algorithm was selected.
+*
+* @param alg the COSE algorithm identifier to report on
+* @param pStats location to return the statistics
+* @param perr location to return errors
+* @return result of the operation
+*/
+
+bool COSE_Stats_GetAlgorithm(int alg, COSE_ALLOC_STATS * pStats, cose_errback * perr)
+{
+	int i = (alg == 0) ? 0 : _COSE_Stats_AlgSlot(alg);
+
+	CHECK_CONDITION(i >= 0, COSE_ERR_UNKNOWN_ALGORITHM);
+	CHECK_CONDITION(pStats != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	_COSE_Stats_Sum(offsetof(StatsBlock, m_rgAlgs) + i * sizeof(COSE_ALLOC_STATS), true, pStats);
+	return true;
+
+errorReturn:
+	return false;
+}
+
+static void _COSE_Stats_Clear(COSE_ALLOC_STATS * pStats, bool fCallPeak)
+{
+	pStats->cCalls = 0;
+	pStats->cAllocs = 0;
+	pStats->cFrees = 0;
+	pStats->cbAllocated = 0;
+	pStats->cbPeak = fCallPeak ? 0 : pStats->cbLive;
+}
+
+/*!
+* @brief Reset the counters
+*
+* The live byte counts are kept as the memory is still allocated, the
+* peaks restart from the live byte counts.  Counters being updated by other
+* threads while the reset is done may be left partly cleared.
+*/
+
+void COSE_Stats_Reset()
+{
+	StatsBlock * pBlock;
+	size_t i;
+
+	STATS_LOCK();
+	for (pBlock = StatsBlockFirst; pBlock != NULL; pBlock = pBlock->m_next) {
+		_COSE_Stats_Clear(&pBlock->m_total, false);
+		for (i = 0; i < COSE_STATS_OP_MAX; i++) _COSE_Stats_Clear(&pBlock->m_rgOps[i], true);
+		for (i = 0; i < STATS_ALG_MAX; i++) _COSE_Stats_Clear(&pBlock->m_rgAlgs[i], false);
+	}
+	STATS_UNLOCK();
+}
+
+#endif // USE_CBOR_CONTEXT
@@ -183,3 +183,87 @@ cn_cbor * cn_cbor_null_create(CBOR_CONTEXT_COMMA cn_cbor_errback * errp)
 	pcn->type = CN_CBOR_NULL;
 	return pcn;
 }
+
+static size_t _cbor_header_size(uint64_t value)
+{
+	if (value < 24) return 1;
+	if (value <= 0xff) return 2;
+	if (value <= 0xffff) return 3;
+	if (value <= 0xffffffff) return 5;
+	return 9;
+}
+
+/***
+* Compute the number of bytes which cn_cbor_encoder_write will produce
+* for an object without doing the serialization.
+*
+* @param[in]	const cn_cbor *	Object to be sized
+* returns		size_t			Size of the encoding, 0 on an invalid object
+*/
+
+size_t cn_cbor_encode_size(const cn_cbor * object)
+{
+	const cn_cbor * p;
+	cn_cbor leaf;
+	uint8_t rgb[16];
+	ssize_t cbLeaf;
+	size_t cb;
+
+	switch (object->type) {
+	case CN_CBOR_FALSE:
+	case CN_CBOR_TRUE:
+	case CN_CBOR_NULL:
+	case CN_CBOR_UNDEF:
+		return 1;
+
+	case CN_CBOR_UINT:
+		return _cbor_header_size((uint64_t) object->v.uint);
+
+	case CN_CBOR_INT:
+		if (object->v.sint < 0) return _cbor_header_size((uint64_t) (-1 - (int64_t) object->v.sint));
+		return _cbor_header_size((uint64_t) object->v.sint);
+
+	case CN_CBOR_BYTES:
+	case CN_CBOR_TEXT:
+		return _cbor_header_size((uint64_t) object->length) + object->length;
+
+	case CN_CBOR_SIMPLE:
+		return _cbor_header_size((uint64_t) object->v.uint);
+
+	case CN_CBOR_TAG:
+		cb = _cbor_header_size((uint64_t) object->v.sint);
+		break;
+
+	case CN_CBOR_ARRAY:
+		cb = (object->flags & CN_CBOR_FL_INDEF) ? 2 : _cbor_header_size((uint64_t) object->length);
+		break;
+
+	case CN_CBOR_MAP:
+		cb = (object->flags & CN_CBOR_FL_INDEF) ? 2 : _cbor_header_size((uint64_t) object->length / 2);
+		break;
+
+	case CN_CBOR_BYTES_CHUNKED:
+	case CN_CBOR_TEXT_CHUNKED:
+		cb = 2;
+		break;
+
+	case CN_CBOR_INVALID:
+		return 0;
+
+	default:
+		//  Floating point values are written in the shortest lossless form,
+		//  let the encoder work out which one that is.
+		leaf = *object;
+		leaf.first_child = leaf.last_child = leaf.next = leaf.parent = NULL;
+		cbLeaf = cn_cbor_encoder_write(rgb, 0, sizeof(rgb), &leaf);
+		return (cbLeaf < 0) ? 0 : (size_t) cbLeaf;
+	}
+
+	for (p = object->first_child; p != NULL; p = p->next) {
+		size_t cbChild = cn_cbor_encode_size(p);
+		if (cbChild == 0) return 0;
+		cb += cbChild;
+	}
+
+	return cb;
+}
@@ -18,7 +18,6 @@
 //  Define which AES GCM algorithms are being used
 //
 
-#if !defined(USE_MBED_TLS)
 #define USE_AES_GCM_128
 #define USE_AES_GCM_192
 #define USE_AES_GCM_256
@@ -26,7 +25,6 @@
 #if defined(USE_AES_GCM_128) || defined(USE_AES_GCM_192) || defined(USE_AES_GCM_256)
 #define USE_AES_GCM
 #endif
-#endif // !defined(USE_MBED_TLS)
 
 //
 //  Define which AES CCM algorithms are being used
@@ -43,6 +41,24 @@
 
 #define INCLUDE_AES_CCM
 
+//
+//  Define if ChaCha20/Poly1305 is being used, only when the crypto
+//  package was built with it
+//
+
+#if defined(USE_OPEN_SSL)
+#include <openssl/opensslconf.h>
+#include <openssl/opensslv.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L) && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define USE_CHACHA20_POLY1305
+#endif
+#elif defined(USE_MBED_TLS)
+#include "mbedtls/version.h"
+#if defined(MBEDTLS_CHACHAPOLY_C)
+#define USE_CHACHA20_POLY1305
+#endif
+#endif
+
 //
 //  Define which HMAC-SHA algorithms are being used
 //
@@ -59,20 +75,15 @@
 //  Define which AES CBC-MAC algorithms are to be used
 //
 
-#if !defined(USE_MBED_TLS)
-
 #define USE_AES_CBC_MAC_128_64
 #define USE_AES_CBC_MAC_128_128
 #define USE_AES_CBC_MAC_256_64
 #define USE_AES_CBC_MAC_256_128
 
-#endif // !defined(USE_MBED_TLS)
-
 //
 //  Define which ECDH algorithms are to be used
 //
 
-#if !defined(USE_MBED_TLS)
 #define USE_ECDH_ES_HKDF_256
 #define USE_ECDH_ES_HKDF_512
 #define USE_ECDH_SS_HKDF_256
@@ -81,9 +92,7 @@
 #define USE_ECDH 1
 #define USE_HKDF_SHA2 1
 #endif
-#endif // !defined(USE_MBED_TLS)
 
-#if !defined(USE_MBED_TLS)
 #define USE_ECDH_ES_A128KW
 #define USE_ECDH_ES_A192KW
 #define USE_ECDH_ES_A256KW
@@ -94,23 +103,19 @@
 #define USE_ECDH 1
 #define USE_HKDF_AES 1
 #endif
-#endif // !defined(USE_MBED_TLS)
 
 //
 //  Define which Key Wrap functions are to be used
 //
 
-#if !defined(USE_MBED_TLS)
 #define USE_AES_KW_128
 #define USE_AES_KW_192
 #define USE_AES_KW_256
-#endif // !defined(USE_MBED_TLS)
 
 //
 //  Define which of the DIRECT + KDF algorithms are to be used
 //
 
-#if !defined(USE_MBED_TLS)
 #define USE_Direct_HKDF_HMAC_SHA_256
 #define USE_Direct_HKDF_HMAC_SHA_512
 #define USE_Direct_HKDF_AES_128
@@ -121,17 +126,21 @@
 #if defined(USE_Direct_HKDF_AES_128) || defined(USE_Direct_KDF_AES_256)
 #define USE_HKDF_AES 1
 #endif
-#endif // !defined(USE_MBED_TLS)
 
 
 //
 //  Define which of the signature algorithms are to be used
 //
 
-#if !defined(USE_MBED_TLS)
 #define USE_ECDSA_SHA_256
 #define USE_ECDSA_SHA_384
 #define USE_ECDSA_SHA_512
+#if defined(USE_ECDSA_SHA_256) || defined(USE_ECDSA_SHA_384) || defined(USE_ECDSA_SHA_512)
+#define USE_ECDSA 1
+#endif
+
+#if !defined(USE_MBED_TLS)
+#define USE_EDDSA
 #endif // !defined(USE_MBED_TLS)
 
 
@@ -12,6 +12,11 @@ typedef struct _cose_recipient * HCOSE_RECIPIENT;
 typedef struct _cose_mac * HCOSE_MAC;
 typedef struct _cose_mac0 * HCOSE_MAC0;
 typedef struct _cose_counterSignature * HCOSE_COUNTERSIGN;
+typedef struct _cose_arena * HCOSE_ARENA;
+typedef struct _cose_prepared_key * HCOSE_PREPARED_KEY;
+typedef struct _cose_key * HCOSE_KEY;
+typedef struct _cose_keyset * HCOSE_KEYSET;
+typedef const struct _cose_provider * HCOSE_PROVIDER;
 
 /**
 * All of the different kinds of errors
@@ -69,6 +74,134 @@ HCOSE COSE_Decode(const byte * rgbData, size_t cbData, int * type, COSE_object_t
 size_t COSE_Encode(HCOSE msg, byte * rgb, size_t ib, size_t cb);
 
 cn_cbor * COSE_get_cbor(HCOSE hmsg);
+size_t COSE_Handle_Count();
+
+#ifdef USE_CBOR_CONTEXT
+/*
+ *  Arena allocator - sub-allocates everything from large blocks which
+ *  are released in a single operation.
+ */
+
+HCOSE_ARENA COSE_Arena_Create(size_t cbBlock, cose_errback * perr);
+cn_cbor_context * COSE_Arena_GetContext(HCOSE_ARENA h);
+bool COSE_Arena_Reset(HCOSE_ARENA h);
+bool COSE_Arena_Destroy(HCOSE_ARENA h);
+#endif // USE_CBOR_CONTEXT
+
+/*
+ *  Per-thread pools for message, recipient and signer objects, and the CBOR
+ *  nodes of their skeletons, allocated without an allocation context.
+ */
+
+typedef enum {
+	COSE_POOL_ENVELOPED = 0,	//  Enveloped and Encrypt messages
+	COSE_POOL_RECIPIENT,
+	COSE_POOL_SIGN,
+	COSE_POOL_SIGN0,
+	COSE_POOL_SIGNER,
+	COSE_POOL_MAC,
+	COSE_POOL_MAC0,
+	COSE_POOL_CBOR,				//  Maps, arrays and tags a message is built on
+	COSE_POOL_MAX
+} COSE_POOL_TYPE;
+
+typedef struct {
+	size_t cCached;		//  Objects currently held by the pool
+	size_t cHits;		//  Allocations satisfied from the pool
+	size_t cMisses;		//  Allocations which went to the heap
+	size_t cReleased;	//  Frees which went to the heap as the pool was full
+} COSE_POOL_STATS;
+
+bool COSE_Pool_GetStats(COSE_POOL_TYPE type, COSE_POOL_STATS * pStats, cose_errback * perr);
+void COSE_Pool_Trim();
+
+/*
+ *  Per-thread pool of random bytes used for nonces, IVs, content keys and
+ *  ephemeral keys.
+ */
+
+typedef struct {
+	size_t cRequests;	//  Requests made of the pool
+	size_t cbRequested;	//  Bytes handed out
+	size_t cRefills;	//  Times the pool was filled from the crypto library
+	size_t cDirect;		//  Large requests which went to the crypto library
+	size_t cForks;		//  Times the pool was thrown away after a fork
+} COSE_RANDOM_STATS;
+
+bool COSE_Random_GetStats(COSE_RANDOM_STATS * pStats, cose_errback * perr);
+void COSE_Random_Clear();
+
+/*
+ *  Cache of keys derived for ECDH-SS and direct HKDF recipients.  The
+ *  cache is shared by all threads and is off until it is given a size.
+ */
+
+typedef struct {
+	size_t cEntries;		//  Keys currently held by the cache
+	size_t cHits;			//  Derivations answered from the cache
+	size_t cMisses;			//  Derivations which were computed
+	size_t cEvictions;		//  Keys dropped to make room for a new one
+	size_t cInvalidated;	//  Keys dropped by COSE_KeyCache_Invalidate
+} COSE_KEYCACHE_STATS;
+
+bool COSE_KeyCache_SetSize(size_t cEntries, cose_errback * perr);
+bool COSE_KeyCache_Invalidate(const cn_cbor * pcborKey, cose_errback * perr);
+void COSE_KeyCache_Clear();
+bool COSE_KeyCache_GetStats(COSE_KEYCACHE_STATS * pStats, cose_errback * perr);
+
+/*
+ *  Pools of ephemeral keys for ECDH-ES senders, one per curve, which are
+ *  generated ahead of time by a background thread.  The pools are off
+ *  until they are given a depth.
+ */
+
+typedef struct {
+	size_t cReady;			//  Keys currently held by the pool
+	size_t cTaken;			//  Keys handed out to senders
+	size_t cExhausted;		//  Senders which found the pool empty and generated a key
+	size_t cGenerated;		//  Keys generated by the refill thread
+	size_t cDiscarded;		//  Keys destroyed unused after a fork or when the pool shrank
+} COSE_EPHEMERAL_STATS;
+
+bool COSE_Ephemeral_SetPool(int iCurve, size_t cDepth, size_t cRefill, cose_errback * perr);
+bool COSE_Ephemeral_SetInterval(unsigned int msInterval, cose_errback * perr);
+void COSE_Ephemeral_Stop();
+bool COSE_Ephemeral_GetStats(int iCurve, COSE_EPHEMERAL_STATS * pStats, cose_errback * perr);
+
+#ifdef USE_CBOR_CONTEXT
+/*
+ *  Allocation statistics - counts the memory used by messages which are
+ *  created or decoded with the counting context.  The counters are kept
+ *  per thread and added together when they are read.
+ */
+
+typedef enum {
+	COSE_STATS_OP_OTHER = 0,	//  Outside of the calls below, e.g. Init and SetContent
+	COSE_STATS_OP_DECODE,
+	COSE_STATS_OP_ENCRYPT,
+	COSE_STATS_OP_DECRYPT,
+	COSE_STATS_OP_SIGN,
+	COSE_STATS_OP_VERIFY,
+	COSE_STATS_OP_MAC,
+	COSE_STATS_OP_MAC_VERIFY,
+	COSE_STATS_OP_MAX
+} COSE_STATS_OP;
+
+typedef struct {
+	size_t cCalls;		//  Number of library calls made
+	size_t cAllocs;		//  Number of allocations
+	size_t cFrees;		//  Number of frees
+	size_t cbAllocated;	//  Total bytes allocated
+	size_t cbLive;		//  Bytes allocated and not yet freed
+	size_t cbPeak;		//  Highest value seen for cbLive
+} COSE_ALLOC_STATS;
+
+cn_cbor_context * COSE_Stats_GetContext();
+bool COSE_Stats_Get(COSE_ALLOC_STATS * pStats, cose_errback * perr);
+bool COSE_Stats_GetOperation(COSE_STATS_OP op, COSE_ALLOC_STATS * pStats, cose_errback * perr);
+bool COSE_Stats_GetAlgorithm(int alg, COSE_ALLOC_STATS * pStats, cose_errback * perr);
+void COSE_Stats_Reset();
+#endif // USE_CBOR_CONTEXT
 
 //  Functions for the signing object
 
@@ -105,6 +238,8 @@ typedef enum {
 	COSE_Algorithm_AES_CCM_64_128_128 = 32,
 	COSE_Algorithm_AES_CCM_64_128_256 = 33,
 
+	COSE_Algorithm_CHACHA20_POLY1305 = 24,
+
 	COSE_Algorithm_ECDH_ES_HKDF_256 = -25,
 	COSE_Algorithm_ECDH_ES_HKDF_512 = -26,
 	COSE_Algorithm_ECDH_SS_HKDF_256 = -27,
@@ -135,6 +270,8 @@ typedef enum {
 	COSE_Algorithm_ECDSA_SHA_256 = -7,
 	COSE_Algorithm_ECDSA_SHA_384 = -35,
 	COSE_Algorithm_ECDSA_SHA_512 = -36,
+
+	COSE_Algorithm_EdDSA = -8,
 } COSE_Algorithms;
 
 typedef enum {
@@ -168,6 +305,7 @@ typedef enum {
 } COSE_Header;
 
 typedef enum {
+	COSE_Key_Type_OKP = 1,
 	COSE_Key_Type_EC2 = 2,
 	COSE_Key_Type_OCTET = 4,
 	COSE_Key_Type = 1,
@@ -193,11 +331,14 @@ bool COSE_Enveloped_map_put_string(HCOSE_ENVELOPED cose, int key, cn_cbor * valu
 
 
 bool COSE_Enveloped_SetContent(HCOSE_ENVELOPED cose, const byte * rgbContent, size_t cbContent, cose_errback * errp);
+bool COSE_Enveloped_SetContentRef(HCOSE_ENVELOPED cose, const byte * rgbContent, size_t cbContent, cose_errback * errp);
 byte * COSE_Enveloped_GetContent(HCOSE_ENVELOPED cose, size_t * pcbContent, cose_errback * errp);
 bool COSE_Enveloped_SetExternal(HCOSE_ENVELOPED hcose, const byte * pbExternalData, size_t cbExternalData, cose_errback * perr);
 
 bool COSE_Enveloped_encrypt(HCOSE_ENVELOPED cose, cose_errback * perror);
 bool COSE_Enveloped_decrypt(HCOSE_ENVELOPED, HCOSE_RECIPIENT, cose_errback * perr);
+bool COSE_Enveloped_decrypt_into(HCOSE_ENVELOPED, HCOSE_RECIPIENT, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr);
+bool COSE_Enveloped_decrypt_keyset(HCOSE_ENVELOPED, HCOSE_KEYSET, cose_errback * perr);
 
 extern bool COSE_Enveloped_AddRecipient(HCOSE_ENVELOPED hMac, HCOSE_RECIPIENT hRecip, cose_errback * perr);
 HCOSE_RECIPIENT COSE_Enveloped_GetRecipient(HCOSE_ENVELOPED cose, int iRecipient, cose_errback * perr);
@@ -215,6 +356,8 @@ HCOSE_RECIPIENT COSE_Recipient_from_shared_secret(byte * rgbKey, int cbKey, byte
 bool COSE_Recipient_SetKey_secret(HCOSE_RECIPIENT h, const byte * rgb, int cb, const byte * rgbKid, int cbKid, cose_errback * perr);
 bool COSE_Recipient_SetKey(HCOSE_RECIPIENT h, const cn_cbor * pKey, cose_errback * perror);
 bool COSE_Recipient_SetSenderKey(HCOSE_RECIPIENT h, const cn_cbor * pKey, int destination, cose_errback * perror);
+bool COSE_Recipient_SetKey2(HCOSE_RECIPIENT h, HCOSE_KEY hKey, cose_errback * perr);
+bool COSE_Recipient_SetSenderKey2(HCOSE_RECIPIENT h, HCOSE_KEY hKey, int destination, cose_errback * perr);
 bool COSE_Recipient_SetExternal(HCOSE_RECIPIENT hcose, const byte * pbExternalData, size_t cbExternalData, cose_errback * perr);
 
 bool COSE_Recipient_map_put_int(HCOSE_RECIPIENT h, int key, cn_cbor * value, int flags, cose_errback * perror);
@@ -239,11 +382,119 @@ bool COSE_Encrypt_map_put_string(HCOSE_ENCRYPT cose, int key, cn_cbor * value, i
 
 
 bool COSE_Encrypt_SetContent(HCOSE_ENCRYPT cose, const byte * rgbContent, size_t cbContent, cose_errback * errp);
+bool COSE_Encrypt_SetContentRef(HCOSE_ENCRYPT cose, const byte * rgbContent, size_t cbContent, cose_errback * errp);
 byte * COSE_Encrypt_GetContent(HCOSE_ENCRYPT cose, size_t * pcbContent, cose_errback * errp);
 bool COSE_Encrypt_SetExternal(HCOSE_ENCRYPT hcose, const byte * pbExternalData, size_t cbExternalData, cose_errback * perr);
 
 bool COSE_Encrypt_encrypt(HCOSE_ENCRYPT cose, const byte * pbKey, size_t cbKey, cose_errback * perror);
 bool COSE_Encrypt_decrypt(HCOSE_ENCRYPT, const byte * pbKey, size_t cbKey, cose_errback * perr);
+bool COSE_Encrypt_encrypt_encode(HCOSE_ENCRYPT cose, const byte * pbKey, size_t cbKey, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr);
+bool COSE_Encrypt_decrypt_into(HCOSE_ENCRYPT, const byte * pbKey, size_t cbKey, byte * pbOut, size_t cbOut, size_t * pcbOut, cose_errback * perr);
+bool COSE_Encrypt_encrypt_prepared(HCOSE_ENCRYPT cose, HCOSE_PREPARED_KEY hKey, cose_errback * perr);
+bool COSE_Encrypt_decrypt_prepared(HCOSE_ENCRYPT cose, HCOSE_PREPARED_KEY hKey, cose_errback * perr);
+
+typedef struct {
+	const byte * pbContent;		//  Content to be encrypted
+	size_t cbContent;
+	const byte * pbIV;			//  Nonce for the message, NULL to generate a random one
+	size_t cbIV;
+	byte * pbOut;				//  Buffer for the encoded message
+	size_t cbOut;
+	size_t cbWritten;			//  Returned - size of the encoded message
+	cose_error err;				//  Returned - COSE_ERR_NONE if the message was encrypted
+} COSE_ENCRYPT_ITEM;
+
+bool COSE_Encrypt_encrypt_batch(HCOSE_ENCRYPT hTemplate, HCOSE_PREPARED_KEY hKey, COSE_ENCRYPT_ITEM * rgItems, size_t cItems, cose_errback * perr);
+
+/*
+ *  Prepared keys - a content encryption, HMAC or AES CBC-MAC key loaded
+ *  into a keyed cipher or HMAC context once and then used for many messages.
+ */
+
+HCOSE_PREPARED_KEY COSE_PreparedKey_Create(int alg, const byte * pbKey, size_t cbKey, CBOR_CONTEXT_COMMA cose_errback * perr);
+bool COSE_PreparedKey_Free(HCOSE_PREPARED_KEY h);
+
+/*
+ *  Key objects - a COSE_Key map which is parsed once and then used for
+ *  many signatures or key agreements.
+ */
+
+HCOSE_KEY COSE_KEY_FromCbor(const cn_cbor * pcborKey, CBOR_CONTEXT_COMMA cose_errback * perr);
+bool COSE_KEY_Free(HCOSE_KEY h);
+
+/*
+ *  Key sets - the keys of a receiver indexed by kid, so that only the
+ *  recipients addressed to the receiver are processed.
+ */
+
+typedef enum cose_keyset_flags {
+	COSE_KEYSET_FLAGS_NONE=0,
+	COSE_KEYSET_TRIAL=1			//  Try every key on every recipient if none matches by kid
+} COSE_KEYSET_FLAGS;
+
+typedef const cn_cbor * (*COSE_KEY_RESOLVER)(const byte * pbKid, size_t cbKid, void * pContext);
+
+HCOSE_KEYSET COSE_KeySet_Init(COSE_KEYSET_FLAGS flags, CBOR_CONTEXT_COMMA cose_errback * perr);
+bool COSE_KeySet_Free(HCOSE_KEYSET h);
+bool COSE_KeySet_AddKey(HCOSE_KEYSET h, const cn_cbor * pKey, cose_errback * perr);
+bool COSE_KeySet_AddKey2(HCOSE_KEYSET h, HCOSE_KEY hKey, cose_errback * perr);
+bool COSE_KeySet_SetResolver(HCOSE_KEYSET h, COSE_KEY_RESOLVER pfnResolver, void * pContext, cose_errback * perr);
+
+/*
+ *  Crypto providers - tables of crypto primitives which can be registered
+ *  at run time to take over some algorithms from the compiled backend.
+ *  The library keeps all of the message processing: it generates and
+ *  places nonces, builds the authenticated data, reads salts and ephemeral
+ *  keys from the headers and writes the result into the message.  A
+ *  provider only sees keys, nonces and buffers.
+ *
+ *  Every primitive returns false on failure and gets m_pContext as its last
+ *  argument.  A NULL member means the provider does not implement that
+ *  primitive; every algorithm claimed must have the primitives it needs.
+ *  EC and OKP keys are passed as their COSE_Key maps.  Registration must
+ *  not run at the same time as any other call into the library, and key
+ *  objects and prepared keys stay with the provider they were created with.
+ */
+
+typedef struct _cose_provider {
+	const char * m_szName;
+	const int * m_rgAlgorithms;		//  Algorithms claimed
+	size_t m_cAlgorithms;
+	void * m_pContext;				//  Passed to every primitive
+
+	//  AES-GCM, AES-CCM and ChaCha20/Poly1305, the cipher text is the size of the plain text
+	bool (*pfnAEAD_Encrypt)(int alg, const byte * pbKey, size_t cbKey, const byte * pbNonce, size_t cbNonce, const byte * pbAAD, size_t cbAAD, const byte * pbIn, size_t cbIn, byte * pbOut, byte * pbTag, size_t cbTag, void * pContext);
+	bool (*pfnAEAD_Decrypt)(int alg, const byte * pbKey, size_t cbKey, const byte * pbNonce, size_t cbNonce, const byte * pbAAD, size_t cbAAD, const byte * pbIn, size_t cbIn, const byte * pbTag, size_t cbTag, byte * pbOut, void * pContext);
+
+	//  HMAC and AES CBC-MAC, the tag is truncated to cbTag bytes.  The library checks tags itself.
+	bool (*pfnMAC_Create)(int alg, const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbTag, size_t cbTag, void * pContext);
+
+	//  AES key wrap (RFC 3394), the output is 8 bytes longer or shorter than the input
+	bool (*pfnKeyWrap)(const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbOut, void * pContext);
+	bool (*pfnKeyUnwrap)(const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbOut, void * pContext);
+
+	//  HKDF (RFC 5869) with SHA-2, the PRK is cbitHash / 8 bytes.  The AES form expands with AES CBC-MAC.
+	bool (*pfnHKDF_Extract)(int cbitHash, const byte * pbSalt, size_t cbSalt, const byte * pbIn, size_t cbIn, byte * pbPRK, void * pContext);
+	bool (*pfnHKDF_Expand)(int cbitHash, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOut, size_t cbOut, void * pContext);
+	bool (*pfnHKDF_AES_Expand)(const byte * pbKey, size_t cbKey, const byte * pbInfo, size_t cbInfo, byte * pbOut, size_t cbOut, void * pContext);
+
+	//  ECDSA and EdDSA over the ToBeSigned bytes, *pcbSig is the buffer size on input
+	bool (*pfnSign)(int alg, const cn_cbor * pKey, const byte * pbIn, size_t cbIn, byte * pbSig, size_t * pcbSig, void * pContext);
+	bool (*pfnVerify)(int alg, const cn_cbor * pKey, const byte * pbIn, size_t cbIn, const byte * pbSig, size_t cbSig, void * pContext);
+
+	//  ECDH, the secret is the x coordinate of the shared point, *pcbSecret is the buffer size on input.
+	//  Keys are COSE_Key maps as given to the library, a peer's y may be the boolean sign bit of a compressed point.
+	bool (*pfnECDH)(const cn_cbor * pKeyPrivate, const cn_cbor * pKeyPublic, byte * pbSecret, size_t * pcbSecret, void * pContext);
+	//  New key pair on a COSE curve for ECDH-ES, each value is cbCoord bytes
+	bool (*pfnEC_Generate)(int iCurve, byte * pbX, byte * pbY, byte * pbD, size_t cbCoord, void * pContext);
+} COSE_PROVIDER;
+
+bool COSE_Provider_Register(HCOSE_PROVIDER hProvider, cose_errback * perr);
+void COSE_Provider_Reset();
+HCOSE_PROVIDER COSE_Provider_Default();
+HCOSE_PROVIDER COSE_Provider_Get(int alg);
+bool COSE_Provider_Supports(HCOSE_PROVIDER hProvider, int alg);
+const char * COSE_Provider_Name(HCOSE_PROVIDER hProvider);
 
 
 //
@@ -260,6 +511,7 @@ bool COSE_Mac_map_put_int(HCOSE_MAC cose, int key, cn_cbor * value, int flags, c
 
 bool COSE_Mac_encrypt(HCOSE_MAC cose, cose_errback * perror);
 bool COSE_Mac_validate(HCOSE_MAC, HCOSE_RECIPIENT, cose_errback * perr);
+bool COSE_Mac_validate_keyset(HCOSE_MAC, HCOSE_KEYSET, cose_errback * perr);
 
 extern bool COSE_Mac_AddRecipient(HCOSE_MAC hMac, HCOSE_RECIPIENT hRecip, cose_errback * perr);
 HCOSE_RECIPIENT COSE_Mac_GetRecipient(HCOSE_MAC cose, int iRecipient, cose_errback * perr);
@@ -277,6 +529,8 @@ bool COSE_Mac0_map_put_int(HCOSE_MAC0 cose, int key, cn_cbor * value, int flags,
 
 bool COSE_Mac0_encrypt(HCOSE_MAC0 cose, const byte * pbKey, size_t cbKey, cose_errback * perror);
 bool COSE_Mac0_validate(HCOSE_MAC0, const byte * pbKey, size_t cbKey, cose_errback * perr);
+bool COSE_Mac0_encrypt_prepared(HCOSE_MAC0 cose, HCOSE_PREPARED_KEY hKey, cose_errback * perr);
+bool COSE_Mac0_validate_prepared(HCOSE_MAC0 cose, HCOSE_PREPARED_KEY hKey, cose_errback * perr);
 
 //
 //
@@ -298,6 +552,7 @@ bool COSE_Sign_map_put_int(HCOSE_SIGN cose, int key, cn_cbor * value, int flags,
 HCOSE_SIGNER COSE_Signer_Init(CBOR_CONTEXT_COMMA cose_errback * perror);
 bool COSE_Signer_Free(HCOSE_SIGNER cose);
 bool COSE_Signer_SetKey(HCOSE_SIGNER hSigner, const cn_cbor * pkey, cose_errback * perr);
+bool COSE_Signer_SetKey2(HCOSE_SIGNER hSigner, HCOSE_KEY hKey, cose_errback * perr);
 extern cn_cbor * COSE_Signer_map_get_int(HCOSE_SIGNER h, int key, int flags, cose_errback * perr);
 extern bool COSE_Signer_map_put_int(HCOSE_SIGNER cose, int key, cn_cbor * value, int flags, cose_errback * errp);
 
@@ -315,9 +570,27 @@ bool COSE_Sign0_SetExternal(HCOSE_SIGN0 hcose, const byte * pbExternalData, size
 
 bool COSE_Sign0_Sign(HCOSE_SIGN0 h, const cn_cbor * pkey, cose_errback * perr);
 bool COSE_Sign0_validate(HCOSE_SIGN0 hSign, const cn_cbor * pkey, cose_errback * perr);
+bool COSE_Sign0_Sign2(HCOSE_SIGN0 h, HCOSE_KEY hKey, cose_errback * perr);
+bool COSE_Sign0_validate2(HCOSE_SIGN0 hSign, HCOSE_KEY hKey, cose_errback * perr);
 cn_cbor * COSE_Sign0_map_get_int(HCOSE_SIGN0 h, int key, int flags, cose_errback * perror);
 bool COSE_Sign0_map_put_int(HCOSE_SIGN0 cose, int key, cn_cbor * value, int flags, cose_errback * errp);
 
+/*
+ *  Batch verification of Sign and Sign0 messages
+ */
+
+typedef struct {
+	const byte * pbMessage;		//  Encoded message
+	size_t cbMessage;
+	COSE_object_type type;		//  Expected message type, COSE_unknown_object if the message is tagged
+	int iSigner;				//  Signer to verify for COSE_Sign messages
+	HCOSE_KEY hKey;				//  Key to verify the signature with
+	bool fValid;				//  Returned - the signature verified
+	cose_error err;				//  Returned - reason the message did not verify
+} COSE_VERIFY_ITEM;
+
+bool COSE_Verify_Batch(COSE_VERIFY_ITEM * rgItems, size_t cItems, int cThreads, CBOR_CONTEXT_COMMA cose_errback * perr);
+
 /*
  * Counter Signature Routines
  */
@@ -24,12 +24,23 @@ typedef struct _COSE {
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context m_allocContext;
 #endif
-	struct _COSE * m_handleList;
 #ifdef USE_COUNTER_SIGNATURES
 	COSE_CounterSign * m_counterSigners;
 #endif
 } COSE;
 
+typedef struct _cose_key {
+	const cn_cbor * m_cborKey;	//  COSE_Key map, owned by the application
+	int m_kty;				//  Key type which was parsed, 0 if not prepared
+	void * m_pECKey;		//  Parsed EC key owned by the crypto library, NULL if not prepared
+	int m_cbGroup;			//  Size of a coordinate of m_pECKey in bytes
+	void * m_pOKPKey;		//  Parsed OKP key owned by the crypto library, NULL if not prepared
+	const struct _cose_crypto_provider * m_pProvider;	//  Provider which parsed the key, NULL if not prepared
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context m_allocContext;
+#endif
+} COSE_KEY;
+
 struct _SignerInfo;
 typedef struct _SignerInfo COSE_SignerInfo;
 
@@ -44,13 +55,15 @@ typedef struct {
 
 struct _SignerInfo {
 	COSE m_message;
-	const cn_cbor * m_pkey;
+	COSE_KEY m_key;
 	COSE_SignerInfo * m_signerNext;
 };
 
 struct _RecipientInfo;
 typedef struct _RecipientInfo COSE_RecipientInfo;
 
+typedef struct _cose_keyset COSE_KeySet;
+
 #if 0
 typedef struct {
 	COSE m_message;		// The message object
@@ -63,6 +76,7 @@ typedef struct {
 	COSE m_message;		// The message object
 	const byte * pbContent;
 	size_t cbContent;
+	bool m_contentBorrowed;		//  pbContent belongs to the application
 	COSE_RecipientInfo * m_recipientFirst;
 } COSE_Enveloped;
 
@@ -71,8 +85,8 @@ typedef COSE_Enveloped COSE_Encrypt;
 struct _RecipientInfo {
 	COSE_Enveloped m_encrypt;
 	COSE_RecipientInfo * m_recipientNext;
-	const cn_cbor * m_pkey;
-	const cn_cbor * m_pkeyStatic;
+	COSE_KEY m_key;
+	COSE_KEY m_keyStatic;
 };
 
 typedef struct {
@@ -87,6 +101,20 @@ typedef struct {
 #endif
 typedef COSE_MacMessage COSE_Mac0Message;
 
+typedef struct _cose_prepared_key {
+	int m_alg;
+	int m_cbitTag;			//  Size of the authentication tag
+	int m_cbitL;			//  Size of the CCM length field, zero for GCM
+	size_t m_cbKey;
+	byte m_rgbKey[512 / 8];
+	void * m_pCipher;		//  Keyed cipher or HMAC context owned by the crypto library
+	void * m_pDecipher;		//  Context keyed for decryption when the library needs a separate one
+	const struct _cose_crypto_provider * m_pProvider;	//  Provider which owns m_pCipher
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context m_allocContext;
+#endif
+} COSE_PreparedKey;
+
 #ifdef USE_COUNTER_SIGNATURES
 typedef struct _COSE_COUNTER_SIGN {
 	COSE_SignerInfo m_signer;
@@ -145,6 +173,70 @@ typedef struct _COSE_COUNTER_SIGN {
 
 #endif // USE_CBOR_CONTEXT
 
+/*
+ *  Allocation of message, recipient and signer objects, and of the CBOR
+ *  nodes of their skeletons, through the per-thread pools
+ */
+
+extern void * _COSE_Pool_Calloc(COSE_POOL_TYPE type, size_t cb CBOR_CONTEXT);
+extern void _COSE_Pool_Free(COSE_POOL_TYPE type, void * pv CBOR_CONTEXT);
+
+extern void _COSE_Pool_CborFree(cn_cbor * cn CBOR_CONTEXT);
+
+#ifdef USE_CBOR_CONTEXT
+extern cn_cbor_context * _COSE_Pool_CborContext(cn_cbor_context * context);
+
+#define COSE_POOL_CALLOC(type, size, ctx) _COSE_Pool_Calloc(type, size, ctx)
+#define COSE_POOL_FREE(type, ptr, ctx) _COSE_Pool_Free(type, ptr, ctx)
+#define COSE_POOL_CBOR_FREE(p, ctx) _COSE_Pool_CborFree(p, ctx)
+#define CBOR_POOL_PARAM_COMMA _COSE_Pool_CborContext(context),
+#else
+#define COSE_POOL_CALLOC(type, size, ctx) _COSE_Pool_Calloc(type, size)
+#define COSE_POOL_FREE(type, ptr, ctx) _COSE_Pool_Free(type, ptr)
+#define COSE_POOL_CBOR_FREE(p, ctx) _COSE_Pool_CborFree(p)
+#define CBOR_POOL_PARAM_COMMA
+#endif
+
+/*
+ *  Random bytes from the per-thread pool
+ */
+
+extern bool _COSE_Random(byte * pb, size_t cb);
+
+/*
+ *  Cache of keys derived with ECDH-SS and direct HKDF
+ */
+
+typedef struct {
+	byte m_rgbDigest[256 / 8];	//  Digest of everything the derived key depends on
+	byte m_rgbPrivate[256 / 8];	//  Digest of the private or shared key
+	byte m_rgbPeer[256 / 8];	//  Digest of the peer key, zero if there is none
+} COSE_KeyCacheId;
+
+extern bool _COSE_KeyCache_Id(const cn_cbor * pKeyPrivate, const cn_cbor * pKeyPeer, bool fHMAC, size_t cbitHash, const byte * pbSalt, size_t cbSalt, const byte * pbContext, size_t cbContext, COSE_KeyCacheId * pId);
+extern bool _COSE_KeyCache_Find(const COSE_KeyCacheId * pId, byte * pbKey, size_t cbKey);
+extern void _COSE_KeyCache_Add(const COSE_KeyCacheId * pId, const byte * pbKey, size_t cbKey);
+
+/*
+ *  Pre-generated ephemeral keys for ECDH-ES
+ */
+
+extern void * _COSE_Ephemeral_Take(int iCurve);
+
+/*
+ *  Attribution of allocations made through the counting context
+ */
+
+#ifdef USE_CBOR_CONTEXT
+extern int _COSE_Stats_Enter(COSE_STATS_OP op);
+extern void _COSE_Stats_Leave(int iStats);
+extern void _COSE_Stats_SetAlgorithm(int alg);
+#else
+#define _COSE_Stats_Enter(op) 0
+#define _COSE_Stats_Leave(iStats) ((void)(iStats))
+#define _COSE_Stats_SetAlgorithm(alg)
+#endif
+
 #ifndef UNUSED_PARAM
 #define UNUSED_PARAM(p) ((void)&(p))
 #endif
@@ -155,32 +247,60 @@ extern cose_error _MapFromCBOR(cn_cbor_errback err);
  *  Set of routines for handle checking
  */
 
-extern void _COSE_InsertInList(COSE ** rootNode, COSE * newMsg);
-extern bool _COSE_IsInList(COSE * rootNode, COSE * thisMsg);
-extern void _COSE_RemoveFromList(COSE ** rootNode, COSE * thisMsg);
+typedef enum {
+	COSE_HANDLE_ENVELOPED = 1,
+	COSE_HANDLE_ENCRYPT,
+	COSE_HANDLE_RECIPIENT,
+	COSE_HANDLE_SIGN,
+	COSE_HANDLE_SIGN0,
+	COSE_HANDLE_SIGNER,
+	COSE_HANDLE_MAC,
+	COSE_HANDLE_MAC0,
+	COSE_HANDLE_KEYSET,
+	COSE_HANDLE_PREPARED_KEY,
+	COSE_HANDLE_KEY
+} COSE_HANDLE_TYPE;
+
+typedef struct _COSE_HandleEpoch COSE_HandleEpoch;
+
+extern bool _COSE_Handle_Add(COSE_HANDLE_TYPE type, COSE * pMessage CBOR_CONTEXT);
+extern bool _COSE_Handle_IsValid(COSE_HANDLE_TYPE type, const COSE * pMessage);
+extern void _COSE_Handle_Remove(COSE_HANDLE_TYPE type, COSE * pMessage);
+extern void _COSE_Handle_EndEpoch(COSE_HandleEpoch * pEpoch);
+extern bool _COSE_Handle_EpochPinned(const COSE_HandleEpoch * pEpoch);
+
+#ifdef USE_CBOR_CONTEXT
+extern COSE_HandleEpoch ** _COSE_Arena_HandleEpoch(const cn_cbor_context * context);
+#endif
 
 extern bool IsValidEncryptHandle(HCOSE_ENCRYPT h);
 extern bool IsValidEnvelopedHandle(HCOSE_ENVELOPED h);
 extern bool IsValidRecipientHandle(HCOSE_RECIPIENT h);
 extern bool IsValidSignerHandle(HCOSE_SIGNER h);
 extern bool IsValidCounterSignHandle(HCOSE_COUNTERSIGN h);
+extern bool IsValidKeySetHandle(HCOSE_KEYSET h);
+extern bool IsValidPreparedKeyHandle(HCOSE_PREPARED_KEY h);
+extern bool IsValidKeyHandle(HCOSE_KEY h);
 
 extern bool _COSE_Init(COSE_INIT_FLAGS flags, COSE * pcose, int msgType, CBOR_CONTEXT_COMMA cose_errback * errp);
 extern bool _COSE_Init_From_Object(COSE* pobj, cn_cbor * pcbor, CBOR_CONTEXT_COMMA cose_errback * perror);
 extern void _COSE_Release(COSE * pcose);
+extern void _COSE_Detach(COSE * pobj);
 
 extern cn_cbor * _COSE_map_get_string(COSE * cose, const char * key, int flags, cose_errback * errp);
 extern cn_cbor * _COSE_map_get_int(COSE * cose, int key, int flags, cose_errback * errp);
 extern bool _COSE_map_put(COSE * cose, int key, cn_cbor * value, int flags, cose_errback * errp);
+extern bool _COSE_map_replace(COSE * cose, int key, cn_cbor * value, int flags, cose_errback * errp);
 
 bool _COSE_SetExternal(COSE * hcose, const byte * pbExternalData, size_t cbExternalData, cose_errback * perr);
 
 
 extern HCOSE_ENVELOPED _COSE_Enveloped_Init_From_Object(cn_cbor *, COSE_Enveloped * pIn, CBOR_CONTEXT_COMMA cose_errback * errp);
 extern void _COSE_Enveloped_Release(COSE_Enveloped * p);
-extern bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip, const byte *pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr);
-extern bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr);
+extern bool _COSE_Enveloped_decrypt(COSE_Enveloped * pcose, COSE_RecipientInfo * pRecip, const COSE_KeySet * pKeys, const byte *pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, byte * pbOut, size_t cbOut, const char * szContext, cose_errback * perr);
+extern bool _COSE_Enveloped_encrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, byte * pbWire, size_t cbWire, size_t * pcbWire, cose_errback * perr);
 extern bool _COSE_Enveloped_SetContent(COSE_Enveloped * cose, const byte * rgbContent, size_t cbContent, cose_errback * errp);
+extern bool _COSE_Enveloped_SetupNonce(COSE_Enveloped * pcose, int alg, size_t * pcbTag, cose_errback * perr);
 
 extern HCOSE_ENCRYPT _COSE_Encrypt_Init_From_Object(cn_cbor *, COSE_Encrypt * pIn, CBOR_CONTEXT_COMMA cose_errback * errp);
 extern void _COSE_Encrypt_Release(COSE_Encrypt * p);
@@ -208,6 +328,13 @@ extern bool _COSE_SignerInfo_Free(COSE_SignerInfo * pSigner);
 extern bool _COSE_Signer_validate(COSE_SignMessage * pSign, COSE_SignerInfo * pSigner, const cn_cbor * pbContent, const cn_cbor * pbProtected, cose_errback * perr);
 
 
+//  Key objects
+extern void _COSE_KEY_Wrap(COSE_KEY * pKey, const cn_cbor * pcborKey);
+extern void _COSE_KEY_Copy(COSE_KEY * pKeyOut, const COSE_KEY * pKey, const struct _cose_crypto_provider * pProvider);
+
+//  Key sets
+extern bool _COSE_KeySet_Recipient_decrypt(const COSE_KeySet * pSet, COSE_RecipientInfo * pRecipFirst, int alg, int cbitKey, byte * pbKey, cose_errback * perr);
+
 // Sign0 items
 extern HCOSE_SIGN0 _COSE_Sign0_Init_From_Object(cn_cbor * cbor, COSE_Sign0Message * pIn, CBOR_CONTEXT_COMMA cose_errback * perr);
 extern void _COSE_Sign0_Release(COSE_Sign0Message * p);
@@ -216,8 +343,8 @@ extern void _COSE_Sign0_Release(COSE_Sign0Message * p);
 extern HCOSE_MAC _COSE_Mac_Init_From_Object(cn_cbor *, COSE_MacMessage * pIn, CBOR_CONTEXT_COMMA cose_errback * errp);
 extern bool _COSE_Mac_Release(COSE_MacMessage * p);
 extern bool _COSE_Mac_Build_AAD(COSE * pCose, char * szContext, byte ** ppbAuthData, size_t * pcbAuthData, CBOR_CONTEXT_COMMA cose_errback * perr);
-extern bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr);
-extern bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, const byte * pbKeyIn, size_t cbKeyIn, const char * szContext, cose_errback * perr);
+extern bool _COSE_Mac_compute(COSE_MacMessage * pcose, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, cose_errback * perr);
+extern bool _COSE_Mac_validate(COSE_MacMessage * pcose, COSE_RecipientInfo * pRecip, const COSE_KeySet * pKeys, const byte * pbKeyIn, size_t cbKeyIn, COSE_PreparedKey * pKeyIn, const char * szContext, cose_errback * perr);
 
 //  MAC0 Items
 extern HCOSE_MAC0 _COSE_Mac0_Init_From_Object(cn_cbor *, COSE_Mac0Message * pIn, CBOR_CONTEXT_COMMA cose_errback * errp);
@@ -238,6 +365,11 @@ extern bool _COSE_CountSign_create(COSE * pMessage, cn_cbor * pcnBody, CBOR_CONT
 #define CHECK_CONDITION_CBOR(condition, error) { if (!(condition)) { DO_ASSERT; if (perr != NULL) {perr->err = _MapFromCBOR(error);} goto errorReturn;}}
 
 extern cn_cbor * _COSE_encode_protected(COSE * pMessage, cose_errback * perr);
+extern byte * _COSE_encode_cbor(const cn_cbor * pcbor, size_t * pcb, CBOR_CONTEXT_COMMA cose_errback * perr);
+extern size_t _COSE_Structure_Write(byte * pbOut, size_t cbOut, const char * szContext, const cn_cbor * pcnProtected, const cn_cbor * pcnProtectedSign, const byte * pbExternal, size_t cbExternal, const cn_cbor * pcnBody, bool fPrefixOnly);
+extern bool _COSE_Structure_Build(const char * szContext, const cn_cbor * pcnProtected, const cn_cbor * pcnProtectedSign, const byte * pbExternal, size_t cbExternal, const cn_cbor * pcnBody, bool fPrefixOnly, byte ** ppb, size_t * pcb, CBOR_CONTEXT_COMMA cose_errback * perr);
+extern size_t _COSE_Encode_Prefix(COSE * pMessage, size_t cbBody, byte * pbOut, size_t cbOut);
+extern size_t _COSE_cbor_head(byte * pb, int majorType, uint64_t value);
 
 
 //// Defines on positions
@@ -269,6 +401,7 @@ cn_cbor * _COSE_arrayget_int(COSE * pMessage, int index);
 
 bool cn_cbor_array_replace(cn_cbor * cb_array, cn_cbor * cb_value, int index, CBOR_CONTEXT_COMMA cn_cbor_errback *errp);
 cn_cbor * cn_cbor_bool_create(int boolValue, CBOR_CONTEXT_COMMA cn_cbor_errback * errp);
+size_t cn_cbor_encode_size(const cn_cbor * object);
 
 
 enum {
@@ -8,8 +8,8 @@
 * @param[in]   int          Size of authenticated data structure
 * @return                   Did the function succeed?
 */
-bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbitKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
-bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
 bool AES_KW_Decrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey, const byte * pbCipherText, size_t cbCipherText, byte * pbKeyOut, int * pcbKeyOut, cose_errback * perr);
 
 /**
@@ -22,15 +22,79 @@ bool AES_KW_Decrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey
 * @param[in]   int          Size of authenticated data structure
 * @return                   Did the function succeed?
 */
-bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
-bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
 bool AES_KW_Encrypt(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKey, const byte *  pbContent, int  cbContent, cose_errback * perr);
 
+/**
+* Perform a ChaCha20/Poly1305 operation
+*
+* The nonce is taken from, or added to, the message in the same way as for
+* AES-GCM.  The 16 byte tag follows the cipher text.
+*/
+bool ChaCha20_Poly1305_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+bool ChaCha20_Poly1305_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+
+/**
+* Load the key of a prepared key into a cipher context which is kept for
+* the life of the prepared key.
+*
+* @param[in]   COSE_PreparedKey Prepared key with the algorithm and key filled in
+* @return                   Did the function succeed?
+*/
+bool AEAD_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr);
+void AEAD_Release_Key(COSE_PreparedKey * pKey);
+
+
+extern bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+extern bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+
+/**
+* Key an AES block cipher context for a prepared CBC-MAC key.  Each message
+* runs through the context, so the key schedule is computed only once.
+*
+* @param[in]   COSE_PreparedKey Prepared key with the algorithm and key filled in
+* @return                   Did the function succeed?
+*/
+bool AES_CBC_MAC_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr);
+void AES_CBC_MAC_Release_Key(COSE_PreparedKey * pKey);
+
+#ifdef USE_OPEN_SSL
+/**
+* Incremental AES CBC-MAC and AES-CMAC (RFC 4493).  Update may be called any
+* number of times, Final returns the 16 byte tag and restarts the context
+* under the same key.  CMAC has no COSE algorithm yet and is reached only
+* through these functions.
+*/
+typedef struct _cbc_mac_ctx CBC_MAC_CTX;
+
+CBC_MAC_CTX * CBC_MAC_New(const byte * pbKey, size_t cbKey, bool fCMAC CBOR_CONTEXT);
+bool CBC_MAC_Update(CBC_MAC_CTX * pctx, const byte * pb, size_t cb);
+bool CBC_MAC_Final(CBC_MAC_CTX * pctx, byte * rgbTag);
+void CBC_MAC_Delete(CBC_MAC_CTX * pctx CBOR_CONTEXT);
+#endif
+
+/**
+* Multi-buffer AES-GCM encryption of many messages under one key and one
+* set of authenticated data, with a 12 byte nonce and a 16 byte tag.  The
+* messages are interleaved so the AES and GHASH work of separate messages
+* overlaps.  Available is false when the processor lacks the instructions,
+* the backend AEAD has to be used then.  Enable is for tests.
+*/
+typedef struct _gcm_batch_key GCM_BATCH_KEY;
 
-extern bool AES_CMAC_Validate(COSE_MacMessage * pcose, int KeySize, int TagSize, const byte * pbKey, int cbitKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+typedef struct {
+	const byte * pbNonce;		//  12 bytes
+	const byte * pbIn;
+	size_t cbIn;
+	byte * pbOut;				//  cbIn bytes of cipher text followed by the tag
+} GCM_BATCH_ITEM;
 
-extern bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
-extern bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbitKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+bool GCM_Batch_Available();
+void GCM_Batch_Enable(bool fEnable);
+GCM_BATCH_KEY * GCM_Batch_New(const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData CBOR_CONTEXT);
+void GCM_Batch_Encrypt(const GCM_BATCH_KEY * pKey, const GCM_BATCH_ITEM * rgItems, size_t cItems);
+void GCM_Batch_Delete(GCM_BATCH_KEY * pKey CBOR_CONTEXT);
 
 /**
 * Perform an HMAC Creation operation
@@ -43,8 +107,19 @@ extern bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TagSize, const byt
 * @param[in]	cose_errback *	Error return location
 * @return						Did the function succeed?
 */
-bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
-bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbitKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+
+/**
+* Absorb the padded key of a prepared HMAC key into an HMAC context which
+* is kept for the life of the prepared key.  Each message starts from a
+* copy of the context.
+*
+* @param[in]   COSE_PreparedKey Prepared key with the algorithm and key filled in
+* @return                   Did the function succeed?
+*/
+bool HMAC_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr);
+void HMAC_Release_Key(COSE_PreparedKey * pKey);
 
 bool HKDF_Extract(COSE * pcose, const byte * pbKey, size_t cbKey, size_t cbitDigest, byte * rgbDigest, size_t * pcbDigest, CBOR_CONTEXT_COMMA cose_errback * perr);
 bool HKDF_Expand(COSE * pcose, size_t cbitDigest, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr);
@@ -60,16 +135,139 @@ bool HKDF_AES_Expand(COSE * pcose, size_t cbitKey, const byte * pbPRK, size_t cb
 * @param[in]	cose_errback *	Error return location
 * @return						Did the function succeed?
 */
-bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr);
-bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr);
+bool ECDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+bool ECDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+
+bool ECDH_ComputeSecret(COSE * pReciient, COSE_KEY * pKeyMe, const COSE_KEY * pKeyYou, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr);
+
+/**
+* Parse the EC key of a key object into a form which is kept for the life
+* of the key object.
+*
+* @param[in]   COSE_KEY *   Key object with the COSE_Key map filled in
+* @param[out]  cose_errback * Error return location
+* @return                   Did the function succeed?
+*/
+bool ECKey_Prepare(COSE_KEY * pKey, cose_errback * perr);
+void ECKey_Release(COSE_KEY * pKey);
+
+/**
+* Perform a signature operation for EdDSA
+*
+* EdDSA signs the message itself rather than a digest, so the encoded
+* prefix and the payload are joined before signing.
+*
+* @param[in]	COSE *			Message holding the signature
+* @param[in]	int				Index of the signature in the message array
+* @param[in]	COSE_KEY *		OKP key to sign or verify with
+* @param[in]	byte *			Encoded prefix of the text to be signed
+* @param[in]	size_t			Size of the prefix
+* @param[in]	byte *			Payload which follows the prefix
+* @param[in]	size_t			Size of the payload
+* @param[in]	cose_errback *	Error return location
+* @return						Did the function succeed?
+*/
+bool EdDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+bool EdDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
 
-bool ECDH_ComputeSecret(COSE * pReciient, cn_cbor ** ppKeyMe, const cn_cbor * pKeyYou, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr);
+/**
+* Parse the OKP key of a key object into a form which is kept for the life
+* of the key object.
+*
+* @param[in]   COSE_KEY *   Key object with the COSE_Key map filled in
+* @param[out]  cose_errback * Error return location
+* @return                   Did the function succeed?
+*/
+bool OKPKey_Prepare(COSE_KEY * pKey, cose_errback * perr);
+void OKPKey_Release(COSE_KEY * pKey);
+
+/**
+* Generate an EC key pair for the ephemeral key pools.  The key is held in
+* the form the backend uses in ECDH_ComputeSecret.
+*
+* @param[in]   int          COSE curve of the key
+* @return                  The new key, NULL on failure
+*/
+void * ECKey_Generate(int iCurve);
+
+/**
+* Free a key made by ECKey_Generate, the private value is wiped
+*/
+void ECKey_Destroy(void * pKey);
 
 /**
 *  Generate random bytes in a buffer
 *
 * @param[in]   byte *      Pointer to buffer to be filled
 * @param[in]   size_t      Size of buffer to be filled
-* @return                  none
+* @return                  Did the function succeed?
+*/
+bool rand_bytes(byte * pb, size_t cb);
+
+/**
+*  Compute the SHA-256 digest of several buffers taken one after the other
+*
+* @param[in]   int          Number of buffers
+* @param[in]   byte **      Buffers to be digested
+* @param[in]   size_t *     Sizes of the buffers
+* @param[out]  byte *       Buffer of 32 bytes to return the digest in
+* @return                  Did the function succeed?
+*/
+bool sha256_digest(int cBuffers, const byte * const * rgpb, const size_t * rgcb, byte * rgbDigest);
+
+/**
+* The table of message level operations each algorithm is dispatched
+* through.  The members have the same meaning as the functions above; a
+* NULL member means the table does not implement that operation.
+*
+* There are two tables.  The backend table holds the functions above and
+* handles every algorithm the library was built with.  The bridge table in
+* Provider.c does the message handling itself and calls the primitives of
+* the COSE_PROVIDER registered for the algorithm.  Random numbers always
+* come from the compiled backend, through the per-thread pool in Random.c.
+*/
+typedef struct _cose_crypto_provider {
+	const char * m_szName;
+
+	bool (*pfnAES_CCM_Encrypt)(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnAES_CCM_Decrypt)(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnAES_GCM_Encrypt)(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnAES_GCM_Decrypt)(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnChaCha20_Poly1305_Encrypt)(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnChaCha20_Poly1305_Decrypt)(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnAEAD_Prepare_Key)(COSE_PreparedKey * pKey, cose_errback * perr);
+	void (*pfnAEAD_Release_Key)(COSE_PreparedKey * pKey);
+
+	bool (*pfnAES_KW_Encrypt)(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKey, const byte * pbContent, int cbContent, cose_errback * perr);
+	bool (*pfnAES_KW_Decrypt)(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey, const byte * pbCipherText, size_t cbCipherText, byte * pbKeyOut, int * pcbKeyOut, cose_errback * perr);
+
+	bool (*pfnAES_CBC_MAC_Create)(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+	bool (*pfnAES_CBC_MAC_Validate)(COSE_MacMessage * pcose, int TagSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+	bool (*pfnAES_CBC_MAC_Prepare_Key)(COSE_PreparedKey * pKey, cose_errback * perr);
+	void (*pfnAES_CBC_MAC_Release_Key)(COSE_PreparedKey * pKey);
+	bool (*pfnHMAC_Create)(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+	bool (*pfnHMAC_Validate)(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbitKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr);
+	bool (*pfnHMAC_Prepare_Key)(COSE_PreparedKey * pKey, cose_errback * perr);
+	void (*pfnHMAC_Release_Key)(COSE_PreparedKey * pKey);
+
+	bool (*pfnHKDF_Extract)(COSE * pcose, const byte * pbKey, size_t cbKey, size_t cbitDigest, byte * rgbDigest, size_t * pcbDigest, CBOR_CONTEXT_COMMA cose_errback * perr);
+	bool (*pfnHKDF_Expand)(COSE * pcose, size_t cbitDigest, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+	bool (*pfnHKDF_AES_Expand)(COSE * pcose, size_t cbitKey, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr);
+
+	bool (*pfnECDSA_Sign)(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+	bool (*pfnECDSA_Verify)(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitsDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+	bool (*pfnECDH_ComputeSecret)(COSE * pReciient, COSE_KEY * pKeyMe, const COSE_KEY * pKeyYou, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr);
+	bool (*pfnECKey_Prepare)(COSE_KEY * pKey, cose_errback * perr);
+	void (*pfnECKey_Release)(COSE_KEY * pKey);
+
+	bool (*pfnEdDSA_Sign)(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+	bool (*pfnEdDSA_Verify)(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr);
+	bool (*pfnOKPKey_Prepare)(COSE_KEY * pKey, cose_errback * perr);
+	void (*pfnOKPKey_Release)(COSE_KEY * pKey);
+} COSE_CRYPTO_PROVIDER;
+
+/**
+* Return the table which handles an algorithm, the bridge table if a
+* provider is registered for it and the backend table otherwise.
 */
-void rand_bytes(byte * pb, size_t cb);
+const COSE_CRYPTO_PROVIDER * _COSE_Provider_Get(int alg);
@@ -4,23 +4,34 @@
 #include "crypto.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <memory.h>
 
 #ifdef USE_MBED_TLS
 
 #include "mbedtls/ccm.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/chachapoly.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/nist_kw.h"
 #include "mbedtls/md.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/ecdh.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/entropy.h"
 
-bool FUseCompressed = true;
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 
-bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
 
 	mbedtls_ccm_context ctx;
+	mbedtls_ccm_context * pctx = &ctx;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int NSize = 15 - (LSize/8);
@@ -32,6 +43,10 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 #endif
 
 	mbedtls_ccm_init(&ctx);
+
+	TSize /= 8; // Comes in in bits not bytes.
+
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
 	
         //  Setup the IV/Nonce and put it into the message
 	pIV = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
@@ -39,7 +54,8 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 		if (perr != NULL) perr->err = COSE_ERR_INVALID_PARAMETER;
 
 	errorReturn:
-		if (rgbOut != NULL) COSE_FREE(rgbOut, context);
+		if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+		else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
 		mbedtls_ccm_free(&ctx);
 		return false;
 	}
@@ -49,27 +65,34 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	//  Setup and run the mbedTLS code
 	cipher = MBEDTLS_CIPHER_ID_AES;
 	
-        CHECK_CONDITION(!mbedtls_ccm_setkey(&ctx, cipher, pbKey, cbKey*8), COSE_ERR_CRYPTO_FAIL);
-	TSize /= 8; // Comes in in bits not bytes.
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_ccm_context *)pPrepared->m_pCipher;
+	else CHECK_CONDITION(!mbedtls_ccm_setkey(&ctx, cipher, pbKey, cbKey*8), COSE_ERR_CRYPTO_FAIL);
 
 	cbOut = (int)  cbCrypto - TSize;
-	rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
-        
-		
-	CHECK_CONDITION(!mbedtls_ccm_auth_decrypt(&ctx, cbOut, rgbIV, NSize, pbAuthData, cbAuthData, pbCrypto, rgbOut, &pbCrypto[cbOut], TSize), COSE_ERR_CRYPTO_FAIL);
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	CHECK_CONDITION(!mbedtls_ccm_auth_decrypt(pctx, cbOut, rgbIV, NSize, pbAuthData, cbAuthData, pbCrypto, rgbOut, &pbCrypto[cbOut], TSize), COSE_ERR_CRYPTO_FAIL);
         
 	mbedtls_ccm_free(&ctx);
 	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
 	pcose->cbContent = cbOut;
 
 	return true;
 }
 
 
-bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
 	mbedtls_ccm_context ctx;
+	mbedtls_ccm_context * pctx = &ctx;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int NSize = 15 - (LSize/8);
@@ -94,7 +117,7 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	
                 pbIV = COSE_CALLOC(NSize, 1, context);
 		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
-		rand_bytes(pbIV, NSize);
+		CHECK_CONDITION(_COSE_Random(pbIV, NSize), COSE_ERR_CRYPTO_FAIL);
 		memcpy(rgbIV, pbIV, NSize);
 		cbor_iv_t = cn_cbor_data_create(pbIV, NSize, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
@@ -112,15 +135,22 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	//  Setup and run the mbedTLS code
 	
 	//cbKey comes in bytes not bits
- 	CHECK_CONDITION(!mbedtls_ccm_setkey(&ctx, cipher, pbKey, cbKey*8), COSE_ERR_CRYPTO_FAIL);
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_ccm_context *)pPrepared->m_pCipher;
+	else CHECK_CONDITION(!mbedtls_ccm_setkey(&ctx, cipher, pbKey, cbKey*8), COSE_ERR_CRYPTO_FAIL);
 	
 	TSize /= 8; // Comes in in bits not bytes.
 
         cbOut = pcose->cbContent; // M00BUG - This is a missing call?
-	rgbOut = (byte *)COSE_CALLOC(cbOut+TSize, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + TSize, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut+TSize, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	CHECK_CONDITION(!mbedtls_ccm_encrypt_and_tag(&ctx, pcose->cbContent, rgbIV, NSize, pbAuthData, cbAuthData, pcose->pbContent, rgbOut, &rgbOut[pcose->cbContent], TSize), COSE_ERR_CRYPTO_FAIL);	
+	CHECK_CONDITION(!mbedtls_ccm_encrypt_and_tag(pctx, pcose->cbContent, rgbIV, NSize, pbAuthData, cbAuthData, pcose->pbContent, rgbOut, &rgbOut[pcose->cbContent], TSize), COSE_ERR_CRYPTO_FAIL);	
 
 	cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + TSize, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
@@ -136,128 +166,227 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 errorReturn:
 	if (pbIV != NULL) COSE_FREE(pbIV, context);
 	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
-	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
 	if (cnTmp != NULL) COSE_FREE(cnTmp, context);
-	printf("errorReturn from OPENSSL\n");
 	mbedtls_ccm_free(&ctx);
 	return false;
 }
-/*
-bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+
+bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
+	mbedtls_gcm_context ctx;
+	mbedtls_gcm_context * pctx = &ctx;
 	int cbOut;
 	byte * rgbOut = NULL;
-	int outl = 0;
-	byte rgbIV[15] = { 0 };
+	int TSize = 128 / 8;
 	const cn_cbor * pIV = NULL;
-	const EVP_CIPHER * cipher;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
-	int TSize = 128 / 8;
 
-	EVP_CIPHER_CTX_init(&ctx);
+	mbedtls_gcm_init(&ctx);
 
-	//  Setup the IV/Nonce and put it into the message
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
+
+	//  Get the nonce from the message
 
 	pIV = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
-	if ((pIV == NULL) || (pIV->type != CN_CBOR_BYTES)) {
-		if (perr != NULL) perr->err = COSE_ERR_INVALID_PARAMETER;
+	CHECK_CONDITION((pIV != NULL) && (pIV->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pIV->length == 96 / 8, COSE_ERR_INVALID_PARAMETER);
 
-	errorReturn:
-		if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return false;
+	//  Setup and run the mbedTLS code
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_gcm_context *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION((cbKey == 128 / 8) || (cbKey == 192 / 8) || (cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(!mbedtls_gcm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, pbKey, (unsigned int) cbKey * 8), COSE_ERR_CRYPTO_FAIL);
 	}
 
-	CHECK_CONDITION(pIV->length == 96/8, COSE_ERR_INVALID_PARAMETER);
-	memcpy(rgbIV, pIV->v.str, pIV->length);
+	cbOut = (int)cbCrypto - TSize;
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut + 1, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	//  Setup and run the OpenSSL code
+	CHECK_CONDITION(!mbedtls_gcm_auth_decrypt(pctx, cbOut, pIV->v.bytes, pIV->length, pbAuthData, cbAuthData, &pbCrypto[cbOut], TSize, pbCrypto, rgbOut), COSE_ERR_DECRYPT_FAILED);
 
-	switch (cbKey) {
-	case 128 / 8:
-		cipher = EVP_aes_128_gcm();
-		break;
+	mbedtls_gcm_free(&ctx);
+	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
+	pcose->cbContent = cbOut;
 
-	case 192 / 8:
-		cipher = EVP_aes_192_gcm();
-		break;
+	return true;
 
-	case 256 / 8:
-		cipher = EVP_aes_256_gcm();
-		break;
+errorReturn:
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
+	mbedtls_gcm_free(&ctx);
+	return false;
+}
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-		break;
+bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	mbedtls_gcm_context ctx;
+	mbedtls_gcm_context * pctx = &ctx;
+	byte * rgbOut = NULL;
+	int TSize = 128 / 8;
+	const cn_cbor * cbor_iv = NULL;
+	cn_cbor * cbor_iv_t = NULL;
+	cn_cbor * cnTmp = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+	byte rgbIV[12];
+	byte * pbIV = NULL;
+	cn_cbor_errback cbor_error;
+
+	mbedtls_gcm_init(&ctx);
+
+	//  Setup the IV/Nonce and put it into the message
+
+	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, perr);
+	if (cbor_iv == NULL) {
+		pbIV = COSE_CALLOC(96 / 8, 1, context);
+		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
+		CHECK_CONDITION(_COSE_Random(pbIV, 96 / 8), COSE_ERR_CRYPTO_FAIL);
+		memcpy(rgbIV, pbIV, 96 / 8);
+		cbor_iv_t = cn_cbor_data_create(pbIV, 96 / 8, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
+		pbIV = NULL;
+
+		if (!_COSE_map_put(&pcose->m_message, COSE_Header_IV, cbor_iv_t, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
+		cbor_iv_t = NULL;
+	}
+	else {
+		CHECK_CONDITION(cbor_iv->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(cbor_iv->length == 96 / 8, COSE_ERR_INVALID_PARAMETER);
+		memcpy(rgbIV, cbor_iv->v.str, cbor_iv->length);
 	}
 
-	//  Do the setup for OpenSSL
+	//  Setup and run the mbedTLS code
 
-	CHECK_CONDITION(EVP_DecryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_DECRYPT_FAILED);
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_gcm_context *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION((cbKey == 128 / 8) || (cbKey == 192 / 8) || (cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(!mbedtls_gcm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, pbKey, (unsigned int) cbKey * 8), COSE_ERR_CRYPTO_FAIL);
+	}
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *)&pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + TSize, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + TSize, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	CHECK_CONDITION(EVP_DecryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
-	
-	//  Pus in the AAD
+	CHECK_CONDITION(!mbedtls_gcm_crypt_and_tag(pctx, MBEDTLS_GCM_ENCRYPT, pcose->cbContent, rgbIV, sizeof(rgbIV), pbAuthData, cbAuthData, pcose->pbContent, rgbOut, TSize, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
+	cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + TSize, CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
+	rgbOut = NULL;
 
-	//  
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	cnTmp = NULL;
 
-	cbOut = (int)cbCrypto - TSize;
-	rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	mbedtls_gcm_free(&ctx);
+	return true;
+
+errorReturn:
+	if (pbIV != NULL) COSE_FREE(pbIV, context);
+	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	if (cnTmp != NULL) COSE_FREE(cnTmp, context);
+	mbedtls_gcm_free(&ctx);
+	return false;
+}
+
+#ifdef USE_CHACHA20_POLY1305
+bool ChaCha20_Poly1305_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	mbedtls_chachapoly_context ctx;
+	mbedtls_chachapoly_context * pctx = &ctx;
+	int cbOut;
+	byte * rgbOut = NULL;
+	int TSize = 128 / 8;
+	const cn_cbor * pIV = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
 
-	//  Process content
+	mbedtls_chachapoly_init(&ctx);
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, rgbOut, &cbOut, pbCrypto, (int)cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
 
-	//  Process Tag
+	//  Get the nonce from the message
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_TAG, TSize, (byte *)pbCrypto + cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	pIV = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
+	CHECK_CONDITION((pIV != NULL) && (pIV->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pIV->length == 96 / 8, COSE_ERR_INVALID_PARAMETER);
 
-	//  Check the result
+	//  Setup and run the mbedTLS code
 
-	CHECK_CONDITION(EVP_DecryptFinal(&ctx, rgbOut + cbOut, &cbOut), COSE_ERR_DECRYPT_FAILED);
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_chachapoly_context *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION(cbKey == 256 / 8, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(!mbedtls_chachapoly_setkey(&ctx, pbKey), COSE_ERR_CRYPTO_FAIL);
+	}
+
+	cbOut = (int)cbCrypto - TSize;
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut + 1, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	CHECK_CONDITION(!mbedtls_chachapoly_auth_decrypt(pctx, cbOut, pIV->v.bytes, pbAuthData, cbAuthData, &pbCrypto[cbOut], pbCrypto, rgbOut), COSE_ERR_DECRYPT_FAILED);
 
+	mbedtls_chachapoly_free(&ctx);
 	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
 	pcose->cbContent = cbOut;
 
 	return true;
+
+errorReturn:
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
+	mbedtls_chachapoly_free(&ctx);
+	return false;
 }
 
-bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool ChaCha20_Poly1305_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
-	int cbOut;
+	mbedtls_chachapoly_context ctx;
+	mbedtls_chachapoly_context * pctx = &ctx;
 	byte * rgbOut = NULL;
-	int outl = 0;
-	byte rgbIV[16] = { 0 };
-	byte * pbIV = NULL;
+	int TSize = 128 / 8;
 	const cn_cbor * cbor_iv = NULL;
 	cn_cbor * cbor_iv_t = NULL;
-	const EVP_CIPHER * cipher;
+	cn_cbor * cnTmp = NULL;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
+	byte rgbIV[12];
+	byte * pbIV = NULL;
 	cn_cbor_errback cbor_error;
 
-	// Make it first so we can clean it up
-	EVP_CIPHER_CTX_init(&ctx);
+	mbedtls_chachapoly_init(&ctx);
 
 	//  Setup the IV/Nonce and put it into the message
 
 	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, perr);
 	if (cbor_iv == NULL) {
-		pbIV = COSE_CALLOC(96, 1, context);
+		pbIV = COSE_CALLOC(96 / 8, 1, context);
 		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
-		rand_bytes(pbIV, 96 / 8);
+		CHECK_CONDITION(_COSE_Random(pbIV, 96 / 8), COSE_ERR_CRYPTO_FAIL);
 		memcpy(rgbIV, pbIV, 96 / 8);
 		cbor_iv_t = cn_cbor_data_create(pbIV, 96 / 8, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
@@ -272,102 +401,259 @@ bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 		memcpy(rgbIV, cbor_iv->v.str, cbor_iv->length);
 	}
 
+	//  Setup and run the mbedTLS code
 
-	switch (cbKey*8) {
-	case 128:
-		cipher = EVP_aes_128_gcm();
-		break;
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (mbedtls_chachapoly_context *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION(cbKey == 256 / 8, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(!mbedtls_chachapoly_setkey(&ctx, pbKey), COSE_ERR_CRYPTO_FAIL);
+	}
 
-	case 192:
-		cipher = EVP_aes_192_gcm();
-		break;
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + TSize, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + TSize, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	case 256:
-		cipher = EVP_aes_256_gcm();
-		break;
+	CHECK_CONDITION(!mbedtls_chachapoly_encrypt_and_tag(pctx, pcose->cbContent, rgbIV, pbAuthData, cbAuthData, pcose->pbContent, rgbOut, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-		break;
-	}
+	cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + TSize, CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
+	rgbOut = NULL;
 
-	//  Setup and run the OpenSSL code
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	cnTmp = NULL;
 
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_CRYPTO_FAIL);
+	mbedtls_chachapoly_free(&ctx);
+	return true;
 
-	CHECK_CONDITION(EVP_EncryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+errorReturn:
+	if (pbIV != NULL) COSE_FREE(pbIV, context);
+	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	if (cnTmp != NULL) COSE_FREE(cnTmp, context);
+	mbedtls_chachapoly_free(&ctx);
+	return false;
+}
+#endif // USE_CHACHA20_POLY1305
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+/*! \private
+* @brief Load a content encryption key into a cipher context
+*
+* AES-CCM, AES-GCM and ChaCha20/Poly1305 keys are each kept keyed in the
+* mbedTLS context for the algorithm.
+*
+* @param pKey  Prepared key with the algorithm and key filled in
+* @param perr  Location to return errors
+* @return result of the operation
+*/
 
-	rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + 128/8, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+bool AEAD_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr)
+{
+	mbedtls_ccm_context * pctx = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
+#endif
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pcose->pbContent, (int)pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
+#ifdef USE_CHACHA20_POLY1305
+	if (pKey->m_alg == COSE_Algorithm_CHACHA20_POLY1305) {
+		mbedtls_chachapoly_context * pchacha;
 
-	CHECK_CONDITION(EVP_EncryptFinal_ex(&ctx, &rgbOut[cbOut], &cbOut), COSE_ERR_CRYPTO_FAIL);
+		pchacha = (mbedtls_chachapoly_context *)COSE_CALLOC(1, sizeof(mbedtls_chachapoly_context), context);
+		CHECK_CONDITION(pchacha != NULL, COSE_ERR_OUT_OF_MEMORY);
+		mbedtls_chachapoly_init(pchacha);
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, 128/8, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
+		if (mbedtls_chachapoly_setkey(pchacha, pKey->m_rgbKey) != 0) {
+			mbedtls_chachapoly_free(pchacha);
+			COSE_FREE(pchacha, context);
+			FAIL_CONDITION(COSE_ERR_CRYPTO_FAIL);
+		}
 
-	cn_cbor * cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + 128/8, CBOR_CONTEXT_PARAM_COMMA NULL);
-	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
-	rgbOut = NULL;
-	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+		pKey->m_pCipher = pchacha;
+		return true;
+	}
+#endif
+
+	if (pKey->m_cbitL == 0) {
+		mbedtls_gcm_context * pgcm;
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+		pgcm = (mbedtls_gcm_context *)COSE_CALLOC(1, sizeof(mbedtls_gcm_context), context);
+		CHECK_CONDITION(pgcm != NULL, COSE_ERR_OUT_OF_MEMORY);
+		mbedtls_gcm_init(pgcm);
+
+		if (mbedtls_gcm_setkey(pgcm, MBEDTLS_CIPHER_ID_AES, pKey->m_rgbKey, (unsigned int) pKey->m_cbKey * 8) != 0) {
+			mbedtls_gcm_free(pgcm);
+			COSE_FREE(pgcm, context);
+			FAIL_CONDITION(COSE_ERR_CRYPTO_FAIL);
+		}
+
+		pKey->m_pCipher = pgcm;
+		return true;
+	}
+
+	pctx = (mbedtls_ccm_context *)COSE_CALLOC(1, sizeof(mbedtls_ccm_context), context);
+	CHECK_CONDITION(pctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	mbedtls_ccm_init(pctx);
+
+	CHECK_CONDITION(!mbedtls_ccm_setkey(pctx, MBEDTLS_CIPHER_ID_AES, pKey->m_rgbKey, (unsigned int) pKey->m_cbKey * 8), COSE_ERR_CRYPTO_FAIL);
+
+	pKey->m_pCipher = pctx;
 	return true;
 
 errorReturn:
-	if (pbIV != NULL) COSE_FREE(pbIV, context);
-	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
-	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (pctx != NULL) {
+		mbedtls_ccm_free(pctx);
+		COSE_FREE(pctx, context);
+	}
 	return false;
 }
 
-
-bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+void AEAD_Release_Key(COSE_PreparedKey * pKey)
 {
-	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
-	int cbOut;
-	byte rgbIV[16] = { 0 };
-	byte * rgbOut = NULL;
-	bool f = false;
-	unsigned int i;
-	cn_cbor * cn = NULL;
 #ifdef USE_CBOR_CONTEXT
-	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+	cn_cbor_context * context = &pKey->m_allocContext;
 #endif
 
-	EVP_CIPHER_CTX_init(&ctx);
+	if (pKey->m_pCipher == NULL) return;
 
-	rgbOut = COSE_CALLOC(16, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+#ifdef USE_CHACHA20_POLY1305
+	if (pKey->m_alg == COSE_Algorithm_CHACHA20_POLY1305) {
+		mbedtls_chachapoly_free((mbedtls_chachapoly_context *)pKey->m_pCipher);
+		COSE_FREE(pKey->m_pCipher, context);
+		pKey->m_pCipher = NULL;
+		return;
+	}
+#endif
 
-	switch (cbKey*8) {
-	case 128:
-		pcipher = EVP_aes_128_cbc();
-		break;
+	if (pKey->m_cbitL == 0) {
+		mbedtls_gcm_free((mbedtls_gcm_context *)pKey->m_pCipher);
+		COSE_FREE(pKey->m_pCipher, context);
+	}
+	else {
+		mbedtls_ccm_free((mbedtls_ccm_context *)pKey->m_pCipher);
+		COSE_FREE(pKey->m_pCipher, context);
+	}
+	pKey->m_pCipher = NULL;
+}
 
-	case 256:
-		pcipher = EVP_aes_256_cbc();
-		break;
+/*
+ *  AES CBC-MAC with a zero IV over input which arrives in pieces.  The last
+ *  block is padded with zeros.  The key schedule is computed once when the
+ *  context is keyed and each block is encrypted in place.
+ */
+
+typedef struct {
+	mbedtls_aes_context m_aes;
+	byte m_rgbState[16];
+	size_t m_cbPending;
+} CBC_MAC_CTX;
+
+static void CBC_MAC_Init(CBC_MAC_CTX * pctx)
+{
+	mbedtls_aes_init(&pctx->m_aes);
+	memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+	pctx->m_cbPending = 0;
+}
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+static void CBC_MAC_Free(CBC_MAC_CTX * pctx)
+{
+	mbedtls_aes_free(&pctx->m_aes);
+	memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+}
+
+static bool CBC_MAC_SetKey(CBC_MAC_CTX * pctx, const byte * pbKey, size_t cbKey)
+{
+	memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+	pctx->m_cbPending = 0;
+	return mbedtls_aes_setkey_enc(&pctx->m_aes, pbKey, (unsigned int) cbKey * 8) == 0;
+}
+
+static bool CBC_MAC_Update(CBC_MAC_CTX * pctx, const byte * pb, size_t cb)
+{
+	size_t cbChunk;
+	size_t i;
+
+	while (cb > 0) {
+		cbChunk = MIN(16 - pctx->m_cbPending, cb);
+		for (i = 0; i < cbChunk; i++) pctx->m_rgbState[pctx->m_cbPending + i] ^= pb[i];
+		pctx->m_cbPending += cbChunk;
+		pb += cbChunk;
+		cb -= cbChunk;
+
+		if (pctx->m_cbPending == 16) {
+			if (mbedtls_aes_crypt_ecb(&pctx->m_aes, MBEDTLS_AES_ENCRYPT, pctx->m_rgbState, pctx->m_rgbState) != 0) return false;
+			pctx->m_cbPending = 0;
+		}
 	}
+	return true;
+}
 
-	//  Setup and run the OpenSSL code
+static bool CBC_MAC_Final(CBC_MAC_CTX * pctx, byte * rgbTag)
+{
+	//  Padding with zeros leaves the pending bytes of the state as they are
 
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	if (pctx->m_cbPending != 0) {
+		if (mbedtls_aes_crypt_ecb(&pctx->m_aes, MBEDTLS_AES_ENCRYPT, pctx->m_rgbState, pctx->m_rgbState) != 0) return false;
+	}
+	memcpy(rgbTag, pctx->m_rgbState, 16);
 
-	for (i = 0; i < (unsigned int)cbAuthData / 16; i++) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbAuthData + (i * 16), 16), COSE_ERR_CRYPTO_FAIL);
+	memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+	pctx->m_cbPending = 0;
+	return true;
+}
+
+/*
+ *  Compute a CBC-MAC tag, with the context of a prepared key when there is
+ *  one and with a context keyed for this message otherwise.
+ */
+
+static bool CBC_MAC_Tag(const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * rgbTag, cose_errback * perr)
+{
+	CBC_MAC_CTX ctx;
+	CBC_MAC_CTX * pctx = &ctx;
+
+	CBC_MAC_Init(&ctx);
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (CBC_MAC_CTX *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION((cbKey == 128 / 8) || (cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
+
+		//  Setup and run the mbedTLS code
+
+		CHECK_CONDITION(CBC_MAC_SetKey(&ctx, pbKey, cbKey), COSE_ERR_CRYPTO_FAIL);
 	}
-	if (cbAuthData % 16 != 0) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbAuthData + (i * 16), cbAuthData % 16), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbIV, 16 - (cbAuthData % 16)), COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(CBC_MAC_Update(pctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(CBC_MAC_Final(pctx, rgbTag), COSE_ERR_CRYPTO_FAIL);
+
+	CBC_MAC_Free(&ctx);
+	return true;
+
+errorReturn:
+	//  A prepared context must not carry a half finished chain into the next message
+	if (pctx != &ctx) {
+		memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+		pctx->m_cbPending = 0;
 	}
+	CBC_MAC_Free(&ctx);
+	return false;
+}
+
+bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	byte * rgbOut = NULL;
+	cn_cbor * cn = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+
+	rgbOut = COSE_CALLOC(16, 1, context);
+	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	if (!CBC_MAC_Tag(pbKey, cbKey, pPrepared, pbAuthData, cbAuthData, rgbOut, perr)) goto errorReturn;
 
 	cn = cn_cbor_data_create(rgbOut, TSize / 8, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_OUT_OF_MEMORY);
@@ -376,300 +662,193 @@ bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey,
 	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cn, INDEX_MAC_TAG, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
 	cn = NULL;
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
-	return !f;
+	return true;
 
 errorReturn:
 	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
 	if (cn != NULL) CN_CBOR_FREE(cn, context);
-	EVP_CIPHER_CTX_cleanup(&ctx);
 	return false;
 }
 
-bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
 {
-	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
-	int cbOut;
-	byte rgbIV[16] = { 0 };
-	byte rgbTag[16] = { 0 };
+	byte rgbTag[16];
+	const cn_cbor * cn;
 	bool f = false;
 	unsigned int i;
 
-	switch (cbKey*8) {
-	case 128:
-		pcipher = EVP_aes_128_cbc();
-		break;
-
-	case 256:
-		pcipher = EVP_aes_256_cbc();
-		break;
-
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-	}
-
-	//  Setup and run the OpenSSL code
-
-	EVP_CIPHER_CTX_init(&ctx);
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	if (!CBC_MAC_Tag(pbKey, cbKey, pPrepared, pbAuthData, cbAuthData, rgbTag, perr)) goto errorReturn;
 
 	TSize /= 8;
 
-	for (i = 0; i < (unsigned int) cbAuthData / 16; i++) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, pbAuthData+(i*16), 16), COSE_ERR_CRYPTO_FAIL);
-	}
-	if (cbAuthData % 16 != 0) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, pbAuthData + (i * 16), cbAuthData % 16), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, rgbIV, 16 - (cbAuthData % 16)), COSE_ERR_CRYPTO_FAIL);
-	}
-
-	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
+	cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
+	CHECK_CONDITION((cn->type == CN_CBOR_BYTES) && (cn->length == TSize), COSE_ERR_CBOR);
 
 	for (i = 0; i < (unsigned int)TSize; i++) f |= (cn->v.bytes[i] != rgbTag[i]);
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
 	return !f;
 
 errorReturn:
-	EVP_CIPHER_CTX_cleanup(&ctx);
 	return false;
 }
 
-#if 0
-//  We are doing CBC-MAC not CMAC at this time
-bool AES_CMAC_Validate(COSE_MacMessage * pcose, int KeySize, int TagSize, const byte * pbAuthData, int cbAuthData, cose_errback * perr)
+/*!
+* @brief Key an AES context for a prepared CBC-MAC key
+*
+* @param pKey  Prepared key with the algorithm and key filled in
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool AES_CBC_MAC_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr)
 {
-	CMAC_CTX * pctx = NULL;
-	const EVP_CIPHER * pcipher = NULL;
-	byte * rgbOut = NULL;
-	size_t cbOut;
-	bool f = false;
-	unsigned int i;
+	CBC_MAC_CTX * pctx = NULL;
 #ifdef USE_CBOR_CONTEXT
-	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+	cn_cbor_context * context = &pKey->m_allocContext;
 #endif
 
-	pctx = CMAC_CTX_new();
+	CHECK_CONDITION((pKey->m_cbKey == 128 / 8) || (pKey->m_cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
 
+	pctx = (CBC_MAC_CTX *)COSE_CALLOC(1, sizeof(CBC_MAC_CTX), context);
+	CHECK_CONDITION(pctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CBC_MAC_Init(pctx);
 
-	switch (KeySize) {
-	case 128: pcipher = EVP_aes_128_cbc(); break;
-	case 256: pcipher = EVP_aes_256_cbc(); break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
-
-	rgbOut = COSE_CALLOC(128/8, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(CBC_MAC_SetKey(pctx, pKey->m_rgbKey, pKey->m_cbKey), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(CMAC_Init(pctx, pcose->pbKey, pcose->cbKey, pcipher, NULL ) == 1, COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(CMAC_Update(pctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(CMAC_Final(pctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
-
-	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
-	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
-
-	for (i = 0; i < (unsigned int)TagSize / 8; i++) f |= (cn->v.bytes[i] != rgbOut[i]);
-
-	COSE_FREE(rgbOut, context);
-	CMAC_CTX_cleanup(pctx);
-	CMAC_CTX_free(pctx);
-	return !f;
+	pKey->m_pCipher = pctx;
+	return true;
 
 errorReturn:
-	COSE_FREE(rgbOut, context);
-	CMAC_CTX_cleanup(pctx);
-	CMAC_CTX_free(pctx);
+	if (pctx != NULL) {
+		CBC_MAC_Free(pctx);
+		COSE_FREE(pctx, context);
+	}
 	return false;
+}
+
+void AES_CBC_MAC_Release_Key(COSE_PreparedKey * pKey)
+{
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
+#endif
+
+	if (pKey->m_pCipher == NULL) return;
 
+	CBC_MAC_Free((CBC_MAC_CTX *)pKey->m_pCipher);
+	COSE_FREE(pKey->m_pCipher, context);
+	pKey->m_pCipher = NULL;
 }
-#endif
 
 bool HKDF_AES_Expand(COSE * pcose, size_t cbitKey, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
-	int cbOut;
-	byte rgbIV[16] = { 0 };
+	CBC_MAC_CTX ctx;
 	byte bCount = 1;
 	size_t ib;
 	byte rgbDigest[128 / 8];
-	int cbDigest = 0;
-	byte rgbOut[16];
+	size_t cbDigest = 0;
 
-	EVP_CIPHER_CTX_init(&ctx);
-
-	switch (cbitKey) {
-	case 128:
-		pcipher = EVP_aes_128_cbc();
-		break;
-
-	case 256:
-		pcipher = EVP_aes_256_cbc();
-		break;
+	CBC_MAC_Init(&ctx);
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-	}
+	CHECK_CONDITION((cbitKey == 128) || (cbitKey == 256), COSE_ERR_INVALID_PARAMETER);
 	CHECK_CONDITION(cbPRK == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
 
-	//  Setup and run the OpenSSL code
+	//  Setup and run the mbedTLS code, the key is the same for every block
 
+	CHECK_CONDITION(CBC_MAC_SetKey(&ctx, pbPRK, cbPRK), COSE_ERR_CRYPTO_FAIL);
 
 	for (ib = 0; ib < cbOutput; ib += 16, bCount += 1) {
-		size_t ib2;
-
-		CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbPRK, rgbIV), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Final(&ctx, rgbDigest), COSE_ERR_CRYPTO_FAIL);
+		cbDigest = sizeof(rgbDigest);
 
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
-		for (ib2 = 0; ib2 < cbInfo; ib2+=16) {
-			CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbInfo+ib2, (int) MIN(16, cbInfo-ib2)), COSE_ERR_CRYPTO_FAIL);
-		}
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
-		if ((cbInfo + 1) % 16 != 0) {
-			CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbIV, (int) 16-(cbInfo+1)%16), COSE_ERR_CRYPTO_FAIL);
-		}
-		memcpy(rgbDigest, rgbOut, cbOut);
-		cbDigest = cbOut;
 		memcpy(pbOutput + ib, rgbDigest, MIN(16, cbOutput - ib));
 	}
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	CBC_MAC_Free(&ctx);
 	return true;
 
 errorReturn:
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	CBC_MAC_Free(&ctx);
 	return false;
 }
 
+static const mbedtls_md_info_t * MD_From_Size(size_t cbitDigest)
+{
+	switch (cbitDigest) {
+	case 256: return mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+	case 384: return mbedtls_md_info_from_type(MBEDTLS_MD_SHA384);
+	case 512: return mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
+	default: return NULL;
+	}
+}
 
 bool HKDF_Extract(COSE * pcose, const byte * pbKey, size_t cbKey, size_t cbitDigest, byte * rgbDigest, size_t * pcbDigest, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
-	byte rgbSalt[EVP_MAX_MD_SIZE] = { 0 };
-	int cbSalt;
-	cn_cbor * cnSalt;
-	HMAC_CTX ctx;
-	const EVP_MD * pmd = NULL;
-	unsigned int cbDigest;
-
-	HMAC_CTX_init(&ctx);
-
-	if (0) {
-	errorReturn:
-		HMAC_cleanup(&ctx);
-		return false;
-	}
+	byte rgbSalt[MBEDTLS_MD_MAX_SIZE] = { 0 };
+	const cn_cbor * cnSalt;
+	const mbedtls_md_info_t * pmd;
 
-	switch (cbitDigest) {
-	case 256: pmd = EVP_sha256(); cbSalt = 256 / 8;  break;
-	case 384: pmd = EVP_sha384(); cbSalt = 384 / 8; break;
-	case 512: pmd = EVP_sha512(); cbSalt = 512 / 8; break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	pmd = MD_From_Size(cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
 
 	cnSalt = _COSE_map_get_int(pcose, COSE_Header_HKDF_salt, COSE_BOTH, perr);
 
 	if (cnSalt != NULL) {
-		CHECK_CONDITION(HMAC_Init(&ctx, cnSalt->v.bytes, (int) cnSalt->length, pmd), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac(pmd, cnSalt->v.bytes, cnSalt->length, pbKey, cbKey, rgbDigest), COSE_ERR_CRYPTO_FAIL);
 	}
 	else {
-		CHECK_CONDITION(HMAC_Init(&ctx, rgbSalt, cbSalt, pmd), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac(pmd, rgbSalt, mbedtls_md_get_size(pmd), pbKey, cbKey, rgbDigest), COSE_ERR_CRYPTO_FAIL);
 	}
-	CHECK_CONDITION(HMAC_Update(&ctx, pbKey, (int)cbKey), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Final(&ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
-	*pcbDigest = cbDigest;
-	HMAC_cleanup(&ctx);
+	*pcbDigest = mbedtls_md_get_size(pmd);
 	return true;
+
+errorReturn:
+	return false;
 }
 
 bool HKDF_Expand(COSE * pcose, size_t cbitDigest, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	HMAC_CTX ctx;
-	const EVP_MD * pmd = NULL;
+	mbedtls_md_context_t ctx;
+	const mbedtls_md_info_t * pmd;
 	size_t ib;
-	int cbSalt;
-	unsigned int cbDigest = 0;
-	byte rgbDigest[EVP_MAX_MD_SIZE];
+	size_t cbDigest = 0;
+	byte rgbDigest[MBEDTLS_MD_MAX_SIZE];
 	byte bCount = 1;
 
-	HMAC_CTX_init(&ctx);
+	mbedtls_md_init(&ctx);
 
-	if (0) {
-	errorReturn:
-		HMAC_cleanup(&ctx);
-		return false;
-	}
+	pmd = MD_From_Size(cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(!mbedtls_md_setup(&ctx, pmd, 1), COSE_ERR_OUT_OF_MEMORY);
 
-	switch (cbitDigest) {
-	case 256: pmd = EVP_sha256(); cbSalt = 256 / 8;  break;
-	case 384: pmd = EVP_sha384(); cbSalt = 384 / 8; break;
-	case 512: pmd = EVP_sha512(); cbSalt = 512 / 8; break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	//  The HMAC key is loaded once, each block after the first only resets
+	//  the context to the keyed state
 
+	CHECK_CONDITION(!mbedtls_md_hmac_starts(&ctx, pbPRK, cbPRK), COSE_ERR_CRYPTO_FAIL);
 
 	for (ib = 0; ib < cbOutput; ib += cbDigest, bCount += 1) {
-		CHECK_CONDITION(HMAC_Init_ex(&ctx, pbPRK, (int)cbPRK, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Final(&ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
+		if (ib != 0) CHECK_CONDITION(!mbedtls_md_hmac_reset(&ctx), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac_update(&ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac_update(&ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac_update(&ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_md_hmac_finish(&ctx, rgbDigest), COSE_ERR_CRYPTO_FAIL);
+		cbDigest = mbedtls_md_get_size(pmd);
 
 		memcpy(pbOutput + ib, rgbDigest, MIN(cbDigest, cbOutput - ib));
 	}
 
-	HMAC_cleanup(&ctx);
+	mbedtls_md_free(&ctx);
 	return true;
 
+errorReturn:
+	mbedtls_md_free(&ctx);
+	return false;
 }
 
-void dump_output(byte* b, size_t s){
-	for(int i = 0; i < s; i++){
-		printf("%02x", *b);
-		b++;
-	}
-	printf("\n");
-}
-
-void diff(unsigned char* a, size_t a_l, unsigned char* b, size_t b_l){
-	size_t s;
-	s = (a_l < b_l) ? a_l : b_l;
-	unsigned char* tmp = a;
-	printf("size = %d\n",s );
-//	printf("%02x\n", *tmp);
-	int i;
-	for(i = 0; i < s; ++i){
-		printf("%02x", *tmp);
-		tmp++;
-	}
-	printf("\n");
-
-	tmp = b;
-	for(i = 0; i < s; ++i){
-		printf("%02x", *tmp);
-		tmp++;
-	}
-	printf("\n");
-
-	for(i = 0; i < s; ++i){
-
-		if(*a != *b){
-			printf("^^");
-
-		} else {
-			printf("__");
-
-		}
-
-		a++;
-		b++;
-	}
-	printf("\n");
-}
-*/
-
-bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
 {
 	byte * rgbOut = NULL;
 //	unsigned int cbOut;
@@ -681,6 +860,9 @@ bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbK
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
+	//  mbedTLS has no prepared form of an HMAC key, the raw key is used
+	UNUSED_PARAM(pPrepared);
+
 	switch (HSize) {
 		case 256: md_name = "SHA256"; break;
 		case 384: md_name = "SHA384"; break;
@@ -712,7 +894,7 @@ bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbK
 	return true;
 }
 
-bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
 {
 	mbedtls_md_context_t contx;
 	const char* md_name;
@@ -726,6 +908,9 @@ bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * p
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
+	//  mbedTLS has no prepared form of an HMAC key, the raw key is used
+	UNUSED_PARAM(pPrepared);
+
 	switch (HSize) {
 		case 256: md_name = "SHA256"; break;
 		case 384: md_name = "SHA384"; break;
@@ -748,9 +933,10 @@ bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * p
 	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
 
-	if (cn->length > (int) cbOut) return false;
+	CHECK_CONDITION((cn->type == CN_CBOR_BYTES) && (cn->length == TSize / 8) && ((unsigned int) TSize / 8 <= cbOut), COSE_ERR_CBOR);
 	for (i = 0; i < (unsigned int) TSize/8; i++) f |= (cn->v.bytes[i] != rgbOut[i]);
 
+	COSE_FREE(rgbOut, context);
 	mbedtls_md_free(&contx); 
 	return !f;
 
@@ -759,38 +945,204 @@ errorReturn:
 	mbedtls_md_free(&contx); 
 	return false;
 }
-/*
 
 #define COSE_Key_EC_Curve -1
 #define COSE_Key_EC_X -2
 #define COSE_Key_EC_Y -3
 #define COSE_Key_EC_d -4
 
-EC_KEY * ECKey_From(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
+/*
+ *  Random numbers come from a CTR-DRBG which lives as long as the thread
+ *  rather than being instantiated for each request.  It is seeded from the
+ *  platform entropy source the first time the thread asks for random bytes
+ *  and mbedTLS reseeds it from the same source at its reseed interval.  The
+ *  state holds no heap memory, so nothing needs to be released when the
+ *  thread exits.
+ */
+
+#ifdef _MSC_VER
+#define COSE_THREAD_LOCAL __declspec(thread)
+#else
+#define COSE_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+	bool m_fSeeded;
+#ifndef _WIN32
+	pid_t m_pid;
+#endif
+	mbedtls_entropy_context m_entropy;
+	mbedtls_ctr_drbg_context m_drbg;
+} RandomState;
+
+static COSE_THREAD_LOCAL RandomState s_random;
+
+static const byte s_rgbPersonalization[] = "COSE-C mbedTLS CTR-DRBG";
+
+static mbedtls_ctr_drbg_context * DRBG_Get(void)
+{
+	RandomState * pState = &s_random;
+	byte rgbCustom[sizeof(s_rgbPersonalization) + sizeof(RandomState *)];
+
+	if (pState->m_fSeeded) {
+#ifndef _WIN32
+		//  A forked child starts with a copy of the parent's state, reseed it
+		//  so the two processes do not hand out the same bytes.
+
+		pid_t pid = getpid();
+		if (pid != pState->m_pid) {
+			if (mbedtls_ctr_drbg_reseed(&pState->m_drbg, (const byte *) &pid, sizeof(pid)) != 0) return NULL;
+			pState->m_pid = pid;
+		}
+#endif
+		return &pState->m_drbg;
+	}
+
+	//  The address of the state differs between threads, putting it in the
+	//  personalization string keeps threads which seed together apart.
+
+	memcpy(rgbCustom, s_rgbPersonalization, sizeof(s_rgbPersonalization));
+	memcpy(rgbCustom + sizeof(s_rgbPersonalization), &pState, sizeof(pState));
+
+	mbedtls_entropy_init(&pState->m_entropy);
+	mbedtls_ctr_drbg_init(&pState->m_drbg);
+	if (mbedtls_ctr_drbg_seed(&pState->m_drbg, mbedtls_entropy_func, &pState->m_entropy, rgbCustom, sizeof(rgbCustom)) != 0) {
+		mbedtls_ctr_drbg_free(&pState->m_drbg);
+		mbedtls_entropy_free(&pState->m_entropy);
+		return NULL;
+	}
+
+#ifndef _WIN32
+	pState->m_pid = getpid();
+#endif
+	pState->m_fSeeded = true;
+	return &pState->m_drbg;
+}
+
+/*
+ *  Random number callback handed to the mbedTLS EC functions, the context
+ *  argument is not used as the generator is found from the thread.
+ */
+
+static int DRBG_Random(void * pv, unsigned char * pb, size_t cb)
+{
+	mbedtls_ctr_drbg_context * pdrbg = DRBG_Get();
+	size_t cbChunk;
+	int ret;
+
+	UNUSED_PARAM(pv);
+	if (pdrbg == NULL) return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+
+	while (cb > 0) {
+		cbChunk = MIN(cb, MBEDTLS_CTR_DRBG_MAX_REQUEST);
+		ret = mbedtls_ctr_drbg_random(pdrbg, pb, cbChunk);
+		if (ret != 0) return ret;
+		pb += cbChunk;
+		cb -= cbChunk;
+	}
+	return 0;
+}
+
+bool rand_bytes(byte * pb, size_t cb)
+{
+	return DRBG_Random(NULL, pb, cb) == 0;
+}
+
+bool sha256_digest(int cBuffers, const byte * const * rgpb, const size_t * rgcb, byte * rgbDigest)
+{
+	mbedtls_md_context_t ctx;
+	bool f;
+	int i;
+
+	mbedtls_md_init(&ctx);
+
+	f = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) == 0;
+	if (f) f = mbedtls_md_starts(&ctx) == 0;
+	for (i = 0; f && (i < cBuffers); i++) f = mbedtls_md_update(&ctx, rgpb[i], rgcb[i]) == 0;
+	if (f) f = mbedtls_md_finish(&ctx, rgbDigest) == 0;
+
+	mbedtls_md_free(&ctx);
+	return f;
+}
+
+/*
+ *  Random number callback for generating ephemeral keys, the bytes come from
+ *  the per-thread pool like every other nonce and key the library makes.
+ */
+
+static int Pool_Random(void * pv, unsigned char * pb, size_t cb)
+{
+	UNUSED_PARAM(pv);
+	return _COSE_Random(pb, cb) ? 0 : MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+}
+
+/*
+ *  mbedTLS does not read compressed points, so y is recovered here from
+ *  y^2 = x^3 + ax + b.  The curves accepted by ECKey_Parse, P-256, P-384
+ *  and P-521, have p = 3 mod 4, where the square root of v is
+ *  v^((p+1)/4) mod p.  This does not hold for every curve, P-224 has
+ *  p = 1 mod 4 and would need Tonelli-Shanks.
+ */
+
+static bool ECKey_Decompress(const mbedtls_ecp_group * grp, mbedtls_ecp_point * pPoint, bool fOdd, cose_errback * perr)
+{
+	mbedtls_mpi v;
+	mbedtls_mpi e;
+	bool fRet = false;
+
+	mbedtls_mpi_init(&v);
+	mbedtls_mpi_init(&e);
+
+	//  mbedTLS leaves A unset for the curves where a = -3
+
+	CHECK_CONDITION(!mbedtls_mpi_mul_mpi(&v, &pPoint->X, &pPoint->X), COSE_ERR_CRYPTO_FAIL);
+	if (grp->A.p == NULL) {
+		CHECK_CONDITION(!mbedtls_mpi_sub_int(&v, &v, 3), COSE_ERR_CRYPTO_FAIL);
+	}
+	else {
+		CHECK_CONDITION(!mbedtls_mpi_add_mpi(&v, &v, &grp->A), COSE_ERR_CRYPTO_FAIL);
+	}
+	CHECK_CONDITION(!mbedtls_mpi_mul_mpi(&v, &v, &pPoint->X), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_add_mpi(&v, &v, &grp->B), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_mod_mpi(&v, &v, &grp->P), COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(!mbedtls_mpi_add_int(&e, &grp->P, 1), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_shift_r(&e, 2), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_exp_mod(&pPoint->Y, &v, &e, &grp->P, NULL), COSE_ERR_CRYPTO_FAIL);
+
+	if (mbedtls_mpi_get_bit(&pPoint->Y, 0) != (fOdd ? 1 : 0)) {
+		CHECK_CONDITION(!mbedtls_mpi_sub_mpi(&pPoint->Y, &grp->P, &pPoint->Y), COSE_ERR_CRYPTO_FAIL);
+	}
+
+	fRet = true;
+
+errorReturn:
+	mbedtls_mpi_free(&v);
+	mbedtls_mpi_free(&e);
+	return fRet;
+}
+
+static bool ECKey_Parse(const cn_cbor * pKey, mbedtls_ecp_keypair * pKeypair, int * cbGroup, cose_errback * perr)
 {
-	EC_KEY * pNewKey = EC_KEY_new();
-	byte  rgbKey[512+1];
-	int cbKey;
 	const cn_cbor * p;
-	int nidGroup = -1;
-	EC_POINT * pPoint = NULL;
+	mbedtls_ecp_group_id groupId;
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_Curve);
 	CHECK_CONDITION(p != NULL, COSE_ERR_INVALID_PARAMETER);
 
 	switch (p->v.sint) {
 	case 1: // P-256
-		nidGroup = NID_X9_62_prime256v1;
+		groupId = MBEDTLS_ECP_DP_SECP256R1;
 		*cbGroup = 256 / 8;
 		break;
 
 	case 2: // P-384
-		nidGroup = NID_secp384r1;
+		groupId = MBEDTLS_ECP_DP_SECP384R1;
 		*cbGroup = 384 / 8;
 		break;
 
 	case 3: // P-521
-		nidGroup = NID_secp521r1;
+		groupId = MBEDTLS_ECP_DP_SECP521R1;
 		*cbGroup = (521 + 7) / 8;
 		break;
 
@@ -798,78 +1150,142 @@ EC_KEY * ECKey_From(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
-	EC_GROUP * ecgroup = EC_GROUP_new_by_curve_name(nidGroup);
-	CHECK_CONDITION(ecgroup != NULL, COSE_ERR_INVALID_PARAMETER);
-	CHECK_CONDITION(EC_KEY_set_group(pNewKey, ecgroup) == 1, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_ecp_group_load(&pKeypair->grp, groupId), COSE_ERR_CRYPTO_FAIL);
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_X);
 	CHECK_CONDITION((p != NULL) && (p->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
 	CHECK_CONDITION(p->length == *cbGroup, COSE_ERR_INVALID_PARAMETER);
-	memcpy(rgbKey+1, p->v.str, p->length);
-	
+	CHECK_CONDITION(!mbedtls_mpi_read_binary(&pKeypair->Q.X, p->v.bytes, p->length), COSE_ERR_CRYPTO_FAIL);
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_Y);
 	CHECK_CONDITION((p != NULL), COSE_ERR_INVALID_PARAMETER);
 	if (p->type == CN_CBOR_BYTES) {
-		rgbKey[0] = POINT_CONVERSION_UNCOMPRESSED;
-		cbKey = (*cbGroup * 2) + 1;
 		CHECK_CONDITION(p->length == *cbGroup, COSE_ERR_INVALID_PARAMETER);
-		memcpy(rgbKey + p->length + 1, p->v.str, p->length);
+		CHECK_CONDITION(!mbedtls_mpi_read_binary(&pKeypair->Q.Y, p->v.bytes, p->length), COSE_ERR_CRYPTO_FAIL);
 	}
-	else if (p->type == CN_CBOR_TRUE) {
-		cbKey = (*cbGroup) + 1;
-		rgbKey[0] = POINT_CONVERSION_COMPRESSED + 1;
-	}
-	else if (p->type == CN_CBOR_FALSE) {
-		cbKey = (*cbGroup) + 1;
-		rgbKey[0] = POINT_CONVERSION_COMPRESSED;
+	else if ((p->type == CN_CBOR_TRUE) || (p->type == CN_CBOR_FALSE)) {
+		if (!ECKey_Decompress(&pKeypair->grp, &pKeypair->Q, p->type == CN_CBOR_TRUE, perr)) goto errorReturn;
 	}
 	else FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 
-	pPoint = EC_POINT_new(ecgroup);
-	CHECK_CONDITION(pPoint != NULL, COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(EC_POINT_oct2point(ecgroup, pPoint, rgbKey, cbKey, NULL) == 1, COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(EC_KEY_set_public_key(pNewKey, pPoint) == 1, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_lset(&pKeypair->Q.Z, 1), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_ecp_check_pubkey(&pKeypair->grp, &pKeypair->Q), COSE_ERR_INVALID_PARAMETER);
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_d);
 	if (p != NULL) {
-		BIGNUM * pbn;
+		CHECK_CONDITION(p->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(!mbedtls_mpi_read_binary(&pKeypair->d, p->v.bytes, p->length), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(!mbedtls_ecp_check_privkey(&pKeypair->grp, &pKeypair->d), COSE_ERR_INVALID_PARAMETER);
+	}
+
+	return true;
+
+errorReturn:
+	return false;
+}
+
+/*!
+* @brief Get the EC key for a key object
+*
+* A key object which has been prepared hands out the key it holds, otherwise
+* the COSE_Key map is parsed into pKeypairTemp.  The caller initializes and
+* frees pKeypairTemp in either case.
+*/
 
-		pbn = BN_bin2bn(p->v.bytes, (int) p->length, NULL);
-		CHECK_CONDITION(pbn != NULL, COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(EC_KEY_set_private_key(pNewKey, pbn) == 1, COSE_ERR_CRYPTO_FAIL);
+static mbedtls_ecp_keypair * ECKey_From(const COSE_KEY * pKey, mbedtls_ecp_keypair * pKeypairTemp, int * cbGroup, cose_errback * perr)
+{
+	if (pKey->m_pECKey != NULL) {
+		*cbGroup = pKey->m_cbGroup;
+		return (mbedtls_ecp_keypair *) pKey->m_pECKey;
 	}
-	
-	return pNewKey;
+
+	CHECK_CONDITION(pKey->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+	if (!ECKey_Parse(pKey->m_cborKey, pKeypairTemp, cbGroup, perr)) return NULL;
+	return pKeypairTemp;
 
 errorReturn:
-	if (pNewKey != NULL) EC_KEY_free(pNewKey);
 	return NULL;
 }
 
-cn_cbor * EC_FromKey(const EC_KEY * pKey, CBOR_CONTEXT_COMMA cose_errback * perr)
+bool ECKey_Prepare(COSE_KEY * pKey, cose_errback * perr)
+{
+	mbedtls_ecp_keypair * pKeypair = NULL;
+	mbedtls_ecp_point pt;
+	mbedtls_mpi one;
+	int cbGroup;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
+#endif
+
+	mbedtls_ecp_point_init(&pt);
+	mbedtls_mpi_init(&one);
+
+	pKeypair = (mbedtls_ecp_keypair *)COSE_CALLOC(1, sizeof(mbedtls_ecp_keypair), context);
+	CHECK_CONDITION(pKeypair != NULL, COSE_ERR_OUT_OF_MEMORY);
+	mbedtls_ecp_keypair_init(pKeypair);
+
+	if (!ECKey_Parse(pKey->m_cborKey, pKeypair, &cbGroup, perr)) goto errorReturn;
+
+	//  Build the multiples of the generator once for the key.  mbedTLS keeps
+	//  them in the group the first time the generator is multiplied and only
+	//  reads them afterwards, so threads sharing the key do not write to it.
+
+	CHECK_CONDITION(!mbedtls_mpi_lset(&one, 1), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_ecp_mul(&pKeypair->grp, &pt, &one, &pKeypair->grp.G, DRBG_Random, NULL), COSE_ERR_CRYPTO_FAIL);
+
+	mbedtls_ecp_point_free(&pt);
+	mbedtls_mpi_free(&one);
+
+	pKey->m_pECKey = pKeypair;
+	pKey->m_cbGroup = cbGroup;
+	return true;
+
+errorReturn:
+	mbedtls_ecp_point_free(&pt);
+	mbedtls_mpi_free(&one);
+	if (pKeypair != NULL) {
+		mbedtls_ecp_keypair_free(pKeypair);
+		COSE_FREE(pKeypair, context);
+	}
+	return false;
+}
+
+void ECKey_Release(COSE_KEY * pKey)
+{
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
+#endif
+
+	if (pKey->m_pECKey != NULL) {
+		mbedtls_ecp_keypair_free((mbedtls_ecp_keypair *) pKey->m_pECKey);
+		COSE_FREE(pKey->m_pECKey, context);
+	}
+	pKey->m_pECKey = NULL;
+}
+
+static cn_cbor * EC_FromKey(const mbedtls_ecp_group * grp, const mbedtls_ecp_point * pPoint, int cbGroup, bool fCompressed, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	cn_cbor * pkey = NULL;
-	const EC_GROUP * pgroup;
 	int cose_group;
 	cn_cbor * p = NULL;
 	cn_cbor_errback cbor_error;
-	const EC_POINT * pPoint;
-	size_t cbSize;
-	byte * pbOut = NULL;
+	byte rgbPoint[MBEDTLS_ECP_MAX_PT_LEN];
+	size_t cbPoint;
+	byte * pbX = NULL;
+	byte * pbY = NULL;
 
-	pgroup = EC_KEY_get0_group(pKey);
-	CHECK_CONDITION(pgroup != NULL, COSE_ERR_INVALID_PARAMETER);
-
-	switch (EC_GROUP_get_curve_name(pgroup)) {
-	case NID_X9_62_prime256v1:		cose_group = 1;		break;
-	case NID_secp384r1: cose_group = 2; break;
-	case NID_secp521r1: cose_group = 3; break;
+	switch (grp->id) {
+	case MBEDTLS_ECP_DP_SECP256R1: cose_group = 1; break;
+	case MBEDTLS_ECP_DP_SECP384R1: cose_group = 2; break;
+	case MBEDTLS_ECP_DP_SECP521R1: cose_group = 3; break;
 
 	default:
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
+	CHECK_CONDITION(!mbedtls_ecp_point_write_binary(grp, pPoint, fCompressed ? MBEDTLS_ECP_PF_COMPRESSED : MBEDTLS_ECP_PF_UNCOMPRESSED, &cbPoint, rgbPoint, sizeof(rgbPoint)), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(cbPoint == (size_t) (fCompressed ? cbGroup + 1 : cbGroup * 2 + 1), COSE_ERR_CRYPTO_FAIL);
+
 	pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(pkey != NULL, cbor_error);
 
@@ -878,361 +1294,348 @@ cn_cbor * EC_FromKey(const EC_KEY * pKey, CBOR_CONTEXT_COMMA cose_errback * perr
 	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_Curve, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
 	p = NULL;
 
-	pPoint = EC_KEY_get0_public_key(pKey);
-	CHECK_CONDITION(pPoint != NULL, COSE_ERR_INVALID_PARAMETER);
-
-	if (FUseCompressed) {
-		cbSize = EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_COMPRESSED, NULL, 0, NULL);
-		CHECK_CONDITION(cbSize > 0, COSE_ERR_CRYPTO_FAIL);
-		pbOut = COSE_CALLOC(cbSize, 1, context);
-		CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
-		CHECK_CONDITION(EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_COMPRESSED, pbOut, cbSize, NULL) == cbSize, COSE_ERR_CRYPTO_FAIL);
-	}
-	else {
-		cbSize = EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_UNCOMPRESSED, NULL, 0, NULL);
-		CHECK_CONDITION(cbSize > 0, COSE_ERR_CRYPTO_FAIL);
-		pbOut = COSE_CALLOC(cbSize, 1, context);
-		CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
-		CHECK_CONDITION(EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_UNCOMPRESSED, pbOut, cbSize, NULL) == cbSize, COSE_ERR_CRYPTO_FAIL);
-	}
-	p = cn_cbor_data_create(pbOut+1, (int) (cbSize / 2), CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	pbX = COSE_CALLOC(cbGroup, 1, context);
+	CHECK_CONDITION(pbX != NULL, COSE_ERR_OUT_OF_MEMORY);
+	memcpy(pbX, rgbPoint + 1, cbGroup);
+	p = cn_cbor_data_create(pbX, cbGroup, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	pbX = NULL;
 	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_X, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
 	p = NULL;
 
-	if (FUseCompressed) {
-		p = cn_cbor_bool_create(pbOut[0] & 1, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	if (fCompressed) {
+		p = cn_cbor_bool_create(rgbPoint[0] & 1, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(p != NULL, cbor_error);
-		CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_Y, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
-		p = NULL;
 	}
 	else {
-		p = cn_cbor_data_create(pbOut + cbSize / 2 + 1, (int)(cbSize / 2), CBOR_CONTEXT_PARAM_COMMA &cbor_error);
-		pbOut = NULL;   // It is already part of the other one.
+		pbY = COSE_CALLOC(cbGroup, 1, context);
+		CHECK_CONDITION(pbY != NULL, COSE_ERR_OUT_OF_MEMORY);
+		memcpy(pbY, rgbPoint + 1 + cbGroup, cbGroup);
+		p = cn_cbor_data_create(pbY, cbGroup, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(p != NULL, cbor_error);
-		CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_Y, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
-		p = NULL;
+		pbY = NULL;
 	}
+	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_Y, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
+	p = NULL;
 
 	p = cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
 	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_Type, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
 	p = NULL;
 
-returnHere:
-	if (pbOut != NULL) COSE_FREE(pbOut, context);
-	if (p != NULL) CN_CBOR_FREE(p, context);
 	return pkey;
 
 errorReturn:
-	CN_CBOR_FREE(pkey, context);
-	pkey = NULL;
-	goto returnHere;
+	if (pbX != NULL) COSE_FREE(pbX, context);
+	if (pbY != NULL) COSE_FREE(pbY, context);
+	if (p != NULL) CN_CBOR_FREE(p, context);
+	if (pkey != NULL) CN_CBOR_FREE(pkey, context);
+	return NULL;
 }
-*/
+
 /*
-bool ECDSA_Sign(const cn_cbor * pKey)
+ *  Hash the to-be-signed structure.  The structure is supplied as the encoded
+ *  prefix followed by the payload so that the payload does not need to be
+ *  copied, memory use is then independent of the payload size.
+ */
+
+static bool DigestToBeSigned(const mbedtls_md_info_t * pmd, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, byte * rgbDigest)
 {
-	byte * digest = NULL;
-	int digestLen = 0;
-	ECDSA_SIG * sig;
+	mbedtls_md_context_t ctx;
+	bool fRet = false;
 
-	EC_KEY * eckey = ECKey_From(pKey);
+	mbedtls_md_init(&ctx);
 
-	sig = ECDSA_do_sign(digest, digestLen, eckey);
+	if (mbedtls_md_setup(&ctx, pmd, 0) != 0) goto errorReturn;
+	if (mbedtls_md_starts(&ctx) != 0) goto errorReturn;
+	if (mbedtls_md_update(&ctx, rgbToSign, cbToSign) != 0) goto errorReturn;
+	if ((cbPayload > 0) && (mbedtls_md_update(&ctx, pbPayload, cbPayload) != 0)) goto errorReturn;
+	if (mbedtls_md_finish(&ctx, rgbDigest) != 0) goto errorReturn;
 
-	return true;
+	fRet = true;
+
+errorReturn:
+	mbedtls_md_free(&ctx);
+	return fRet;
 }
-*/
-/*
-bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr)
+
+bool ECDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
 {
-	EC_KEY * eckey = NULL;
-	byte rgbDigest[EVP_MAX_MD_SIZE];
-	unsigned int cbDigest = sizeof(rgbDigest);
-	byte  * pbSig = NULL;
-	const EVP_MD * digest;
+	mbedtls_ecp_keypair keypair;
+	mbedtls_ecp_keypair * pKeypair;
+	mbedtls_mpi r;
+	mbedtls_mpi s;
+	const mbedtls_md_info_t * pmd;
+	byte rgbDigest[MBEDTLS_MD_MAX_SIZE];
+	byte * pbSig = NULL;
+	int cbR;
+	cn_cbor * p = NULL;
+	cn_cbor_errback cbor_error;
+	bool fRet = false;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pSigner->m_allocContext;
 #endif
-	cn_cbor * p = NULL;
-	ECDSA_SIG * psig = NULL;
-	cn_cbor_errback cbor_error;
-	int cbR;
-	byte rgbSig[66];
-	int cb;
-	
-	eckey = ECKey_From(pKey, &cbR, perr);
-	if (eckey == NULL) {
-	errorReturn:
-		if (pbSig != NULL) COSE_FREE(pbSig, context);
-		if (p != NULL) CN_CBOR_FREE(p, context);
-		if (eckey != NULL) EC_KEY_free(eckey);
-		return false;
-	}
 
-	switch (cbitDigest) {
-	case 256: digest = EVP_sha256(); break;
-	case 512: digest = EVP_sha512(); break;
-	case 384: digest = EVP_sha384(); break;
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-	}
+	mbedtls_ecp_keypair_init(&keypair);
+	mbedtls_mpi_init(&r);
+	mbedtls_mpi_init(&s);
 
-	EVP_Digest(rgbToSign, cbToSign, rgbDigest, &cbDigest, digest, NULL);
+	pKeypair = ECKey_From(pKey, &keypair, &cbR, perr);
+	if (pKeypair == NULL) goto errorReturn;
 
-	psig = ECDSA_do_sign(rgbDigest, cbDigest, eckey);
-	CHECK_CONDITION(psig != NULL, COSE_ERR_CRYPTO_FAIL);
+	pmd = MD_From_Size(cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	CHECK_CONDITION(DigestToBeSigned(pmd, rgbToSign, cbToSign, pbPayload, cbPayload, rgbDigest), COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(!mbedtls_ecdsa_sign(&pKeypair->grp, &r, &s, &pKeypair->d, rgbDigest, mbedtls_md_get_size(pmd), DRBG_Random, NULL), COSE_ERR_CRYPTO_FAIL);
 
 	pbSig = COSE_CALLOC(cbR, 2, context);
 	CHECK_CONDITION(pbSig != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	cb = BN_bn2bin(psig->r, rgbSig);
-	CHECK_CONDITION(cb <= cbR, COSE_ERR_INVALID_PARAMETER);
-	memcpy(pbSig + cbR - cb, rgbSig, cb);
+	CHECK_CONDITION(!mbedtls_mpi_write_binary(&r, pbSig, cbR), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_write_binary(&s, pbSig + cbR, cbR), COSE_ERR_CRYPTO_FAIL);
 
-	cb = BN_bn2bin(psig->s, rgbSig);
-	CHECK_CONDITION(cb <= cbR, COSE_ERR_INVALID_PARAMETER);
-	memcpy(pbSig + 2*cbR - cb, rgbSig, cb);
-
-	p = cn_cbor_data_create(pbSig, cbR*2, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	p = cn_cbor_data_create(pbSig, cbR * 2, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	pbSig = NULL;
 
 	CHECK_CONDITION(_COSE_array_replace(pSigner, p, index, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
-	
-	pbSig = NULL;
+	p = NULL;
 
-	if (eckey != NULL) EC_KEY_free(eckey);
+	fRet = true;
 
-	return true;
+errorReturn:
+	if (p != NULL) CN_CBOR_FREE(p, context);
+	if (pbSig != NULL) COSE_FREE(pbSig, context);
+	mbedtls_mpi_free(&r);
+	mbedtls_mpi_free(&s);
+	mbedtls_ecp_keypair_free(&keypair);
+	return fRet;
 }
 
-bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr)
+bool ECDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
 {
-	EC_KEY * eckey = NULL;
-	byte rgbDigest[EVP_MAX_MD_SIZE];
-	unsigned int cbDigest = sizeof(rgbDigest);
-	const EVP_MD * digest;
-#ifdef USE_CBOR_CONTEXT
-	cn_cbor_context * context = &pSigner->m_allocContext;
-#endif
-	cn_cbor * p = NULL;
-	ECDSA_SIG sig = { NULL, NULL };
+	mbedtls_ecp_keypair keypair;
+	mbedtls_ecp_keypair * pKeypair;
+	mbedtls_mpi r;
+	mbedtls_mpi s;
+	const mbedtls_md_info_t * pmd;
+	byte rgbDigest[MBEDTLS_MD_MAX_SIZE];
 	int cbR;
-	cn_cbor * pSig;
-	size_t cbSignature;
+	const cn_cbor * pSig;
+	bool fRet = false;
 
-	eckey = ECKey_From(pKey, &cbR, perr);
-	if (eckey == NULL) {
-	errorReturn:
-		if (sig.r != NULL) BN_free(sig.r);
-		if (sig.s != NULL) BN_free(sig.s);
-		if (p != NULL) CN_CBOR_FREE(p, context);
-		if (eckey != NULL) EC_KEY_free(eckey);
-		return false;
-	}
+	mbedtls_ecp_keypair_init(&keypair);
+	mbedtls_mpi_init(&r);
+	mbedtls_mpi_init(&s);
 
-	switch (cbitDigest) {
-	case 256: digest = EVP_sha256(); break;
-	case 512: digest = EVP_sha512(); break;
-	case 384: digest = EVP_sha384(); break;
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-	}
-	EVP_Digest(rgbToSign, cbToSign, rgbDigest, &cbDigest, digest, NULL);
+	pKeypair = ECKey_From(pKey, &keypair, &cbR, perr);
+	if (pKeypair == NULL) goto errorReturn;
+
+	pmd = MD_From_Size(cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	CHECK_CONDITION(DigestToBeSigned(pmd, rgbToSign, cbToSign, pbPayload, cbPayload, rgbDigest), COSE_ERR_CRYPTO_FAIL);
 
 	pSig = _COSE_arrayget_int(pSigner, index);
-	CHECK_CONDITION(pSig != NULL, COSE_ERR_INVALID_PARAMETER);
-	cbSignature = pSig->length;
+	CHECK_CONDITION((pSig != NULL) && (pSig->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pSig->length == cbR * 2, COSE_ERR_INVALID_PARAMETER);
 
-	CHECK_CONDITION(cbSignature / 2 == cbR, COSE_ERR_INVALID_PARAMETER);
-	sig.r = BN_bin2bn(pSig->v.bytes,(int) cbSignature/2, NULL);
-	sig.s = BN_bin2bn(pSig->v.bytes+cbSignature/2, (int) cbSignature/2, NULL);
+	CHECK_CONDITION(!mbedtls_mpi_read_binary(&r, pSig->v.bytes, cbR), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_read_binary(&s, pSig->v.bytes + cbR, cbR), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(ECDSA_do_verify(rgbDigest, cbDigest, &sig, eckey) == 1, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_ecdsa_verify(&pKeypair->grp, rgbDigest, mbedtls_md_get_size(pmd), &pKeypair->Q, &r, &s), COSE_ERR_CRYPTO_FAIL);
 
-	BN_free(sig.r);
-	BN_free(sig.s);
-	if (eckey != NULL) EC_KEY_free(eckey);
+	fRet = true;
 
-	return true;
+errorReturn:
+	mbedtls_mpi_free(&r);
+	mbedtls_mpi_free(&s);
+	mbedtls_ecp_keypair_free(&keypair);
+	return fRet;
 }
 
 bool AES_KW_Decrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey, const byte * pbCipherText, size_t cbCipherText, byte * pbKeyOut, int * pcbKeyOut, cose_errback * perr)
 {
+	mbedtls_nist_kw_context ctx;
 	byte rgbOut[512 / 8];
-	AES_KEY key;
+	size_t cbOut;
 
-	CHECK_CONDITION(AES_set_decrypt_key(pbKeyIn, (int)cbitKey, &key) == 0, COSE_ERR_CRYPTO_FAIL);
+	mbedtls_nist_kw_init(&ctx);
 
-	CHECK_CONDITION(AES_unwrap_key(&key, NULL, rgbOut, pbCipherText, (int) cbCipherText), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_nist_kw_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, pbKeyIn, (unsigned int) cbitKey, 0), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_nist_kw_unwrap(&ctx, MBEDTLS_KW_MODE_KW, pbCipherText, cbCipherText, rgbOut, &cbOut, sizeof(rgbOut)), COSE_ERR_CRYPTO_FAIL);
 
-	memcpy(pbKeyOut, rgbOut, cbCipherText - 8);
-	*pcbKeyOut = (int) (cbCipherText - 8);
+	memcpy(pbKeyOut, rgbOut, cbOut);
+	*pcbKeyOut = (int) cbOut;
 
+	memset(rgbOut, 0, sizeof(rgbOut));
+	mbedtls_nist_kw_free(&ctx);
 	return true;
+
 errorReturn:
+	memset(rgbOut, 0, sizeof(rgbOut));
+	mbedtls_nist_kw_free(&ctx);
 	return false;
 }
 
 bool AES_KW_Encrypt(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKey, const byte *  pbContent, int  cbContent, cose_errback * perr)
 {
+	mbedtls_nist_kw_context ctx;
 	byte  *pbOut = NULL;
-	AES_KEY key;
+	size_t cbOut;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_encrypt.m_message.m_allocContext;
 #endif
 	cn_cbor * cnTmp = NULL;
 
+	mbedtls_nist_kw_init(&ctx);
+
 	pbOut = COSE_CALLOC(cbContent + 8, 1, context);
 	CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	CHECK_CONDITION(AES_set_encrypt_key(pbKeyIn, cbitKey, &key) == 0, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_nist_kw_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, pbKeyIn, (unsigned int) cbitKey, 1), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_nist_kw_wrap(&ctx, MBEDTLS_KW_MODE_KW, pbContent, cbContent, pbOut, &cbOut, cbContent + 8), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(AES_wrap_key(&key, NULL, pbOut, pbContent, cbContent), COSE_ERR_CRYPTO_FAIL);
-
-	cnTmp = cn_cbor_data_create(pbOut, (int)cbContent + 8, CBOR_CONTEXT_PARAM_COMMA NULL);
+	cnTmp = cn_cbor_data_create(pbOut, (int)cbOut, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
 	pbOut = NULL;
 	CHECK_CONDITION(_COSE_array_replace(&pcose->m_encrypt.m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
 	cnTmp = NULL;
 
+	mbedtls_nist_kw_free(&ctx);
 	return true;
 
 errorReturn:
 	COSE_FREE(cnTmp, context);
 	if (pbOut != NULL) COSE_FREE(pbOut, context);
+	mbedtls_nist_kw_free(&ctx);
 	return false;
 }
 
-*/
-/*
-//#include <stdio.h> //TODO
-void rand_bytes(byte * pb, size_t cb){
-//ctx->aes_ctx->rk e null... i callchainen lngst in. prova istllet:
-//kolla https://tls.mbed.org/kb/how-to/add-a-random-generator
-        //init random
-       mbedtls_ctr_drbg_context ctr_drbg;
-          char *personalization = "my_app_specific_string";
-
-        ret = mbedtls_ctr_drbg_init( &ctr_drbg, mbedtls_entropy_func, &entropy,
-                                         (const unsigned char *) personalization,
-                                                             strlen( personalization ) ); 
-        
-        if(ret != 0) {
-            //printf TODO
-        }    
-    
-        mbedtls_ctr_drbg_random(&ctx,pb, cb); 	
-
-	mbedtls_ctr_drbg_free(&ctx);	
-        printf("rand byute done\n");
-}*/
-//TODO HOW TO GENERATE GOOD RANDOM BYTES
-static const unsigned char entropy_source_pr[96] =
-   { 0xc1, 0x80, 0x81, 0xa6, 0x5d, 0x44, 0x02, 0x16,
-     0x19, 0xb3, 0xf1, 0x80, 0xb1, 0xc9, 0x20, 0x02,
-     0x6a, 0x54, 0x6f, 0x0c, 0x70, 0x81, 0x49, 0x8b,
-     0x6e, 0xa6, 0x62, 0x52, 0x6d, 0x51, 0xb1, 0xcb,
-     0x58, 0x3b, 0xfa, 0xd5, 0x37, 0x5f, 0xfb, 0xc9,
-     0xff, 0x46, 0xd2, 0x19, 0xc7, 0x22, 0x3e, 0x95,
-     0x45, 0x9d, 0x82, 0xe1, 0xe7, 0x22, 0x9f, 0x63,
-     0x31, 0x69, 0xd2, 0x6b, 0x57, 0x47, 0x4f, 0xa3,
-     0x37, 0xc9, 0x98, 0x1c, 0x0b, 0xfb, 0x91, 0x31,
-     0x4d, 0x55, 0xb9, 0xe9, 0x1c, 0x5a, 0x5e, 0xe4,
-     0x93, 0x92, 0xcf, 0xc5, 0x23, 0x12, 0xd5, 0x56,
-     0x2c, 0x4a, 0x6e, 0xff, 0xdc, 0x10, 0xd0, 0x68 };
-
-static const unsigned char nonce_pers_pr[16] =
-     { 0xd2, 0x54, 0xfc, 0xff, 0x02, 0x1e, 0x69, 0xd2,
-      0x29, 0xc9, 0xcf, 0xad, 0x85, 0xfa, 0x48, 0x6c };
-
-static size_t test_offset;
-static int ctr_drbg_self_test_entropy( void *data, unsigned char *buf, size_t len ) {
-    const unsigned char *p = data;
-    memcpy( buf, p + test_offset, len );
-    test_offset += len;
-    return( 0 );
- }
-
-void rand_bytes(byte* pb, size_t cb){
-     
-     mbedtls_ctr_drbg_context ctx;
-    // unsigned char buf[16];
-     
-     mbedtls_ctr_drbg_init( &ctx );
-     
-     mbedtls_ctr_drbg_seed_entropy_len( &ctx, ctr_drbg_self_test_entropy, (void *) entropy_source_pr, nonce_pers_pr, 16, 32 );
-     
-     //mbedtls_ctr_drbg_set_prediction_resistance( &ctx, MBEDTLS_CTR_DRBG_PR_ON );
-    
-     mbedtls_ctr_drbg_random( &ctx, pb, cb );
-     //mbedtls_ctr_drbg_random( &ctx, buf, MBEDTLS_CTR_DRBG_BLOCKSIZE );
-     //memcmp( buf, result_pr, MBEDTLS_CTR_DRBG_BLOCKSIZE ) );
-     
-     mbedtls_ctr_drbg_free( &ctx );
+static int ECGroup_Curve(mbedtls_ecp_group_id id)
+{
+	switch (id) {
+	case MBEDTLS_ECP_DP_SECP256R1: return 1;
+	case MBEDTLS_ECP_DP_SECP384R1: return 2;
+	case MBEDTLS_ECP_DP_SECP521R1: return 3;
+	default: return 0;
+	}
+}
+
+void * ECKey_Generate(int iCurve)
+{
+	mbedtls_ecp_keypair * pkeypair;
+	mbedtls_ecp_group_id id;
+
+	switch (iCurve) {
+	case 1: id = MBEDTLS_ECP_DP_SECP256R1; break;
+	case 2: id = MBEDTLS_ECP_DP_SECP384R1; break;
+	case 3: id = MBEDTLS_ECP_DP_SECP521R1; break;
+	default: return NULL;
+	}
+
+	pkeypair = (mbedtls_ecp_keypair *)calloc(1, sizeof(mbedtls_ecp_keypair));
+	if (pkeypair == NULL) return NULL;
+	mbedtls_ecp_keypair_init(pkeypair);
+
+	if (mbedtls_ecp_gen_key(id, pkeypair, Pool_Random, NULL) != 0) {
+		ECKey_Destroy(pkeypair);
+		return NULL;
+	}
+	return pkeypair;
+}
+
+void ECKey_Destroy(void * pKey)
+{
+	//  mbedtls_ecp_keypair_free zeroizes the private value
+
+	mbedtls_ecp_keypair_free((mbedtls_ecp_keypair *) pKey);
+	free(pKey);
 }
-//END OF TODO RANDOM BYTES
 
 /*!
 *
 * @param[in] pRecipent	Pointer to the message object
-* @param[in] ppKeyPrivate	Address of key with private portion
-* @param[in] pKeyPublic	Address of the key w/o a private portion
+* @param[in/out] pKeyPrivate	Key with private portion, an ephemeral key is generated and returned if the map is NULL
+* @param[in] pKeyPublic	Key w/o a private portion
 * @param[in/out] ppbSecret	pointer to buffer to hold the computed secret
 * @param[in/out] pcbSecret	size of the computed secret
 * @param[in] context		cbor allocation context structure
 * @param[out] perr			location to return error information
 * @returns		success of the function
 */
-/*
-bool ECDH_ComputeSecret(COSE * pRecipient, cn_cbor ** ppKeyPrivate, const cn_cbor * pKeyPublic, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr)
+
+bool ECDH_ComputeSecret(COSE * pRecipient, COSE_KEY * pKeyPrivate, const COSE_KEY * pKeyPublic, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr)
 {
-	EC_KEY * peckeyPrivate = NULL;
-	EC_KEY * peckeyPublic = NULL;
+	mbedtls_ecp_keypair keypairPublic;
+	mbedtls_ecp_keypair keypairPrivate;
+	mbedtls_ecp_keypair * pKeypairPublic;
+	mbedtls_ecp_keypair * pKeypairPrivate;
+	mbedtls_ecp_keypair * pKeypairPooled = NULL;
+	mbedtls_ecp_group * pgroup;
+	mbedtls_mpi z;
 	int cbGroup;
-	int cbsecret;
 	byte * pbsecret = NULL;
+	bool fCompressed;
 	bool fRet = false;
 
-	peckeyPublic = ECKey_From(pKeyPublic, &cbGroup, perr);
-	if (peckeyPublic == NULL) goto errorReturn;
+	mbedtls_ecp_keypair_init(&keypairPublic);
+	mbedtls_ecp_keypair_init(&keypairPrivate);
+	mbedtls_mpi_init(&z);
+
+	pKeypairPublic = ECKey_From(pKeyPublic, &keypairPublic, &cbGroup, perr);
+	if (pKeypairPublic == NULL) goto errorReturn;
 
-	if (*ppKeyPrivate == NULL) {
+	if (pKeyPrivate->m_cborKey == NULL) {
 		{
 			cn_cbor * pCompress = _COSE_map_get_int(pRecipient, COSE_Header_UseCompressedECDH, COSE_BOTH, perr);
-			if (pCompress == NULL) FUseCompressed = false;
-			else FUseCompressed = (pCompress->type == CN_CBOR_TRUE);
+			fCompressed = (pCompress != NULL) && (pCompress->type == CN_CBOR_TRUE);
+		}
+
+		//  Take a key from the pool for the curve.  If there is none the
+		//  ephemeral key is generated in the group of the public key, which
+		//  has the multiples of the generator already built when that key was
+		//  prepared.
+
+		pgroup = &pKeypairPublic->grp;
+		pKeypairPooled = (mbedtls_ecp_keypair *) _COSE_Ephemeral_Take(ECGroup_Curve(pgroup->id));
+		if (pKeypairPooled != NULL) pKeypairPrivate = pKeypairPooled;
+		else {
+			pKeypairPrivate = &keypairPrivate;
+			CHECK_CONDITION(!mbedtls_ecp_gen_keypair(pgroup, &pKeypairPrivate->d, &pKeypairPrivate->Q, Pool_Random, NULL), COSE_ERR_CRYPTO_FAIL);
 		}
-		peckeyPrivate = EC_KEY_new();
-		EC_KEY_set_group(peckeyPrivate, EC_KEY_get0_group(peckeyPublic));
-		CHECK_CONDITION(EC_KEY_generate_key(peckeyPrivate) == 1, COSE_ERR_CRYPTO_FAIL);
-		*ppKeyPrivate = EC_FromKey(peckeyPrivate, CBOR_CONTEXT_PARAM_COMMA perr);
-		if (*ppKeyPrivate == NULL) goto errorReturn;
+		pKeyPrivate->m_cborKey = EC_FromKey(pgroup, &pKeypairPrivate->Q, cbGroup, fCompressed, CBOR_CONTEXT_PARAM_COMMA perr);
+		if (pKeyPrivate->m_cborKey == NULL) goto errorReturn;
 	}
 	else {
-		peckeyPrivate = ECKey_From(*ppKeyPrivate, &cbGroup, perr);
-		if (peckeyPrivate == NULL) goto errorReturn;
+		pKeypairPrivate = ECKey_From(pKeyPrivate, &keypairPrivate, &cbGroup, perr);
+		if (pKeypairPrivate == NULL) goto errorReturn;
+		pgroup = &pKeypairPrivate->grp;
+		CHECK_CONDITION(pgroup->id == pKeypairPublic->grp.id, COSE_ERR_INVALID_PARAMETER);
 	}
 
+	CHECK_CONDITION(!mbedtls_ecdh_compute_shared(pgroup, &z, &pKeypairPublic->Q, &pKeypairPrivate->d, DRBG_Random, NULL), COSE_ERR_CRYPTO_FAIL);
+
 	pbsecret = COSE_CALLOC(cbGroup, 1, context);
 	CHECK_CONDITION(pbsecret != NULL, COSE_ERR_OUT_OF_MEMORY);
-
-	cbsecret = ECDH_compute_key(pbsecret, cbGroup, EC_KEY_get0_public_key(peckeyPublic), peckeyPrivate, NULL);
-	CHECK_CONDITION(cbsecret > 0, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(!mbedtls_mpi_write_binary(&z, pbsecret, cbGroup), COSE_ERR_CRYPTO_FAIL);
 
 	*ppbSecret = pbsecret;
-	*pcbSecret = cbsecret;
+	*pcbSecret = cbGroup;
 	pbsecret = NULL;
 
 	fRet = true;
 
 errorReturn:
 	if (pbsecret != NULL) COSE_FREE(pbsecret, context);
-	if (peckeyPublic != NULL) EC_KEY_free(peckeyPublic);
-	if (peckeyPrivate != NULL) EC_KEY_free(peckeyPrivate);
+	mbedtls_mpi_free(&z);
+	if (pKeypairPooled != NULL) ECKey_Destroy(pKeypairPooled);
+	mbedtls_ecp_keypair_free(&keypairPrivate);
+	mbedtls_ecp_keypair_free(&keypairPublic);
 
 	return fRet;
 }
-*/
+
 #endif // USE_MBED_TLS
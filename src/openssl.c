@@ -16,13 +16,25 @@
 #include <openssl/ecdh.h>
 #include <openssl/rand.h>
 
-bool FUseCompressed = true;
+//  The opaque context and accessor APIs (EVP_CIPHER_CTX_new, HMAC_CTX_new,
+//  ECDSA_SIG_get0, EC_KEY_up_ref) and the raw EdDSA keys need 1.1.1
+
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error OpenSSL 1.1.1 or later is required
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 
-bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx = NULL;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int NSize = 15 - (LSize/8);
@@ -34,7 +46,9 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
-	EVP_CIPHER_CTX_init(&ctx);
+	TSize /= 8; // Comes in in bits not bytes.
+
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
 
 	//  Setup the IV/Nonce and put it into the message
 
@@ -43,8 +57,9 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 		if (perr != NULL) perr->err = COSE_ERR_INVALID_PARAMETER;
 
 	errorReturn:
-		if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+		else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
+		if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 		return false;
 	}
 
@@ -53,55 +68,76 @@ bool AES_CCM_Decrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 
 	//  Setup and run the OpenSSL code
 
-	switch (cbKey) {
-	case 128/8:
-		cipher = EVP_aes_128_ccm();
-		break;
-
-	case 192/8:
-		cipher = EVP_aes_192_ccm();
-		break;
-
-	case 256/8:
-		cipher = EVP_aes_256_ccm();
-		break;
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce and tag are loaded
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-		break;
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pDecipher;
+		CHECK_CONDITION(pctx != NULL, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 0), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *) &pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
 	}
-	CHECK_CONDITION(EVP_DecryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_DECRYPT_FAILED);
+	else {
+		switch (cbKey) {
+		case 128/8:
+			cipher = EVP_aes_128_ccm();
+			break;
+
+		case 192/8:
+			cipher = EVP_aes_192_ccm();
+			break;
+
+		case 256/8:
+			cipher = EVP_aes_256_ccm();
+			break;
+
+		default:
+			FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+			break;
+		}
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
 
-	TSize /= 8; // Comes in in bits not bytes.
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_L, (LSize/8), 0), COSE_ERR_DECRYPT_FAILED);
-	// CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_IVLEN, NSize, 0), COSE_ERR_DECRYPT_FAILED);
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *) &pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL), COSE_ERR_DECRYPT_FAILED);
+
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_L, (LSize/8), 0), COSE_ERR_DECRYPT_FAILED);
+		// CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, NSize, 0), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *) &pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
 
-	CHECK_CONDITION(EVP_DecryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_DecryptInit(ctx, 0, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
+	}
 
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, NULL, &cbOut, NULL, (int) cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, NULL, &cbOut, NULL, (int) cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
 
 	cbOut = (int)  cbCrypto - TSize;
-	rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, rgbOut, &cbOut, pbCrypto, (int) cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, rgbOut, &cbOut, pbCrypto, (int) cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 
 	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
 	pcose->cbContent = cbOut;
 
 	return true;
 }
 
 
-bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx = NULL;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int NSize = 15 - (LSize/8);
@@ -117,8 +153,6 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	byte * pbIV = NULL;
 	cn_cbor_errback cbor_error;
 
-	EVP_CIPHER_CTX_init(&ctx);
-
 	switch (cbKey*8) {
 	case 128:
 		cipher = EVP_aes_128_ccm();
@@ -141,7 +175,7 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	if (cbor_iv == NULL) {
 		pbIV = COSE_CALLOC(NSize, 1, context);
 		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
-		rand_bytes(pbIV, NSize);
+		CHECK_CONDITION(_COSE_Random(pbIV, NSize), COSE_ERR_CRYPTO_FAIL);
 		memcpy(rgbIV, pbIV, NSize);
 		cbor_iv_t = cn_cbor_data_create(pbIV, NSize, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
@@ -158,27 +192,46 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 
 	//  Setup and run the OpenSSL code
 
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_CRYPTO_FAIL);
-
 	TSize /= 8; // Comes in in bits not bytes.
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_L, (LSize/8), 0), COSE_ERR_CRYPTO_FAIL);
-	// CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_IVLEN, NSize, 0), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_TAG, TSize, NULL), COSE_ERR_CRYPTO_FAIL);	// Say we are doing an 8 byte tag
 
-	CHECK_CONDITION(EVP_EncryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce is loaded
+
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pCipher;
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 1), COSE_ERR_CRYPTO_FAIL);
+	}
+	else {
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
+
+		CHECK_CONDITION(EVP_EncryptInit_ex(ctx, cipher, NULL, NULL, NULL), COSE_ERR_CRYPTO_FAIL);
+
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_L, (LSize/8), 0), COSE_ERR_CRYPTO_FAIL);
+		// CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, NSize, 0), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, TSize, NULL), COSE_ERR_CRYPTO_FAIL);	// Say we are doing an 8 byte tag
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, 0, &cbOut, 0, (int) pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(EVP_EncryptInit(ctx, 0, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	}
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, 0, &cbOut, 0, (int) pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
 
-	rgbOut = (byte *)COSE_CALLOC(cbOut+TSize, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + TSize, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut+TSize, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pcose->pbContent, (int) pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, rgbOut, &cbOut, pcose->pbContent, (int) pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(EVP_EncryptFinal_ex(&ctx, &rgbOut[cbOut], &cbOut), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptFinal_ex(pctx, &rgbOut[cbOut], &cbOut), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_GET_TAG, TSize, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_CCM_GET_TAG, TSize, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
 
 	cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + TSize, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
@@ -187,21 +240,22 @@ bool AES_CCM_Encrypt(COSE_Enveloped * pcose, int TSize, int LSize, const byte *
 	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
 	cnTmp = NULL;
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return true;
 
 errorReturn:
 	if (pbIV != NULL) COSE_FREE(pbIV, context);
 	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
-	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
 	if (cnTmp != NULL) COSE_FREE(cnTmp, context);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return false;
 }
 
-bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx = NULL;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int outl = 0;
@@ -213,7 +267,7 @@ bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 #endif
 	int TSize = 128 / 8;
 
-	EVP_CIPHER_CTX_init(&ctx);
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
 
 	//  Setup the IV/Nonce and put it into the message
 
@@ -222,8 +276,9 @@ bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 		if (perr != NULL) perr->err = COSE_ERR_INVALID_PARAMETER;
 
 	errorReturn:
-		if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+		else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
+		if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 		return false;
 	}
 
@@ -232,65 +287,85 @@ bool AES_GCM_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 
 	//  Setup and run the OpenSSL code
 
-	switch (cbKey) {
-	case 128 / 8:
-		cipher = EVP_aes_128_gcm();
-		break;
-
-	case 192 / 8:
-		cipher = EVP_aes_192_gcm();
-		break;
-
-	case 256 / 8:
-		cipher = EVP_aes_256_gcm();
-		break;
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce is loaded
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
-		break;
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pCipher;
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 0), COSE_ERR_DECRYPT_FAILED);
 	}
+	else {
+		switch (cbKey) {
+		case 128 / 8:
+			cipher = EVP_aes_128_gcm();
+			break;
+
+		case 192 / 8:
+			cipher = EVP_aes_192_gcm();
+			break;
+
+		case 256 / 8:
+			cipher = EVP_aes_256_gcm();
+			break;
+
+		default:
+			FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+			break;
+		}
+
+		//  Do the setup for OpenSSL
 
-	//  Do the setup for OpenSSL
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
 
-	CHECK_CONDITION(EVP_DecryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL), COSE_ERR_DECRYPT_FAILED);
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *)&pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, TSize, (void *)&pbCrypto[cbCrypto - TSize]), COSE_ERR_DECRYPT_FAILED);
 
-	CHECK_CONDITION(EVP_DecryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
+		CHECK_CONDITION(EVP_DecryptInit(ctx, 0, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
+	}
 	
 	//  Pus in the AAD
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
 
 	//  
 
 	cbOut = (int)cbCrypto - TSize;
-	rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
 	//  Process content
 
-	CHECK_CONDITION(EVP_DecryptUpdate(&ctx, rgbOut, &cbOut, pbCrypto, (int)cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, rgbOut, &cbOut, pbCrypto, (int)cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
 
 	//  Process Tag
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_TAG, TSize, (byte *)pbCrypto + cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_GCM_SET_TAG, TSize, (byte *)pbCrypto + cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
 
 	//  Check the result
 
-	CHECK_CONDITION(EVP_DecryptFinal(&ctx, rgbOut + cbOut, &cbOut), COSE_ERR_DECRYPT_FAILED);
+	CHECK_CONDITION(EVP_DecryptFinal(pctx, rgbOut + cbOut, &outl), COSE_ERR_DECRYPT_FAILED);
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 
 	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
 	pcose->cbContent = cbOut;
 
 	return true;
 }
 
-bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx = NULL;
 	int cbOut;
 	byte * rgbOut = NULL;
 	int outl = 0;
@@ -304,16 +379,13 @@ bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 #endif
 	cn_cbor_errback cbor_error;
 
-	// Make it first so we can clean it up
-	EVP_CIPHER_CTX_init(&ctx);
-
 	//  Setup the IV/Nonce and put it into the message
 
 	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, perr);
 	if (cbor_iv == NULL) {
 		pbIV = COSE_CALLOC(96, 1, context);
 		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
-		rand_bytes(pbIV, 96 / 8);
+		CHECK_CONDITION(_COSE_Random(pbIV, 96 / 8), COSE_ERR_CRYPTO_FAIL);
 		memcpy(rgbIV, pbIV, 96 / 8);
 		cbor_iv_t = cn_cbor_data_create(pbIV, 96 / 8, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
@@ -349,110 +421,375 @@ bool AES_GCM_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, c
 
 	//  Setup and run the OpenSSL code
 
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, cipher, NULL, NULL, NULL), COSE_ERR_CRYPTO_FAIL);
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce is loaded
 
-	CHECK_CONDITION(EVP_EncryptInit(&ctx, 0, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pCipher;
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 1), COSE_ERR_CRYPTO_FAIL);
+	}
+	else {
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(EVP_EncryptInit_ex(ctx, cipher, NULL, NULL, NULL), COSE_ERR_CRYPTO_FAIL);
 
-	rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + 128/8, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+		CHECK_CONDITION(EVP_EncryptInit(ctx, 0, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	}
+
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + 128/8, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + 128/8, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
 
-	CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pcose->pbContent, (int)pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, rgbOut, &cbOut, pcose->pbContent, (int)pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(EVP_EncryptFinal_ex(&ctx, &rgbOut[cbOut], &cbOut), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptFinal_ex(pctx, &rgbOut[cbOut], &cbOut), COSE_ERR_CRYPTO_FAIL);
 
-	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, 128/8, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_GCM_GET_TAG, 128/8, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
 
 	cn_cbor * cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + 128/8, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
 	rgbOut = NULL;
 	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return true;
 
 errorReturn:
 	if (pbIV != NULL) COSE_FREE(pbIV, context);
 	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
-	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return false;
 }
 
+#ifdef USE_CHACHA20_POLY1305
+bool ChaCha20_Poly1305_Decrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbCrypto, size_t cbCrypto, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
+{
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx;
+	int cbOut;
+	byte * rgbOut = NULL;
+	int outl = 0;
+	byte rgbIV[12] = { 0 };
+	const cn_cbor * pIV = NULL;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pcose->m_message.m_allocContext;
+#endif
+	int TSize = 128 / 8;
+
+
+	CHECK_CONDITION(cbCrypto >= (size_t) TSize, COSE_ERR_INVALID_PARAMETER);
+
+	//  Get the nonce from the message
+
+	pIV = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, NULL);
+	CHECK_CONDITION((pIV != NULL) && (pIV->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(pIV->length == 96 / 8, COSE_ERR_INVALID_PARAMETER);
+	memcpy(rgbIV, pIV->v.str, pIV->length);
+
+	//  Setup and run the OpenSSL code
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce is loaded
+
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pCipher;
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 0), COSE_ERR_DECRYPT_FAILED);
+	}
+	else {
+		CHECK_CONDITION(cbKey == 256 / 8, COSE_ERR_INVALID_PARAMETER);
+
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
+		CHECK_CONDITION(EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, pbKey, rgbIV), COSE_ERR_DECRYPT_FAILED);
+	}
+
+	//  Push in the AAD
+
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_DECRYPT_FAILED);
 
-bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+	cbOut = (int)cbCrypto - TSize;
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= (size_t) cbOut, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(cbOut + 1, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	//  Process content
+
+	CHECK_CONDITION(EVP_DecryptUpdate(pctx, rgbOut, &cbOut, pbCrypto, (int)cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+
+	//  Process Tag
+
+	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_AEAD_SET_TAG, TSize, (byte *)pbCrypto + cbCrypto - TSize), COSE_ERR_DECRYPT_FAILED);
+
+	//  Check the result
+
+	CHECK_CONDITION(EVP_DecryptFinal_ex(pctx, rgbOut + cbOut, &outl), COSE_ERR_DECRYPT_FAILED);
+
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
+
+	pcose->pbContent = rgbOut;
+	pcose->m_contentBorrowed = (rgbOut == pbOutput);
+	pcose->cbContent = cbOut;
+
+	return true;
+
+errorReturn:
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	else if (rgbOut != NULL) memset(rgbOut, 0, cbCrypto - TSize);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
+	return false;
+}
+
+bool ChaCha20_Poly1305_Encrypt(COSE_Enveloped * pcose, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX * ctx = NULL;
+	EVP_CIPHER_CTX * pctx;
 	int cbOut;
-	byte rgbIV[16] = { 0 };
 	byte * rgbOut = NULL;
-	bool f = false;
-	unsigned int i;
-	cn_cbor * cn = NULL;
+	int outl = 0;
+	byte rgbIV[12] = { 0 };
+	byte * pbIV = NULL;
+	const cn_cbor * cbor_iv = NULL;
+	cn_cbor * cbor_iv_t = NULL;
+	cn_cbor * cnTmp = NULL;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
+	cn_cbor_errback cbor_error;
 
-	EVP_CIPHER_CTX_init(&ctx);
 
-	rgbOut = COSE_CALLOC(16, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	//  Setup the IV/Nonce and put it into the message
 
-	switch (cbKey*8) {
+	cbor_iv = _COSE_map_get_int(&pcose->m_message, COSE_Header_IV, COSE_BOTH, perr);
+	if (cbor_iv == NULL) {
+		pbIV = COSE_CALLOC(96 / 8, 1, context);
+		CHECK_CONDITION(pbIV != NULL, COSE_ERR_OUT_OF_MEMORY);
+		CHECK_CONDITION(_COSE_Random(pbIV, 96 / 8), COSE_ERR_CRYPTO_FAIL);
+		memcpy(rgbIV, pbIV, 96 / 8);
+		cbor_iv_t = cn_cbor_data_create(pbIV, 96 / 8, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+		CHECK_CONDITION_CBOR(cbor_iv_t != NULL, cbor_error);
+		pbIV = NULL;
+
+		if (!_COSE_map_put(&pcose->m_message, COSE_Header_IV, cbor_iv_t, COSE_UNPROTECT_ONLY, perr)) goto errorReturn;
+		cbor_iv_t = NULL;
+	}
+	else {
+		CHECK_CONDITION(cbor_iv->type == CN_CBOR_BYTES, COSE_ERR_INVALID_PARAMETER);
+		CHECK_CONDITION(cbor_iv->length == 96 / 8, COSE_ERR_INVALID_PARAMETER);
+		memcpy(rgbIV, cbor_iv->v.str, cbor_iv->length);
+	}
+
+	//  Setup and run the OpenSSL code
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) {
+		//  The context is already keyed, only the nonce is loaded
+
+		pctx = (EVP_CIPHER_CTX *)pPrepared->m_pCipher;
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, NULL, rgbIV, 1), COSE_ERR_CRYPTO_FAIL);
+	}
+	else {
+		CHECK_CONDITION(cbKey == 256 / 8, COSE_ERR_INVALID_PARAMETER);
+
+		ctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+		pctx = ctx;
+		CHECK_CONDITION(EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	}
+
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, NULL, &outl, pbAuthData, (int) cbAuthData), COSE_ERR_CRYPTO_FAIL);
+
+	if (pbOutput != NULL) {
+		CHECK_CONDITION(cbOutput >= pcose->cbContent + 128 / 8, COSE_ERR_INVALID_PARAMETER);
+		rgbOut = pbOutput;
+	}
+	else {
+		rgbOut = (byte *)COSE_CALLOC(pcose->cbContent + 128 / 8, 1, context);
+		CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	}
+
+	CHECK_CONDITION(EVP_EncryptUpdate(pctx, rgbOut, &cbOut, pcose->pbContent, (int)pcose->cbContent), COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(EVP_EncryptFinal_ex(pctx, &rgbOut[cbOut], &outl), COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_AEAD_GET_TAG, 128 / 8, &rgbOut[pcose->cbContent]), COSE_ERR_CRYPTO_FAIL);
+
+	cnTmp = cn_cbor_data_create(rgbOut, (int)pcose->cbContent + 128 / 8, CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
+	rgbOut = NULL;
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cnTmp, INDEX_BODY, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
+	return true;
+
+errorReturn:
+	if (pbIV != NULL) COSE_FREE(pbIV, context);
+	if (cbor_iv_t != NULL) COSE_FREE(cbor_iv_t, context);
+	if ((rgbOut != NULL) && (rgbOut != pbOutput)) COSE_FREE(rgbOut, context);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
+	return false;
+}
+#endif // USE_CHACHA20_POLY1305
+
+/*! \private
+* @brief Load a content encryption key into a cipher context
+*
+* The context holds the expanded key (and for GCM the hash table) so that
+* AES_CCM_*, AES_GCM_* and ChaCha20_Poly1305_* only need to load the nonce
+* for each message.  OpenSSL picks the CCM block function for the direction
+* when the key is loaded, so CCM gets a second context keyed for decryption.
+*
+* @param pKey  Prepared key with the algorithm and key filled in
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool AEAD_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr)
+{
+	EVP_CIPHER_CTX * pctx = NULL;
+	EVP_CIPHER_CTX * pctxDecrypt = NULL;
+	const EVP_CIPHER * cipher;
+	bool fCCM = (pKey->m_cbitL != 0);
+	int fEncrypt;
+
+#ifdef USE_CHACHA20_POLY1305
+	if (pKey->m_alg == COSE_Algorithm_CHACHA20_POLY1305) {
+		cipher = EVP_chacha20_poly1305();
+	}
+	else
+#endif
+	switch (pKey->m_cbKey * 8) {
 	case 128:
-		pcipher = EVP_aes_128_cbc();
+		cipher = fCCM ? EVP_aes_128_ccm() : EVP_aes_128_gcm();
+		break;
+
+	case 192:
+		cipher = fCCM ? EVP_aes_192_ccm() : EVP_aes_192_gcm();
 		break;
 
 	case 256:
-		pcipher = EVP_aes_256_cbc();
+		cipher = fCCM ? EVP_aes_256_ccm() : EVP_aes_256_gcm();
 		break;
 
 	default:
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
-	//  Setup and run the OpenSSL code
+	for (fEncrypt = 1; fEncrypt >= (fCCM ? 0 : 1); fEncrypt--) {
+		pctx = EVP_CIPHER_CTX_new();
+		CHECK_CONDITION(pctx != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, cipher, NULL, NULL, NULL, fEncrypt), COSE_ERR_CRYPTO_FAIL);
+		if (fCCM) {
+			CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_CCM_SET_L, pKey->m_cbitL / 8, 0), COSE_ERR_CRYPTO_FAIL);
+			CHECK_CONDITION(EVP_CIPHER_CTX_ctrl(pctx, EVP_CTRL_CCM_SET_TAG, pKey->m_cbitTag / 8, NULL), COSE_ERR_CRYPTO_FAIL);
+		}
+		CHECK_CONDITION(EVP_CipherInit_ex(pctx, NULL, NULL, pKey->m_rgbKey, NULL, fEncrypt), COSE_ERR_CRYPTO_FAIL);
 
-	for (i = 0; i < (unsigned int)cbAuthData / 16; i++) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbAuthData + (i * 16), 16), COSE_ERR_CRYPTO_FAIL);
-	}
-	if (cbAuthData % 16 != 0) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbAuthData + (i * 16), cbAuthData % 16), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbIV, 16 - (cbAuthData % 16)), COSE_ERR_CRYPTO_FAIL);
+		if (fEncrypt) {
+			pKey->m_pCipher = pctx;
+		}
+		else {
+			pctxDecrypt = pctx;
+		}
+		pctx = NULL;
 	}
 
-	cn = cn_cbor_data_create(rgbOut, TSize / 8, CBOR_CONTEXT_PARAM_COMMA NULL);
-	CHECK_CONDITION(cn != NULL, COSE_ERR_OUT_OF_MEMORY);
-	rgbOut = NULL;
-
-	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cn, INDEX_MAC_TAG, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
-	cn = NULL;
-
-	EVP_CIPHER_CTX_cleanup(&ctx);
-	return !f;
+	pKey->m_pDecipher = pctxDecrypt;
+	return true;
 
 errorReturn:
-	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
-	if (cn != NULL) CN_CBOR_FREE(cn, context);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if (pctx != NULL) EVP_CIPHER_CTX_free(pctx);
+	AEAD_Release_Key(pKey);
 	return false;
 }
 
-bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+void AEAD_Release_Key(COSE_PreparedKey * pKey)
+{
+	if (pKey->m_pCipher != NULL) EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)pKey->m_pCipher);
+	if (pKey->m_pDecipher != NULL) EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)pKey->m_pDecipher);
+	pKey->m_pCipher = NULL;
+	pKey->m_pDecipher = NULL;
+}
+
+/*
+ *  AES CBC-MAC and AES-CMAC over input which arrives in pieces.  The key
+ *  schedule is computed once when the context is keyed, and Final leaves
+ *  the context ready for another MAC under the same key, which is what lets
+ *  a prepared key keep one context for all of its messages.  Whole blocks
+ *  are handed to OpenSSL in bulk, only the last block of CBC output is kept.
+ *  The final block of input, which may be partial, is held back until
+ *  Final so that it can be padded and, for CMAC, masked with a subkey.
+ */
+
+#define CBC_MAC_CHUNK 512
+
+struct _cbc_mac_ctx {
+	EVP_CIPHER_CTX * m_pctx;
+	bool m_fCMAC;
+	byte m_rgbState[16];		//  Last block of CBC output
+	byte m_rgbPending[16];		//  Input held back for the final block
+	size_t m_cbPending;
+	byte m_rgbK1[16];			//  CMAC subkeys
+	byte m_rgbK2[16];
+};
+
+static const byte rgbZeroBlock[16] = { 0 };
+
+static bool CBC_MAC_Init(CBC_MAC_CTX * pctx)
+{
+	memset(pctx, 0, sizeof(*pctx));
+	pctx->m_pctx = EVP_CIPHER_CTX_new();
+	return pctx->m_pctx != NULL;
+}
+
+static void CBC_MAC_Free(CBC_MAC_CTX * pctx)
+{
+	if (pctx->m_pctx != NULL) EVP_CIPHER_CTX_free(pctx->m_pctx);
+	memset(pctx, 0, sizeof(*pctx));
+}
+
+static bool CBC_MAC_Reset(CBC_MAC_CTX * pctx)
+{
+	memset(pctx->m_rgbState, 0, sizeof(pctx->m_rgbState));
+	memset(pctx->m_rgbPending, 0, sizeof(pctx->m_rgbPending));
+	pctx->m_cbPending = 0;
+
+	//  Setting only the IV restarts the chain without a new key schedule
+
+	return EVP_EncryptInit_ex(pctx->m_pctx, NULL, NULL, NULL, rgbZeroBlock) == 1;
+}
+
+//  Multiply by x in GF(2^128), used to derive the CMAC subkeys
+
+static void CMAC_Double(byte * rgbOut, const byte * rgbIn)
+{
+	byte bMask = (byte) (0 - (rgbIn[0] >> 7));
+	int i;
+
+	for (i = 0; i < 15; i++) rgbOut[i] = (byte) ((rgbIn[i] << 1) | (rgbIn[i + 1] >> 7));
+	rgbOut[15] = (byte) ((rgbIn[15] << 1) ^ (bMask & 0x87));
+}
+
+static bool CBC_MAC_SetKey(CBC_MAC_CTX * pctx, const byte * pbKey, size_t cbKey, bool fCMAC)
 {
 	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
+	byte rgbL[16];
 	int cbOut;
-	byte rgbIV[16] = { 0 };
-	byte rgbTag[16] = { 0 };
-	bool f = false;
-	unsigned int i;
 
-	switch (cbKey*8) {
+	switch (cbKey * 8) {
 	case 128:
 		pcipher = EVP_aes_128_cbc();
 		break;
@@ -462,303 +799,580 @@ bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey
 		break;
 
 	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+		return false;
 	}
 
-	//  Setup and run the OpenSSL code
+	pctx->m_fCMAC = fCMAC;
+	if (EVP_EncryptInit_ex(pctx->m_pctx, pcipher, NULL, pbKey, rgbZeroBlock) != 1) return false;
+	EVP_CIPHER_CTX_set_padding(pctx->m_pctx, 0);
 
-	EVP_CIPHER_CTX_init(&ctx);
-	CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbKey, rgbIV), COSE_ERR_CRYPTO_FAIL);
+	if (fCMAC) {
+		if (EVP_EncryptUpdate(pctx->m_pctx, rgbL, &cbOut, rgbZeroBlock, 16) != 1) return false;
+		CMAC_Double(pctx->m_rgbK1, rgbL);
+		CMAC_Double(pctx->m_rgbK2, pctx->m_rgbK1);
+		memset(rgbL, 0, sizeof(rgbL));
+	}
 
-	TSize /= 8;
+	return CBC_MAC_Reset(pctx);
+}
+
+/*!
+* @brief Allocate a CBC-MAC or CMAC context and key it
+*
+* @param pbKey  AES key, 128 or 256 bits
+* @param cbKey  Size of the key in bytes
+* @param fCMAC  Compute AES-CMAC rather than CBC-MAC
+* @return the keyed context or NULL on failure
+*/
+
+CBC_MAC_CTX * CBC_MAC_New(const byte * pbKey, size_t cbKey, bool fCMAC CBOR_CONTEXT)
+{
+	CBC_MAC_CTX * pctx;
 
-	for (i = 0; i < (unsigned int) cbAuthData / 16; i++) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, pbAuthData+(i*16), 16), COSE_ERR_CRYPTO_FAIL);
+	pctx = (CBC_MAC_CTX *)COSE_CALLOC(1, sizeof(CBC_MAC_CTX), context);
+	if (pctx == NULL) return NULL;
+
+	if (!CBC_MAC_Init(pctx) || !CBC_MAC_SetKey(pctx, pbKey, cbKey, fCMAC)) {
+		CBC_MAC_Delete(pctx CBOR_CONTEXT_PARAM);
+		return NULL;
 	}
-	if (cbAuthData % 16 != 0) {
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, pbAuthData + (i * 16), cbAuthData % 16), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbTag, &cbOut, rgbIV, 16 - (cbAuthData % 16)), COSE_ERR_CRYPTO_FAIL);
+	return pctx;
+}
+
+void CBC_MAC_Delete(CBC_MAC_CTX * pctx CBOR_CONTEXT)
+{
+	if (pctx == NULL) return;
+	CBC_MAC_Free(pctx);
+	COSE_FREE(pctx, context);
+}
+
+//  Run whole blocks through the cipher, cb must be a non-zero multiple of 16
+
+static bool CBC_MAC_Blocks(CBC_MAC_CTX * pctx, const byte * pb, size_t cb)
+{
+	byte rgbOut[CBC_MAC_CHUNK];
+	size_t cbChunk;
+	int cbOut = 0;
+
+	while (cb > 0) {
+		cbChunk = MIN(cb, sizeof(rgbOut));
+		if (EVP_EncryptUpdate(pctx->m_pctx, rgbOut, &cbOut, pb, (int) cbChunk) != 1) return false;
+		if (cbOut != (int) cbChunk) return false;
+		pb += cbChunk;
+		cb -= cbChunk;
 	}
 
-	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
-	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
+	memcpy(pctx->m_rgbState, &rgbOut[cbOut - 16], 16);
+	return true;
+}
 
-	for (i = 0; i < (unsigned int)TSize; i++) f |= (cn->v.bytes[i] != rgbTag[i]);
+bool CBC_MAC_Update(CBC_MAC_CTX * pctx, const byte * pb, size_t cb)
+{
+	size_t cbChunk;
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
-	return !f;
+	if (cb == 0) return true;
+
+	//  The held back block is only run once more input shows it is not the
+	//  last one
+
+	if (pctx->m_cbPending > 0) {
+		cbChunk = MIN(16 - pctx->m_cbPending, cb);
+		memcpy(&pctx->m_rgbPending[pctx->m_cbPending], pb, cbChunk);
+		pctx->m_cbPending += cbChunk;
+		pb += cbChunk;
+		cb -= cbChunk;
+		if (cb == 0) return true;
+
+		if (!CBC_MAC_Blocks(pctx, pctx->m_rgbPending, 16)) return false;
+		pctx->m_cbPending = 0;
+	}
+
+	cbChunk = ((cb - 1) / 16) * 16;
+	if (cbChunk > 0) {
+		if (!CBC_MAC_Blocks(pctx, pb, cbChunk)) return false;
+		pb += cbChunk;
+		cb -= cbChunk;
+	}
+
+	memcpy(pctx->m_rgbPending, pb, cb);
+	pctx->m_cbPending = cb;
+	return true;
+}
+
+bool CBC_MAC_Final(CBC_MAC_CTX * pctx, byte * rgbTag)
+{
+	const byte * pbMask = NULL;
+	int i;
+
+	if (pctx->m_fCMAC) {
+		if (pctx->m_cbPending == 16) pbMask = pctx->m_rgbK1;
+		else {
+			pctx->m_rgbPending[pctx->m_cbPending] = 0x80;
+			memset(&pctx->m_rgbPending[pctx->m_cbPending + 1], 0, 15 - pctx->m_cbPending);
+			pbMask = pctx->m_rgbK2;
+		}
+		for (i = 0; i < 16; i++) pctx->m_rgbPending[i] ^= pbMask[i];
+		if (!CBC_MAC_Blocks(pctx, pctx->m_rgbPending, 16)) return false;
+	}
+	else if (pctx->m_cbPending > 0) {
+		memset(&pctx->m_rgbPending[pctx->m_cbPending], 0, 16 - pctx->m_cbPending);
+		if (!CBC_MAC_Blocks(pctx, pctx->m_rgbPending, 16)) return false;
+	}
+
+	memcpy(rgbTag, pctx->m_rgbState, 16);
+	return CBC_MAC_Reset(pctx);
+}
+
+/*
+ *  Compute a CBC-MAC tag, with the context of a prepared key when there is
+ *  one and with a context keyed for this message otherwise.
+ */
+
+static bool CBC_MAC_Tag(const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, byte * rgbTag, cose_errback * perr)
+{
+	CBC_MAC_CTX ctx;
+	CBC_MAC_CTX * pctx = &ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) pctx = (CBC_MAC_CTX *)pPrepared->m_pCipher;
+	else {
+		CHECK_CONDITION(CBC_MAC_Init(&ctx), COSE_ERR_OUT_OF_MEMORY);
+		CHECK_CONDITION((cbKey == 128 / 8) || (cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
+
+		//  Setup and run the OpenSSL code
+
+		CHECK_CONDITION(CBC_MAC_SetKey(&ctx, pbKey, cbKey, false), COSE_ERR_CRYPTO_FAIL);
+	}
+
+	CHECK_CONDITION(CBC_MAC_Update(pctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(CBC_MAC_Final(pctx, rgbTag), COSE_ERR_CRYPTO_FAIL);
+
+	CBC_MAC_Free(&ctx);
+	return true;
 
 errorReturn:
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	//  A prepared context must not carry a half finished chain into the next message
+	if (pctx != &ctx) CBC_MAC_Reset(pctx);
+	CBC_MAC_Free(&ctx);
 	return false;
 }
 
-#if 0
-//  We are doing CBC-MAC not CMAC at this time
-bool AES_CMAC_Validate(COSE_MacMessage * pcose, int KeySize, int TagSize, const byte * pbAuthData, int cbAuthData, cose_errback * perr)
+bool AES_CBC_MAC_Create(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
 {
-	CMAC_CTX * pctx = NULL;
-	const EVP_CIPHER * pcipher = NULL;
 	byte * rgbOut = NULL;
-	size_t cbOut;
-	bool f = false;
-	unsigned int i;
+	cn_cbor * cn = NULL;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
-	pctx = CMAC_CTX_new();
+	rgbOut = COSE_CALLOC(16, 1, context);
+	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 
+	if (!CBC_MAC_Tag(pbKey, cbKey, pPrepared, pbAuthData, cbAuthData, rgbOut, perr)) goto errorReturn;
 
-	switch (KeySize) {
-	case 128: pcipher = EVP_aes_128_cbc(); break;
-	case 256: pcipher = EVP_aes_256_cbc(); break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	cn = cn_cbor_data_create(rgbOut, TSize / 8, CBOR_CONTEXT_PARAM_COMMA NULL);
+	CHECK_CONDITION(cn != NULL, COSE_ERR_OUT_OF_MEMORY);
+	rgbOut = NULL;
 
-	rgbOut = COSE_CALLOC(128/8, 1, context);
-	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cn, INDEX_MAC_TAG, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	cn = NULL;
 
-	CHECK_CONDITION(CMAC_Init(pctx, pcose->pbKey, pcose->cbKey, pcipher, NULL /*impl*/) == 1, COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(CMAC_Update(pctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(CMAC_Final(pctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
+	return true;
 
-	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
+errorReturn:
+	if (rgbOut != NULL) COSE_FREE(rgbOut, context);
+	if (cn != NULL) CN_CBOR_FREE(cn, context);
+	return false;
+}
+
+bool AES_CBC_MAC_Validate(COSE_MacMessage * pcose, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	byte rgbTag[16];
+	const cn_cbor * cn;
+	bool f = false;
+	unsigned int i;
+
+	if (!CBC_MAC_Tag(pbKey, cbKey, pPrepared, pbAuthData, cbAuthData, rgbTag, perr)) goto errorReturn;
+
+	TSize /= 8;
+
+	cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
+	CHECK_CONDITION((cn->type == CN_CBOR_BYTES) && (cn->length == TSize), COSE_ERR_CBOR);
 
-	for (i = 0; i < (unsigned int)TagSize / 8; i++) f |= (cn->v.bytes[i] != rgbOut[i]);
+	for (i = 0; i < (unsigned int)TSize; i++) f |= (cn->v.bytes[i] != rgbTag[i]);
 
-	COSE_FREE(rgbOut, context);
-	CMAC_CTX_cleanup(pctx);
-	CMAC_CTX_free(pctx);
 	return !f;
 
 errorReturn:
-	COSE_FREE(rgbOut, context);
-	CMAC_CTX_cleanup(pctx);
-	CMAC_CTX_free(pctx);
 	return false;
+}
+
+/*!
+* @brief Key a CBC-MAC context for a prepared key
+*
+* The context is keyed once here and every message with the key runs
+* through it, Final restarts the chain without a new key schedule.
+*
+* @param pKey  Prepared key with the algorithm and key filled in
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool AES_CBC_MAC_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr)
+{
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
+#endif
+
+	CHECK_CONDITION((pKey->m_cbKey == 128 / 8) || (pKey->m_cbKey == 256 / 8), COSE_ERR_INVALID_PARAMETER);
+
+	pKey->m_pCipher = CBC_MAC_New(pKey->m_rgbKey, pKey->m_cbKey, false CBOR_CONTEXT_PARAM);
+	CHECK_CONDITION(pKey->m_pCipher != NULL, COSE_ERR_CRYPTO_FAIL);
+	return true;
 
+errorReturn:
+	return false;
 }
+
+void AES_CBC_MAC_Release_Key(COSE_PreparedKey * pKey)
+{
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pKey->m_allocContext;
 #endif
 
+	CBC_MAC_Delete((CBC_MAC_CTX *)pKey->m_pCipher CBOR_CONTEXT_PARAM);
+	pKey->m_pCipher = NULL;
+}
+
 bool HKDF_AES_Expand(COSE * pcose, size_t cbitKey, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	const EVP_CIPHER * pcipher = NULL;
-	EVP_CIPHER_CTX ctx;
-	int cbOut;
-	byte rgbIV[16] = { 0 };
+	CBC_MAC_CTX ctx;
 	byte bCount = 1;
 	size_t ib;
 	byte rgbDigest[128 / 8];
-	int cbDigest = 0;
-	byte rgbOut[16];
+	size_t cbDigest = 0;
 
-	EVP_CIPHER_CTX_init(&ctx);
+	UNUSED_PARAM(pcose);
 
-	switch (cbitKey) {
-	case 128:
-		pcipher = EVP_aes_128_cbc();
-		break;
+	CHECK_CONDITION(CBC_MAC_Init(&ctx), COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION((cbitKey == 128) || (cbitKey == 256), COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(cbPRK == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
 
-	case 256:
-		pcipher = EVP_aes_256_cbc();
-		break;
+	//  Setup and run the OpenSSL code, the key is the same for every block
+	//  so it is only scheduled once
 
-	default:
-		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION(CBC_MAC_SetKey(&ctx, pbPRK, cbPRK, false), COSE_ERR_CRYPTO_FAIL);
+
+	for (ib = 0; ib < cbOutput; ib += 16, bCount += 1) {
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Update(&ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(CBC_MAC_Final(&ctx, rgbDigest), COSE_ERR_CRYPTO_FAIL);
+		cbDigest = sizeof(rgbDigest);
+
+		memcpy(pbOutput + ib, rgbDigest, MIN(16, cbOutput - ib));
 	}
-	CHECK_CONDITION(cbPRK == cbitKey / 8, COSE_ERR_INVALID_PARAMETER);
 
-	//  Setup and run the OpenSSL code
+	memset(rgbDigest, 0, sizeof(rgbDigest));
+	CBC_MAC_Free(&ctx);
+	return true;
 
+errorReturn:
+	memset(rgbDigest, 0, sizeof(rgbDigest));
+	CBC_MAC_Free(&ctx);
+	return false;
+}
 
-	for (ib = 0; ib < cbOutput; ib += 16, bCount += 1) {
-		size_t ib2;
 
-		CHECK_CONDITION(EVP_EncryptInit_ex(&ctx, pcipher, NULL, pbPRK, rgbIV), COSE_ERR_CRYPTO_FAIL);
+static const EVP_MD * HMAC_MD(int HSize)
+{
+	switch (HSize) {
+	case 256: return EVP_sha256();
+	case 384: return EVP_sha384();
+	case 512: return EVP_sha512();
+	default: return NULL;
+	}
+}
 
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
-		for (ib2 = 0; ib2 < cbInfo; ib2+=16) {
-			CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, pbInfo+ib2, (int) MIN(16, cbInfo-ib2)), COSE_ERR_CRYPTO_FAIL);
-		}
-		CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
-		if ((cbInfo + 1) % 16 != 0) {
-			CHECK_CONDITION(EVP_EncryptUpdate(&ctx, rgbOut, &cbOut, rgbIV, (int) 16-(cbInfo+1)%16), COSE_ERR_CRYPTO_FAIL);
+/*
+ *  When a message carries no salt HKDF-Extract uses a salt of zeros as long
+ *  as the hash, so the keyed HMAC context for it is the same for every
+ *  message.  One context per hash is built the first time it is needed and
+ *  kept for the life of the process, extracts start from a copy of it.
+ *  The shared contexts are only read once they are built.
+ */
+
+static HMAC_CTX * RgHKDFZeroSalt[3] = { NULL, NULL, NULL };
+
+static int HKDF_ZeroSaltIndex(size_t cbitDigest)
+{
+	switch (cbitDigest) {
+	case 256: return 0;
+	case 384: return 1;
+	case 512: return 2;
+	default: return -1;
+	}
+}
+
+static void HKDF_ZeroSaltInit(void)
+{
+	static const size_t rgcbit[3] = { 256, 384, 512 };
+	byte rgbSalt[EVP_MAX_MD_SIZE] = { 0 };
+	HMAC_CTX * pctx;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		pctx = HMAC_CTX_new();
+		if (pctx == NULL) continue;
+		if (HMAC_Init_ex(pctx, rgbSalt, (int) rgcbit[i] / 8, HMAC_MD((int) rgcbit[i]), NULL) != 1) {
+			HMAC_CTX_free(pctx);
+			continue;
 		}
-		memcpy(rgbDigest, rgbOut, cbOut);
-		cbDigest = cbOut;
-		memcpy(pbOutput + ib, rgbDigest, MIN(16, cbOutput - ib));
+		RgHKDFZeroSalt[i] = pctx;
 	}
+}
 
-	EVP_CIPHER_CTX_cleanup(&ctx);
-	return true;
+#ifdef _WIN32
+static INIT_ONCE HKDFZeroSaltOnce = INIT_ONCE_STATIC_INIT;
 
-errorReturn:
-	EVP_CIPHER_CTX_cleanup(&ctx);
-	return false;
+static BOOL CALLBACK HKDF_ZeroSaltInitOnce(PINIT_ONCE pOnce, PVOID pParam, PVOID * ppContext)
+{
+	UNUSED_PARAM(pOnce);
+	UNUSED_PARAM(pParam);
+	UNUSED_PARAM(ppContext);
+	HKDF_ZeroSaltInit();
+	return TRUE;
 }
+#else
+static pthread_once_t HKDFZeroSaltOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static HMAC_CTX * HKDF_ZeroSalt(size_t cbitDigest)
+{
+	int i = HKDF_ZeroSaltIndex(cbitDigest);
 
+	if (i < 0) return NULL;
+#ifdef _WIN32
+	InitOnceExecuteOnce(&HKDFZeroSaltOnce, HKDF_ZeroSaltInitOnce, NULL, NULL);
+#else
+	pthread_once(&HKDFZeroSaltOnce, HKDF_ZeroSaltInit);
+#endif
+	return RgHKDFZeroSalt[i];
+}
 
 bool HKDF_Extract(COSE * pcose, const byte * pbKey, size_t cbKey, size_t cbitDigest, byte * rgbDigest, size_t * pcbDigest, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	byte rgbSalt[EVP_MAX_MD_SIZE] = { 0 };
-	int cbSalt;
 	cn_cbor * cnSalt;
-	HMAC_CTX ctx;
+	HMAC_CTX * ctx = NULL;
+	HMAC_CTX * pctxZero;
 	const EVP_MD * pmd = NULL;
 	unsigned int cbDigest;
 
-	HMAC_CTX_init(&ctx);
-
-	if (0) {
-	errorReturn:
-		HMAC_cleanup(&ctx);
-		return false;
-	}
+	pmd = HMAC_MD((int) cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	switch (cbitDigest) {
-	case 256: pmd = EVP_sha256(); cbSalt = 256 / 8;  break;
-	case 384: pmd = EVP_sha384(); cbSalt = 384 / 8; break;
-	case 512: pmd = EVP_sha512(); cbSalt = 512 / 8; break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	ctx = HMAC_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	cnSalt = _COSE_map_get_int(pcose, COSE_Header_HKDF_salt, COSE_BOTH, perr);
 
 	if (cnSalt != NULL) {
-		CHECK_CONDITION(HMAC_Init(&ctx, cnSalt->v.bytes, (int) cnSalt->length, pmd), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Init_ex(ctx, cnSalt->v.bytes, (int) cnSalt->length, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
+	}
+	else if ((pctxZero = HKDF_ZeroSalt(cbitDigest)) != NULL) {
+		CHECK_CONDITION(HMAC_CTX_copy(ctx, pctxZero), COSE_ERR_CRYPTO_FAIL);
 	}
 	else {
-		CHECK_CONDITION(HMAC_Init(&ctx, rgbSalt, cbSalt, pmd), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Init_ex(ctx, rgbSalt, (int) cbitDigest / 8, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
 	}
-	CHECK_CONDITION(HMAC_Update(&ctx, pbKey, (int)cbKey), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Final(&ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Update(ctx, pbKey, (int)cbKey), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Final(ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
 	*pcbDigest = cbDigest;
-	HMAC_cleanup(&ctx);
+	HMAC_CTX_free(ctx);
 	return true;
+
+errorReturn:
+	if (ctx != NULL) HMAC_CTX_free(ctx);
+	return false;
 }
 
 bool HKDF_Expand(COSE * pcose, size_t cbitDigest, const byte * pbPRK, size_t cbPRK, const byte * pbInfo, size_t cbInfo, byte * pbOutput, size_t cbOutput, cose_errback * perr)
 {
-	HMAC_CTX ctx;
+	HMAC_CTX * ctxKey = NULL;
+	HMAC_CTX * ctx = NULL;
 	const EVP_MD * pmd = NULL;
 	size_t ib;
-	int cbSalt;
 	unsigned int cbDigest = 0;
 	byte rgbDigest[EVP_MAX_MD_SIZE];
 	byte bCount = 1;
 
-	HMAC_CTX_init(&ctx);
+	UNUSED_PARAM(pcose);
 
-	if (0) {
-	errorReturn:
-		HMAC_cleanup(&ctx);
-		return false;
-	}
+	pmd = HMAC_MD((int) cbitDigest);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	switch (cbitDigest) {
-	case 256: pmd = EVP_sha256(); cbSalt = 256 / 8;  break;
-	case 384: pmd = EVP_sha384(); cbSalt = 384 / 8; break;
-	case 512: pmd = EVP_sha512(); cbSalt = 512 / 8; break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	ctxKey = HMAC_CTX_new();
+	CHECK_CONDITION(ctxKey != NULL, COSE_ERR_OUT_OF_MEMORY);
+	ctx = HMAC_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
 
+	//  The PRK is absorbed once, each block starts from a copy of the
+	//  keyed context
+
+	CHECK_CONDITION(HMAC_Init_ex(ctxKey, pbPRK, (int)cbPRK, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
 
 	for (ib = 0; ib < cbOutput; ib += cbDigest, bCount += 1) {
-		CHECK_CONDITION(HMAC_Init_ex(&ctx, pbPRK, (int)cbPRK, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Update(&ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
-		CHECK_CONDITION(HMAC_Final(&ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_CTX_copy(ctx, ctxKey), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Update(ctx, rgbDigest, cbDigest), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Update(ctx, pbInfo, cbInfo), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Update(ctx, &bCount, 1), COSE_ERR_CRYPTO_FAIL);
+		CHECK_CONDITION(HMAC_Final(ctx, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
 
 		memcpy(pbOutput + ib, rgbDigest, MIN(cbDigest, cbOutput - ib));
 	}
 
-	HMAC_cleanup(&ctx);
+	memset(rgbDigest, 0, sizeof(rgbDigest));
+	HMAC_CTX_free(ctx);
+	HMAC_CTX_free(ctxKey);
+	return true;
+
+errorReturn:
+	memset(rgbDigest, 0, sizeof(rgbDigest));
+	if (ctx != NULL) HMAC_CTX_free(ctx);
+	if (ctxKey != NULL) HMAC_CTX_free(ctxKey);
+	return false;
+}
+
+/*!
+* @brief Load a prepared HMAC key into an HMAC context
+*
+* The inner and outer padded keys are hashed once here, the messages which
+* use the key only copy the context.  The key size of each of the HMAC
+* algorithms is the size of its hash.
+*
+* @param pKey  Prepared key with the algorithm and key filled in
+* @param perr  Location to return errors
+* @return result of the operation
+*/
+
+bool HMAC_Prepare_Key(COSE_PreparedKey * pKey, cose_errback * perr)
+{
+	HMAC_CTX * pctx = NULL;
+	const EVP_MD * pmd;
+
+	pmd = HMAC_MD((int) pKey->m_cbKey * 8);
+	CHECK_CONDITION(pmd != NULL, COSE_ERR_INVALID_PARAMETER);
+
+	pctx = HMAC_CTX_new();
+	CHECK_CONDITION(pctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+
+	CHECK_CONDITION(HMAC_Init_ex(pctx, pKey->m_rgbKey, (int) pKey->m_cbKey, pmd, NULL), COSE_ERR_CRYPTO_FAIL);
+
+	pKey->m_pCipher = pctx;
 	return true;
 
+errorReturn:
+	if (pctx != NULL) HMAC_CTX_free(pctx);
+	return false;
 }
 
-bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+void HMAC_Release_Key(COSE_PreparedKey * pKey)
 {
-	HMAC_CTX ctx;
-	const EVP_MD * pmd = NULL;
+	if (pKey->m_pCipher != NULL) HMAC_CTX_free((HMAC_CTX *)pKey->m_pCipher);
+	pKey->m_pCipher = NULL;
+}
+
+/*
+ *  Start an HMAC for a message, from the prepared context when there is one
+ *  and from the raw key otherwise.
+ */
+
+static bool HMAC_Start(HMAC_CTX * pctx, int HSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared)
+{
+	const EVP_MD * pmd;
+
+	if ((pPrepared != NULL) && (pPrepared->m_pCipher != NULL)) return HMAC_CTX_copy(pctx, (HMAC_CTX *)pPrepared->m_pCipher) == 1;
+
+	pmd = HMAC_MD(HSize);
+	if (pmd == NULL) return false;
+	return HMAC_Init_ex(pctx, pbKey, (int) cbKey, pmd, NULL) == 1;
+}
+
+bool HMAC_Create(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+{
+	HMAC_CTX * ctx = NULL;
 	byte * rgbOut = NULL;
 	unsigned int cbOut;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
-	HMAC_CTX_init(&ctx);
+	CHECK_CONDITION(HMAC_MD(HSize) != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	if (0) {
-	errorReturn:
-		COSE_FREE(rgbOut, context);
-		HMAC_cleanup(&ctx);
-		return false;
-	}
-
-	switch (HSize) {
-	case 256: pmd = EVP_sha256(); break;
-	case 384: pmd = EVP_sha384(); break;
-	case 512: pmd = EVP_sha512(); break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	ctx = HMAC_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	rgbOut = COSE_CALLOC(EVP_MAX_MD_SIZE, 1, context);
 	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	CHECK_CONDITION(HMAC_Init(&ctx, pbKey, (int) cbKey, pmd), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Update(&ctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Final(&ctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Start(ctx, HSize, pbKey, cbKey, pPrepared), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Update(ctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Final(ctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
 
 	CHECK_CONDITION(_COSE_array_replace(&pcose->m_message, cn_cbor_data_create(rgbOut, TSize / 8, CBOR_CONTEXT_PARAM_COMMA NULL), INDEX_MAC_TAG, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
 
-	HMAC_cleanup(&ctx);
+	HMAC_CTX_free(ctx);
 	return true;
+
+errorReturn:
+	COSE_FREE(rgbOut, context);
+	if (ctx != NULL) HMAC_CTX_free(ctx);
+	return false;
 }
 
-bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
+bool HMAC_Validate(COSE_MacMessage * pcose, int HSize, int TSize, const byte * pbKey, size_t cbKey, COSE_PreparedKey * pPrepared, const byte * pbAuthData, size_t cbAuthData, cose_errback * perr)
 {
-	HMAC_CTX ctx;
-	const EVP_MD * pmd = NULL;
+	HMAC_CTX * ctx = NULL;
 	byte * rgbOut = NULL;
 	unsigned int cbOut;
 	bool f = false;
 	unsigned int i;
+	const cn_cbor * cn;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_message.m_allocContext;
 #endif
 
-	HMAC_CTX_init(&ctx);
+	CHECK_CONDITION(HMAC_MD(HSize) != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	switch (HSize) {
-	case 256: pmd = EVP_sha256(); break;
-	case 384: pmd = EVP_sha384(); break;
-	case 512: pmd = EVP_sha512(); break;
-	default: FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER); break;
-	}
+	ctx = HMAC_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	rgbOut = COSE_CALLOC(EVP_MAX_MD_SIZE, 1, context);
 	CHECK_CONDITION(rgbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	CHECK_CONDITION(HMAC_Init(&ctx, pbKey, (int) cbKey, pmd), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Update(&ctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
-	CHECK_CONDITION(HMAC_Final(&ctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Start(ctx, HSize, pbKey, cbKey, pPrepared), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Update(ctx, pbAuthData, cbAuthData), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(HMAC_Final(ctx, rgbOut, &cbOut), COSE_ERR_CRYPTO_FAIL);
 
-	cn_cbor * cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
+	cn = _COSE_arrayget_int(&pcose->m_message, INDEX_MAC_TAG);
 	CHECK_CONDITION(cn != NULL, COSE_ERR_CBOR);
 
-	if (cn->length > (int) cbOut) return false;
+	//  The tag must be exactly the truncated length, a shorter one would
+	//  otherwise be compared past its end
+
+	CHECK_CONDITION((cn->type == CN_CBOR_BYTES) && (cn->length == TSize / 8) && ((unsigned int) TSize / 8 <= cbOut), COSE_ERR_CBOR);
 	for (i = 0; i < (unsigned int) TSize/8; i++) f |= (cn->v.bytes[i] != rgbOut[i]);
 
-	HMAC_cleanup(&ctx);
+	COSE_FREE(rgbOut, context);
+	HMAC_CTX_free(ctx);
 	return !f;
 
 errorReturn:
 	COSE_FREE(rgbOut, context);
-	HMAC_cleanup(&ctx);
+	if (ctx != NULL) HMAC_CTX_free(ctx);
 	return false;
 }
 
@@ -768,14 +1382,18 @@ errorReturn:
 #define COSE_Key_EC_Y -3
 #define COSE_Key_EC_d -4
 
-EC_KEY * ECKey_From(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
+static EC_KEY * ECKey_Parse(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
 {
 	EC_KEY * pNewKey = EC_KEY_new();
 	byte  rgbKey[512+1];
 	int cbKey;
 	const cn_cbor * p;
 	int nidGroup = -1;
+	EC_GROUP * ecgroup = NULL;
 	EC_POINT * pPoint = NULL;
+	BIGNUM * pbn = NULL;
+
+	CHECK_CONDITION(pNewKey != NULL, COSE_ERR_OUT_OF_MEMORY);
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_Curve);
 	CHECK_CONDITION(p != NULL, COSE_ERR_INVALID_PARAMETER);
@@ -800,7 +1418,7 @@ EC_KEY * ECKey_From(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
-	EC_GROUP * ecgroup = EC_GROUP_new_by_curve_name(nidGroup);
+	ecgroup = EC_GROUP_new_by_curve_name(nidGroup);
 	CHECK_CONDITION(ecgroup != NULL, COSE_ERR_INVALID_PARAMETER);
 	CHECK_CONDITION(EC_KEY_set_group(pNewKey, ecgroup) == 1, COSE_ERR_CRYPTO_FAIL);
 
@@ -835,21 +1453,109 @@ EC_KEY * ECKey_From(const cn_cbor * pKey, int * cbGroup, cose_errback * perr)
 
 	p = cn_cbor_mapget_int(pKey, COSE_Key_EC_d);
 	if (p != NULL) {
-		BIGNUM * pbn;
-
 		pbn = BN_bin2bn(p->v.bytes, (int) p->length, NULL);
 		CHECK_CONDITION(pbn != NULL, COSE_ERR_CRYPTO_FAIL);
 		CHECK_CONDITION(EC_KEY_set_private_key(pNewKey, pbn) == 1, COSE_ERR_CRYPTO_FAIL);
+		BN_clear_free(pbn);
+		pbn = NULL;
 	}
-	
+
+	EC_POINT_free(pPoint);
+	EC_GROUP_free(ecgroup);
 	return pNewKey;
 
 errorReturn:
+	if (pbn != NULL) BN_clear_free(pbn);
+	if (pPoint != NULL) EC_POINT_free(pPoint);
+	if (ecgroup != NULL) EC_GROUP_free(ecgroup);
 	if (pNewKey != NULL) EC_KEY_free(pNewKey);
 	return NULL;
 }
 
-cn_cbor * EC_FromKey(const EC_KEY * pKey, CBOR_CONTEXT_COMMA cose_errback * perr)
+/*!
+* @brief Get the EC key for a key object
+*
+* A key object which has been prepared hands out another reference to the
+* key it holds, otherwise the COSE_Key map is parsed.  The caller frees the
+* result with EC_KEY_free in either case.
+*/
+
+EC_KEY * ECKey_From(const COSE_KEY * pKey, int * cbGroup, cose_errback * perr)
+{
+	if (pKey->m_pECKey != NULL) {
+		CHECK_CONDITION(EC_KEY_up_ref((EC_KEY *) pKey->m_pECKey) == 1, COSE_ERR_CRYPTO_FAIL);
+		*cbGroup = pKey->m_cbGroup;
+		return (EC_KEY *) pKey->m_pECKey;
+	}
+
+	return ECKey_Parse(pKey->m_cborKey, cbGroup, perr);
+
+errorReturn:
+	return NULL;
+}
+
+bool ECKey_Prepare(COSE_KEY * pKey, cose_errback * perr)
+{
+	EC_KEY * eckey;
+	int cbGroup;
+
+	//  The named curves already carry a table for the generator, so there
+	//  is nothing to precompute beyond the parse itself.
+
+	eckey = ECKey_Parse(pKey->m_cborKey, &cbGroup, perr);
+	if (eckey == NULL) return false;
+
+	pKey->m_pECKey = eckey;
+	pKey->m_cbGroup = cbGroup;
+	return true;
+}
+
+void ECKey_Release(COSE_KEY * pKey)
+{
+	if (pKey->m_pECKey != NULL) EC_KEY_free((EC_KEY *) pKey->m_pECKey);
+	pKey->m_pECKey = NULL;
+}
+
+static int ECGroup_Curve(const EC_GROUP * pgroup)
+{
+	switch (EC_GROUP_get_curve_name(pgroup)) {
+	case NID_X9_62_prime256v1: return 1;
+	case NID_secp384r1: return 2;
+	case NID_secp521r1: return 3;
+	default: return 0;
+	}
+}
+
+void * ECKey_Generate(int iCurve)
+{
+	EC_KEY * peckey;
+	int nidGroup;
+
+	switch (iCurve) {
+	case 1: nidGroup = NID_X9_62_prime256v1; break;
+	case 2: nidGroup = NID_secp384r1; break;
+	case 3: nidGroup = NID_secp521r1; break;
+	default: return NULL;
+	}
+
+	peckey = EC_KEY_new_by_curve_name(nidGroup);
+	if (peckey == NULL) return NULL;
+
+	if (EC_KEY_generate_key(peckey) != 1) {
+		EC_KEY_free(peckey);
+		return NULL;
+	}
+	return peckey;
+}
+
+void ECKey_Destroy(void * pKey)
+{
+	//  EC_KEY_free clears the private value before it is freed
+
+	EC_KEY_free((EC_KEY *) pKey);
+}
+
+cn_cbor * EC_FromKey(const EC_KEY * pKey, bool fCompressed, CBOR_CONTEXT_COMMA cose_errback * perr)
 {
 	cn_cbor * pkey = NULL;
 	const EC_GROUP * pgroup;
@@ -883,7 +1589,7 @@ cn_cbor * EC_FromKey(const EC_KEY * pKey, CBOR_CONTEXT_COMMA cose_errback * perr
 	pPoint = EC_KEY_get0_public_key(pKey);
 	CHECK_CONDITION(pPoint != NULL, COSE_ERR_INVALID_PARAMETER);
 
-	if (FUseCompressed) {
+	if (fCompressed) {
 		cbSize = EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_COMPRESSED, NULL, 0, NULL);
 		CHECK_CONDITION(cbSize > 0, COSE_ERR_CRYPTO_FAIL);
 		pbOut = COSE_CALLOC(cbSize, 1, context);
@@ -897,13 +1603,16 @@ cn_cbor * EC_FromKey(const EC_KEY * pKey, CBOR_CONTEXT_COMMA cose_errback * perr
 		CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 		CHECK_CONDITION(EC_POINT_point2oct(pgroup, pPoint, POINT_CONVERSION_UNCOMPRESSED, pbOut, cbSize, NULL) == cbSize, COSE_ERR_CRYPTO_FAIL);
 	}
-	p = cn_cbor_data_create(pbOut+1, (int) (cbSize / 2), CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	//  A compressed point is the sign byte followed by the whole of X,
+	//  an uncompressed one the format byte followed by X and Y.
+	p = cn_cbor_data_create(pbOut+1, (int) (fCompressed ? cbSize - 1 : cbSize / 2), CBOR_CONTEXT_PARAM_COMMA &cbor_error);
 	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
 	CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_X, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
 	p = NULL;
 
-	if (FUseCompressed) {
+	if (fCompressed) {
 		p = cn_cbor_bool_create(pbOut[0] & 1, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+		pbOut = NULL;   // X points into it.
 		CHECK_CONDITION_CBOR(p != NULL, cbor_error);
 		CHECK_CONDITION_CBOR(cn_cbor_mapput_int(pkey, COSE_Key_EC_Y, p, CBOR_CONTEXT_PARAM_COMMA &cbor_error), cbor_error);
 		p = NULL;
@@ -947,7 +1656,33 @@ bool ECDSA_Sign(const cn_cbor * pKey)
 }
 */
 
-bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr)
+/*
+ *  Hash the to-be-signed structure.  The structure is supplied as the encoded
+ *  prefix followed by the payload so that the payload does not need to be
+ *  copied, memory use is then independent of the payload size.
+ */
+
+static bool DigestToBeSigned(const EVP_MD * digest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, byte * rgbDigest, unsigned int * pcbDigest)
+{
+	EVP_MD_CTX * ctx;
+	bool fRet = false;
+
+	ctx = EVP_MD_CTX_create();
+	if (ctx == NULL) return false;
+
+	if (!EVP_DigestInit_ex(ctx, digest, NULL)) goto errorReturn;
+	if (!EVP_DigestUpdate(ctx, rgbToSign, cbToSign)) goto errorReturn;
+	if ((cbPayload > 0) && !EVP_DigestUpdate(ctx, pbPayload, cbPayload)) goto errorReturn;
+	if (!EVP_DigestFinal_ex(ctx, rgbDigest, pcbDigest)) goto errorReturn;
+
+	fRet = true;
+
+errorReturn:
+	EVP_MD_CTX_destroy(ctx);
+	return fRet;
+}
+
+bool ECDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
 {
 	EC_KEY * eckey = NULL;
 	byte rgbDigest[EVP_MAX_MD_SIZE];
@@ -959,6 +1694,8 @@ bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest,
 #endif
 	cn_cbor * p = NULL;
 	ECDSA_SIG * psig = NULL;
+	const BIGNUM * pbnR = NULL;
+	const BIGNUM * pbnS = NULL;
 	cn_cbor_errback cbor_error;
 	int cbR;
 	byte rgbSig[66];
@@ -969,6 +1706,7 @@ bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest,
 	errorReturn:
 		if (pbSig != NULL) COSE_FREE(pbSig, context);
 		if (p != NULL) CN_CBOR_FREE(p, context);
+		if (psig != NULL) ECDSA_SIG_free(psig);
 		if (eckey != NULL) EC_KEY_free(eckey);
 		return false;
 	}
@@ -981,7 +1719,7 @@ bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest,
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
 
-	EVP_Digest(rgbToSign, cbToSign, rgbDigest, &cbDigest, digest, NULL);
+	CHECK_CONDITION(DigestToBeSigned(digest, rgbToSign, cbToSign, pbPayload, cbPayload, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
 
 	psig = ECDSA_do_sign(rgbDigest, cbDigest, eckey);
 	CHECK_CONDITION(psig != NULL, COSE_ERR_CRYPTO_FAIL);
@@ -989,11 +1727,13 @@ bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest,
 	pbSig = COSE_CALLOC(cbR, 2, context);
 	CHECK_CONDITION(pbSig != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	cb = BN_bn2bin(psig->r, rgbSig);
+	ECDSA_SIG_get0(psig, &pbnR, &pbnS);
+
+	cb = BN_bn2bin(pbnR, rgbSig);
 	CHECK_CONDITION(cb <= cbR, COSE_ERR_INVALID_PARAMETER);
 	memcpy(pbSig + cbR - cb, rgbSig, cb);
 
-	cb = BN_bn2bin(psig->s, rgbSig);
+	cb = BN_bn2bin(pbnS, rgbSig);
 	CHECK_CONDITION(cb <= cbR, COSE_ERR_INVALID_PARAMETER);
 	memcpy(pbSig + 2*cbR - cb, rgbSig, cb);
 
@@ -1004,12 +1744,13 @@ bool ECDSA_Sign(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest,
 	
 	pbSig = NULL;
 
+	ECDSA_SIG_free(psig);
 	if (eckey != NULL) EC_KEY_free(eckey);
 
 	return true;
 }
 
-bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, cose_errback * perr)
+bool ECDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, int cbitDigest, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
 {
 	EC_KEY * eckey = NULL;
 	byte rgbDigest[EVP_MAX_MD_SIZE];
@@ -1019,7 +1760,9 @@ bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDiges
 	cn_cbor_context * context = &pSigner->m_allocContext;
 #endif
 	cn_cbor * p = NULL;
-	ECDSA_SIG sig = { NULL, NULL };
+	ECDSA_SIG * psig = NULL;
+	BIGNUM * pbnR = NULL;
+	BIGNUM * pbnS = NULL;
 	int cbR;
 	cn_cbor * pSig;
 	size_t cbSignature;
@@ -1027,8 +1770,9 @@ bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDiges
 	eckey = ECKey_From(pKey, &cbR, perr);
 	if (eckey == NULL) {
 	errorReturn:
-		if (sig.r != NULL) BN_free(sig.r);
-		if (sig.s != NULL) BN_free(sig.s);
+		if (psig != NULL) ECDSA_SIG_free(psig);
+		if (pbnR != NULL) BN_free(pbnR);
+		if (pbnS != NULL) BN_free(pbnS);
 		if (p != NULL) CN_CBOR_FREE(p, context);
 		if (eckey != NULL) EC_KEY_free(eckey);
 		return false;
@@ -1041,57 +1785,339 @@ bool ECDSA_Verify(COSE * pSigner, int index, const cn_cbor * pKey, int cbitDiges
 	default:
 		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
 	}
-	EVP_Digest(rgbToSign, cbToSign, rgbDigest, &cbDigest, digest, NULL);
+	CHECK_CONDITION(DigestToBeSigned(digest, rgbToSign, cbToSign, pbPayload, cbPayload, rgbDigest, &cbDigest), COSE_ERR_CRYPTO_FAIL);
 
 	pSig = _COSE_arrayget_int(pSigner, index);
 	CHECK_CONDITION(pSig != NULL, COSE_ERR_INVALID_PARAMETER);
 	cbSignature = pSig->length;
 
-	CHECK_CONDITION(cbSignature / 2 == cbR, COSE_ERR_INVALID_PARAMETER);
-	sig.r = BN_bin2bn(pSig->v.bytes,(int) cbSignature/2, NULL);
-	sig.s = BN_bin2bn(pSig->v.bytes+cbSignature/2, (int) cbSignature/2, NULL);
+	CHECK_CONDITION(cbSignature / 2 == (size_t) cbR, COSE_ERR_INVALID_PARAMETER);
+	psig = ECDSA_SIG_new();
+	CHECK_CONDITION(psig != NULL, COSE_ERR_OUT_OF_MEMORY);
+	pbnR = BN_bin2bn(pSig->v.bytes,(int) cbSignature/2, NULL);
+	pbnS = BN_bin2bn(pSig->v.bytes+cbSignature/2, (int) cbSignature/2, NULL);
+	CHECK_CONDITION((pbnR != NULL) && (pbnS != NULL), COSE_ERR_OUT_OF_MEMORY);
+
+	//  The signature owns r and s from here on
 
-	CHECK_CONDITION(ECDSA_do_verify(rgbDigest, cbDigest, &sig, eckey) == 1, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(ECDSA_SIG_set0(psig, pbnR, pbnS) == 1, COSE_ERR_CRYPTO_FAIL);
+	pbnR = NULL;
+	pbnS = NULL;
 
-	BN_free(sig.r);
-	BN_free(sig.s);
+	CHECK_CONDITION(ECDSA_do_verify(rgbDigest, cbDigest, psig, eckey) == 1, COSE_ERR_CRYPTO_FAIL);
+
+	ECDSA_SIG_free(psig);
 	if (eckey != NULL) EC_KEY_free(eckey);
 
 	return true;
 }
 
+#ifdef USE_EDDSA
+
+#define COSE_Key_OKP_Curve -1
+#define COSE_Key_OKP_X -2
+#define COSE_Key_OKP_d -4
+
+#define COSE_Curve_Ed25519 6
+#define COSE_Curve_Ed448 7
+
+static EVP_PKEY * OKPKey_Parse(const cn_cbor * pKey, cose_errback * perr)
+{
+	const cn_cbor * p;
+	const cn_cbor * pX;
+	EVP_PKEY * pkey = NULL;
+	int type;
+	size_t cbKey;
+	byte rgbPublic[57];
+	size_t cbPublic;
+
+	p = cn_cbor_mapget_int(pKey, COSE_Key_Type);
+	CHECK_CONDITION((p != NULL) && (p->type == CN_CBOR_UINT) && (p->v.uint == COSE_Key_Type_OKP), COSE_ERR_INVALID_PARAMETER);
+
+	p = cn_cbor_mapget_int(pKey, COSE_Key_OKP_Curve);
+	CHECK_CONDITION((p != NULL) && (p->type == CN_CBOR_UINT), COSE_ERR_INVALID_PARAMETER);
+
+	switch (p->v.uint) {
+	case COSE_Curve_Ed25519:
+		type = EVP_PKEY_ED25519;
+		cbKey = 32;
+		break;
+
+	case COSE_Curve_Ed448:
+		type = EVP_PKEY_ED448;
+		cbKey = 57;
+		break;
+
+	default:
+		FAIL_CONDITION(COSE_ERR_INVALID_PARAMETER);
+	}
+
+	pX = cn_cbor_mapget_int(pKey, COSE_Key_OKP_X);
+	if (pX != NULL) CHECK_CONDITION((pX->type == CN_CBOR_BYTES) && (pX->length == (int) cbKey), COSE_ERR_INVALID_PARAMETER);
+
+	//  The public key is derived from the private key when there is one,
+	//  a public key given with it has to be the same one
+
+	p = cn_cbor_mapget_int(pKey, COSE_Key_OKP_d);
+	if (p != NULL) {
+		CHECK_CONDITION((p->type == CN_CBOR_BYTES) && (p->length == (int) cbKey), COSE_ERR_INVALID_PARAMETER);
+		pkey = EVP_PKEY_new_raw_private_key(type, NULL, p->v.bytes, cbKey);
+		CHECK_CONDITION(pkey != NULL, COSE_ERR_CRYPTO_FAIL);
+
+		if (pX != NULL) {
+			cbPublic = sizeof(rgbPublic);
+			CHECK_CONDITION(EVP_PKEY_get_raw_public_key(pkey, rgbPublic, &cbPublic) == 1, COSE_ERR_CRYPTO_FAIL);
+			CHECK_CONDITION((cbPublic == cbKey) && (memcmp(rgbPublic, pX->v.bytes, cbKey) == 0), COSE_ERR_INVALID_PARAMETER);
+		}
+		return pkey;
+	}
+
+	CHECK_CONDITION(pX != NULL, COSE_ERR_INVALID_PARAMETER);
+	return EVP_PKEY_new_raw_public_key(type, NULL, pX->v.bytes, cbKey);
+
+errorReturn:
+	if (pkey != NULL) EVP_PKEY_free(pkey);
+	return NULL;
+}
+
+/*!
+* @brief Get the OKP key for a key object
+*
+* As for ECKey_From, the caller frees the result with EVP_PKEY_free.
+*/
+
+static EVP_PKEY * OKPKey_From(const COSE_KEY * pKey, cose_errback * perr)
+{
+	EVP_PKEY * pkey;
+
+	if (pKey->m_pOKPKey != NULL) {
+		CHECK_CONDITION(EVP_PKEY_up_ref((EVP_PKEY *) pKey->m_pOKPKey) == 1, COSE_ERR_CRYPTO_FAIL);
+		return (EVP_PKEY *) pKey->m_pOKPKey;
+	}
+
+	CHECK_CONDITION(pKey->m_cborKey != NULL, COSE_ERR_INVALID_PARAMETER);
+	pkey = OKPKey_Parse(pKey->m_cborKey, perr);
+	if ((pkey == NULL) && (perr != NULL) && (perr->err == COSE_ERR_NONE)) perr->err = COSE_ERR_CRYPTO_FAIL;
+	return pkey;
+
+errorReturn:
+	return NULL;
+}
+
+bool OKPKey_Prepare(COSE_KEY * pKey, cose_errback * perr)
+{
+	EVP_PKEY * pkey;
+
+	if (perr != NULL) perr->err = COSE_ERR_NONE;
+	pkey = OKPKey_Parse(pKey->m_cborKey, perr);
+	if (pkey == NULL) {
+		if ((perr != NULL) && (perr->err == COSE_ERR_NONE)) perr->err = COSE_ERR_CRYPTO_FAIL;
+		return false;
+	}
+
+	pKey->m_pOKPKey = pkey;
+	return true;
+}
+
+void OKPKey_Release(COSE_KEY * pKey)
+{
+	if (pKey->m_pOKPKey != NULL) EVP_PKEY_free((EVP_PKEY *) pKey->m_pOKPKey);
+	pKey->m_pOKPKey = NULL;
+}
+
+/*
+ *  EdDSA has no separate digest step, the whole to-be-signed structure goes
+ *  to the signature function.  Join the prefix and the payload when there
+ *  is a payload, otherwise use the prefix where it is.
+ *
+ *  This is a copy of the payload and, unlike ECDSA, memory use grows with
+ *  the payload.  Pure Ed25519 and Ed448 hash the message twice, once for
+ *  the nonce and once for the challenge, so OpenSSL only signs and verifies
+ *  them in one call over a contiguous buffer.  Callers signing large
+ *  payloads should prefer ECDSA where the streaming digest is used.
+ */
+
+static const byte * JoinToBeSigned(const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, byte ** ppbJoined, size_t * pcbJoined, CBOR_CONTEXT_COMMA cose_errback * perr)
+{
+	byte * pb;
+
+	*ppbJoined = NULL;
+	*pcbJoined = cbToSign + cbPayload;
+	if (cbPayload == 0) return rgbToSign;
+
+	pb = (byte *)COSE_CALLOC(cbToSign + cbPayload, 1, context);
+	CHECK_CONDITION(pb != NULL, COSE_ERR_OUT_OF_MEMORY);
+	memcpy(pb, rgbToSign, cbToSign);
+	memcpy(pb + cbToSign, pbPayload, cbPayload);
+
+	*ppbJoined = pb;
+	return pb;
+
+errorReturn:
+	return NULL;
+}
+
+bool EdDSA_Sign(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	EVP_PKEY * pkey = NULL;
+	EVP_MD_CTX * ctx = NULL;
+	byte * pbJoined = NULL;
+	const byte * pbTBS;
+	size_t cbTBS;
+	byte * pbSig = NULL;
+	size_t cbSig;
+	cn_cbor * p = NULL;
+	cn_cbor_errback cbor_error;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSigner->m_allocContext;
+#endif
+	bool fRet = false;
+
+	pkey = OKPKey_From(pKey, perr);
+	if (pkey == NULL) goto errorReturn;
+
+	pbTBS = JoinToBeSigned(rgbToSign, cbToSign, pbPayload, cbPayload, &pbJoined, &cbTBS, CBOR_CONTEXT_PARAM_COMMA perr);
+	if (pbTBS == NULL) goto errorReturn;
+
+	ctx = EVP_MD_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) == 1, COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(EVP_DigestSign(ctx, NULL, &cbSig, pbTBS, cbTBS) == 1, COSE_ERR_CRYPTO_FAIL);
+	pbSig = (byte *)COSE_CALLOC(cbSig, 1, context);
+	CHECK_CONDITION(pbSig != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(EVP_DigestSign(ctx, pbSig, &cbSig, pbTBS, cbTBS) == 1, COSE_ERR_CRYPTO_FAIL);
+
+	p = cn_cbor_data_create(pbSig, (int) cbSig, CBOR_CONTEXT_PARAM_COMMA &cbor_error);
+	CHECK_CONDITION_CBOR(p != NULL, cbor_error);
+	pbSig = NULL;
+
+	CHECK_CONDITION(_COSE_array_replace(pSigner, p, index, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_ERR_CBOR);
+	p = NULL;
+
+	fRet = true;
+
+errorReturn:
+	if (p != NULL) CN_CBOR_FREE(p, context);
+	if (pbSig != NULL) COSE_FREE(pbSig, context);
+	if (pbJoined != NULL) COSE_FREE(pbJoined, context);
+	if (ctx != NULL) EVP_MD_CTX_free(ctx);
+	if (pkey != NULL) EVP_PKEY_free(pkey);
+	return fRet;
+}
+
+bool EdDSA_Verify(COSE * pSigner, int index, const COSE_KEY * pKey, const byte * rgbToSign, size_t cbToSign, const byte * pbPayload, size_t cbPayload, cose_errback * perr)
+{
+	EVP_PKEY * pkey = NULL;
+	EVP_MD_CTX * ctx = NULL;
+	byte * pbJoined = NULL;
+	const byte * pbTBS;
+	size_t cbTBS;
+	const cn_cbor * pSig;
+#ifdef USE_CBOR_CONTEXT
+	cn_cbor_context * context = &pSigner->m_allocContext;
+#endif
+	bool fRet = false;
+
+	pSig = _COSE_arrayget_int(pSigner, index);
+	CHECK_CONDITION((pSig != NULL) && (pSig->type == CN_CBOR_BYTES), COSE_ERR_INVALID_PARAMETER);
+
+	pkey = OKPKey_From(pKey, perr);
+	if (pkey == NULL) goto errorReturn;
+
+	pbTBS = JoinToBeSigned(rgbToSign, cbToSign, pbPayload, cbPayload, &pbJoined, &cbTBS, CBOR_CONTEXT_PARAM_COMMA perr);
+	if (pbTBS == NULL) goto errorReturn;
+
+	ctx = EVP_MD_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	CHECK_CONDITION(EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1, COSE_ERR_CRYPTO_FAIL);
+
+	CHECK_CONDITION(EVP_DigestVerify(ctx, pSig->v.bytes, pSig->length, pbTBS, cbTBS) == 1, COSE_ERR_CRYPTO_FAIL);
+
+	fRet = true;
+
+errorReturn:
+	if (pbJoined != NULL) COSE_FREE(pbJoined, context);
+	if (ctx != NULL) EVP_MD_CTX_free(ctx);
+	if (pkey != NULL) EVP_PKEY_free(pkey);
+	return fRet;
+}
+
+#endif // USE_EDDSA
+
+static const EVP_CIPHER * AES_KW_Cipher(size_t cbitKey)
+{
+	switch (cbitKey) {
+	case 128: return EVP_aes_128_wrap();
+	case 192: return EVP_aes_192_wrap();
+	case 256: return EVP_aes_256_wrap();
+	default: return NULL;
+	}
+}
+
 bool AES_KW_Decrypt(COSE_Enveloped * pcose, const byte * pbKeyIn, size_t cbitKey, const byte * pbCipherText, size_t cbCipherText, byte * pbKeyOut, int * pcbKeyOut, cose_errback * perr)
 {
 	byte rgbOut[512 / 8];
-	AES_KEY key;
+	EVP_CIPHER_CTX * ctx = NULL;
+	const EVP_CIPHER * cipher = AES_KW_Cipher(cbitKey);
+	int cbOut = 0;
+	int outl = 0;
+
+	UNUSED_PARAM(pcose);
 
-	CHECK_CONDITION(AES_set_decrypt_key(pbKeyIn, (int)cbitKey, &key) == 0, COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(cipher != NULL, COSE_ERR_INVALID_PARAMETER);
+	CHECK_CONDITION((cbCipherText > 8) && (cbCipherText - 8 <= sizeof(rgbOut)), COSE_ERR_INVALID_PARAMETER);
 
-	CHECK_CONDITION(AES_unwrap_key(&key, NULL, rgbOut, pbCipherText, (int) cbCipherText), COSE_ERR_CRYPTO_FAIL);
+	ctx = EVP_CIPHER_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+	CHECK_CONDITION(EVP_DecryptInit_ex(ctx, cipher, NULL, pbKeyIn, NULL), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_DecryptUpdate(ctx, rgbOut, &cbOut, pbCipherText, (int) cbCipherText), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_DecryptFinal_ex(ctx, rgbOut + cbOut, &outl), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(cbOut + outl == (int) (cbCipherText - 8), COSE_ERR_CRYPTO_FAIL);
 
 	memcpy(pbKeyOut, rgbOut, cbCipherText - 8);
 	*pcbKeyOut = (int) (cbCipherText - 8);
 
+	memset(rgbOut, 0, sizeof(rgbOut));
+	EVP_CIPHER_CTX_free(ctx);
 	return true;
+
 errorReturn:
+	memset(rgbOut, 0, sizeof(rgbOut));
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return false;
 }
 
 bool AES_KW_Encrypt(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKey, const byte *  pbContent, int  cbContent, cose_errback * perr)
 {
 	byte  *pbOut = NULL;
-	AES_KEY key;
+	EVP_CIPHER_CTX * ctx = NULL;
+	const EVP_CIPHER * cipher = AES_KW_Cipher(cbitKey);
+	int cbOut = 0;
+	int outl = 0;
 #ifdef USE_CBOR_CONTEXT
 	cn_cbor_context * context = &pcose->m_encrypt.m_message.m_allocContext;
 #endif
 	cn_cbor * cnTmp = NULL;
 
+	CHECK_CONDITION(cipher != NULL, COSE_ERR_INVALID_PARAMETER);
+
 	pbOut = COSE_CALLOC(cbContent + 8, 1, context);
 	CHECK_CONDITION(pbOut != NULL, COSE_ERR_OUT_OF_MEMORY);
 
-	CHECK_CONDITION(AES_set_encrypt_key(pbKeyIn, cbitKey, &key) == 0, COSE_ERR_CRYPTO_FAIL);
+	ctx = EVP_CIPHER_CTX_new();
+	CHECK_CONDITION(ctx != NULL, COSE_ERR_OUT_OF_MEMORY);
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
 
-	CHECK_CONDITION(AES_wrap_key(&key, NULL, pbOut, pbContent, cbContent), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptInit_ex(ctx, cipher, NULL, pbKeyIn, NULL), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptUpdate(ctx, pbOut, &cbOut, pbContent, cbContent), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(EVP_EncryptFinal_ex(ctx, pbOut + cbOut, &outl), COSE_ERR_CRYPTO_FAIL);
+	CHECK_CONDITION(cbOut + outl == cbContent + 8, COSE_ERR_CRYPTO_FAIL);
+
+	EVP_CIPHER_CTX_free(ctx);
+	ctx = NULL;
 
 	cnTmp = cn_cbor_data_create(pbOut, (int)cbContent + 8, CBOR_CONTEXT_PARAM_COMMA NULL);
 	CHECK_CONDITION(cnTmp != NULL, COSE_ERR_CBOR);
@@ -1104,20 +2130,38 @@ bool AES_KW_Encrypt(COSE_RecipientInfo * pcose, const byte * pbKeyIn, int cbitKe
 errorReturn:
 	COSE_FREE(cnTmp, context);
 	if (pbOut != NULL) COSE_FREE(pbOut, context);
+	if (ctx != NULL) EVP_CIPHER_CTX_free(ctx);
 	return false;
 }
 
 
-void rand_bytes(byte * pb, size_t cb)
+bool rand_bytes(byte * pb, size_t cb)
+{
+	return RAND_bytes(pb, (int) cb) == 1;
+}
+
+bool sha256_digest(int cBuffers, const byte * const * rgpb, const size_t * rgcb, byte * rgbDigest)
 {
-	RAND_bytes(pb, (int) cb);
+	EVP_MD_CTX * pctx;
+	bool f;
+	int i;
+
+	pctx = EVP_MD_CTX_create();
+	if (pctx == NULL) return false;
+
+	f = EVP_DigestInit_ex(pctx, EVP_sha256(), NULL) == 1;
+	for (i = 0; f && (i < cBuffers); i++) f = EVP_DigestUpdate(pctx, rgpb[i], rgcb[i]) == 1;
+	if (f) f = EVP_DigestFinal_ex(pctx, rgbDigest, NULL) == 1;
+
+	EVP_MD_CTX_destroy(pctx);
+	return f;
 }
 
 /*!
 *
 * @param[in] pRecipent	Pointer to the message object
-* @param[in] ppKeyPrivate	Address of key with private portion
-* @param[in] pKeyPublic	Address of the key w/o a private portion
+* @param[in/out] pKeyPrivate	Key with private portion, an ephemeral key is generated and returned if the map is NULL
+* @param[in] pKeyPublic	Key w/o a private portion
 * @param[in/out] ppbSecret	pointer to buffer to hold the computed secret
 * @param[in/out] pcbSecret	size of the computed secret
 * @param[in] context		cbor allocation context structure
@@ -1125,32 +2169,39 @@ void rand_bytes(byte * pb, size_t cb)
 * @returns		success of the function
 */
 
-bool ECDH_ComputeSecret(COSE * pRecipient, cn_cbor ** ppKeyPrivate, const cn_cbor * pKeyPublic, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr)
+bool ECDH_ComputeSecret(COSE * pRecipient, COSE_KEY * pKeyPrivate, const COSE_KEY * pKeyPublic, byte ** ppbSecret, size_t * pcbSecret, CBOR_CONTEXT_COMMA cose_errback *perr)
 {
 	EC_KEY * peckeyPrivate = NULL;
 	EC_KEY * peckeyPublic = NULL;
 	int cbGroup;
 	int cbsecret;
 	byte * pbsecret = NULL;
+	bool fCompressed;
 	bool fRet = false;
 
 	peckeyPublic = ECKey_From(pKeyPublic, &cbGroup, perr);
 	if (peckeyPublic == NULL) goto errorReturn;
 
-	if (*ppKeyPrivate == NULL) {
+	if (pKeyPrivate->m_cborKey == NULL) {
 		{
 			cn_cbor * pCompress = _COSE_map_get_int(pRecipient, COSE_Header_UseCompressedECDH, COSE_BOTH, perr);
-			if (pCompress == NULL) FUseCompressed = false;
-			else FUseCompressed = (pCompress->type == CN_CBOR_TRUE);
+			fCompressed = (pCompress != NULL) && (pCompress->type == CN_CBOR_TRUE);
+		}
+
+		//  Take a key from the pool for the curve, generate one if there is none
+
+		peckeyPrivate = (EC_KEY *) _COSE_Ephemeral_Take(ECGroup_Curve(EC_KEY_get0_group(peckeyPublic)));
+		if (peckeyPrivate == NULL) {
+			peckeyPrivate = EC_KEY_new();
+			CHECK_CONDITION(peckeyPrivate != NULL, COSE_ERR_OUT_OF_MEMORY);
+			EC_KEY_set_group(peckeyPrivate, EC_KEY_get0_group(peckeyPublic));
+			CHECK_CONDITION(EC_KEY_generate_key(peckeyPrivate) == 1, COSE_ERR_CRYPTO_FAIL);
 		}
-		peckeyPrivate = EC_KEY_new();
-		EC_KEY_set_group(peckeyPrivate, EC_KEY_get0_group(peckeyPublic));
-		CHECK_CONDITION(EC_KEY_generate_key(peckeyPrivate) == 1, COSE_ERR_CRYPTO_FAIL);
-		*ppKeyPrivate = EC_FromKey(peckeyPrivate, CBOR_CONTEXT_PARAM_COMMA perr);
-		if (*ppKeyPrivate == NULL) goto errorReturn;
+		pKeyPrivate->m_cborKey = EC_FromKey(peckeyPrivate, fCompressed, CBOR_CONTEXT_PARAM_COMMA perr);
+		if (pKeyPrivate->m_cborKey == NULL) goto errorReturn;
 	}
 	else {
-		peckeyPrivate = ECKey_From(*ppKeyPrivate, &cbGroup, perr);
+		peckeyPrivate = ECKey_From(pKeyPrivate, &cbGroup, perr);
 		if (peckeyPrivate == NULL) goto errorReturn;
 	}
 
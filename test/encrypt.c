@@ -8,6 +8,23 @@
 #include <cose.h>
 #include <cn-cbor/cn-cbor.h>
 
+#ifdef _MSC_VER
+#include <windows.h>
+#define SLEEP_MS(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#include <time.h>
+#define SLEEP_MS(ms) usleep((ms) * 1000)
+#endif
+
+//  The batch tests switch the multi-buffer AES-GCM code off through the
+//  library's internal interface.
+
+#include "cose_int.h"
+#include "crypto.h"
+#undef CBOR_CONTEXT_PARAM
+#undef CBOR_CONTEXT_PARAM_COMMA
+
 #include "json.h"
 #include "test.h"
 #include "context.h"
@@ -356,6 +373,964 @@ errorReturn:
 }
 
 
+//
+//  Encrypt0 message with a content larger than any of the old fixed
+//  serialization buffers.  The content is borrowed rather than copied.
+//
+
+int EncryptLargeMessage()
+{
+	HCOSE_ENCRYPT hEncObj = NULL;
+	byte rgbKey[128 / 8] = { 'a', 'b', 'c' };
+	byte rgbIV[96 / 8] = { 1, 2, 3 };
+	size_t cbContent = 300 * 1024;
+	byte * pbContent = NULL;
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	byte * rgb = NULL;
+	size_t cb;
+	byte * rgb2 = NULL;
+	size_t cb2;
+	size_t i;
+	int typ;
+
+	pbContent = (byte *)malloc(cbContent);
+	if (pbContent == NULL) goto errorReturn;
+	for (i = 0; i < cbContent; i++) pbContent[i] = (byte)i;
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_GCM_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_IV, cn_cbor_data_create(rgbIV, sizeof(rgbIV), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_SetContentRef(hEncObj, pbContent, cbContent, NULL)) goto errorReturn;
+
+	if (!COSE_Encrypt_encrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	if (cb <= cbContent) goto errorReturn;
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hEncObj, rgb, 0, cb) != cb) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	//  Encrypting straight into the wire buffer gives the same bytes
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_GCM_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_IV, cn_cbor_data_create(rgbIV, sizeof(rgbIV), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_SetContentRef(hEncObj, pbContent, cbContent, NULL)) goto errorReturn;
+
+	rgb2 = (byte *)malloc(cb);
+	if (rgb2 == NULL) goto errorReturn;
+	if (!COSE_Encrypt_encrypt_encode(hEncObj, rgbKey, sizeof(rgbKey), NULL, 0, &cb2, NULL) || (cb2 != cb)) goto errorReturn;
+	if (COSE_Encrypt_encrypt_encode(hEncObj, rgbKey, sizeof(rgbKey), rgb2, cb - 1, &cb2, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_encrypt_encode(hEncObj, rgbKey, sizeof(rgbKey), rgb2, cb, &cb2, NULL) || (cb2 != cb)) goto errorReturn;
+	if (memcmp(rgb, rgb2, cb) != 0) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	//  Decrypt into memory owned by the message
+
+	hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgb, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+
+	if (!COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+	pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+	if ((pbDecrypted == NULL) || (cbDecrypted != cbContent)) goto errorReturn;
+	if (memcmp(pbDecrypted, pbContent, cbContent) != 0) goto errorReturn;
+
+	//  Decrypt again, this time in place over the encoded message
+
+	if (!COSE_Encrypt_decrypt_into(hEncObj, rgbKey, sizeof(rgbKey), NULL, 0, &cbDecrypted, NULL)) goto errorReturn;
+	pbDecrypted = COSE_Encrypt_GetContent(hEncObj, NULL, NULL);
+	if ((pbDecrypted < rgb) || (pbDecrypted >= rgb + cb) || (cbDecrypted != cbContent)) goto errorReturn;
+	if (memcmp(pbDecrypted, pbContent, cbContent) != 0) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	free(rgb2);
+	free(rgb);
+	free(pbContent);
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (rgb2 != NULL) free(rgb2);
+	if (rgb != NULL) free(rgb);
+	if (pbContent != NULL) free(pbContent);
+	CFails++;
+	return 0;
+}
+
+//
+//  Run several messages through one prepared key and check they
+//  interoperate with the raw key
+//
+
+int EncryptPreparedKey()
+{
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	byte rgbKey[128 / 8] = { 'a', 'b', 'c' };
+	byte rgbIV[13] = { 1, 2, 3 };
+	char * sz = "This is the content to be used";
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+	cose_errback cose_error;
+
+	if (COSE_PreparedKey_Create(COSE_Algorithm_AES_CCM_16_64_128, rgbKey, sizeof(rgbKey) - 1, CBOR_CONTEXT_PARAM_COMMA NULL) != NULL) goto errorReturn;
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_AES_CCM_16_64_128, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	for (i = 0; i < 3; i++) {
+		rgbIV[12] = (byte) i;
+
+		hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+		if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_IV, cn_cbor_data_create(rgbIV, sizeof(rgbIV), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Encrypt_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+		if (!COSE_Encrypt_encrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+		rgb = (byte *)malloc(cb);
+		if (rgb == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hEncObj, rgb, 0, cb) != cb) goto errorReturn;
+
+		COSE_Encrypt_Free(hEncObj);
+		hEncObj = NULL;
+
+		//  Decrypt with both the raw key and the prepared key
+
+		hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgb, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+
+		if (!COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+		pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+		if ((pbDecrypted == NULL) || (cbDecrypted != strlen(sz)) || (memcmp(pbDecrypted, sz, cbDecrypted) != 0)) goto errorReturn;
+
+		if (!COSE_Encrypt_decrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+		pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+		if ((pbDecrypted == NULL) || (cbDecrypted != strlen(sz)) || (memcmp(pbDecrypted, sz, cbDecrypted) != 0)) goto errorReturn;
+
+		COSE_Encrypt_Free(hEncObj);
+		hEncObj = NULL;
+		free(rgb);
+		rgb = NULL;
+	}
+
+	//  Both directions report a bad message handle the same way
+
+	CHECK_FAILURE(COSE_Encrypt_encrypt_prepared(NULL, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, goto errorReturn);
+	CHECK_FAILURE(COSE_Encrypt_decrypt_prepared(NULL, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, goto errorReturn);
+
+	//  The key cannot be used with a different algorithm
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_128_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+	if (COSE_Encrypt_encrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+
+	//  Handles which are not live prepared keys are rejected
+
+	CHECK_FAILURE(COSE_Encrypt_encrypt_prepared(hEncObj, (HCOSE_PREPARED_KEY)hEncObj, &cose_error), COSE_ERR_INVALID_HANDLE, goto errorReturn);
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	CHECK_FAILURE(COSE_Encrypt_encrypt_prepared(hEncObj, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, CFails++);
+	CHECK_FAILURE(COSE_Encrypt_decrypt_prepared(hEncObj, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, CFails++);
+	CHECK_FAILURE(COSE_Encrypt_encrypt_batch(hEncObj, hKey, NULL, 0, &cose_error), COSE_ERR_INVALID_HANDLE, CFails++);
+	if (COSE_PreparedKey_Free(hKey)) CFails++;
+	if (COSE_PreparedKey_Free(NULL)) CFails++;
+
+	COSE_Encrypt_Free(hEncObj);
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+
+//
+//  ChaCha20/Poly1305 round trip with both the raw and the prepared key,
+//  a damaged tag must not decrypt
+//
+
+int EncryptChaCha20()
+{
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	byte rgbKey[256 / 8] = { 'a', 'b', 'c' };
+	byte rgbIV[96 / 8] = { 1, 2, 3 };
+	char * sz = "This is the content to be used";
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+
+	if (COSE_PreparedKey_Create(COSE_Algorithm_CHACHA20_POLY1305, rgbKey, 128 / 8, CBOR_CONTEXT_PARAM_COMMA NULL) != NULL) goto errorReturn;
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_CHACHA20_POLY1305, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_CHACHA20_POLY1305, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_IV, cn_cbor_data_create(rgbIV, sizeof(rgbIV), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	if (!COSE_Encrypt_encrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hEncObj, rgb, 0, cb) != cb) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgb, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+
+	if (!COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+	pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+	if ((pbDecrypted == NULL) || (cbDecrypted != strlen(sz)) || (memcmp(pbDecrypted, sz, cbDecrypted) != 0)) goto errorReturn;
+
+	if (!COSE_Encrypt_decrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+	pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+	if ((pbDecrypted == NULL) || (cbDecrypted != strlen(sz)) || (memcmp(pbDecrypted, sz, cbDecrypted) != 0)) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	//  The tag is the last byte of the message
+
+	rgb[cb - 1] ^= 1;
+	hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgb, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+	if (COSE_Encrypt_decrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	free(rgb);
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+
+int EncryptBatch()
+{
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	byte rgbKey[128 / 8] = { 'a', 'b', 'c' };
+	byte rgbIV[8][96 / 8] = { { 0 } };
+	byte rgbContent[300];
+	byte rgbOut[8][400];
+	COSE_ENCRYPT_ITEM rgItems[8];
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	cn_cbor * cnIV;
+	int typ;
+	int i;
+
+	for (i = 0; i < (int) sizeof(rgbContent); i++) rgbContent[i] = (byte) i;
+	for (i = 0; i < 8; i++) rgbIV[i][0] = (byte) (i + 1);
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_AES_GCM_128, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_GCM_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+
+	//  Even items supply a nonce of their own, odd ones get a random one.
+	//  The last output buffer is too small.
+
+	memset(rgItems, 0, sizeof(rgItems));
+	for (i = 0; i < 8; i++) {
+		rgItems[i].pbContent = rgbContent;
+		rgItems[i].cbContent = 40 * i + 1;
+		if (i % 2 == 0) {
+			rgItems[i].pbIV = rgbIV[i];
+			rgItems[i].cbIV = sizeof(rgbIV[i]);
+		}
+		rgItems[i].pbOut = rgbOut[i];
+		rgItems[i].cbOut = (i == 7) ? 100 : sizeof(rgbOut[i]);
+	}
+
+	if (!COSE_Encrypt_encrypt_batch(hEncObj, hKey, rgItems, 8, NULL)) goto errorReturn;
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	if (rgItems[7].err != COSE_ERR_INVALID_PARAMETER) goto errorReturn;
+
+	for (i = 0; i < 7; i++) {
+		if ((rgItems[i].err != COSE_ERR_NONE) || (rgItems[i].cbWritten == 0)) goto errorReturn;
+
+		hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgbOut[i], rgItems[i].cbWritten, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+
+		cnIV = COSE_Encrypt_map_get_int(hEncObj, COSE_Header_IV, COSE_UNPROTECT_ONLY, NULL);
+		if ((cnIV == NULL) || (cnIV->length != sizeof(rgbIV[i]))) goto errorReturn;
+		if ((i % 2 == 0) && (memcmp(cnIV->v.bytes, rgbIV[i], sizeof(rgbIV[i])) != 0)) goto errorReturn;
+
+		if (!COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+		pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+		if ((pbDecrypted == NULL) || (cbDecrypted != rgItems[i].cbContent) || (memcmp(pbDecrypted, rgbContent, cbDecrypted) != 0)) goto errorReturn;
+
+		COSE_Encrypt_Free(hEncObj);
+		hEncObj = NULL;
+	}
+
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	CFails++;
+	return 0;
+}
+
+//
+//  A batch through the multi-buffer AES-GCM code and again through the
+//  backend loop.  With the same nonces both must give the same bytes.  There
+//  are enough items of varied length to refill the lanes and to run more
+//  than one chunk.
+//
+
+#define BATCH_COMPARE_ITEMS 150
+
+static bool EncryptBatchCompare(int alg, const byte * pbKey, size_t cbKey, bool fExternal)
+{
+	static byte rgbContent[700];
+	static byte rgbIV[BATCH_COMPARE_ITEMS][96 / 8];
+	static byte rgbOut[2][BATCH_COMPARE_ITEMS][800];
+	static COSE_ENCRYPT_ITEM rgItems[2][BATCH_COMPARE_ITEMS];
+	const byte rgbExternal[] = { 'e', 'x', 't' };
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	int iRun;
+	int typ;
+	int i;
+
+	for (i = 0; i < (int) sizeof(rgbContent); i++) rgbContent[i] = (byte) (i * 7);
+	for (i = 0; i < BATCH_COMPARE_ITEMS; i++) {
+		rgbIV[i][0] = (byte) i;
+		rgbIV[i][11] = (byte) alg;
+	}
+
+	hKey = COSE_PreparedKey_Create(alg, pbKey, cbKey, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	for (iRun = 0; iRun < 2; iRun++) {
+		GCM_Batch_Enable(iRun == 0);
+
+		hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+		if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(alg, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (fExternal && !COSE_Encrypt_SetExternal(hEncObj, rgbExternal, sizeof(rgbExternal), NULL)) goto errorReturn;
+
+		for (i = 0; i < BATCH_COMPARE_ITEMS; i++) {
+			rgItems[iRun][i].pbContent = rgbContent;
+			rgItems[iRun][i].cbContent = (i * 37) % sizeof(rgbContent);
+			rgItems[iRun][i].pbIV = rgbIV[i];
+			rgItems[iRun][i].cbIV = sizeof(rgbIV[i]);
+			rgItems[iRun][i].pbOut = rgbOut[iRun][i];
+			rgItems[iRun][i].cbOut = sizeof(rgbOut[iRun][i]);
+		}
+
+		if (!COSE_Encrypt_encrypt_batch(hEncObj, hKey, rgItems[iRun], BATCH_COMPARE_ITEMS, NULL)) goto errorReturn;
+		COSE_Encrypt_Free(hEncObj);
+		hEncObj = NULL;
+	}
+	GCM_Batch_Enable(true);
+
+	for (i = 0; i < BATCH_COMPARE_ITEMS; i++) {
+		if ((rgItems[0][i].err != COSE_ERR_NONE) || (rgItems[1][i].err != COSE_ERR_NONE)) goto errorReturn;
+		if (rgItems[0][i].cbWritten != rgItems[1][i].cbWritten) goto errorReturn;
+		if (memcmp(rgbOut[0][i], rgbOut[1][i], rgItems[0][i].cbWritten) != 0) goto errorReturn;
+	}
+
+	for (i = 0; i < BATCH_COMPARE_ITEMS; i += 25) {
+		hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgbOut[0][i], rgItems[0][i].cbWritten, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+		if (fExternal && !COSE_Encrypt_SetExternal(hEncObj, rgbExternal, sizeof(rgbExternal), NULL)) goto errorReturn;
+		if (!COSE_Encrypt_decrypt(hEncObj, pbKey, cbKey, NULL)) goto errorReturn;
+		pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+		if ((pbDecrypted == NULL) || (cbDecrypted != rgItems[0][i].cbContent) || (memcmp(pbDecrypted, rgbContent, cbDecrypted) != 0)) goto errorReturn;
+		COSE_Encrypt_Free(hEncObj);
+		hEncObj = NULL;
+	}
+
+	COSE_PreparedKey_Free(hKey);
+	return true;
+
+errorReturn:
+	GCM_Batch_Enable(true);
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	return false;
+}
+
+int EncryptBatchGCM()
+{
+	byte rgbKey[256 / 8] = { 'k', 'e', 'y', 0x80, 0xff };
+
+#ifdef USE_AES_GCM_128
+	if (!EncryptBatchCompare(COSE_Algorithm_AES_GCM_128, rgbKey, 128 / 8, false)) goto errorReturn;
+#endif
+#ifdef USE_AES_GCM_192
+	if (!EncryptBatchCompare(COSE_Algorithm_AES_GCM_192, rgbKey, 192 / 8, true)) goto errorReturn;
+#endif
+#ifdef USE_AES_GCM_256
+	if (!EncryptBatchCompare(COSE_Algorithm_AES_GCM_256, rgbKey, 256 / 8, true)) goto errorReturn;
+#endif
+	return 1;
+
+errorReturn:
+	CFails++;
+	return 0;
+}
+
+//
+//  Messages per second through COSE_Encrypt_encrypt_batch with the backend
+//  loop and with the multi-buffer code, for telemetry sized payloads.  Run
+//  with --bench, it is not part of the test run.
+//
+
+#ifdef _MSC_VER
+static double BenchSeconds()
+{
+	LARGE_INTEGER count;
+	LARGE_INTEGER freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart / (double) freq.QuadPart;
+}
+#else
+static double BenchSeconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+#endif
+
+#define BENCH_ITEMS 1024
+
+void EncryptBatchBench()
+{
+	static const size_t rgcbContent[] = { 64, 128, 256, 512, 1000 };
+	static byte rgbContent[1000];
+	static byte rgbOut[BENCH_ITEMS][1100];
+	static COSE_ENCRYPT_ITEM rgItems[BENCH_ITEMS];
+	byte rgbKey[128 / 8] = { 'k', 'e', 'y' };
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	double rgRate[2];
+	double tStart;
+	double t;
+	size_t cMessages;
+	int iRun;
+	int iSize;
+	int i;
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_AES_GCM_128, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_GCM_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+
+	printf("AES-GCM-128 Encrypt0 batches of %d messages, random nonces\n", BENCH_ITEMS);
+	printf("%8s %16s %16s %8s\n", "bytes", "loop msg/s", "batch msg/s", "speedup");
+
+	for (iSize = 0; iSize < (int) _countof(rgcbContent); iSize++) {
+		for (iRun = 0; iRun < 2; iRun++) {
+			GCM_Batch_Enable(iRun == 1);
+			cMessages = 0;
+			tStart = BenchSeconds();
+			do {
+				memset(rgItems, 0, sizeof(rgItems));
+				for (i = 0; i < BENCH_ITEMS; i++) {
+					rgItems[i].pbContent = rgbContent;
+					rgItems[i].cbContent = rgcbContent[iSize];
+					rgItems[i].pbOut = rgbOut[i];
+					rgItems[i].cbOut = sizeof(rgbOut[i]);
+				}
+				if (!COSE_Encrypt_encrypt_batch(hEncObj, hKey, rgItems, BENCH_ITEMS, NULL)) goto errorReturn;
+				for (i = 0; i < BENCH_ITEMS; i++) {
+					if (rgItems[i].err != COSE_ERR_NONE) goto errorReturn;
+				}
+				cMessages += BENCH_ITEMS;
+				t = BenchSeconds() - tStart;
+			} while (t < 0.5);
+			rgRate[iRun] = (double) cMessages / t;
+		}
+		printf("%8d %16.0f %16.0f %7.2fx\n", (int) rgcbContent[iSize], rgRate[0], rgRate[1], rgRate[1] / rgRate[0]);
+	}
+
+	GCM_Batch_Enable(true);
+	COSE_Encrypt_Free(hEncObj);
+	COSE_PreparedKey_Free(hKey);
+	return;
+
+errorReturn:
+	GCM_Batch_Enable(true);
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	CFails++;
+}
+
+#if defined(USE_ECDH_SS_HKDF_256)
+//
+//  ECDH-SS recipient with the derived key cache on.  The keys are derived
+//  with the full key pair, and the public half alone must drop them.
+//
+
+static bool KeyCacheECDH()
+{
+	HCOSE_ENVELOPED hEncObj = NULL;
+	HCOSE_RECIPIENT hRecip = NULL;
+	cn_cbor * pkey = NULL;
+	cn_cbor * pkeyPublic = NULL;
+	byte rgbX[] = { 0x65, 0xed, 0xa5, 0xa1, 0x25, 0x77, 0xc2, 0xba, 0xe8, 0x29, 0x43, 0x7f, 0xe3, 0x38, 0x70, 0x1a, 0x10, 0xaa, 0xa3, 0x75, 0xe1, 0xbb, 0x5b, 0x5d, 0xe1, 0x08, 0xde, 0x43, 0x9c, 0x08, 0x55, 0x1d };
+	byte rgbY[] = { 0x1e, 0x52, 0xed, 0x75, 0x70, 0x11, 0x63, 0xf7, 0xf9, 0xe4, 0x0d, 0xdf, 0x9f, 0x34, 0x1b, 0x3d, 0xc9, 0xba, 0x86, 0x0a, 0xf7, 0xe0, 0xca, 0x7c, 0xa7, 0xe9, 0xee, 0xcd, 0x00, 0x84, 0xd1, 0x9c };
+	byte rgbD[] = { 0xaf, 0xf9, 0x07, 0xc9, 0x9f, 0x9a, 0xd3, 0xaa, 0xe6, 0xc4, 0xcd, 0xf2, 0x11, 0x22, 0xbc, 0xe2, 0xbd, 0x68, 0xb5, 0x28, 0x3e, 0x69, 0x07, 0x15, 0x4a, 0xd9, 0x11, 0x84, 0x0f, 0xa2, 0x08, 0xcf };
+	char * sz = "This is the content to be used";
+	COSE_KEYCACHE_STATS stats;
+	cn_cbor * cn;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+	bool f = false;
+
+	for (i = 0; i < 2; i++) {
+		cn = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (cn == NULL) goto errorReturn;
+		if (i == 0) pkey = cn;
+		else pkeyPublic = cn;
+		cn_cbor_mapput_int(cn, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+		cn_cbor_mapput_int(cn, -1, cn_cbor_int_create(1, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+		cn_cbor_mapput_int(cn, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+		cn_cbor_mapput_int(cn, -3, cn_cbor_data_create(rgbY, sizeof(rgbY), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	}
+	cn_cbor_mapput_int(pkey, -4, cn_cbor_data_create(rgbD, sizeof(rgbD), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	hEncObj = COSE_Enveloped_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	hRecip = COSE_Recipient_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hRecip == NULL) goto errorReturn;
+	if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_ECDH_SS_HKDF_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+	if (!COSE_Recipient_SetSenderKey(hRecip, pkey, 2, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+
+	if (!COSE_Enveloped_encrypt(hEncObj, NULL)) goto errorReturn;
+	COSE_Recipient_Free(hRecip);
+	hRecip = NULL;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	if (cb < 1) goto errorReturn;
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	cb = COSE_Encode((HCOSE)hEncObj, rgb, 0, cb);
+	if (cb < 1) goto errorReturn;
+
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	hEncObj = (HCOSE_ENVELOPED)COSE_Decode(rgb, cb, &typ, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+
+	hRecip = COSE_Enveloped_GetRecipient(hEncObj, 0, NULL);
+	if (hRecip == NULL) goto errorReturn;
+	if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_decrypt(hEncObj, hRecip, NULL)) goto errorReturn;
+
+	if (!COSE_KeyCache_GetStats(&stats, NULL) || (stats.cEntries == 0)) goto errorReturn;
+
+	//  The message only carries the public half of the static key
+
+	if (!COSE_KeyCache_Invalidate(pkeyPublic, NULL)) goto errorReturn;
+	if (!COSE_KeyCache_GetStats(&stats, NULL) || (stats.cEntries != 0)) goto errorReturn;
+
+	f = true;
+
+errorReturn:
+	if (hRecip != NULL) COSE_Recipient_Free(hRecip);
+	if (hEncObj != NULL) COSE_Enveloped_Free(hEncObj);
+	if (pkey != NULL) cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	if (pkeyPublic != NULL) cn_cbor_free(pkeyPublic CBOR_CONTEXT_PARAM);
+	if (rgb != NULL) free(rgb);
+	return f;
+}
+#endif
+
+//
+//  Direct HKDF recipient with the derived key cache on.  The key derived
+//  when the message is sent is found again by each decryption.
+//
+
+int EncryptKeyCache()
+{
+	HCOSE_ENVELOPED hEncObj = NULL;
+	HCOSE_RECIPIENT hRecip = NULL;
+	cn_cbor * pkey = NULL;
+	byte rgbSecret[256 / 8] = { 'a', 'b', 'c' };
+	char * sz = "This is the content to be used";
+	COSE_KEYCACHE_STATS stats;
+	COSE_KEYCACHE_STATS statsStart;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+
+	if (!COSE_KeyCache_SetSize(8, NULL)) goto errorReturn;
+	if (!COSE_KeyCache_GetStats(&statsStart, NULL)) goto errorReturn;
+
+	pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (pkey == NULL) goto errorReturn;
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OCTET, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_data_create(rgbSecret, sizeof(rgbSecret), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	hEncObj = COSE_Enveloped_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	hRecip = COSE_Recipient_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hRecip == NULL) goto errorReturn;
+	if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_Direct_HKDF_HMAC_SHA_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+
+	if (!COSE_Enveloped_encrypt(hEncObj, NULL)) goto errorReturn;
+	COSE_Recipient_Free(hRecip);
+	hRecip = NULL;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	if (cb < 1) goto errorReturn;
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	cb = COSE_Encode((HCOSE)hEncObj, rgb, 0, cb);
+	if (cb < 1) goto errorReturn;
+
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	for (i = 0; i < 2; i++) {
+		hEncObj = (HCOSE_ENVELOPED)COSE_Decode(rgb, cb, &typ, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hEncObj == NULL) goto errorReturn;
+
+		hRecip = COSE_Enveloped_GetRecipient(hEncObj, 0, NULL);
+		if (hRecip == NULL) goto errorReturn;
+		if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+		if (!COSE_Enveloped_decrypt(hEncObj, hRecip, NULL)) goto errorReturn;
+
+		COSE_Recipient_Free(hRecip);
+		hRecip = NULL;
+		COSE_Enveloped_Free(hEncObj);
+		hEncObj = NULL;
+	}
+
+	if (!COSE_KeyCache_GetStats(&stats, NULL)) goto errorReturn;
+	if ((stats.cEntries != 1) || (stats.cHits != statsStart.cHits + 2) || (stats.cMisses != statsStart.cMisses + 1)) goto errorReturn;
+
+	//  Dropping the key empties the cache
+
+	if (!COSE_KeyCache_Invalidate(pkey, NULL)) goto errorReturn;
+	if (!COSE_KeyCache_GetStats(&stats, NULL) || (stats.cEntries != 0) || (stats.cInvalidated != statsStart.cInvalidated + 1)) goto errorReturn;
+
+#if defined(USE_ECDH_SS_HKDF_256)
+	if (!KeyCacheECDH()) CFails++;
+#endif
+
+	if (COSE_KeyCache_SetSize(1000000, NULL)) CFails++;
+	if (!COSE_KeyCache_SetSize(0, NULL)) CFails++;
+
+	free(rgb);
+	cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Enveloped_Free(hEncObj);
+	if (hRecip != NULL) COSE_Recipient_Free(hRecip);
+	if (pkey != NULL) cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	if (rgb != NULL) free(rgb);
+	COSE_KeyCache_SetSize(0, NULL);
+	CFails++;
+	return 0;
+}
+
+//
+//  ECDH-ES recipient with an ephemeral key pool for P-256.  The sender
+//  either takes a key from the pool or counts the pool as exhausted, and
+//  the message decrypts in both cases.
+//
+
+int EncryptEphemeralPool()
+{
+	HCOSE_ENVELOPED hEncObj = NULL;
+	HCOSE_RECIPIENT hRecip = NULL;
+	cn_cbor * pkey = NULL;
+	byte rgbX[] = { 0x65, 0xed, 0xa5, 0xa1, 0x25, 0x77, 0xc2, 0xba, 0xe8, 0x29, 0x43, 0x7f, 0xe3, 0x38, 0x70, 0x1a, 0x10, 0xaa, 0xa3, 0x75, 0xe1, 0xbb, 0x5b, 0x5d, 0xe1, 0x08, 0xde, 0x43, 0x9c, 0x08, 0x55, 0x1d };
+	byte rgbY[] = { 0x1e, 0x52, 0xed, 0x75, 0x70, 0x11, 0x63, 0xf7, 0xf9, 0xe4, 0x0d, 0xdf, 0x9f, 0x34, 0x1b, 0x3d, 0xc9, 0xba, 0x86, 0x0a, 0xf7, 0xe0, 0xca, 0x7c, 0xa7, 0xe9, 0xee, 0xcd, 0x00, 0x84, 0xd1, 0x9c };
+	byte rgbD[] = { 0xaf, 0xf9, 0x07, 0xc9, 0x9f, 0x9a, 0xd3, 0xaa, 0xe6, 0xc4, 0xcd, 0xf2, 0x11, 0x22, 0xbc, 0xe2, 0xbd, 0x68, 0xb5, 0x28, 0x3e, 0x69, 0x07, 0x15, 0x4a, 0xd9, 0x11, 0x84, 0x0f, 0xa2, 0x08, 0xcf };
+	char * sz = "This is the content to be used";
+	COSE_EPHEMERAL_STATS stats;
+	COSE_EPHEMERAL_STATS statsStart;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+
+	if (COSE_Ephemeral_SetPool(4, 2, 1, NULL)) CFails++;
+	if (COSE_Ephemeral_SetPool(1, 2, 0, NULL)) CFails++;
+	if (COSE_Ephemeral_SetInterval(0, NULL)) CFails++;
+
+	//  Wait for the refill thread to fill the pool, then slow it down so
+	//  the key taken below is not replaced before the counters are read.
+
+	if (!COSE_Ephemeral_SetInterval(10, NULL)) goto errorReturn;
+	if (!COSE_Ephemeral_SetPool(1, 2, 1, NULL)) goto errorReturn;
+	for (i = 0; i < 1000; i++) {
+		if (!COSE_Ephemeral_GetStats(1, &statsStart, NULL)) goto errorReturn;
+		if (statsStart.cReady == 2) break;
+		SLEEP_MS(10);
+	}
+	if (statsStart.cReady != 2) goto errorReturn;
+	if (!COSE_Ephemeral_SetInterval(60 * 1000, NULL)) goto errorReturn;
+
+	pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (pkey == NULL) goto errorReturn;
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_int_create(1, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -3, cn_cbor_data_create(rgbY, sizeof(rgbY), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -4, cn_cbor_data_create(rgbD, sizeof(rgbD), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	hEncObj = COSE_Enveloped_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	hRecip = COSE_Recipient_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hRecip == NULL) goto errorReturn;
+	if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_ECDH_ES_HKDF_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+
+	if (!COSE_Enveloped_encrypt(hEncObj, NULL)) goto errorReturn;
+	COSE_Recipient_Free(hRecip);
+	hRecip = NULL;
+
+	if (!COSE_Ephemeral_GetStats(1, &stats, NULL)) goto errorReturn;
+	if ((stats.cTaken != statsStart.cTaken + 1) || (stats.cExhausted != statsStart.cExhausted)) goto errorReturn;
+	if (stats.cReady != statsStart.cReady - 1) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	if (cb < 1) goto errorReturn;
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	cb = COSE_Encode((HCOSE)hEncObj, rgb, 0, cb);
+	if (cb < 1) goto errorReturn;
+
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	hEncObj = (HCOSE_ENVELOPED)COSE_Decode(rgb, cb, &typ, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+
+	hRecip = COSE_Enveloped_GetRecipient(hEncObj, 0, NULL);
+	if (hRecip == NULL) goto errorReturn;
+	if (!COSE_Recipient_SetKey(hRecip, pkey, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_decrypt(hEncObj, hRecip, NULL)) goto errorReturn;
+
+	COSE_Recipient_Free(hRecip);
+	COSE_Enveloped_Free(hEncObj);
+
+	COSE_Ephemeral_Stop();
+	if (!COSE_Ephemeral_GetStats(1, &stats, NULL) || (stats.cReady != 0)) CFails++;
+
+	free(rgb);
+	cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Enveloped_Free(hEncObj);
+	if (hRecip != NULL) COSE_Recipient_Free(hRecip);
+	if (pkey != NULL) cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	if (rgb != NULL) free(rgb);
+	COSE_Ephemeral_Stop();
+	CFails++;
+	return 0;
+}
+
+//
+//  Two AES key wrap recipients addressed by kid.  The receiver holds the
+//  key of the second one in a key set and only that recipient is processed.
+//  A key filed under the wrong kid is only found by trial decryption, and a
+//  key not in the set can come from the resolver.
+//
+
+static const cn_cbor * KeySetResolver(const byte * pbKid, size_t cbKid, void * pContext)
+{
+	if ((cbKid == 3) && (memcmp(pbKid, "bob", 3) == 0)) return (const cn_cbor *)pContext;
+	return NULL;
+}
+
+static cn_cbor * KeySetKey(const byte * pbKey, const char * szKid)
+{
+	cn_cbor * pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (pkey == NULL) return NULL;
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OCTET, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, COSE_Key_ID, cn_cbor_data_create((const byte *) szKid, (int) strlen(szKid), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_data_create(pbKey, 128 / 8, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	return pkey;
+}
+
+static bool KeySetDecrypt(const byte * pb, size_t cb, HCOSE_KEYSET hKeys)
+{
+	HCOSE_ENVELOPED hEncObj;
+	cose_errback cose_err;
+	int typ;
+	bool f;
+
+	hEncObj = (HCOSE_ENVELOPED)COSE_Decode(pb, cb, &typ, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) return false;
+
+	f = COSE_Enveloped_decrypt_keyset(hEncObj, hKeys, &cose_err);
+	if (!f && (cose_err.err != COSE_ERR_NO_RECIPIENT_FOUND)) CFails++;
+
+	COSE_Enveloped_Free(hEncObj);
+	return f;
+}
+
+int EncryptKeySet()
+{
+	HCOSE_ENVELOPED hEncObj = NULL;
+	HCOSE_RECIPIENT hRecip = NULL;
+	HCOSE_KEYSET hKeys = NULL;
+	cn_cbor * rgpkey[3] = { NULL, NULL, NULL };
+	byte rgbAlice[128 / 8] = { 'a', 'l', 'i', 'c', 'e' };
+	byte rgbBob[128 / 8] = { 'b', 'o', 'b' };
+	const char * rgszKid[2] = { "alice", "bob" };
+	char * sz = "This is the content to be used";
+	byte * rgb = NULL;
+	size_t cb;
+	int i;
+
+	rgpkey[0] = KeySetKey(rgbAlice, "alice");
+	rgpkey[1] = KeySetKey(rgbBob, "bob");
+	rgpkey[2] = KeySetKey(rgbBob, "carol");
+	if ((rgpkey[0] == NULL) || (rgpkey[1] == NULL) || (rgpkey[2] == NULL)) goto errorReturn;
+
+	hEncObj = COSE_Enveloped_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	for (i = 0; i < 2; i++) {
+		hRecip = COSE_Recipient_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hRecip == NULL) goto errorReturn;
+		if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_KW_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_KID, cn_cbor_data_create((const byte *) rgszKid[i], (int) strlen(rgszKid[i]), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Recipient_SetKey(hRecip, rgpkey[i], NULL)) goto errorReturn;
+		if (!COSE_Enveloped_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+		COSE_Recipient_Free(hRecip);
+		hRecip = NULL;
+	}
+
+	if (!COSE_Enveloped_encrypt(hEncObj, NULL)) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	if (cb < 1) goto errorReturn;
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	cb = COSE_Encode((HCOSE)hEncObj, rgb, 0, cb);
+	if (cb < 1) goto errorReturn;
+
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	//  Found by kid
+
+	hKeys = COSE_KeySet_Init(COSE_KEYSET_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKeys == NULL) goto errorReturn;
+	if (!COSE_KeySet_AddKey(hKeys, rgpkey[1], NULL)) goto errorReturn;
+	if (!KeySetDecrypt(rgb, cb, hKeys)) CFails++;
+	COSE_KeySet_Free(hKeys);
+
+	//  Filed under the wrong kid - only trial decryption finds it
+
+	hKeys = COSE_KeySet_Init(COSE_KEYSET_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKeys == NULL) goto errorReturn;
+	if (!COSE_KeySet_AddKey(hKeys, rgpkey[2], NULL)) goto errorReturn;
+	if (KeySetDecrypt(rgb, cb, hKeys)) CFails++;
+	COSE_KeySet_Free(hKeys);
+
+	hKeys = COSE_KeySet_Init(COSE_KEYSET_TRIAL, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKeys == NULL) goto errorReturn;
+	if (!COSE_KeySet_AddKey(hKeys, rgpkey[2], NULL)) goto errorReturn;
+	if (!KeySetDecrypt(rgb, cb, hKeys)) CFails++;
+	COSE_KeySet_Free(hKeys);
+
+	//  Supplied by the resolver
+
+	hKeys = COSE_KeySet_Init(COSE_KEYSET_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKeys == NULL) goto errorReturn;
+	if (KeySetDecrypt(rgb, cb, hKeys)) CFails++;
+	if (!COSE_KeySet_SetResolver(hKeys, KeySetResolver, rgpkey[1], NULL)) goto errorReturn;
+	if (!KeySetDecrypt(rgb, cb, hKeys)) CFails++;
+	COSE_KeySet_Free(hKeys);
+	hKeys = NULL;
+
+	if (COSE_KeySet_Init((COSE_KEYSET_FLAGS) 8, CBOR_CONTEXT_PARAM_COMMA NULL) != NULL) CFails++;
+
+	free(rgb);
+	for (i = 0; i < 3; i++) cn_cbor_free(rgpkey[i] CBOR_CONTEXT_PARAM);
+	return 1;
+
+errorReturn:
+	if (hEncObj != NULL) COSE_Enveloped_Free(hEncObj);
+	if (hRecip != NULL) COSE_Recipient_Free(hRecip);
+	if (hKeys != NULL) COSE_KeySet_Free(hKeys);
+	for (i = 0; i < 3; i++) {
+		if (rgpkey[i] != NULL) cn_cbor_free(rgpkey[i] CBOR_CONTEXT_PARAM);
+	}
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+
+
 /********************************************/
 
 int _ValidateEncrypt(const cn_cbor * pControl, const byte * pbEncoded, size_t cbEncoded)
@@ -599,6 +1574,53 @@ void Enveloped_Corners()
 	return;
 }
 
+//
+//  Decode a message whose ciphertext is shorter than the tag and check
+//  that it is rejected with both the raw and the prepared key
+//
+
+static void Encrypt_Truncated(int alg, size_t cbIV, size_t cbKey)
+{
+	byte rgbMsg[64];
+	byte rgbKey[256 / 8] = { 1, 2, 3 };
+	size_t cb = 0;
+	int typ;
+	HCOSE_ENCRYPT hEncrypt;
+	HCOSE_PREPARED_KEY hKey;
+	cose_errback cose_error;
+
+	rgbMsg[cb++] = 0x83;
+	rgbMsg[cb++] = 0x43;
+	rgbMsg[cb++] = 0xa1;
+	rgbMsg[cb++] = 0x01;
+	rgbMsg[cb++] = (byte) alg;
+	rgbMsg[cb++] = 0xa1;
+	rgbMsg[cb++] = 0x05;
+	rgbMsg[cb++] = (byte) (0x40 + cbIV);
+	memset(&rgbMsg[cb], 7, cbIV);
+	cb += cbIV;
+	rgbMsg[cb++] = 0x44;
+	memset(&rgbMsg[cb], 9, 4);
+	cb += 4;
+
+	hEncrypt = (HCOSE_ENCRYPT)COSE_Decode(rgbMsg, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncrypt == NULL) {
+		CFails++;
+		return;
+	}
+
+	CHECK_FAILURE(COSE_Encrypt_decrypt(hEncrypt, rgbKey, cbKey, &cose_error), COSE_ERR_INVALID_PARAMETER, CFails++);
+
+	hKey = COSE_PreparedKey_Create(alg, rgbKey, cbKey, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) CFails++;
+	else {
+		CHECK_FAILURE(COSE_Encrypt_decrypt_prepared(hEncrypt, hKey, &cose_error), COSE_ERR_INVALID_PARAMETER, CFails++);
+		COSE_PreparedKey_Free(hKey);
+	}
+
+	COSE_Encrypt_Free(hEncrypt);
+}
+
 void Encrypt_Corners()
 {
 	HCOSE_ENCRYPT hEncrypt = NULL;
@@ -647,6 +1669,15 @@ void Encrypt_Corners()
 	CHECK_FAILURE(COSE_Encrypt_encrypt(hEncrypt, rgb, sizeof(rgb), &cose_error), COSE_ERR_UNKNOWN_ALGORITHM, CFails++);
 	COSE_Encrypt_Free(hEncrypt);
 
+	//  Ciphertext shorter than the tag
+
+#ifdef USE_AES_GCM_128
+	Encrypt_Truncated(COSE_Algorithm_AES_GCM_128, 96 / 8, 128 / 8);
+#endif
+#ifdef USE_AES_CCM_16_64_128
+	Encrypt_Truncated(COSE_Algorithm_AES_CCM_16_64_128, 13, 128 / 8);
+#endif
+
 	return;
 }
 
@@ -6,6 +6,14 @@
 #include <cose.h>
 #include <cn-cbor/cn-cbor.h>
 
+//  The CBC-MAC engine is tested directly, the test's own allocation macros
+//  replace those of the library.
+
+#include "cose_int.h"
+#include "crypto.h"
+#undef CBOR_CONTEXT_PARAM
+#undef CBOR_CONTEXT_PARAM_COMMA
+
 #include "json.h"
 #include "test.h"
 #include "context.h"
@@ -210,6 +218,7 @@ int MacMessage()
 	HCOSE_RECIPIENT hRecip = COSE_Recipient_from_shared_secret(rgbSecret, sizeof(rgbSecret), rgbKid, cbKid, CBOR_CONTEXT_PARAM_COMMA NULL);
 	if (hRecip == NULL) goto errorReturn;
 	if (!COSE_Mac_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+	COSE_Recipient_Free(hRecip);
 
 	if (!COSE_Mac_encrypt(hEncObj, NULL)) goto errorReturn;
 
@@ -270,6 +279,290 @@ errorReturn:
 	return 1;
 }
 
+int Mac0PreparedKey()
+{
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_MAC0 hMacObj = NULL;
+	byte rgbKey[256 / 8] = { 'a', 'b', 'c' };
+	char * sz = "This is the content to be used";
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+
+	if (COSE_PreparedKey_Create(COSE_Algorithm_HMAC_256_64, rgbKey, sizeof(rgbKey) - 1, CBOR_CONTEXT_PARAM_COMMA NULL) != NULL) goto errorReturn;
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_HMAC_256_64, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	for (i = 0; i < 3; i++) {
+		hMacObj = COSE_Mac0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+		if (!COSE_Mac0_map_put_int(hMacObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_HMAC_256_64, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Mac0_SetContent(hMacObj, (byte *) sz, strlen(sz) - i, NULL)) goto errorReturn;
+
+		if (!COSE_Mac0_encrypt_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hMacObj, NULL, 0, 0);
+		rgb = (byte *)malloc(cb);
+		if (rgb == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hMacObj, rgb, 0, cb) != cb) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+
+		//  Validate with both the raw key and the prepared key
+
+		hMacObj = (HCOSE_MAC0)COSE_Decode(rgb, cb, &typ, COSE_mac0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+
+		if (!COSE_Mac0_validate(hMacObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+		if (!COSE_Mac0_validate_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+
+		//  The tag is the last item, drop its final byte and it must
+		//  no longer validate
+
+		if (rgb[cb - 9] != 0x48) goto errorReturn;
+		rgb[cb - 9] = 0x47;
+		hMacObj = (HCOSE_MAC0)COSE_Decode(rgb, cb - 1, &typ, COSE_mac0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+		if (COSE_Mac0_validate(hMacObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+		if (COSE_Mac0_validate_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+		free(rgb);
+		rgb = NULL;
+	}
+
+	//  The key cannot be used with a different algorithm
+
+	hMacObj = COSE_Mac0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hMacObj == NULL) goto errorReturn;
+	if (!COSE_Mac0_map_put_int(hMacObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_HMAC_256_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Mac0_SetContent(hMacObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+	if (COSE_Mac0_encrypt_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+	//  A freed key is rejected
+
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	if (COSE_Mac0_encrypt_prepared(hMacObj, hKey, NULL)) CFails++;
+	if (COSE_Mac0_validate_prepared(hMacObj, hKey, NULL)) CFails++;
+
+	COSE_Mac0_Free(hMacObj);
+	return 1;
+
+errorReturn:
+	if (hMacObj != NULL) COSE_Mac0_Free(hMacObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+
+#ifdef USE_OPEN_SSL
+/*
+ *  Run one message through a CBC-MAC context, cut into pieces of the sizes
+ *  in rgcbSplit (used in turn) or in one piece when cSplit is zero, and
+ *  compare the tag.
+ */
+
+static bool MacCBCRun(CBC_MAC_CTX * pctx, const byte * pb, size_t cb, const size_t * rgcbSplit, size_t cSplit, const byte * rgbExpected)
+{
+	byte rgbTag[16];
+	size_t cbChunk;
+	size_t i = 0;
+
+	if (cSplit == 0) {
+		if (!CBC_MAC_Update(pctx, pb, cb)) return false;
+	}
+	else {
+		while (cb > 0) {
+			cbChunk = rgcbSplit[i++ % cSplit];
+			if (cbChunk > cb) cbChunk = cb;
+			if (!CBC_MAC_Update(pctx, pb, cbChunk)) return false;
+			if (!CBC_MAC_Update(pctx, pb, 0)) return false;
+			pb += cbChunk;
+			cb -= cbChunk;
+		}
+	}
+	if (!CBC_MAC_Final(pctx, rgbTag)) return false;
+	return memcmp(rgbTag, rgbExpected, sizeof(rgbTag)) == 0;
+}
+
+int MacCBCKnownAnswer()
+{
+	static const byte rgbKey128[16] = {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+	};
+	static const byte rgbKey256[32] = {
+		0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+		0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+	};
+
+	//  RFC 4493 section 4 and SP 800-38B appendix D.3 for the 256-bit key
+
+	static const byte rgbCMACMessage[64] = {
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+		0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+		0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+		0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+	};
+	static const struct {
+		bool fCMAC;
+		const byte * pbKey;
+		size_t cbKey;
+		size_t cbMessage;		//  CMAC takes a prefix of rgbCMACMessage, CBC-MAC bytes 0, 1, 2, ...
+		byte rgbTag[16];
+	} rgTests[] = {
+		{ true, rgbKey128, 16, 0, { 0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46 } },
+		{ true, rgbKey128, 16, 16, { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c } },
+		{ true, rgbKey128, 16, 40, { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 } },
+		{ true, rgbKey128, 16, 64, { 0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe } },
+		{ true, rgbKey256, 32, 0, { 0x02, 0x89, 0x62, 0xf6, 0x1b, 0x7b, 0xf8, 0x9e, 0xfc, 0x6b, 0x55, 0x1f, 0x46, 0x67, 0xd9, 0x83 } },
+		{ true, rgbKey256, 32, 16, { 0x28, 0xa7, 0x02, 0x3f, 0x45, 0x2e, 0x8f, 0x82, 0xbd, 0x4b, 0xf2, 0x8d, 0x8c, 0x37, 0xc3, 0x5c } },
+		{ true, rgbKey256, 32, 40, { 0xaa, 0xf3, 0xd8, 0xf1, 0xde, 0x56, 0x40, 0xc2, 0x32, 0xf5, 0xb1, 0x69, 0xb9, 0xc9, 0x11, 0xe6 } },
+		{ true, rgbKey256, 32, 64, { 0xe1, 0x99, 0x21, 0x90, 0x54, 0x9f, 0x6e, 0xd5, 0x69, 0x6a, 0x2c, 0x05, 0x6c, 0x31, 0x54, 0x10 } },
+
+		//  CBC-MAC with a zero IV over the zero padded input, as computed by
+		//  AES-CBC encryption of the padded input
+
+		{ false, rgbKey128, 16, 0, { 0 } },
+		{ false, rgbKey128, 16, 15, { 0x62, 0x5e, 0x73, 0x89, 0x27, 0x7e, 0xc0, 0x37, 0x20, 0xb3, 0x4f, 0xe7, 0x28, 0xc7, 0x2a, 0x0f } },
+		{ false, rgbKey128, 16, 16, { 0x50, 0xfe, 0x67, 0xcc, 0x99, 0x6d, 0x32, 0xb6, 0xda, 0x09, 0x37, 0xe9, 0x9b, 0xaf, 0xec, 0x60 } },
+		{ false, rgbKey128, 16, 17, { 0xd6, 0x4f, 0x87, 0xaf, 0xe2, 0x7f, 0x42, 0xc6, 0xd5, 0xdf, 0xd6, 0xd6, 0xb1, 0x84, 0x7e, 0x64 } },
+		{ false, rgbKey128, 16, 600, { 0x81, 0xfc, 0xc5, 0x39, 0xe0, 0xb7, 0x18, 0x49, 0xd0, 0x2f, 0x09, 0xf4, 0x8b, 0x41, 0xb5, 0xa7 } },
+		{ false, rgbKey256, 32, 0, { 0 } },
+		{ false, rgbKey256, 32, 15, { 0x3e, 0x62, 0x28, 0xd2, 0xba, 0xbd, 0x63, 0x92, 0xc6, 0xdc, 0x32, 0x05, 0x35, 0x14, 0xa8, 0x37 } },
+		{ false, rgbKey256, 32, 16, { 0xb7, 0xbf, 0x3a, 0x5d, 0xf4, 0x39, 0x89, 0xdd, 0x97, 0xf0, 0xfa, 0x97, 0xeb, 0xce, 0x2f, 0x4a } },
+		{ false, rgbKey256, 32, 17, { 0xb9, 0xa5, 0x91, 0x51, 0x4e, 0xd5, 0x99, 0x32, 0x7f, 0x36, 0x84, 0x8a, 0xaf, 0x93, 0xf0, 0xc6 } },
+		{ false, rgbKey256, 32, 600, { 0x24, 0x84, 0xf9, 0xd2, 0xea, 0xcf, 0xa8, 0xdd, 0xe8, 0x5f, 0x47, 0x27, 0x0f, 0x0a, 0x79, 0xc1 } },
+	};
+
+	//  Pieces which straddle, end on and skip past block and chunk boundaries
+
+	static const size_t rgcbSplit1[] = { 1 };
+	static const size_t rgcbSplit2[] = { 7, 9, 16, 1, 15, 17 };
+	static const size_t rgcbSplit3[] = { 16, 520, 3 };
+	static const struct {
+		const size_t * rgcb;
+		size_t c;
+	} rgSplits[] = {
+		{ NULL, 0 },
+		{ rgcbSplit1, _countof(rgcbSplit1) },
+		{ rgcbSplit2, _countof(rgcbSplit2) },
+		{ rgcbSplit3, _countof(rgcbSplit3) },
+	};
+
+	byte rgbData[600];
+	CBC_MAC_CTX * pctx = NULL;
+	const byte * pb;
+	size_t iTest;
+	size_t iSplit;
+	size_t i;
+
+	for (i = 0; i < sizeof(rgbData); i++) rgbData[i] = (byte) i;
+
+	for (iTest = 0; iTest < _countof(rgTests); iTest++) {
+		pctx = CBC_MAC_New(rgTests[iTest].pbKey, rgTests[iTest].cbKey, rgTests[iTest].fCMAC CBOR_CONTEXT_PARAM);
+		if (pctx == NULL) goto errorReturn;
+
+		pb = rgTests[iTest].fCMAC ? rgbCMACMessage : rgbData;
+
+		//  Final restarts the context, so each split runs on the same one
+
+		for (iSplit = 0; iSplit < _countof(rgSplits); iSplit++) {
+			if (!MacCBCRun(pctx, pb, rgTests[iTest].cbMessage, rgSplits[iSplit].rgcb, rgSplits[iSplit].c, rgTests[iTest].rgbTag)) goto errorReturn;
+		}
+
+		CBC_MAC_Delete(pctx CBOR_CONTEXT_PARAM);
+		pctx = NULL;
+	}
+
+	if (CBC_MAC_New(rgbKey128, 24, false CBOR_CONTEXT_PARAM) != NULL) goto errorReturn;
+
+	return 1;
+
+errorReturn:
+	if (pctx != NULL) CBC_MAC_Delete(pctx CBOR_CONTEXT_PARAM);
+	CFails++;
+	return 0;
+}
+#endif
+
+#ifdef USE_AES_CBC_MAC_256_64
+int Mac0PreparedCBCMAC()
+{
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_MAC0 hMacObj = NULL;
+	byte rgbKey[256 / 8] = { 'a', 'b', 'c' };
+	char * sz = "This is the content to be used";
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_CBC_MAC_256_64, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	//  Alternate which side uses the prepared key, each message must
+	//  start a fresh chain on the prepared context
+
+	for (i = 0; i < 4; i++) {
+		hMacObj = COSE_Mac0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+		if (!COSE_Mac0_map_put_int(hMacObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_CBC_MAC_256_64, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Mac0_SetContent(hMacObj, (byte *) sz, strlen(sz) - i, NULL)) goto errorReturn;
+
+		if (i % 2 == 0) {
+			if (!COSE_Mac0_encrypt_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+		}
+		else if (!COSE_Mac0_encrypt(hMacObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hMacObj, NULL, 0, 0);
+		rgb = (byte *)malloc(cb);
+		if (rgb == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hMacObj, rgb, 0, cb) != cb) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+
+		hMacObj = (HCOSE_MAC0)COSE_Decode(rgb, cb, &typ, COSE_mac0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+
+		if (!COSE_Mac0_validate(hMacObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+		if (!COSE_Mac0_validate_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+
+		//  Damage the last byte of the tag
+
+		rgb[cb - 1] ^= 1;
+		hMacObj = (HCOSE_MAC0)COSE_Decode(rgb, cb, &typ, COSE_mac0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hMacObj == NULL) goto errorReturn;
+		if (COSE_Mac0_validate_prepared(hMacObj, hKey, NULL)) goto errorReturn;
+
+		COSE_Mac0_Free(hMacObj);
+		hMacObj = NULL;
+		free(rgb);
+		rgb = NULL;
+	}
+
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	return 1;
+
+errorReturn:
+	if (hMacObj != NULL) COSE_Mac0_Free(hMacObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+#endif
 
 int _ValidateMac0(const cn_cbor * pControl, const byte * pbEncoded, size_t cbEncoded)
 {
@@ -0,0 +1,344 @@
+//  provider.c
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cose.h>
+#include <cn-cbor/cn-cbor.h>
+
+#include "test.h"
+
+#ifdef USE_OPEN_SSL
+#include <openssl/evp.h>
+
+//  The providers below implement their primitives with OpenSSL directly,
+//  the way an application bringing its own crypto library would.
+
+#ifdef USE_AES_GCM_128
+static bool EVP_GCM(bool fEncrypt, const byte * pbKey, size_t cbKey, const byte * pbNonce, size_t cbNonce, const byte * pbAAD, size_t cbAAD, const byte * pbIn, size_t cbIn, byte * pbOut, byte * pbTag, size_t cbTag)
+{
+	const EVP_CIPHER * cipher;
+	EVP_CIPHER_CTX * ctx;
+	int cbOut;
+	bool f;
+
+	switch (cbKey) {
+	case 128 / 8: cipher = EVP_aes_128_gcm(); break;
+	case 192 / 8: cipher = EVP_aes_192_gcm(); break;
+	case 256 / 8: cipher = EVP_aes_256_gcm(); break;
+	default: return false;
+	}
+	if (cbNonce != 96 / 8) return false;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) return false;
+
+	f = EVP_CipherInit_ex(ctx, cipher, NULL, pbKey, pbNonce, fEncrypt) == 1;
+	if (f && !fEncrypt) f = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int) cbTag, pbTag) == 1;
+	if (f) f = EVP_CipherUpdate(ctx, NULL, &cbOut, pbAAD, (int) cbAAD) == 1;
+	if (f && (cbIn > 0)) f = EVP_CipherUpdate(ctx, pbOut, &cbOut, pbIn, (int) cbIn) == 1;
+	if (f) f = EVP_CipherFinal_ex(ctx, pbOut + cbIn, &cbOut) == 1;
+	if (f && fEncrypt) f = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int) cbTag, pbTag) == 1;
+
+	EVP_CIPHER_CTX_free(ctx);
+	return f;
+}
+
+
+static bool CountGCM_Encrypt(int alg, const byte * pbKey, size_t cbKey, const byte * pbNonce, size_t cbNonce, const byte * pbAAD, size_t cbAAD, const byte * pbIn, size_t cbIn, byte * pbOut, byte * pbTag, size_t cbTag, void * pContext)
+{
+	if ((alg != COSE_Algorithm_AES_GCM_128) || (cbTag != 128 / 8)) return false;
+	*(int *)pContext += 1;
+	return EVP_GCM(true, pbKey, cbKey, pbNonce, cbNonce, pbAAD, cbAAD, pbIn, cbIn, pbOut, pbTag, cbTag);
+}
+
+static bool CountGCM_Decrypt(int alg, const byte * pbKey, size_t cbKey, const byte * pbNonce, size_t cbNonce, const byte * pbAAD, size_t cbAAD, const byte * pbIn, size_t cbIn, const byte * pbTag, size_t cbTag, byte * pbOut, void * pContext)
+{
+	if ((alg != COSE_Algorithm_AES_GCM_128) || (cbTag != 128 / 8)) return false;
+	*(int *)pContext += 1;
+	return EVP_GCM(false, pbKey, cbKey, pbNonce, cbNonce, pbAAD, cbAAD, pbIn, cbIn, pbOut, (byte *) pbTag, cbTag);
+}
+
+int EncryptProvider()
+{
+	static const int rgAlgs[] = { COSE_Algorithm_AES_GCM_128 };
+	COSE_PROVIDER provider = { 0 };
+	int CProviderCalls = 0;
+	HCOSE_PREPARED_KEY hKey = NULL;
+	HCOSE_ENCRYPT hEncObj = NULL;
+	byte rgbKey[128 / 8] = { 'a', 'b', 'c' };
+	char * sz = "This is the content to be used";
+	const byte * pbDecrypted;
+	size_t cbDecrypted;
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+
+	provider.m_szName = "Counting";
+	provider.m_rgAlgorithms = rgAlgs;
+	provider.m_cAlgorithms = 1;
+	provider.m_pContext = &CProviderCalls;
+	provider.pfnAEAD_Encrypt = CountGCM_Encrypt;
+
+	//  A provider missing a primitive for an algorithm it claims is refused
+
+	if (COSE_Provider_Supports(&provider, COSE_Algorithm_AES_GCM_128)) goto errorReturn;
+	if (COSE_Provider_Register(&provider, NULL)) goto errorReturn;
+
+	provider.pfnAEAD_Decrypt = CountGCM_Decrypt;
+	if (!COSE_Provider_Supports(&provider, COSE_Algorithm_AES_GCM_128)) goto errorReturn;
+	if (COSE_Provider_Supports(&provider, COSE_Algorithm_AES_GCM_256)) goto errorReturn;
+	if (!COSE_Provider_Supports(COSE_Provider_Default(), COSE_Algorithm_AES_GCM_256)) goto errorReturn;
+
+	//  Keys prepared before the registration still work
+
+	hKey = COSE_PreparedKey_Create(COSE_Algorithm_AES_GCM_128, rgbKey, sizeof(rgbKey), CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	if (!COSE_Provider_Register(&provider, NULL)) goto errorReturn;
+	if (COSE_Provider_Get(COSE_Algorithm_AES_GCM_128) != &provider) goto errorReturn;
+	if (COSE_Provider_Get(COSE_Algorithm_AES_GCM_256) != COSE_Provider_Default()) goto errorReturn;
+	if (strcmp(COSE_Provider_Name(COSE_Provider_Get(COSE_Algorithm_AES_GCM_128)), "Counting") != 0) goto errorReturn;
+
+	hEncObj = COSE_Encrypt_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_GCM_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Encrypt_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+	if (!COSE_Encrypt_encrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hEncObj, rgb, 0, cb) != cb) goto errorReturn;
+	COSE_Encrypt_Free(hEncObj);
+	hEncObj = NULL;
+
+	hEncObj = (HCOSE_ENCRYPT)COSE_Decode(rgb, cb, &typ, COSE_encrypt_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Encrypt_decrypt(hEncObj, rgbKey, sizeof(rgbKey), NULL)) goto errorReturn;
+	pbDecrypted = COSE_Encrypt_GetContent(hEncObj, &cbDecrypted, NULL);
+	if ((pbDecrypted == NULL) || (cbDecrypted != strlen(sz)) || (memcmp(pbDecrypted, sz, cbDecrypted) != 0)) goto errorReturn;
+
+	if (CProviderCalls != 2) goto errorReturn;
+
+	//  After a reset the default provider handles the algorithm again, and
+	//  reads the message the provider wrote
+
+	COSE_Provider_Reset();
+	if (COSE_Provider_Get(COSE_Algorithm_AES_GCM_128) != COSE_Provider_Default()) goto errorReturn;
+	if (!COSE_Encrypt_decrypt_prepared(hEncObj, hKey, NULL)) goto errorReturn;
+	if (CProviderCalls != 2) goto errorReturn;
+
+	COSE_Encrypt_Free(hEncObj);
+	free(rgb);
+	if (!COSE_PreparedKey_Free(hKey)) CFails++;
+	return 1;
+
+errorReturn:
+	COSE_Provider_Reset();
+	if (hEncObj != NULL) COSE_Encrypt_Free(hEncObj);
+	if (hKey != NULL) COSE_PreparedKey_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails++;
+	return 0;
+}
+#endif // USE_AES_GCM_128
+
+#if defined(USE_AES_CCM_16_64_128) && defined(USE_AES_KW_128) && defined(USE_HMAC_256_256)
+//
+//  Four AES key wrap recipients, of which the receiver's key set holds the
+//  third.  Counting the key unwraps shows that only the recipient with the
+//  matching kid is processed, for both Enveloped and MAC messages.
+//
+
+static bool EVP_KW(bool fEncrypt, const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbOut)
+{
+	const EVP_CIPHER * cipher;
+	EVP_CIPHER_CTX * ctx;
+	int cbOut = 0;
+	int cbFinal = 0;
+	bool f;
+
+	switch (cbKey) {
+	case 128 / 8: cipher = EVP_aes_128_wrap(); break;
+	case 192 / 8: cipher = EVP_aes_192_wrap(); break;
+	case 256 / 8: cipher = EVP_aes_256_wrap(); break;
+	default: return false;
+	}
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) return false;
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+	f = EVP_CipherInit_ex(ctx, cipher, NULL, pbKey, NULL, fEncrypt) == 1;
+	if (f) f = EVP_CipherUpdate(ctx, pbOut, &cbOut, pbIn, (int) cbIn) == 1;
+	if (f) f = EVP_CipherFinal_ex(ctx, pbOut + cbOut, &cbFinal) == 1;
+	if (f) f = (size_t) (cbOut + cbFinal) == (fEncrypt ? cbIn + 8 : cbIn - 8);
+
+	EVP_CIPHER_CTX_free(ctx);
+	return f;
+}
+
+static bool CountKW_Wrap(const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbOut, void * pContext)
+{
+	(void) pContext;
+	return EVP_KW(true, pbKey, cbKey, pbIn, cbIn, pbOut);
+}
+
+static bool CountKW_Unwrap(const byte * pbKey, size_t cbKey, const byte * pbIn, size_t cbIn, byte * pbOut, void * pContext)
+{
+	*(int *)pContext += 1;
+	return EVP_KW(false, pbKey, cbKey, pbIn, cbIn, pbOut);
+}
+
+static cn_cbor * CountKey(const char * szKid, byte rgbKey[128 / 8])
+{
+	cn_cbor * pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	if (pkey == NULL) return NULL;
+	memset(rgbKey, 0, 128 / 8);
+	memcpy(rgbKey, szKid, strlen(szKid));
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OCTET, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, COSE_Key_ID, cn_cbor_data_create((const byte *) szKid, (int) strlen(szKid), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_data_create(rgbKey, 128 / 8, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	return pkey;
+}
+
+static HCOSE_RECIPIENT CountRecipient(const char * szKid, const cn_cbor * pkey)
+{
+	HCOSE_RECIPIENT hRecip = COSE_Recipient_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	if (hRecip == NULL) return NULL;
+	if (!COSE_Recipient_map_put_int(hRecip, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_KW_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL) ||
+		!COSE_Recipient_map_put_int(hRecip, COSE_Header_KID, cn_cbor_data_create((const byte *) szKid, (int) strlen(szKid), CBOR_CONTEXT_PARAM_COMMA NULL), COSE_UNPROTECT_ONLY, NULL) ||
+		!COSE_Recipient_SetKey(hRecip, pkey, NULL)) {
+		COSE_Recipient_Free(hRecip);
+		return NULL;
+	}
+	return hRecip;
+}
+
+int EncryptKeySetCount()
+{
+	static const int rgAlgs[] = { COSE_Algorithm_AES_KW_128 };
+	static const char * rgszKid[4] = { "alice", "bob", "carol", "dave" };
+	COSE_PROVIDER provider = { 0 };
+	int CUnwrapCalls = 0;
+	HCOSE_ENVELOPED hEncObj = NULL;
+	HCOSE_MAC hMacObj = NULL;
+	HCOSE_RECIPIENT hRecip = NULL;
+	HCOSE_KEYSET hKeys = NULL;
+	cn_cbor * rgpkey[4] = { NULL, NULL, NULL, NULL };
+	byte rgrgbKey[4][128 / 8];
+	char * sz = "This is the content to be used";
+	cose_errback cose_err;
+	byte * rgbEnv = NULL;
+	byte * rgbMac = NULL;
+	size_t cbEnv;
+	size_t cbMac;
+	int typ;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		rgpkey[i] = CountKey(rgszKid[i], rgrgbKey[i]);
+		if (rgpkey[i] == NULL) goto errorReturn;
+	}
+
+	hEncObj = COSE_Enveloped_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_map_put_int(hEncObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_AES_CCM_16_64_128, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Enveloped_SetContent(hEncObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	hMacObj = COSE_Mac_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hMacObj == NULL) goto errorReturn;
+	if (!COSE_Mac_map_put_int(hMacObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_HMAC_256_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Mac_SetContent(hMacObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	for (i = 0; i < 4; i++) {
+		hRecip = CountRecipient(rgszKid[i], rgpkey[i]);
+		if (hRecip == NULL) goto errorReturn;
+		if (!COSE_Enveloped_AddRecipient(hEncObj, hRecip, NULL)) goto errorReturn;
+		COSE_Recipient_Free(hRecip);
+
+		hRecip = CountRecipient(rgszKid[i], rgpkey[i]);
+		if (hRecip == NULL) goto errorReturn;
+		if (!COSE_Mac_AddRecipient(hMacObj, hRecip, NULL)) goto errorReturn;
+		COSE_Recipient_Free(hRecip);
+		hRecip = NULL;
+	}
+
+	if (!COSE_Enveloped_encrypt(hEncObj, NULL)) goto errorReturn;
+	cbEnv = COSE_Encode((HCOSE)hEncObj, NULL, 0, 0);
+	rgbEnv = (byte *)malloc(cbEnv);
+	if (rgbEnv == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hEncObj, rgbEnv, 0, cbEnv) != cbEnv) goto errorReturn;
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	if (!COSE_Mac_encrypt(hMacObj, NULL)) goto errorReturn;
+	cbMac = COSE_Encode((HCOSE)hMacObj, NULL, 0, 0);
+	rgbMac = (byte *)malloc(cbMac);
+	if (rgbMac == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hMacObj, rgbMac, 0, cbMac) != cbMac) goto errorReturn;
+	COSE_Mac_Free(hMacObj);
+	hMacObj = NULL;
+
+	hKeys = COSE_KeySet_Init(COSE_KEYSET_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKeys == NULL) goto errorReturn;
+	if (!COSE_KeySet_AddKey(hKeys, rgpkey[2], NULL)) goto errorReturn;
+
+	provider.m_szName = "Counting";
+	provider.m_rgAlgorithms = rgAlgs;
+	provider.m_cAlgorithms = 1;
+	provider.m_pContext = &CUnwrapCalls;
+	provider.pfnKeyWrap = CountKW_Wrap;
+	provider.pfnKeyUnwrap = CountKW_Unwrap;
+	if (!COSE_Provider_Register(&provider, NULL)) goto errorReturn;
+
+	CUnwrapCalls = 0;
+	hEncObj = (HCOSE_ENVELOPED)COSE_Decode(rgbEnv, cbEnv, &typ, COSE_enveloped_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hEncObj == NULL) goto errorReturn;
+	if (!COSE_Enveloped_decrypt_keyset(hEncObj, hKeys, NULL)) goto errorReturn;
+	if (CUnwrapCalls != 1) goto errorReturn;
+	COSE_Enveloped_Free(hEncObj);
+	hEncObj = NULL;
+
+	CUnwrapCalls = 0;
+	hMacObj = (HCOSE_MAC)COSE_Decode(rgbMac, cbMac, &typ, COSE_mac_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hMacObj == NULL) goto errorReturn;
+	if (!COSE_Mac_validate_keyset(hMacObj, hKeys, NULL)) goto errorReturn;
+	if (CUnwrapCalls != 1) goto errorReturn;
+
+	COSE_Provider_Reset();
+
+	//  Only registered key sets are accepted
+
+	if (COSE_Mac_validate_keyset(hMacObj, (HCOSE_KEYSET) rgbMac, &cose_err) || (cose_err.err != COSE_ERR_INVALID_HANDLE)) goto errorReturn;
+	if (COSE_KeySet_AddKey((HCOSE_KEYSET) rgbMac, rgpkey[0], &cose_err) || (cose_err.err != COSE_ERR_INVALID_HANDLE)) goto errorReturn;
+	if (COSE_KeySet_Free((HCOSE_KEYSET) rgbMac)) goto errorReturn;
+
+	COSE_Mac_Free(hMacObj);
+	if (!COSE_KeySet_Free(hKeys)) CFails++;
+	free(rgbEnv);
+	free(rgbMac);
+	for (i = 0; i < 4; i++) cn_cbor_free(rgpkey[i] CBOR_CONTEXT_PARAM);
+	return 1;
+
+errorReturn:
+	COSE_Provider_Reset();
+	if (hEncObj != NULL) COSE_Enveloped_Free(hEncObj);
+	if (hMacObj != NULL) COSE_Mac_Free(hMacObj);
+	if (hRecip != NULL) COSE_Recipient_Free(hRecip);
+	if (hKeys != NULL) COSE_KeySet_Free(hKeys);
+	for (i = 0; i < 4; i++) {
+		if (rgpkey[i] != NULL) cn_cbor_free(rgpkey[i] CBOR_CONTEXT_PARAM);
+	}
+	if (rgbEnv != NULL) free(rgbEnv);
+	if (rgbMac != NULL) free(rgbMac);
+	CFails++;
+	return 0;
+}
+#endif
+#endif // USE_OPEN_SSL
@@ -247,6 +247,329 @@ int SignMessage()
 	return 1;
 }
 
+int Sign0KeyObject()
+{
+	HCOSE_KEY hKey = NULL;
+	HCOSE_SIGN0 hSignObj = NULL;
+	cn_cbor * pkeyText;
+	cose_errback cose_error;
+	char * sz = "This is the content to be used";
+	byte rgbX[] = { 0x65, 0xed, 0xa5, 0xa1, 0x25, 0x77, 0xc2, 0xba, 0xe8, 0x29, 0x43, 0x7f, 0xe3, 0x38, 0x70, 0x1a, 0x10, 0xaa, 0xa3, 0x75, 0xe1, 0xbb, 0x5b, 0x5d, 0xe1, 0x08, 0xde, 0x43, 0x9c, 0x08, 0x55, 0x1d };
+	byte rgbY[] = { 0x1e, 0x52, 0xed, 0x75, 0x70, 0x11, 0x63, 0xf7, 0xf9, 0xe4, 0x0d, 0xdf, 0x9f, 0x34, 0x1b, 0x3d, 0xc9, 0xba, 0x86, 0x0a, 0xf7, 0xe0, 0xca, 0x7c, 0xa7, 0xe9, 0xee, 0xcd, 0x00, 0x84, 0xd1, 0x9c };
+	byte rgbD[] = { 0xaf, 0xf9, 0x07, 0xc9, 0x9f, 0x9a, 0xd3, 0xaa, 0xe6, 0xc4, 0xcd, 0xf2, 0x11, 0x22, 0xbc, 0xe2, 0xbd, 0x68, 0xb5, 0x28, 0x3e, 0x69, 0x07, 0x15, 0x4a, 0xd9, 0x11, 0x84, 0x0f, 0xa2, 0x08, 0xcf };
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+	int i;
+
+	cn_cbor * pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_int_create(1, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -3, cn_cbor_data_create(rgbY, sizeof(rgbY), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -4, cn_cbor_data_create(rgbD, sizeof(rgbD), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	if (COSE_KEY_FromCbor(NULL, CBOR_CONTEXT_PARAM_COMMA NULL) != NULL) goto errorReturn;
+
+	hKey = COSE_KEY_FromCbor(pkey, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	for (i = 0; i < 3; i++) {
+		hSignObj = COSE_Sign0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hSignObj == NULL) goto errorReturn;
+		if (!COSE_Sign0_map_put_int(hSignObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_ECDSA_SHA_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Sign0_SetContent(hSignObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+		if (!COSE_Sign0_Sign2(hSignObj, hKey, NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hSignObj, NULL, 0, 0);
+		rgb = (byte *)malloc(cb);
+		if (rgb == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hSignObj, rgb, 0, cb) != cb) goto errorReturn;
+
+		COSE_Sign0_Free(hSignObj);
+		hSignObj = NULL;
+
+		//  Validate with both the key object and the COSE_Key map
+
+		hSignObj = (HCOSE_SIGN0)COSE_Decode(rgb, cb, &typ, COSE_sign0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hSignObj == NULL) goto errorReturn;
+
+		if (!COSE_Sign0_validate2(hSignObj, hKey, NULL)) goto errorReturn;
+		if (!COSE_Sign0_validate(hSignObj, pkey, NULL)) goto errorReturn;
+
+		COSE_Sign0_Free(hSignObj);
+		hSignObj = NULL;
+		free(rgb);
+		rgb = NULL;
+	}
+
+	//  Handles which are not live key objects are rejected
+
+	hSignObj = COSE_Sign0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hSignObj == NULL) goto errorReturn;
+	CHECK_FAILURE(COSE_Sign0_Sign2(hSignObj, (HCOSE_KEY)hSignObj, &cose_error), COSE_ERR_INVALID_HANDLE, goto errorReturn);
+
+	if (!COSE_KEY_Free(hKey)) CFails += 1;
+	CHECK_FAILURE(COSE_Sign0_Sign2(hSignObj, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, CFails += 1);
+	CHECK_FAILURE(COSE_Sign0_validate2(hSignObj, hKey, &cose_error), COSE_ERR_INVALID_HANDLE, CFails += 1);
+	if (COSE_KEY_Free(hKey)) CFails += 1;
+	hKey = NULL;
+	COSE_Sign0_Free(hSignObj);
+	hSignObj = NULL;
+
+	//  A key type given as a text string is kept as a map reference
+
+	pkeyText = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkeyText, COSE_Key_Type, cn_cbor_string_create("private", CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	hKey = COSE_KEY_FromCbor(pkeyText, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) CFails += 1;
+	else if (!COSE_KEY_Free(hKey)) CFails += 1;
+	cn_cbor_free(pkeyText CBOR_CONTEXT_PARAM);
+
+	cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	return 0;
+
+errorReturn:
+	if (hSignObj != NULL) COSE_Sign0_Free(hSignObj);
+	if (hKey != NULL) COSE_KEY_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails += 1;
+	return 1;
+}
+
+int Sign0EdDSA()
+{
+	HCOSE_KEY hKey = NULL;
+	HCOSE_SIGN0 hSignObj = NULL;
+	char * sz = "This is the content to be used";
+	//  Key from test 1 of RFC 8032
+	byte rgbX[] = { 0xd7, 0x5a, 0x98, 0x01, 0x82, 0xb1, 0x0a, 0xb7, 0xd5, 0x4b, 0xfe, 0xd3, 0xc9, 0x64, 0x07, 0x3a, 0x0e, 0xe1, 0x72, 0xf3, 0xda, 0xa6, 0x23, 0x25, 0xaf, 0x02, 0x1a, 0x68, 0xf7, 0x07, 0x51, 0x1a };
+	byte rgbD[] = { 0x9d, 0x61, 0xb1, 0x9d, 0xef, 0xfd, 0x5a, 0x60, 0xba, 0x84, 0x4a, 0xf4, 0x92, 0xec, 0x2c, 0xc4, 0x44, 0x49, 0xc5, 0x69, 0x7b, 0x32, 0x69, 0x19, 0x70, 0x3b, 0xac, 0x03, 0x1c, 0xae, 0x7f, 0x60 };
+	byte * rgb = NULL;
+	size_t cb;
+	int typ;
+
+	cn_cbor * pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OKP, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_int_create(6, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	cn_cbor * pkeyPrivate = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkeyPrivate, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OKP, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkeyPrivate, -1, cn_cbor_int_create(6, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkeyPrivate, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkeyPrivate, -4, cn_cbor_data_create(rgbD, sizeof(rgbD), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	hSignObj = COSE_Sign0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hSignObj == NULL) goto errorReturn;
+	if (!COSE_Sign0_map_put_int(hSignObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_EdDSA, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Sign0_SetContent(hSignObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+
+	if (!COSE_Sign0_Sign(hSignObj, pkeyPrivate, NULL)) goto errorReturn;
+
+	cb = COSE_Encode((HCOSE)hSignObj, NULL, 0, 0);
+	rgb = (byte *)malloc(cb);
+	if (rgb == NULL) goto errorReturn;
+	if (COSE_Encode((HCOSE)hSignObj, rgb, 0, cb) != cb) goto errorReturn;
+
+	COSE_Sign0_Free(hSignObj);
+	hSignObj = NULL;
+
+	//  Validate with the public key, both as a map and as a key object
+
+	hKey = COSE_KEY_FromCbor(pkey, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	hSignObj = (HCOSE_SIGN0)COSE_Decode(rgb, cb, &typ, COSE_sign0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hSignObj == NULL) goto errorReturn;
+
+	if (!COSE_Sign0_validate(hSignObj, pkey, NULL)) goto errorReturn;
+	if (!COSE_Sign0_validate2(hSignObj, hKey, NULL)) goto errorReturn;
+
+	COSE_Sign0_Free(hSignObj);
+	hSignObj = NULL;
+
+	//  A changed message must not validate
+
+	rgb[cb - 1] ^= 1;
+	hSignObj = (HCOSE_SIGN0)COSE_Decode(rgb, cb, &typ, COSE_sign0_object, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hSignObj == NULL) goto errorReturn;
+	if (COSE_Sign0_validate2(hSignObj, hKey, NULL)) goto errorReturn;
+
+	COSE_Sign0_Free(hSignObj);
+	hSignObj = NULL;
+
+	//  A private key whose public half does not match d is refused
+
+	rgbX[0] ^= 1;
+	hSignObj = COSE_Sign0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hSignObj == NULL) goto errorReturn;
+	if (!COSE_Sign0_map_put_int(hSignObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_EdDSA, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+	if (!COSE_Sign0_SetContent(hSignObj, (byte *) sz, strlen(sz), NULL)) goto errorReturn;
+	if (COSE_Sign0_Sign(hSignObj, pkeyPrivate, NULL)) goto errorReturn;
+
+	COSE_Sign0_Free(hSignObj);
+	COSE_KEY_Free(hKey);
+	free(rgb);
+	cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	cn_cbor_free(pkeyPrivate CBOR_CONTEXT_PARAM);
+	return 0;
+
+errorReturn:
+	if (hSignObj != NULL) COSE_Sign0_Free(hSignObj);
+	if (hKey != NULL) COSE_KEY_Free(hKey);
+	if (rgb != NULL) free(rgb);
+	CFails += 1;
+	return 1;
+}
+
+int SignBatch()
+{
+	HCOSE_KEY hKey = NULL;
+	HCOSE_SIGN0 hSignObj = NULL;
+	HCOSE_SIGN hSign = NULL;
+#ifdef USE_CBOR_CONTEXT
+	HCOSE_ARENA hArena = NULL;
+#endif
+	char * sz = "This is the content to be used";
+	byte rgbX[] = { 0x65, 0xed, 0xa5, 0xa1, 0x25, 0x77, 0xc2, 0xba, 0xe8, 0x29, 0x43, 0x7f, 0xe3, 0x38, 0x70, 0x1a, 0x10, 0xaa, 0xa3, 0x75, 0xe1, 0xbb, 0x5b, 0x5d, 0xe1, 0x08, 0xde, 0x43, 0x9c, 0x08, 0x55, 0x1d };
+	byte rgbY[] = { 0x1e, 0x52, 0xed, 0x75, 0x70, 0x11, 0x63, 0xf7, 0xf9, 0xe4, 0x0d, 0xdf, 0x9f, 0x34, 0x1b, 0x3d, 0xc9, 0xba, 0x86, 0x0a, 0xf7, 0xe0, 0xca, 0x7c, 0xa7, 0xe9, 0xee, 0xcd, 0x00, 0x84, 0xd1, 0x9c };
+	byte rgbD[] = { 0xaf, 0xf9, 0x07, 0xc9, 0x9f, 0x9a, 0xd3, 0xaa, 0xe6, 0xc4, 0xcd, 0xf2, 0x11, 0x22, 0xbc, 0xe2, 0xbd, 0x68, 0xb5, 0x28, 0x3e, 0x69, 0x07, 0x15, 0x4a, 0xd9, 0x11, 0x84, 0x0f, 0xa2, 0x08, 0xcf };
+	COSE_VERIFY_ITEM rgItems[16];
+	byte * rgpb[16] = { NULL };
+	size_t cHandles;
+	size_t cb;
+	int i;
+	int j;
+
+	cn_cbor * pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_EC2, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -1, cn_cbor_int_create(1, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -2, cn_cbor_data_create(rgbX, sizeof(rgbX), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -3, cn_cbor_data_create(rgbY, sizeof(rgbY), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+	cn_cbor_mapput_int(pkey, -4, cn_cbor_data_create(rgbD, sizeof(rgbD), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+	hKey = COSE_KEY_FromCbor(pkey, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hKey == NULL) goto errorReturn;
+
+	memset(rgItems, 0, sizeof(rgItems));
+	for (i = 0; i < (int) _countof(rgItems); i++) {
+		hSignObj = COSE_Sign0_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hSignObj == NULL) goto errorReturn;
+		if (!COSE_Sign0_map_put_int(hSignObj, COSE_Header_Algorithm, cn_cbor_int_create(COSE_Algorithm_ECDSA_SHA_256, CBOR_CONTEXT_PARAM_COMMA NULL), COSE_PROTECT_ONLY, NULL)) goto errorReturn;
+		if (!COSE_Sign0_SetContent(hSignObj, (byte *) sz, strlen(sz) - i, NULL)) goto errorReturn;
+		if (!COSE_Sign0_Sign2(hSignObj, hKey, NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hSignObj, NULL, 0, 0);
+		rgpb[i] = (byte *)malloc(cb);
+		if (rgpb[i] == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hSignObj, rgpb[i], 0, cb) != cb) goto errorReturn;
+
+		COSE_Sign0_Free(hSignObj);
+		hSignObj = NULL;
+
+		//  Every third message has its signature damaged
+
+		if (i % 3 == 1) rgpb[i][cb - 1] ^= 1;
+
+		rgItems[i].pbMessage = rgpb[i];
+		rgItems[i].cbMessage = cb;
+		rgItems[i].type = COSE_sign0_object;
+		rgItems[i].hKey = hKey;
+	}
+
+	//  The test allocator is not thread safe, let the workers use their own arenas
+
+#ifdef USE_CBOR_CONTEXT
+	if (!COSE_Verify_Batch(rgItems, _countof(rgItems), 4, NULL, NULL)) goto errorReturn;
+#else
+	if (!COSE_Verify_Batch(rgItems, _countof(rgItems), 4, NULL)) goto errorReturn;
+#endif
+
+	for (i = 0; i < (int) _countof(rgItems); i++) {
+		if (rgItems[i].fValid != (i % 3 != 1)) goto errorReturn;
+		if (!rgItems[i].fValid && (rgItems[i].err != COSE_ERR_CRYPTO_FAIL)) goto errorReturn;
+	}
+
+	//  COSE_Sign messages with two signers, verified for one of them.  The
+	//  batch is run a few times on one thread with an arena which is
+	//  reset after each run, and the handle registry must not grow.
+
+	for (i = 0; i < (int) _countof(rgItems); i++) {
+		free(rgpb[i]);
+		rgpb[i] = NULL;
+
+		hSign = COSE_Sign_Init(0, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hSign == NULL) goto errorReturn;
+		if (!COSE_Sign_SetContent(hSign, (byte *) sz, strlen(sz) - i, NULL)) goto errorReturn;
+		for (j = 0; j < 2; j++) {
+			HCOSE_SIGNER hSigner = COSE_Sign_add_signer(hSign, pkey, COSE_Algorithm_ECDSA_SHA_256, NULL);
+			if (hSigner == NULL) goto errorReturn;
+			COSE_Signer_Free(hSigner);
+		}
+		if (!COSE_Sign_Sign(hSign, NULL)) goto errorReturn;
+
+		cb = COSE_Encode((HCOSE)hSign, NULL, 0, 0);
+		rgpb[i] = (byte *)malloc(cb);
+		if (rgpb[i] == NULL) goto errorReturn;
+		if (COSE_Encode((HCOSE)hSign, rgpb[i], 0, cb) != cb) goto errorReturn;
+
+		COSE_Sign_Free(hSign);
+		hSign = NULL;
+
+		//  Signer 0 of the decoded message is the last one encoded, whose
+		//  signature ends the encoding
+
+		if (i % 3 == 1) rgpb[i][cb - 1] ^= 1;
+
+		rgItems[i].pbMessage = rgpb[i];
+		rgItems[i].cbMessage = cb;
+		rgItems[i].type = COSE_sign_object;
+		rgItems[i].iSigner = 0;
+	}
+
+	cHandles = COSE_Handle_Count();
+#ifdef USE_CBOR_CONTEXT
+	hArena = COSE_Arena_Create(0, NULL);
+	if (hArena == NULL) goto errorReturn;
+#endif
+
+	for (j = 0; j < 3; j++) {
+#ifdef USE_CBOR_CONTEXT
+		if (!COSE_Verify_Batch(rgItems, _countof(rgItems), 1, COSE_Arena_GetContext(hArena), NULL)) goto errorReturn;
+		if (!COSE_Arena_Reset(hArena)) goto errorReturn;
+#else
+		if (!COSE_Verify_Batch(rgItems, _countof(rgItems), 1, NULL)) goto errorReturn;
+#endif
+
+		for (i = 0; i < (int) _countof(rgItems); i++) {
+			if (rgItems[i].fValid != (i % 3 != 1)) goto errorReturn;
+			if (!rgItems[i].fValid && (rgItems[i].err != COSE_ERR_CRYPTO_FAIL)) goto errorReturn;
+		}
+		if (COSE_Handle_Count() != cHandles) goto errorReturn;
+	}
+
+#ifdef USE_CBOR_CONTEXT
+	COSE_Arena_Destroy(hArena);
+#endif
+	for (i = 0; i < (int) _countof(rgItems); i++) free(rgpb[i]);
+	COSE_KEY_Free(hKey);
+	cn_cbor_free(pkey CBOR_CONTEXT_PARAM);
+	return 0;
+
+errorReturn:
+#ifdef USE_CBOR_CONTEXT
+	if (hArena != NULL) COSE_Arena_Destroy(hArena);
+#endif
+	if (hSign != NULL) COSE_Sign_Free(hSign);
+	if (hSignObj != NULL) COSE_Sign0_Free(hSignObj);
+	if (hKey != NULL) COSE_KEY_Free(hKey);
+	for (i = 0; i < (int) _countof(rgItems); i++) if (rgpb[i] != NULL) free(rgpb[i]);
+	CFails += 1;
+	return 1;
+}
+
 
 int _ValidateSign0(const cn_cbor * pControl, const byte * pbEncoded, size_t cbEncoded)
 {
@@ -28,7 +28,7 @@ typedef struct _NameMap {
 	int    i;
 } NameMap;
 
-NameMap RgAlgorithmNames[47] = {
+NameMap RgAlgorithmNames[49] = {
 	{"HS256", COSE_Algorithm_HMAC_256_256},
 	{"HS256/64", COSE_Algorithm_HMAC_256_64},
 	{"HS384", COSE_Algorithm_HMAC_384_384},
@@ -44,6 +44,7 @@ NameMap RgAlgorithmNames[47] = {
 	{"A128GCM", COSE_Algorithm_AES_GCM_128},
 	{"A192GCM", COSE_Algorithm_AES_GCM_192},
 	{"A256GCM", COSE_Algorithm_AES_GCM_256},
+	{"ChaCha20/Poly1305", COSE_Algorithm_CHACHA20_POLY1305},
 	{"AES-CCM-16-128/64", COSE_Algorithm_AES_CCM_16_64_128},
 	{"AES-CCM-16-256/64", COSE_Algorithm_AES_CCM_16_64_256},
 	{"AES-CCM-16-128/128", COSE_Algorithm_AES_CCM_16_128_128},
@@ -55,6 +56,7 @@ NameMap RgAlgorithmNames[47] = {
 	{"ES256", COSE_Algorithm_ECDSA_SHA_256},
 	{"ES384", COSE_Algorithm_ECDSA_SHA_384},
 	{"ES512", COSE_Algorithm_ECDSA_SHA_512},
+	{"EdDSA", COSE_Algorithm_EdDSA},
 	{"HKDF-HMAC-SHA-256", COSE_Algorithm_Direct_HKDF_HMAC_SHA_256},
 	{"HKDF-HMAC-SHA-512", COSE_Algorithm_Direct_HKDF_HMAC_SHA_512},
 	{"HKDF-AES-128", COSE_Algorithm_Direct_HKDF_AES_128},
@@ -79,10 +81,14 @@ NameMap RgAlgorithmNames[47] = {
 };
 
 
-NameMap RgCurveNames[3] = {
+NameMap RgCurveNames[7] = {
 	{"P-256", 1},
 	{"P-384", 2},
-	{"P-521", 3}
+	{"P-521", 3},
+	{"X25519", 4},
+	{"X448", 5},
+	{"Ed25519", 6},
+	{"Ed448", 7}
 };
 
 int MapName(const cn_cbor * p, NameMap * rgMap, unsigned int cMap)
@@ -182,6 +188,9 @@ int IsAlgorithmSupported(const cn_cbor * alg)
 #ifdef USE_AES_GCM_256
 	case COSE_Algorithm_AES_GCM_256:
 #endif
+#ifdef USE_CHACHA20_POLY1305
+	case COSE_Algorithm_CHACHA20_POLY1305:
+#endif
 #ifdef USE_AES_KW_128
 	case COSE_Algorithm_AES_KW_128:
 #endif
@@ -242,6 +251,9 @@ int IsAlgorithmSupported(const cn_cbor * alg)
 #ifdef USE_ECDSA_SHA_512
 	case COSE_Algorithm_ECDSA_SHA_512:
 #endif
+#ifdef USE_EDDSA
+	case COSE_Algorithm_EdDSA:
+#endif
 #ifdef USE_HMAC_256_64
 	case COSE_Algorithm_HMAC_256_64:
 #endif
@@ -301,14 +313,17 @@ struct {
 	int kty;
 	int operation;
 	int keyNew;
-} RgStringKeys[7] = {
+} RgStringKeys[10] = {
 	{ "kty", 0, OPERATION_IGNORE, COSE_Key_Type},
 	{ "kid", 0, OPERATION_NONE, COSE_Key_ID},
 	{ "crv", 2, OPERATION_STRING, COSE_Key_EC2_Curve},
 	{ "x", 2, OPERATION_BASE64, COSE_Key_EC2_X},
 	{ "y", 2, OPERATION_BASE64, COSE_Key_EC2_Y},
 	{ "d", 2, OPERATION_BASE64, -4},
-	{ "k", 4, OPERATION_BASE64, -1}
+	{ "k", 4, OPERATION_BASE64, -1},
+	{ "crv", 1, OPERATION_STRING, COSE_Key_EC2_Curve},
+	{ "x", 1, OPERATION_BASE64, COSE_Key_EC2_X},
+	{ "d", 1, OPERATION_BASE64, -4}
 };
 
 bool SetAttributes(HCOSE hHandle, const cn_cbor * pAttributes, int which, int msgType, bool fPublicKey)
@@ -518,6 +533,7 @@ cn_cbor * BuildKey(const cn_cbor * pKeyIn, bool fPublicKey)
 	}
 	else if (pKty->length == 3) {
 		if (strncmp(pKty->v.str, "oct", 3) == 0) kty = 4;
+		else if (strncmp(pKty->v.str, "OKP", 3) == 0) kty = 1;
 		else return NULL;
 	}
 	else return NULL;
@@ -530,7 +546,7 @@ cn_cbor * BuildKey(const cn_cbor * pKeyIn, bool fPublicKey)
 		pValue = pKey->next;
 
 		if (pKey->type == CN_CBOR_TEXT) {
-			for (i = 0; i < 7; i++) {
+			for (i = 0; i < _countof(RgStringKeys); i++) {
 				if ((pKey->length == strlen(RgStringKeys[i].szKey)) &&
 					(strncmp(pKey->v.str, RgStringKeys[i].szKey, strlen(RgStringKeys[i].szKey)) == 0) &&
 					((RgStringKeys[i].kty == 0) || (RgStringKeys[i].kty == kty))) {
@@ -737,6 +753,222 @@ void RunMemoryTest(const char * szFileName)
 #endif
 }
 
+#ifdef USE_CBOR_CONTEXT
+//
+//  Run the standard messages several times through a single arena,
+//  resetting it between passes so that the blocks get reused.  Objects
+//  left on the arena must lose their handles when it is reset.
+//
+
+void RunArenaTest()
+{
+	HCOSE_ARENA hArena;
+	HCOSE_MAC0 hMac0;
+	HCOSE_ENVELOPED hEnv;
+	HCOSE_RECIPIENT hRecip;
+	HCOSE_KEYSET hSet;
+	HCOSE_KEY hKey;
+	cn_cbor * pkey;
+	byte rgbSecret[128 / 8] = { 'a', 'b', 'c' };
+	size_t cHandles = COSE_Handle_Count();
+	int i;
+
+	hArena = COSE_Arena_Create(0, NULL);
+	if (hArena == NULL) {
+		CFails += 1;
+		return;
+	}
+
+	allocator = COSE_Arena_GetContext(hArena);
+	for (i = 0; i < 3; i++) {
+		MacMessage();
+		SignMessage();
+#ifdef USE_ECDSA_SHA_256
+		Sign0KeyObject();
+		SignBatch();
+#endif
+		EncryptMessage();
+		if (!COSE_Arena_Reset(hArena)) CFails += 1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		hMac0 = COSE_Mac0_Init(COSE_INIT_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+		hEnv = COSE_Enveloped_Init(COSE_INIT_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+		hRecip = COSE_Recipient_Init(COSE_INIT_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+		hSet = COSE_KeySet_Init(COSE_KEYSET_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if ((hMac0 == NULL) || (hEnv == NULL) || (hRecip == NULL) || (hSet == NULL)) CFails += 1;
+		else if (!COSE_Enveloped_AddRecipient(hEnv, hRecip, NULL)) CFails += 1;
+		if (COSE_Handle_Count() != cHandles + 4) CFails += 1;
+
+		if (!COSE_Arena_Reset(hArena)) CFails += 1;
+		if (COSE_Handle_Count() != cHandles) CFails += 1;
+
+		if (COSE_Mac0_Free(hMac0)) CFails += 1;
+		if (COSE_Enveloped_Free(hEnv)) CFails += 1;
+		if (COSE_Recipient_Free(hRecip)) CFails += 1;
+		if (COSE_KeySet_Free(hSet)) CFails += 1;
+	}
+
+	//  Key objects hold crypto library objects, the arena is not reset
+	//  or destroyed until they are freed
+
+	pkey = cn_cbor_map_create(CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (pkey == NULL) CFails += 1;
+	else {
+		cn_cbor_mapput_int(pkey, COSE_Key_Type, cn_cbor_int_create(COSE_Key_Type_OCTET, CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+		cn_cbor_mapput_int(pkey, -1, cn_cbor_data_create(rgbSecret, sizeof(rgbSecret), CBOR_CONTEXT_PARAM_COMMA NULL), CBOR_CONTEXT_PARAM_COMMA NULL);
+
+		hKey = COSE_KEY_FromCbor(pkey, CBOR_CONTEXT_PARAM_COMMA NULL);
+		if (hKey == NULL) CFails += 1;
+		else {
+			if (COSE_Arena_Reset(hArena)) CFails += 1;
+			if (COSE_Arena_Destroy(hArena)) CFails += 1;
+			if (COSE_Handle_Count() != cHandles + 1) CFails += 1;
+			if (!COSE_KEY_Free(hKey)) CFails += 1;
+		}
+		if (!COSE_Arena_Reset(hArena)) CFails += 1;
+	}
+
+	hMac0 = COSE_Mac0_Init(COSE_INIT_FLAGS_NONE, CBOR_CONTEXT_PARAM_COMMA NULL);
+	if (hMac0 == NULL) CFails += 1;
+	allocator = NULL;
+	if (!COSE_Arena_Destroy(hArena)) CFails += 1;
+	if (COSE_Handle_Count() != cHandles) CFails += 1;
+	if (COSE_Mac0_Free(hMac0)) CFails += 1;
+}
+
+//
+//  Run a message through the counting context and check that the
+//  memory was charged to the calls and algorithm used.
+//
+
+void RunStatsTest()
+{
+	COSE_ALLOC_STATS stats;
+
+	COSE_Stats_Reset();
+
+	allocator = COSE_Stats_GetContext();
+	EncryptMessage();
+	allocator = NULL;
+
+	if (!COSE_Stats_Get(&stats, NULL)) CFails += 1;
+	else if ((stats.cAllocs == 0) || (stats.cFrees == 0) || (stats.cbPeak == 0)) CFails += 1;
+
+	if (!COSE_Stats_GetOperation(COSE_STATS_OP_ENCRYPT, &stats, NULL) || (stats.cCalls != 1) || (stats.cAllocs == 0)) CFails += 1;
+	if (!COSE_Stats_GetOperation(COSE_STATS_OP_DECRYPT, &stats, NULL) || (stats.cCalls == 0)) CFails += 1;
+	if (!COSE_Stats_GetOperation(COSE_STATS_OP_DECODE, &stats, NULL) || (stats.cCalls != 1) || (stats.cbPeak == 0)) CFails += 1;
+	if (!COSE_Stats_GetAlgorithm(COSE_Algorithm_AES_CCM_16_64_128, &stats, NULL) || (stats.cAllocs == 0)) CFails += 1;
+
+	if (COSE_Stats_GetOperation(COSE_STATS_OP_MAX, &stats, NULL)) CFails += 1;
+	if (COSE_Stats_GetAlgorithm(9999, &stats, NULL)) CFails += 1;
+
+#ifdef USE_EDDSA
+	allocator = COSE_Stats_GetContext();
+	Sign0EdDSA();
+	allocator = NULL;
+
+	if (!COSE_Stats_GetOperation(COSE_STATS_OP_SIGN, &stats, NULL) || (stats.cCalls == 0)) CFails += 1;
+	if (!COSE_Stats_GetOperation(COSE_STATS_OP_VERIFY, &stats, NULL) || (stats.cCalls == 0)) CFails += 1;
+	if (!COSE_Stats_GetAlgorithm(COSE_Algorithm_EdDSA, &stats, NULL) || (stats.cAllocs == 0)) CFails += 1;
+#endif
+
+	COSE_Stats_Reset();
+	if (!COSE_Stats_Get(&stats, NULL) || (stats.cAllocs != 0)) CFails += 1;
+}
+#endif // USE_CBOR_CONTEXT
+
+//
+//  Decoding and freeing messages with signers and recipients must give
+//  back every handle they registered.
+//
+
+void RunHandleTest()
+{
+	size_t cHandles = COSE_Handle_Count();
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		SignMessage();
+		MacMessage();
+	}
+
+	if (COSE_Handle_Count() != cHandles) CFails += 1;
+}
+
+void RunPoolTest()
+{
+	COSE_POOL_STATS stats;
+	size_t cHits;
+#ifdef USE_CBOR_CONTEXT
+	size_t cCborHits;
+#endif
+	int i;
+
+#ifdef USE_CBOR_CONTEXT
+	allocator = NULL;
+#endif
+
+	if (!COSE_Pool_GetStats(COSE_POOL_ENVELOPED, &stats, NULL)) {
+		CFails += 1;
+		return;
+	}
+	cHits = stats.cHits;
+#ifdef USE_CBOR_CONTEXT
+	if (!COSE_Pool_GetStats(COSE_POOL_CBOR, &stats, NULL)) CFails += 1;
+	cCborHits = stats.cHits;
+#endif
+
+	//  Every message after the first should reuse a pooled object
+
+	for (i = 0; i < 3; i++) EncryptMessage();
+
+	if (!COSE_Pool_GetStats(COSE_POOL_ENVELOPED, &stats, NULL)) CFails += 1;
+	else if ((stats.cHits < cHits + 2) || (stats.cCached == 0)) CFails += 1;
+
+	//  and the maps, array and tag of its skeleton, four or more per message
+
+#ifdef USE_CBOR_CONTEXT
+	if (!COSE_Pool_GetStats(COSE_POOL_CBOR, &stats, NULL)) CFails += 1;
+	else if ((stats.cHits < cCborHits + 8) || (stats.cCached == 0)) CFails += 1;
+#endif
+
+	COSE_Pool_Trim();
+	if (!COSE_Pool_GetStats(COSE_POOL_ENVELOPED, &stats, NULL) || (stats.cCached != 0)) CFails += 1;
+
+	if (COSE_Pool_GetStats(COSE_POOL_MAX, &stats, NULL)) CFails += 1;
+}
+
+void RunRandomTest()
+{
+	COSE_RANDOM_STATS stats;
+	size_t cRequests;
+	size_t cRefills;
+
+	if (!COSE_Random_GetStats(&stats, NULL)) {
+		CFails += 1;
+		return;
+	}
+	cRequests = stats.cRequests;
+
+	//  Half of the batch items take a random nonce from the pool
+
+	EncryptBatch();
+
+	if (!COSE_Random_GetStats(&stats, NULL)) CFails += 1;
+	else if ((stats.cRequests < cRequests + 4) || (stats.cRefills == 0)) CFails += 1;
+
+	//  Clearing the pool forces the next batch to refill it
+
+	cRefills = stats.cRefills;
+	COSE_Random_Clear();
+	EncryptBatch();
+
+	if (!COSE_Random_GetStats(&stats, NULL) || (stats.cRefills != cRefills + 1)) CFails += 1;
+
+	if (COSE_Random_GetStats(NULL, NULL)) CFails += 1;
+}
+
 void RunFileTest(const char * szFileName)
 {
 	const cn_cbor * pControl = NULL;
@@ -891,6 +1123,7 @@ int main(int argc, char ** argv)
 	bool fDir = false;
         bool fCorners = false;
 		bool fMemory = false;
+	bool fBench = false;
 
 	for (i = 1; i < argc; i++) {
 		printf("arg: '%s'\n", argv[i]);
@@ -904,6 +1137,9 @@ int main(int argc, char ** argv)
 			else if (strcmp(argv[i], "--memory") == 0) {
 				fMemory = true;
 			}
+			else if (strcmp(argv[i], "--bench") == 0) {
+				fBench = true;
+			}
 		}
 		else {
 			szWhere = argv[i];
@@ -932,15 +1168,69 @@ int main(int argc, char ** argv)
 	else if (fCorners) {
 		RunCorners();
 	}
+	else if (fBench) {
+#ifdef USE_AES_GCM_128
+		EncryptBatchBench();
+#endif
+	}
 	else {
 #ifdef USE_CBOR_CONTEXT
 		allocator = CreateContext((unsigned int) -1);
 #endif
 		MacMessage();
+#ifdef USE_HMAC_256_64
+		Mac0PreparedKey();
+#endif
+#ifdef USE_AES_CBC_MAC_256_64
+		Mac0PreparedCBCMAC();
+#endif
+#ifdef USE_OPEN_SSL
+		MacCBCKnownAnswer();
+#endif
 		SignMessage();
+#ifdef USE_ECDSA_SHA_256
+		Sign0KeyObject();
+		SignBatch();
+#endif
+#ifdef USE_EDDSA
+		Sign0EdDSA();
+#endif
 		EncryptMessage();
+#ifdef USE_AES_GCM_128
+		EncryptLargeMessage();
+		EncryptBatch();
+		EncryptBatchGCM();
+#endif
+#if defined(USE_AES_GCM_128) && defined(USE_OPEN_SSL)
+		EncryptProvider();
+#endif
+#ifdef USE_AES_CCM_16_64_128
+		EncryptPreparedKey();
+#endif
+#ifdef USE_CHACHA20_POLY1305
+		EncryptChaCha20();
+#endif
+#if defined(USE_AES_CCM_16_64_128) && defined(USE_Direct_HKDF_HMAC_SHA_256)
+		EncryptKeyCache();
+#endif
+#if defined(USE_AES_CCM_16_64_128) && defined(USE_ECDH_ES_HKDF_256)
+		EncryptEphemeralPool();
+#endif
+#if defined(USE_AES_CCM_16_64_128) && defined(USE_AES_KW_128)
+		EncryptKeySet();
+#endif
+#if defined(USE_AES_CCM_16_64_128) && defined(USE_AES_KW_128) && defined(USE_HMAC_256_256) && defined(USE_OPEN_SSL)
+		EncryptKeySetCount();
+#endif
 #ifdef USE_CBOR_CONTEXT
 		FreeContext(allocator);
+		RunArenaTest();
+		RunStatsTest();
+#endif
+		RunPoolTest();
+		RunHandleTest();
+#ifdef USE_AES_GCM_128
+		RunRandomTest();
 #endif
 	}
 
@@ -16,6 +16,17 @@ cn_cbor_context * allocator;
 
 int ValidateEnveloped(const cn_cbor * pControl);
 int EncryptMessage();
+int EncryptLargeMessage();
+int EncryptPreparedKey();
+int EncryptChaCha20();
+int EncryptBatch();
+int EncryptBatchGCM();
+void EncryptBatchBench();
+int EncryptProvider();
+int EncryptKeyCache();
+int EncryptEphemeralPool();
+int EncryptKeySet();
+int EncryptKeySetCount();
 int BuildEnvelopedMessage(const cn_cbor * pControl);
 int ValidateEncrypt(const cn_cbor * pControl);
 int BuildEncryptMessage(const cn_cbor * pControl);
@@ -28,6 +39,9 @@ void Recipient_Corners();
 
 int ValidateSigned(const cn_cbor * pControl);
 int SignMessage();
+int Sign0KeyObject();
+int SignBatch();
+int Sign0EdDSA();
 int BuildSignedMessage(const cn_cbor * pControl);
 int ValidateSign0(const cn_cbor * pControl);
 int BuildSign0Message(const cn_cbor * pControl);
@@ -39,6 +53,9 @@ void Sign0_Corners();
 
 int ValidateMAC(const cn_cbor * pControl);
 int MacMessage();
+int Mac0PreparedKey();
+int Mac0PreparedCBCMAC();
+int MacCBCKnownAnswer();
 int BuildMacMessage(const cn_cbor * pControl);
 int ValidateMac0(const cn_cbor * pControl);
 int BuildMac0Message(const cn_cbor * pControl);